@@ -0,0 +1,951 @@
+// Fake NVML backend for running nvml-tool without a GPU.
+//
+// `make fake` builds build/libnvidia-ml-fake.so; point the tool at it with
+// NVML_TOOL_LIBRARY=build/libnvidia-ml-fake.so. The simulated devices are configured from the
+// environment when the library is loaded:
+//
+//   FAKE_NVML_DEVICES=N                 Number of devices (default 2)
+//   FAKE_NVML_FANS=N                    Fans per device, 0 for none (default 2)
+//   FAKE_NVML_TEMP=BASE:AMP:PERIOD      Temperature BASE + AMP * sin(2 pi t / PERIOD) in C, plus
+//                                       2 C per device index (default 45:15:60)
+//   FAKE_NVML_POWER=USE:LIMIT:MIN:MAX   Power draw, limit and limit constraints in W
+//                                       (default 150:300:100:350)
+//   FAKE_NVML_ERRORS=FN=CODE,...        Make FN return the nvmlReturn_t CODE, e.g.
+//                                       nvmlDeviceGetPowerUsage=3 (NOT_SUPPORTED)
+//   FAKE_NVML_LATENCY_US=US,FN=US,...   Busy-wait before returning: a bare value applies to every
+//                                       function, FN=US overrides it for one function
+//   FAKE_NVML_DEVICE_LATENCY_US=I=US,.. Extra delay on every call that takes device I's handle,
+//                                       e.g. to simulate a GPU that stops responding
+//   FAKE_NVML_EVENT_MS=MS               Deliver a clock event every MS to event sets, round-robin
+//                                       over the registered devices (default 0, no events)
+//   FAKE_NVML_ENERGY_START=MJ           Offset added to the energy counter in mJ, e.g. close to
+//                                       2^64 to exercise wrap handling (default 0)
+//   FAKE_NVML_PROCS=N                   Compute processes per device (default 2). They are real
+//                                       PIDs taken from /proc, so /proc lookups on them work.
+//   FAKE_NVML_UTIL=I=PCT,...            Pin device I's GPU utilization. Its power draw then
+//                                       follows the load, from the minimum to the maximum limit,
+//                                       instead of the default curve.
+//   FAKE_NVML_NVLINKS=N                 Active NVLink links per device (default 0). PCIe and
+//                                       NVLink traffic follow the utilization.
+//   FAKE_NVML_SPIKE=W:MS:PERIOD_MS      Every PERIOD_MS, raise the draw by W for MS, past the
+//                                       power limit like a real transient (default none)
+//   FAKE_NVML_CLOCK_STEP_MS=MS          Replace wall time with a clock that advances MS per
+//                                       sampling pass (each read of device 0's temperature), so
+//                                       runs are reproducible (default 0, wall time)
+//
+// Clocks and throttle reasons follow the other curves: a draw over the power limit reports
+// SwPowerCap and scales the SM clock down, 83 C and up reports SwThermalSlowdown, and a device
+// under 5% busy reports GpuIdle and drops to idle clocks in P8. nvmlDeviceGetSamples buffers
+// power, utilization and clock samples every 50 ms, keeping the newest 120.
+//
+// FN is the function name as written in nvml.h; a versioned symbol such as nvmlInit_v2 also
+// matches the unversioned name. Fans left in automatic mode follow the temperature, manual fan
+// speeds cool the device a little, and power limits that are set stick for the process lifetime.
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <math.h>
+#include <nvml.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define FAKE_MAX_DEVICES 64
+#define FAKE_MAX_FANS 8
+#define FAKE_MAX_RULES 32
+#define FAKE_NAME_LEN 64
+#define FAKE_MAX_PIDS 4096
+#define FAKE_SM_CLOCK_MHZ 1980
+#define FAKE_SM_IDLE_CLOCK_MHZ 210
+#define FAKE_MEM_CLOCK_MHZ 9501
+#define FAKE_MEM_IDLE_CLOCK_MHZ 405
+#define FAKE_THERMAL_SLOWDOWN_C 83
+#define FAKE_IDLE_UTIL 5
+#define FAKE_SAMPLE_MS 50
+#define FAKE_SAMPLE_BUFFER 120
+#define FAKE_PCIE_KBPS_PER_PCT 50000     // PCIe RX at 100% busy: 5 GB/s, TX a quarter of it
+#define FAKE_NVLINK_KIBPS_PER_PCT 200000 // Per link and direction: ~20 GiB/s at 100% busy
+
+#define STR_(x) #x
+#define STR(x) STR_(x)
+
+struct nvmlDevice_st {
+  unsigned int index;
+  unsigned int fan_speed[FAKE_MAX_FANS]; // Set speed, only used while fan_manual is set
+  int fan_manual[FAKE_MAX_FANS];
+  unsigned int power_limit_mw;
+  long latency_ns; // FAKE_NVML_DEVICE_LATENCY_US
+  int utilization; // FAKE_NVML_UTIL percent, -1 to follow the curve
+};
+
+// One FAKE_NVML_ERRORS or FAKE_NVML_LATENCY_US entry
+typedef struct {
+  char name[FAKE_NAME_LEN];
+  long value;
+} fake_rule_t;
+
+static struct {
+  unsigned int device_count;
+  unsigned int fan_count;
+  double temp_base, temp_amplitude, temp_period;
+  unsigned int power_usage_mw, power_limit_mw, power_min_mw, power_max_mw;
+  long latency_ns; // Default for functions without their own rule
+  long event_interval_ns;
+  unsigned long long energy_start_mj;
+  unsigned int procs_per_device;
+  unsigned int nvlinks;
+  unsigned int spike_mw, spike_ms, spike_period_ms;
+  fake_rule_t errors[FAKE_MAX_RULES];
+  int error_count;
+  fake_rule_t latencies[FAKE_MAX_RULES];
+  int latency_count;
+  unsigned int clock_step_ms; // Stepped simulated clock, 0 to follow real time
+} config = {2, 2, 45, 15, 60, 150000, 300000, 100000, 350000, 0, 0, 0, 2, 0, 0, 0, 0, {{"", 0}},
+            0, {{"", 0}}, 0, 0};
+
+static struct nvmlDevice_st devices[FAKE_MAX_DEVICES];
+static pthread_mutex_t state_lock = PTHREAD_MUTEX_INITIALIZER;
+static int initialized;
+static struct timespec start_time;
+static unsigned long long start_realtime_us; // start_time on the clock sample timestamps use
+static unsigned long clock_steps;             // FAKE_NVML_CLOCK_STEP_MS steps taken so far
+
+// Per-function settings, resolved from the rules on the first call
+typedef struct {
+  int resolved;
+  nvmlReturn_t error;
+  long latency_ns;
+} fake_call_t;
+
+static void parse_rules(const char* env, fake_rule_t* rules, int* count, long* fallback,
+                        long scale) {
+  const char* spec = getenv(env);
+  if (!spec) return;
+
+  char buf[2048];
+  char* save = NULL;
+  snprintf(buf, sizeof(buf), "%s", spec);
+  for (char* tok = strtok_r(buf, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+    char* eq = strchr(tok, '=');
+    if (!eq) {
+      if (fallback) *fallback = strtol(tok, NULL, 10) * scale;
+      continue;
+    }
+    if (*count >= FAKE_MAX_RULES) continue;
+    *eq = '\0';
+    snprintf(rules[*count].name, FAKE_NAME_LEN, "%s", tok);
+    rules[*count].value = strtol(eq + 1, NULL, 10) * scale;
+    (*count)++;
+  }
+}
+
+__attribute__((constructor)) static void fake_configure(void) {
+  const char* env;
+
+  if ((env = getenv("FAKE_NVML_DEVICES"))) config.device_count = strtoul(env, NULL, 10);
+  if (config.device_count > FAKE_MAX_DEVICES) config.device_count = FAKE_MAX_DEVICES;
+  if ((env = getenv("FAKE_NVML_FANS"))) config.fan_count = strtoul(env, NULL, 10);
+  if (config.fan_count > FAKE_MAX_FANS) config.fan_count = FAKE_MAX_FANS;
+  if ((env = getenv("FAKE_NVML_TEMP")))
+    sscanf(env, "%lf:%lf:%lf", &config.temp_base, &config.temp_amplitude, &config.temp_period);
+  if (config.temp_period <= 0) config.temp_period = 60;
+
+  if ((env = getenv("FAKE_NVML_POWER"))) {
+    double use, limit, min, max;
+    int n = sscanf(env, "%lf:%lf:%lf:%lf", &use, &limit, &min, &max);
+    if (n >= 1) config.power_usage_mw = use * 1000;
+    if (n >= 2) config.power_limit_mw = limit * 1000;
+    if (n >= 3) config.power_min_mw = min * 1000;
+    if (n >= 4) config.power_max_mw = max * 1000;
+  }
+
+  if ((env = getenv("FAKE_NVML_EVENT_MS")))
+    config.event_interval_ns = strtol(env, NULL, 10) * 1000000;
+  if ((env = getenv("FAKE_NVML_ENERGY_START"))) config.energy_start_mj = strtoull(env, NULL, 10);
+  if ((env = getenv("FAKE_NVML_PROCS"))) config.procs_per_device = strtoul(env, NULL, 10);
+  if ((env = getenv("FAKE_NVML_NVLINKS"))) config.nvlinks = strtoul(env, NULL, 10);
+  if (config.nvlinks > NVML_NVLINK_MAX_LINKS) config.nvlinks = NVML_NVLINK_MAX_LINKS;
+  if ((env = getenv("FAKE_NVML_CLOCK_STEP_MS"))) config.clock_step_ms = strtoul(env, NULL, 10);
+  if ((env = getenv("FAKE_NVML_SPIKE"))) {
+    unsigned int w = 0;
+    sscanf(env, "%u:%u:%u", &w, &config.spike_ms, &config.spike_period_ms);
+    config.spike_mw = w * 1000;
+  }
+  parse_rules("FAKE_NVML_ERRORS", config.errors, &config.error_count, NULL, 1);
+  parse_rules("FAKE_NVML_LATENCY_US", config.latencies, &config.latency_count, &config.latency_ns,
+              1000);
+
+  for (unsigned int i = 0; i < FAKE_MAX_DEVICES; i++) {
+    devices[i].index = i;
+    devices[i].power_limit_mw = config.power_limit_mw;
+    devices[i].utilization = -1;
+  }
+
+  fake_rule_t device_latencies[FAKE_MAX_RULES];
+  int device_latency_count = 0;
+  parse_rules("FAKE_NVML_DEVICE_LATENCY_US", device_latencies, &device_latency_count, NULL, 1000);
+  for (int i = 0; i < device_latency_count; i++) {
+    unsigned long index = strtoul(device_latencies[i].name, NULL, 10);
+    if (index < FAKE_MAX_DEVICES) devices[index].latency_ns = device_latencies[i].value;
+  }
+
+  fake_rule_t utilizations[FAKE_MAX_RULES];
+  int utilization_count = 0;
+  parse_rules("FAKE_NVML_UTIL", utilizations, &utilization_count, NULL, 1);
+  for (int i = 0; i < utilization_count; i++) {
+    unsigned long index = strtoul(utilizations[i].name, NULL, 10);
+    long pct = utilizations[i].value;
+    if (index < FAKE_MAX_DEVICES) devices[index].utilization = pct < 0 ? 0 : pct > 100 ? 100 : pct;
+  }
+}
+
+// "nvmlInit" matches both nvmlInit and nvmlInit_v2
+static int rule_matches(const char* rule, const char* symbol) {
+  size_t len = strlen(rule);
+  if (strncmp(rule, symbol, len) != 0) return 0;
+  return symbol[len] == '\0' || (symbol[len] == '_' && symbol[len + 1] == 'v');
+}
+
+static void fake_resolve(fake_call_t* call, const char* symbol) {
+  call->error = NVML_SUCCESS;
+  call->latency_ns = config.latency_ns;
+  for (int i = 0; i < config.error_count; i++)
+    if (rule_matches(config.errors[i].name, symbol)) call->error = config.errors[i].value;
+  for (int i = 0; i < config.latency_count; i++)
+    if (rule_matches(config.latencies[i].name, symbol))
+      call->latency_ns = config.latencies[i].value;
+  __atomic_store_n(&call->resolved, 1, __ATOMIC_RELEASE);
+}
+
+static double elapsed_s(const struct timespec* from) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - from->tv_sec) + (now.tv_nsec - from->tv_nsec) / 1e9;
+}
+
+// Spin rather than sleep so that microsecond latencies stay accurate for benchmarking; delays
+// from a millisecond up sleep instead
+static void busy_wait(long ns) {
+  if (ns >= 1000000) {
+    struct timespec ts = {ns / 1000000000L, ns % 1000000000L};
+    while (nanosleep(&ts, &ts) != 0) {
+    }
+    return;
+  }
+
+  struct timespec begin;
+  clock_gettime(CLOCK_MONOTONIC, &begin);
+  while (elapsed_s(&begin) * 1e9 < ns) {
+  }
+}
+
+static nvmlReturn_t fake_enter(fake_call_t* call, const char* symbol, int needs_init) {
+  if (!__atomic_load_n(&call->resolved, __ATOMIC_ACQUIRE)) fake_resolve(call, symbol);
+  if (call->latency_ns > 0) busy_wait(call->latency_ns);
+  if (call->error != NVML_SUCCESS) return call->error;
+  if (needs_init && !__atomic_load_n(&initialized, __ATOMIC_ACQUIRE))
+    return NVML_ERROR_UNINITIALIZED;
+  return NVML_SUCCESS;
+}
+
+// Apply the configured latency and injected error, and check nvmlInit was called
+#define FAKE_ENTER(name)                                                                           \
+  do {                                                                                             \
+    static fake_call_t call;                                                                       \
+    nvmlReturn_t injected = fake_enter(&call, STR(name), 1);                                       \
+    if (injected != NVML_SUCCESS) return injected;                                                 \
+  } while (0)
+
+// As FAKE_ENTER, for functions taking a device handle
+#define FAKE_ENTER_DEVICE(name, device)                                                            \
+  do {                                                                                             \
+    FAKE_ENTER(name);                                                                              \
+    if (!valid_device(device)) return NVML_ERROR_INVALID_ARGUMENT;                                 \
+    if (device->latency_ns > 0) busy_wait(device->latency_ns);                                     \
+  } while (0)
+
+static int valid_device(nvmlDevice_t device) {
+  return device >= devices && device < devices + config.device_count;
+}
+
+static unsigned int manual_fan_average(nvmlDevice_t device) {
+  unsigned int sum = 0, count = 0;
+  for (unsigned int i = 0; i < config.fan_count; i++) {
+    if (!device->fan_manual[i]) continue;
+    sum += device->fan_speed[i];
+    count++;
+  }
+  return count ? sum / count : 0;
+}
+
+// Curves below take `t`, seconds since nvmlInit, so buffered samples can be computed after the
+// fact; live readings pass now_s(). With FAKE_NVML_CLOCK_STEP_MS the clock only moves when
+// device 0's temperature is read, once per sampling pass, so runs are reproducible.
+static double now_s(void) {
+  if (config.clock_step_ms)
+    return __atomic_load_n(&clock_steps, __ATOMIC_RELAXED) * (config.clock_step_ms / 1000.0);
+  return elapsed_s(&start_time);
+}
+
+static double curve_phase(double t) {
+  return 2 * M_PI * t / config.temp_period;
+}
+
+static unsigned int device_temperature(nvmlDevice_t device, double t) {
+  double temp =
+      config.temp_base + config.temp_amplitude * sin(curve_phase(t)) + 2.0 * device->index;
+  unsigned int manual = manual_fan_average(device);
+  if (manual > 30) temp -= (manual - 30) / 5.0; // Forced airflow helps a little
+  return temp < 0 ? 0 : (unsigned int)lround(temp);
+}
+
+// Automatic fans ramp from 30% at 40 C to 100% at 87 C
+static unsigned int fan_speed(nvmlDevice_t device, unsigned int fan) {
+  if (device->fan_manual[fan]) return device->fan_speed[fan];
+  long speed = 30 + (long)(device_temperature(device, now_s()) - 40.0) * 3 / 2;
+  return speed < 30 ? 30 : speed > 100 ? 100 : speed;
+}
+
+static unsigned int gpu_utilization(nvmlDevice_t device, double t) {
+  if (device->utilization >= 0) return device->utilization;
+  return (unsigned int)lround(50 + 40 * sin(curve_phase(t) + device->index));
+}
+
+// Draw the device would like: swings +-20% around the configured value, or follows a pinned
+// utilization from the minimum to the maximum limit
+static double power_demand(nvmlDevice_t device, double t) {
+  if (device->utilization >= 0)
+    return config.power_min_mw +
+           (config.power_max_mw - config.power_min_mw) * device->utilization / 100.0;
+  return config.power_usage_mw * (1 + 0.2 * sin(curve_phase(t) + device->index));
+}
+
+// Capped at the limit, except for FAKE_NVML_SPIKE transients. Call with state_lock held.
+static unsigned int power_usage(nvmlDevice_t device, double t) {
+  double usage = power_demand(device, t);
+  if (usage > device->power_limit_mw) usage = device->power_limit_mw;
+  if (config.spike_period_ms && fmod(t * 1000, config.spike_period_ms) < config.spike_ms)
+    usage += config.spike_mw;
+  return (unsigned int)usage;
+}
+
+// Call with state_lock held
+static unsigned long long throttle_reasons(nvmlDevice_t device, double t) {
+  unsigned long long reasons = 0;
+  if (power_demand(device, t) > device->power_limit_mw)
+    reasons |= nvmlClocksThrottleReasonSwPowerCap;
+  if (device_temperature(device, t) >= FAKE_THERMAL_SLOWDOWN_C)
+    reasons |= nvmlClocksThrottleReasonSwThermalSlowdown;
+  if (gpu_utilization(device, t) < FAKE_IDLE_UTIL) reasons |= nvmlClocksThrottleReasonGpuIdle;
+  return reasons;
+}
+
+// The SM clock gives way in proportion to how far the demand is over the power limit, and by
+// another 20% while thermally throttled. Call with state_lock held.
+static unsigned int sm_clock(nvmlDevice_t device, double t) {
+  unsigned long long reasons = throttle_reasons(device, t);
+  if (reasons & nvmlClocksThrottleReasonGpuIdle) return FAKE_SM_IDLE_CLOCK_MHZ;
+  double clock = FAKE_SM_CLOCK_MHZ, demand = power_demand(device, t);
+  if (demand > device->power_limit_mw) clock *= device->power_limit_mw / demand;
+  if (reasons & nvmlClocksThrottleReasonSwThermalSlowdown) clock *= 0.8;
+  return (unsigned int)lround(clock);
+}
+
+// The memory clock only drops while the GPU is idle
+static unsigned int mem_clock(nvmlDevice_t device, double t) {
+  return gpu_utilization(device, t) < FAKE_IDLE_UTIL ? FAKE_MEM_IDLE_CLOCK_MHZ : FAKE_MEM_CLOCK_MHZ;
+}
+
+// Integral of gpu_utilization() in percent-seconds, the basis of the NVLink byte counters
+static double utilization_integral(nvmlDevice_t device, double t) {
+  if (device->utilization >= 0) return device->utilization * t;
+  double omega = 2 * M_PI / config.temp_period;
+  return 50 * t + 40 / omega * (cos(device->index) - cos(omega * t + device->index));
+}
+
+// Integral of the power_usage() curve (ignoring the cap at the limit) in mJ. Counted from boot
+// rather than nvmlInit so that, like the driver's counter, it carries on across processes, which
+// also means its phase is not the one power readings follow. Wraps modulo 2^64 like a hardware
+// counter would.
+static unsigned long long energy_consumed(nvmlDevice_t device) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  double t = now.tv_sec + now.tv_nsec / 1e9;
+  double omega = 2 * M_PI / config.temp_period;
+  double swing = 0.2 / omega * (cos(device->index) - cos(omega * t + device->index));
+  return config.energy_start_mj + (unsigned long long)(config.power_usage_mw * (t + swing));
+}
+
+nvmlReturn_t nvmlInit(void) {
+  static fake_call_t call;
+  nvmlReturn_t injected = fake_enter(&call, STR(nvmlInit), 0);
+  if (injected != NVML_SUCCESS) return injected;
+
+  pthread_mutex_lock(&state_lock);
+  if (!initialized) {
+    struct timespec realtime;
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    clock_gettime(CLOCK_REALTIME, &realtime);
+    start_realtime_us = realtime.tv_sec * 1000000ULL + realtime.tv_nsec / 1000;
+  }
+  __atomic_store_n(&initialized, initialized + 1, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&state_lock);
+  return NVML_SUCCESS;
+}
+
+nvmlReturn_t nvmlShutdown(void) {
+  FAKE_ENTER(nvmlShutdown);
+  pthread_mutex_lock(&state_lock);
+  __atomic_store_n(&initialized, initialized - 1, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&state_lock);
+  return NVML_SUCCESS;
+}
+
+const char* nvmlErrorString(nvmlReturn_t result) {
+  switch (result) {
+  case NVML_SUCCESS: return "Success";
+  case NVML_ERROR_UNINITIALIZED: return "Uninitialized";
+  case NVML_ERROR_INVALID_ARGUMENT: return "Invalid Argument";
+  case NVML_ERROR_NOT_SUPPORTED: return "Not Supported";
+  case NVML_ERROR_NO_PERMISSION: return "Insufficient Permissions";
+  case NVML_ERROR_NOT_FOUND: return "Not Found";
+  case NVML_ERROR_INSUFFICIENT_SIZE: return "Insufficient Size";
+  case NVML_ERROR_DRIVER_NOT_LOADED: return "Driver Not Loaded";
+  case NVML_ERROR_TIMEOUT: return "Timeout";
+  case NVML_ERROR_FUNCTION_NOT_FOUND: return "Function Not Found";
+  case NVML_ERROR_GPU_IS_LOST: return "GPU is lost";
+  case NVML_ERROR_NO_DATA: return "No data";
+  default: return "Unknown Error";
+  }
+}
+
+nvmlReturn_t nvmlSystemGetDriverVersion(char* version, unsigned int length) {
+  FAKE_ENTER(nvmlSystemGetDriverVersion);
+  if (!version) return NVML_ERROR_INVALID_ARGUMENT;
+  if ((unsigned int)snprintf(version, length, "999.99.99") >= length)
+    return NVML_ERROR_INSUFFICIENT_SIZE;
+  return NVML_SUCCESS;
+}
+
+nvmlReturn_t nvmlDeviceGetCount(unsigned int* count) {
+  FAKE_ENTER(nvmlDeviceGetCount);
+  if (!count) return NVML_ERROR_INVALID_ARGUMENT;
+  *count = config.device_count;
+  return NVML_SUCCESS;
+}
+
+nvmlReturn_t nvmlDeviceGetHandleByIndex(unsigned int index, nvmlDevice_t* device) {
+  FAKE_ENTER(nvmlDeviceGetHandleByIndex);
+  if (!device || index >= config.device_count) return NVML_ERROR_INVALID_ARGUMENT;
+  *device = &devices[index];
+  return NVML_SUCCESS;
+}
+
+static void format_uuid(unsigned int index, char* out, size_t len) {
+  snprintf(out, len, "GPU-%08x-fa4e-4000-8000-%012x", 0xf00d0000u + index, index);
+}
+
+static void format_bus_id(unsigned int index, char* out, size_t len) {
+  snprintf(out, len, "00000000:%02X:00.0", index + 1);
+}
+
+nvmlReturn_t nvmlDeviceGetHandleByUUID(const char* uuid, nvmlDevice_t* device) {
+  FAKE_ENTER(nvmlDeviceGetHandleByUUID);
+  if (!uuid || !device) return NVML_ERROR_INVALID_ARGUMENT;
+  for (unsigned int i = 0; i < config.device_count; i++) {
+    char buf[NVML_DEVICE_UUID_BUFFER_SIZE];
+    format_uuid(i, buf, sizeof(buf));
+    if (strcmp(buf, uuid) == 0) {
+      *device = &devices[i];
+      return NVML_SUCCESS;
+    }
+  }
+  return NVML_ERROR_NOT_FOUND;
+}
+
+nvmlReturn_t nvmlDeviceGetHandleByPciBusId(const char* bus_id, nvmlDevice_t* device) {
+  FAKE_ENTER(nvmlDeviceGetHandleByPciBusId);
+  unsigned int domain, bus, dev, fn;
+  if (!bus_id || !device) return NVML_ERROR_INVALID_ARGUMENT;
+  if (sscanf(bus_id, "%x:%x:%x.%x", &domain, &bus, &dev, &fn) != 4)
+    return NVML_ERROR_INVALID_ARGUMENT;
+  if (domain != 0 || dev != 0 || fn != 0 || bus < 1 || bus > config.device_count)
+    return NVML_ERROR_NOT_FOUND;
+  *device = &devices[bus - 1];
+  return NVML_SUCCESS;
+}
+
+nvmlReturn_t nvmlDeviceGetIndex(nvmlDevice_t device, unsigned int* index) {
+  FAKE_ENTER_DEVICE(nvmlDeviceGetIndex, device);
+  if (!index) return NVML_ERROR_INVALID_ARGUMENT;
+  *index = device->index;
+  return NVML_SUCCESS;
+}
+
+nvmlReturn_t nvmlDeviceGetName(nvmlDevice_t device, char* name, unsigned int length) {
+  FAKE_ENTER_DEVICE(nvmlDeviceGetName, device);
+  if (!name) return NVML_ERROR_INVALID_ARGUMENT;
+  if ((unsigned int)snprintf(name, length, "Fake NVIDIA GPU %u", device->index) >= length)
+    return NVML_ERROR_INSUFFICIENT_SIZE;
+  return NVML_SUCCESS;
+}
+
+nvmlReturn_t nvmlDeviceGetUUID(nvmlDevice_t device, char* uuid, unsigned int length) {
+  FAKE_ENTER_DEVICE(nvmlDeviceGetUUID, device);
+  if (!uuid) return NVML_ERROR_INVALID_ARGUMENT;
+  if (length < 41) return NVML_ERROR_INSUFFICIENT_SIZE;
+  format_uuid(device->index, uuid, length);
+  return NVML_SUCCESS;
+}
+
+nvmlReturn_t nvmlDeviceGetPciInfo(nvmlDevice_t device, nvmlPciInfo_t* pci) {
+  FAKE_ENTER_DEVICE(nvmlDeviceGetPciInfo, device);
+  if (!pci) return NVML_ERROR_INVALID_ARGUMENT;
+  memset(pci, 0, sizeof(*pci));
+  pci->bus = device->index + 1;
+  pci->pciDeviceId = 0x268410deu; // Device ID in the high half, NVIDIA vendor ID in the low half
+  format_bus_id(device->index, pci->busId, sizeof(pci->busId));
+  snprintf(pci->busIdLegacy, sizeof(pci->busIdLegacy), "0000:%02X:00.0", device->index + 1);
+  return NVML_SUCCESS;
+}
+
+nvmlReturn_t nvmlDeviceGetTemperature(nvmlDevice_t device, nvmlTemperatureSensors_t sensor,
+                                      unsigned int* temp) {
+  FAKE_ENTER_DEVICE(nvmlDeviceGetTemperature, device);
+  if (!temp || sensor != NVML_TEMPERATURE_GPU) return NVML_ERROR_INVALID_ARGUMENT;
+  pthread_mutex_lock(&state_lock);
+  if (config.clock_step_ms && device->index == 0)
+    __atomic_add_fetch(&clock_steps, 1, __ATOMIC_RELAXED);
+  *temp = device_temperature(device, now_s());
+  pthread_mutex_unlock(&state_lock);
+  return NVML_SUCCESS;
+}
+
+nvmlReturn_t nvmlDeviceGetMemoryInfo(nvmlDevice_t device, nvmlMemory_t* memory) {
+  FAKE_ENTER_DEVICE(nvmlDeviceGetMemoryInfo, device);
+  if (!memory) return NVML_ERROR_INVALID_ARGUMENT;
+  memory->total = 24ull << 30;
+  memory->used = (unsigned long long)((0.3 + 0.2 * sin(curve_phase(now_s()))) * memory->total);
+  memory->free = memory->total - memory->used;
+  return NVML_SUCCESS;
+}
+
+nvmlReturn_t nvmlDeviceGetNumFans(nvmlDevice_t device, unsigned int* count) {
+  FAKE_ENTER_DEVICE(nvmlDeviceGetNumFans, device);
+  if (!count) return NVML_ERROR_INVALID_ARGUMENT;
+  *count = config.fan_count;
+  return NVML_SUCCESS;
+}
+
+nvmlReturn_t nvmlDeviceGetFanSpeed_v2(nvmlDevice_t device, unsigned int fan, unsigned int* speed) {
+  FAKE_ENTER_DEVICE(nvmlDeviceGetFanSpeed_v2, device);
+  if (!speed || fan >= config.fan_count) return NVML_ERROR_INVALID_ARGUMENT;
+  pthread_mutex_lock(&state_lock);
+  *speed = fan_speed(device, fan);
+  pthread_mutex_unlock(&state_lock);
+  return NVML_SUCCESS;
+}
+
+nvmlReturn_t nvmlDeviceGetFanSpeed(nvmlDevice_t device, unsigned int* speed) {
+  FAKE_ENTER_DEVICE(nvmlDeviceGetFanSpeed, device);
+  if (!speed) return NVML_ERROR_INVALID_ARGUMENT;
+  if (config.fan_count == 0) return NVML_ERROR_NOT_SUPPORTED;
+  pthread_mutex_lock(&state_lock);
+  *speed = fan_speed(device, 0);
+  pthread_mutex_unlock(&state_lock);
+  return NVML_SUCCESS;
+}
+
+nvmlReturn_t nvmlDeviceSetFanSpeed_v2(nvmlDevice_t device, unsigned int fan, unsigned int speed) {
+  FAKE_ENTER_DEVICE(nvmlDeviceSetFanSpeed_v2, device);
+  if (fan >= config.fan_count || speed > 100) return NVML_ERROR_INVALID_ARGUMENT;
+  pthread_mutex_lock(&state_lock);
+  device->fan_speed[fan] = speed;
+  device->fan_manual[fan] = 1;
+  pthread_mutex_unlock(&state_lock);
+  return NVML_SUCCESS;
+}
+
+nvmlReturn_t nvmlDeviceSetFanControlPolicy(nvmlDevice_t device, unsigned int fan,
+                                           nvmlFanControlPolicy_t policy) {
+  FAKE_ENTER_DEVICE(nvmlDeviceSetFanControlPolicy, device);
+  if (fan >= config.fan_count) return NVML_ERROR_INVALID_ARGUMENT;
+  pthread_mutex_lock(&state_lock);
+  device->fan_manual[fan] = policy == NVML_FAN_POLICY_MANUAL;
+  pthread_mutex_unlock(&state_lock);
+  return NVML_SUCCESS;
+}
+
+nvmlReturn_t nvmlDeviceGetPowerUsage(nvmlDevice_t device, unsigned int* power) {
+  FAKE_ENTER_DEVICE(nvmlDeviceGetPowerUsage, device);
+  if (!power) return NVML_ERROR_INVALID_ARGUMENT;
+  pthread_mutex_lock(&state_lock);
+  *power = power_usage(device, now_s());
+  pthread_mutex_unlock(&state_lock);
+  return NVML_SUCCESS;
+}
+
+nvmlReturn_t nvmlDeviceGetPowerManagementLimit(nvmlDevice_t device, unsigned int* limit) {
+  FAKE_ENTER_DEVICE(nvmlDeviceGetPowerManagementLimit, device);
+  if (!limit) return NVML_ERROR_INVALID_ARGUMENT;
+  pthread_mutex_lock(&state_lock);
+  *limit = device->power_limit_mw;
+  pthread_mutex_unlock(&state_lock);
+  return NVML_SUCCESS;
+}
+
+nvmlReturn_t nvmlDeviceGetPowerManagementLimitConstraints(nvmlDevice_t device,
+                                                          unsigned int* min_limit,
+                                                          unsigned int* max_limit) {
+  FAKE_ENTER_DEVICE(nvmlDeviceGetPowerManagementLimitConstraints, device);
+  if (!min_limit || !max_limit) return NVML_ERROR_INVALID_ARGUMENT;
+  *min_limit = config.power_min_mw;
+  *max_limit = config.power_max_mw;
+  return NVML_SUCCESS;
+}
+
+nvmlReturn_t nvmlDeviceSetPowerManagementLimit(nvmlDevice_t device, unsigned int limit) {
+  FAKE_ENTER_DEVICE(nvmlDeviceSetPowerManagementLimit, device);
+  if (limit < config.power_min_mw || limit > config.power_max_mw)
+    return NVML_ERROR_INVALID_ARGUMENT;
+  pthread_mutex_lock(&state_lock);
+  device->power_limit_mw = limit;
+  pthread_mutex_unlock(&state_lock);
+  return NVML_SUCCESS;
+}
+
+nvmlReturn_t nvmlDeviceGetUtilizationRates(nvmlDevice_t device, nvmlUtilization_t* utilization) {
+  FAKE_ENTER_DEVICE(nvmlDeviceGetUtilizationRates, device);
+  if (!utilization) return NVML_ERROR_INVALID_ARGUMENT;
+  utilization->gpu = gpu_utilization(device, now_s());
+  utilization->memory = utilization->gpu / 2;
+  return NVML_SUCCESS;
+}
+
+nvmlReturn_t nvmlDeviceGetClockInfo(nvmlDevice_t device, nvmlClockType_t type,
+                                    unsigned int* clock) {
+  FAKE_ENTER_DEVICE(nvmlDeviceGetClockInfo, device);
+  if (!clock) return NVML_ERROR_INVALID_ARGUMENT;
+  pthread_mutex_lock(&state_lock);
+  double t = now_s();
+  nvmlReturn_t result = NVML_SUCCESS;
+  switch (type) {
+  case NVML_CLOCK_GRAPHICS:
+  case NVML_CLOCK_SM: *clock = sm_clock(device, t); break;
+  case NVML_CLOCK_MEM: *clock = mem_clock(device, t); break;
+  default: result = NVML_ERROR_NOT_SUPPORTED; break;
+  }
+  pthread_mutex_unlock(&state_lock);
+  return result;
+}
+
+nvmlReturn_t nvmlDeviceGetPerformanceState(nvmlDevice_t device, nvmlPstates_t* state) {
+  FAKE_ENTER_DEVICE(nvmlDeviceGetPerformanceState, device);
+  if (!state) return NVML_ERROR_INVALID_ARGUMENT;
+  *state = gpu_utilization(device, now_s()) < FAKE_IDLE_UTIL ? NVML_PSTATE_8 : NVML_PSTATE_0;
+  return NVML_SUCCESS;
+}
+
+nvmlReturn_t nvmlDeviceGetCurrentClocksThrottleReasons(nvmlDevice_t device,
+                                                       unsigned long long* reasons) {
+  FAKE_ENTER_DEVICE(nvmlDeviceGetCurrentClocksThrottleReasons, device);
+  if (!reasons) return NVML_ERROR_INVALID_ARGUMENT;
+  pthread_mutex_lock(&state_lock);
+  *reasons = throttle_reasons(device, now_s());
+  pthread_mutex_unlock(&state_lock);
+  return NVML_SUCCESS;
+}
+
+nvmlReturn_t nvmlDeviceGetTotalEnergyConsumption(nvmlDevice_t device, unsigned long long* energy) {
+  FAKE_ENTER_DEVICE(nvmlDeviceGetTotalEnergyConsumption, device);
+  if (!energy) return NVML_ERROR_INVALID_ARGUMENT;
+  *energy = energy_consumed(device);
+  return NVML_SUCCESS;
+}
+
+// The driver's sample buffer: one sample every FAKE_SAMPLE_MS since nvmlInit, the newest
+// FAKE_SAMPLE_BUFFER of them kept. Returns those newer than last_seen_us, NOT_FOUND if none are.
+nvmlReturn_t nvmlDeviceGetSamples(nvmlDevice_t device, nvmlSamplingType_t type,
+                                  unsigned long long last_seen_us, nvmlValueType_t* value_type,
+                                  unsigned int* count, nvmlSample_t* samples) {
+  FAKE_ENTER_DEVICE(nvmlDeviceGetSamples, device);
+  if (!value_type || !count) return NVML_ERROR_INVALID_ARGUMENT;
+  switch (type) {
+  case NVML_TOTAL_POWER_SAMPLES:
+  case NVML_GPU_UTILIZATION_SAMPLES:
+  case NVML_MEMORY_UTILIZATION_SAMPLES:
+  case NVML_PROCESSOR_CLK_SAMPLES:
+  case NVML_MEMORY_CLK_SAMPLES: break;
+  default: return NVML_ERROR_NOT_SUPPORTED;
+  }
+  *value_type = NVML_VALUE_TYPE_UNSIGNED_INT;
+  if (!samples) {
+    *count = FAKE_SAMPLE_BUFFER;
+    return NVML_SUCCESS;
+  }
+
+  long long newest = (long long)(now_s() * 1000) / FAKE_SAMPLE_MS;
+  long long first = newest - FAKE_SAMPLE_BUFFER + 1;
+  if (last_seen_us >= start_realtime_us) {
+    long long seen = (long long)(last_seen_us - start_realtime_us) / (FAKE_SAMPLE_MS * 1000);
+    if (seen + 1 > first) first = seen + 1;
+  }
+  if (first < 0) first = 0;
+  if (first > newest) return NVML_ERROR_NOT_FOUND;
+  if (*count < newest - first + 1) {
+    *count = newest - first + 1;
+    return NVML_ERROR_INSUFFICIENT_SIZE;
+  }
+
+  pthread_mutex_lock(&state_lock);
+  *count = newest - first + 1;
+  for (unsigned int k = 0; k < *count; k++) {
+    long long ms = (first + k) * FAKE_SAMPLE_MS;
+    double t = ms / 1000.0;
+    unsigned int v = 0;
+    switch (type) {
+    case NVML_TOTAL_POWER_SAMPLES: v = power_usage(device, t); break;
+    case NVML_GPU_UTILIZATION_SAMPLES: v = gpu_utilization(device, t); break;
+    case NVML_MEMORY_UTILIZATION_SAMPLES: v = gpu_utilization(device, t) / 2; break;
+    case NVML_PROCESSOR_CLK_SAMPLES: v = sm_clock(device, t); break;
+    default: v = mem_clock(device, t); break;
+    }
+    samples[k].timeStamp = start_realtime_us + ms * 1000;
+    samples[k].sampleValue.uiVal = v;
+  }
+  pthread_mutex_unlock(&state_lock);
+  return NVML_SUCCESS;
+}
+
+nvmlReturn_t nvmlDeviceGetPcieThroughput(nvmlDevice_t device, nvmlPcieUtilCounter_t counter,
+                                         unsigned int* value) {
+  FAKE_ENTER_DEVICE(nvmlDeviceGetPcieThroughput, device);
+  if (!value) return NVML_ERROR_INVALID_ARGUMENT;
+  unsigned int rx = gpu_utilization(device, now_s()) * FAKE_PCIE_KBPS_PER_PCT;
+  switch (counter) {
+  case NVML_PCIE_UTIL_RX_BYTES: *value = rx; break;
+  case NVML_PCIE_UTIL_TX_BYTES: *value = rx / 4; break;
+  default: return NVML_ERROR_INVALID_ARGUMENT;
+  }
+  return NVML_SUCCESS;
+}
+
+nvmlReturn_t nvmlDeviceGetNvLinkState(nvmlDevice_t device, unsigned int link,
+                                      nvmlEnableState_t* active) {
+  FAKE_ENTER_DEVICE(nvmlDeviceGetNvLinkState, device);
+  if (!active || link >= NVML_NVLINK_MAX_LINKS) return NVML_ERROR_INVALID_ARGUMENT;
+  if (config.nvlinks == 0) return NVML_ERROR_NOT_SUPPORTED;
+  *active = link < config.nvlinks ? NVML_FEATURE_ENABLED : NVML_FEATURE_DISABLED;
+  return NVML_SUCCESS;
+}
+
+// PIDs of processes that exist on this host, collected on first use
+static unsigned int host_pids[FAKE_MAX_PIDS];
+static unsigned int host_pid_count;
+static pthread_once_t host_pids_once = PTHREAD_ONCE_INIT;
+
+static void collect_host_pids(void) {
+  DIR* dir = opendir("/proc");
+  if (!dir) return;
+  struct dirent* entry;
+  while (host_pid_count < FAKE_MAX_PIDS && (entry = readdir(dir))) {
+    char* end;
+    unsigned long pid = strtoul(entry->d_name, &end, 10);
+    if (pid > 0 && *end == '\0') host_pids[host_pid_count++] = pid;
+  }
+  closedir(dir);
+}
+
+// Number of processes on the device; process k is host_pids[device_pid(device, k)]
+static unsigned int device_procs(void) {
+  pthread_once(&host_pids_once, collect_host_pids);
+  return config.procs_per_device < host_pid_count ? config.procs_per_device : host_pid_count;
+}
+
+static unsigned int device_pid(nvmlDevice_t device, unsigned int k) {
+  return host_pids[(device->index * config.procs_per_device + k) % host_pid_count];
+}
+
+nvmlReturn_t nvmlDeviceGetComputeRunningProcesses(nvmlDevice_t device, unsigned int* count,
+                                                  nvmlProcessInfo_t* infos) {
+  FAKE_ENTER_DEVICE(nvmlDeviceGetComputeRunningProcesses, device);
+  if (!count) return NVML_ERROR_INVALID_ARGUMENT;
+  unsigned int procs = device_procs();
+  if (*count < procs) {
+    *count = procs;
+    return NVML_ERROR_INSUFFICIENT_SIZE;
+  }
+  if (procs && !infos) return NVML_ERROR_INVALID_ARGUMENT;
+
+  for (unsigned int k = 0; k < procs; k++) {
+    memset(&infos[k], 0, sizeof(infos[k]));
+    infos[k].pid = device_pid(device, k);
+    infos[k].usedGpuMemory = (k % 8 + 1) * 256ULL * 1024 * 1024;
+  }
+  *count = procs;
+  return NVML_SUCCESS;
+}
+
+// One sample per process, stamped now; NOT_FOUND if the caller has already seen this instant
+nvmlReturn_t nvmlDeviceGetProcessUtilization(nvmlDevice_t device,
+                                             nvmlProcessUtilizationSample_t* utilization,
+                                             unsigned int* count,
+                                             unsigned long long last_seen_us) {
+  FAKE_ENTER_DEVICE(nvmlDeviceGetProcessUtilization, device);
+  if (!count) return NVML_ERROR_INVALID_ARGUMENT;
+  unsigned int procs = device_procs();
+  if (!utilization || *count < procs) {
+    *count = procs;
+    return NVML_ERROR_INSUFFICIENT_SIZE;
+  }
+
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  unsigned long long now_us = now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+  if (procs == 0 || last_seen_us >= now_us) return NVML_ERROR_NOT_FOUND;
+
+  for (unsigned int k = 0; k < procs; k++) {
+    double busy = 0.5 + 0.4 * sin(curve_phase(now_s()) + device->index + k);
+    memset(&utilization[k], 0, sizeof(utilization[k]));
+    utilization[k].pid = device_pid(device, k);
+    utilization[k].timeStamp = now_us;
+    utilization[k].smUtil = (unsigned int)lround(busy * 100 / procs);
+    utilization[k].memUtil = utilization[k].smUtil / 2;
+  }
+  *count = procs;
+  return NVML_SUCCESS;
+}
+
+static void set_uint_field(nvmlFieldValue_t* value, unsigned int v) {
+  value->valueType = NVML_VALUE_TYPE_UNSIGNED_INT;
+  value->value.uiVal = v;
+}
+
+nvmlReturn_t nvmlDeviceGetFieldValues(nvmlDevice_t device, int count, nvmlFieldValue_t* values) {
+  FAKE_ENTER_DEVICE(nvmlDeviceGetFieldValues, device);
+  if (count < 0 || (count > 0 && !values)) return NVML_ERROR_INVALID_ARGUMENT;
+
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  pthread_mutex_lock(&state_lock);
+  for (int i = 0; i < count; i++) {
+    nvmlFieldValue_t* v = &values[i];
+    v->timestamp = now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+    v->latencyUsec = 0;
+    v->nvmlReturn = NVML_SUCCESS;
+    switch (v->fieldId) {
+#ifdef NVML_FI_DEV_POWER_INSTANT
+    case NVML_FI_DEV_POWER_INSTANT: set_uint_field(v, power_usage(device, now_s())); break;
+#endif
+#ifdef NVML_FI_DEV_POWER_CURRENT_LIMIT
+    case NVML_FI_DEV_POWER_CURRENT_LIMIT: set_uint_field(v, device->power_limit_mw); break;
+#endif
+#ifdef NVML_FI_DEV_POWER_MIN_LIMIT
+    case NVML_FI_DEV_POWER_MIN_LIMIT: set_uint_field(v, config.power_min_mw); break;
+#endif
+#ifdef NVML_FI_DEV_POWER_MAX_LIMIT
+    case NVML_FI_DEV_POWER_MAX_LIMIT: set_uint_field(v, config.power_max_mw); break;
+#endif
+#ifdef NVML_FI_DEV_POWER_DEFAULT_LIMIT
+    case NVML_FI_DEV_POWER_DEFAULT_LIMIT: set_uint_field(v, config.power_limit_mw); break;
+#endif
+#ifdef NVML_FI_DEV_TOTAL_ENERGY_CONSUMPTION
+    case NVML_FI_DEV_TOTAL_ENERGY_CONSUMPTION:
+      v->valueType = NVML_VALUE_TYPE_UNSIGNED_LONG_LONG;
+      v->value.ullVal = energy_consumed(device);
+      break;
+#endif
+#if defined(NVML_FI_DEV_NVLINK_THROUGHPUT_DATA_TX) && defined(NVML_FI_DEV_NVLINK_THROUGHPUT_DATA_RX)
+    case NVML_FI_DEV_NVLINK_THROUGHPUT_DATA_TX:
+    case NVML_FI_DEV_NVLINK_THROUGHPUT_DATA_RX: {
+      // KiB since nvmlInit; links carry a little more the higher their number, RX 60% of TX
+      if (v->scopeId >= config.nvlinks) {
+        v->nvmlReturn = NVML_ERROR_NOT_SUPPORTED;
+        break;
+      }
+      double kib = utilization_integral(device, now_s()) * FAKE_NVLINK_KIBPS_PER_PCT *
+                   (1 + 0.1 * v->scopeId);
+      if (v->fieldId == NVML_FI_DEV_NVLINK_THROUGHPUT_DATA_RX) kib *= 0.6;
+      v->valueType = NVML_VALUE_TYPE_UNSIGNED_LONG_LONG;
+      v->value.ullVal = (unsigned long long)kib;
+    } break;
+#endif
+    default: v->nvmlReturn = NVML_ERROR_NOT_SUPPORTED; break;
+    }
+  }
+  pthread_mutex_unlock(&state_lock);
+  return NVML_SUCCESS;
+}
+
+#define FAKE_EVENT_TYPES                                                                           \
+  (nvmlEventTypeClock | nvmlEventTypePState | nvmlEventTypeXidCriticalError |                      \
+   nvmlEventTypePowerSourceChange)
+
+struct nvmlEventSet_st {
+  unsigned long long types[FAKE_MAX_DEVICES]; // Registered event types per device
+  unsigned int next_device;                   // Round-robin position for the next event
+  long long next_event_ns;                    // CLOCK_MONOTONIC time of the next event
+};
+
+static long long monotonic_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+nvmlReturn_t nvmlEventSetCreate(nvmlEventSet_t* set) {
+  FAKE_ENTER(nvmlEventSetCreate);
+  if (!set) return NVML_ERROR_INVALID_ARGUMENT;
+  *set = calloc(1, sizeof(**set));
+  if (!*set) return NVML_ERROR_MEMORY;
+  (*set)->next_event_ns = monotonic_ns() + config.event_interval_ns;
+  return NVML_SUCCESS;
+}
+
+nvmlReturn_t nvmlEventSetFree(nvmlEventSet_t set) {
+  FAKE_ENTER(nvmlEventSetFree);
+  free(set);
+  return NVML_SUCCESS;
+}
+
+nvmlReturn_t nvmlDeviceGetSupportedEventTypes(nvmlDevice_t device, unsigned long long* types) {
+  FAKE_ENTER_DEVICE(nvmlDeviceGetSupportedEventTypes, device);
+  if (!types) return NVML_ERROR_INVALID_ARGUMENT;
+  *types = FAKE_EVENT_TYPES;
+  return NVML_SUCCESS;
+}
+
+nvmlReturn_t nvmlDeviceRegisterEvents(nvmlDevice_t device, unsigned long long types,
+                                      nvmlEventSet_t set) {
+  FAKE_ENTER_DEVICE(nvmlDeviceRegisterEvents, device);
+  if (!set || (types & ~FAKE_EVENT_TYPES)) return NVML_ERROR_NOT_SUPPORTED;
+  set->types[device->index] |= types;
+  return NVML_SUCCESS;
+}
+
+// Delivers a clock event (or the first registered type) every FAKE_NVML_EVENT_MS
+nvmlReturn_t nvmlEventSetWait(nvmlEventSet_t set, nvmlEventData_t* data, unsigned int timeout_ms) {
+  FAKE_ENTER(nvmlEventSetWait);
+  if (!set || !data) return NVML_ERROR_INVALID_ARGUMENT;
+
+  long long wait_ns = (long long)timeout_ms * 1000000;
+  long long until_event = set->next_event_ns - monotonic_ns();
+  if (config.event_interval_ns > 0 && until_event < wait_ns) wait_ns = until_event;
+  if (wait_ns > 0) busy_wait(wait_ns);
+  if (config.event_interval_ns <= 0 || monotonic_ns() < set->next_event_ns)
+    return NVML_ERROR_TIMEOUT;
+  set->next_event_ns += config.event_interval_ns;
+
+  for (unsigned int i = 0; i < config.device_count; i++) {
+    unsigned int index = (set->next_device + i) % config.device_count;
+    unsigned long long types = set->types[index];
+    if (!types) continue;
+    set->next_device = index + 1;
+    memset(data, 0, sizeof(*data));
+    data->device = &devices[index];
+    data->eventType = (types & nvmlEventTypeClock) ? nvmlEventTypeClock : types & -types;
+    return NVML_SUCCESS;
+  }
+  return NVML_ERROR_TIMEOUT;
+}
@@ -1,18 +1,81 @@
 #define _GNU_SOURCE
 #include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <getopt.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <nvml.h>
+#include <poll.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "nvml-tool-shm.h"
+
 #define MAX_DEVICES 64
 #define MAX_NAME_LEN 256
 #define MAX_UUID_LEN 80
+#define FULL_UUID_LEN 40 // "GPU-" followed by a 36-character UUID
 #define MAX_SETPOINTS 16
+#define MAX_FANS 8
+#define MAX_FIELDS 16
+#define PCI_BUS_ID_LEN 16
+#define MAX_SELECTOR_LEN 2048
+#define DEFAULT_WATCH_INTERVAL_MS 1000
+#define MAX_INTERVAL_MS 3600000
+#define DEFAULT_BENCH_ITERATIONS 1000
+#define DEFAULT_STATS_WINDOW_MS (5 * 60 * 1000)
+#define OUT_BUF_SIZE 65536 // One output frame; larger frames take more than one write
+#define FANCTL_INTERVAL_MS 2000
+#define FANCTL_REFRESH_MS 60000 // Rewrite unchanged fan speeds this often, in case of a reset
+#define FANCTL_MIN_INTERVAL_MS 250   // Adaptive interval while temperatures move fast
+#define FANCTL_MAX_INTERVAL_MS 8000  // Adaptive interval while temperatures are flat
+#define FANCTL_FAST_DELTA_C 2        // Change per tick that counts as moving fast
+#define EVENT_WAIT_TIMEOUT_MS 500
+#define EVENT_TICK_MIN_MS 250 // Event wakeups closer together than this share one tick
+#define PID_DEFAULT_KP 4.0         // Fan percent per C above target
+#define PID_DEFAULT_KI 0.1         // Fan percent per C*s
+#define PID_DEFAULT_KD 2.0         // Fan percent per C/s of temperature rise
+#define PID_DEFAULT_SLEW 5.0       // Fan percent per second
+#define PID_DEFAULT_HYSTERESIS 1.0 // C
+#define POWERCTL_DEFAULT_DEADBAND_W 5
+#define POWERCTL_MAX_BUDGET_W 100000
+#define POWERCTL_MAX_DEADBAND_W 1000
+#define SAMPLER_QUEUE_LEN 16
+#define DEFAULT_SOCKET_PATH "/run/nvml-tool.sock"
+#define SOCKET_ENV "NVML_TOOL_SOCKET"
+#define QUERY_MAGIC 0x4e564d4cu // "NVML"
+#define QUERY_VERSION 3
+#define QUERY_TIMEOUT_MS 2000
+#define QUERY_MAX_CLIENTS 64 // Query clients served at once; more wait in the backlog
+#define DEFAULT_EXPORTER_ADDR ":9401"
+#define DEFAULT_AGGREGATE_ADDR ":9402"
+#define DEFAULT_AGGREGATE_SOCKET "/run/nvml-tool-aggregate.sock"
+#define EXPORTER_MAX_CLIENTS 64
+#define EXPORTER_MAX_FANS 8
+#define EXPORTER_REQUEST_MAX 4096
+#define DEFAULT_CACHE_DIR "/run/nvml-tool"
+#define CACHE_DIR_ENV "NVML_TOOL_CACHE_DIR"
+#define CACHE_FILE "devices"
+#define CACHE_VERSION 1
 
 typedef enum {
   CMD_NONE,
@@ -22,30 +85,201 @@ typedef enum {
   CMD_TEMP,
   CMD_STATUS,
   CMD_LIST,
-  CMD_FANCTL
+  CMD_FANCTL,
+  CMD_WATCH,
+  CMD_SERVE,
+  CMD_SHM,
+  CMD_EXPORTER,
+  CMD_BENCH,
+  CMD_RECORD,
+  CMD_REPLAY,
+  CMD_STATS,
+  CMD_ENERGY,
+  CMD_PROCS,
+  CMD_AGENT,
+  CMD_AGGREGATE,
+  CMD_POWERCTL,
+  CMD_SAMPLES
 } command_t;
 
-typedef enum { SUBCMD_NONE, SUBCMD_SET, SUBCMD_RESTORE, SUBCMD_JSON } subcommand_t;
+typedef enum {
+  SUBCMD_NONE,
+  SUBCMD_SET,
+  SUBCMD_RESTORE,
+  SUBCMD_JSON,
+  SUBCMD_START,
+  SUBCMD_STOP
+} subcommand_t;
+
+// Long options without a short form
+enum {
+  OPT_MODE = 256,
+  OPT_TARGET,
+  OPT_GAINS,
+  OPT_SLEW,
+  OPT_HYSTERESIS,
+  OPT_FAN_RANGE,
+  OPT_SIMULATE,
+  OPT_ENCODING,
+  OPT_FROM,
+  OPT_TO,
+  OPT_WINDOW,
+  OPT_EVERY,
+  OPT_ENERGY,
+  OPT_FORMATTERS,
+  OPT_CONNECT,
+  OPT_NODE,
+  OPT_NODES,
+  OPT_BUDGET,
+  OPT_DEADBAND,
+  OPT_THROTTLE,
+  OPT_IO
+};
 
 typedef struct {
   unsigned int temp;
   unsigned int fan;
 } setpoint_t;
 
+typedef enum { FAN_MODE_LINEAR, FAN_MODE_PID } fan_mode_t;
+
+// fanctl --mode pid settings
+typedef struct {
+  double target;     // Temperature to hold, C
+  double kp, ki, kd; // Fan percent per C of error, per C*s of error and per C/s of change
+  double slew;       // Max fan change in percent per second, 0 for unlimited
+  double hysteresis; // Errors within +-hysteresis C count as on target
+  unsigned int min_fan, max_fan;
+} pid_config_t;
+
+typedef struct {
+  int primed;
+  double integral; // Integral term, percent
+  double prev_temp;
+  double output; // Last output before rounding, percent
+} pid_state_t;
+
 typedef struct {
   int devices[MAX_DEVICES];
   int device_count;
   int all_devices;
-  char uuid[MAX_UUID_LEN];
-  int use_uuid;
+  char uuid_list[MAX_SELECTOR_LEN]; // Comma-separated UUIDs or UUID prefixes
+  char pci_list[MAX_SELECTOR_LEN];  // Comma-separated PCI bus IDs
   command_t command;
   subcommand_t subcommand;
   unsigned int set_value;
   char temp_unit;
   setpoint_t setpoints[MAX_SETPOINTS];
   int setpoint_count;
+  fan_mode_t fan_mode;
+  pid_config_t pid;
+  const char* simulate; // fanctl: replay a temperature trace instead of driving fans
+  const char* output;   // record: recording to write
+  const char* input;    // replay: recording to read
+  int encoding;         // record: REC_ENCODING_*
+  const char* from;     // replay, fanctl --simulate: time range to read
+  const char* to;
+  unsigned long long window_ms; // stats: window to summarize
+  unsigned long long every_ms;  // stats: report interval, 0 for once per window
+  const char* marker;           // energy start/stop: marker file
+  unsigned int interval_ms;
+  unsigned long count;
+  char socket_path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+  const char* shm_name;
+  const char* listen_addr;
+  int events; // watch: also sample on NVML events
+  int energy; // watch: also report energy used per tick
+  int throttle; // watch: also report clocks, P-state and throttle reasons
+  int io;       // watch: also report utilization and PCIe/NVLink throughput; info, exporter: PCIe
+  int formatters; // bench: time the output formatters instead of the NVML getters
+  const char* connect_addr; // agent: aggregator to push samples to
+  const char* node_name;    // agent: node name to report, NULL for the hostname
+  int agent_nodes;          // agent: simulated nodes, one connection each; 0 for just this one
+  unsigned int budget_w;    // powerctl: power budget shared by the selected devices
+  unsigned int deadband_w;  // powerctl: smallest limit change worth writing
 } cli_args_t;
 
+// Query protocol spoken over the serve socket. Client and daemon are the same binary on the
+// same host, so structs travel in native layout; magic and version catch mismatched builds.
+typedef struct {
+  uint32_t magic;
+  uint16_t version;
+  uint8_t command;
+  uint8_t subcommand;
+  uint8_t all_devices;
+  uint8_t device_count;
+  char temp_unit;
+  uint8_t io;
+  int32_t devices[MAX_DEVICES];
+  char uuid_list[MAX_SELECTOR_LEN];
+  char pci_list[MAX_SELECTOR_LEN];
+} query_request_t;
+
+typedef struct {
+  uint32_t magic;
+  int32_t status;   // Error count, as the one-shot command would have returned
+  uint32_t out_len; // Bytes of stdout payload that follow
+  uint32_t err_len; // Bytes of stderr payload that follow the stdout payload
+} query_response_t;
+
+// Metrics a sampling pass can collect
+enum {
+  SAMPLE_TEMP = 1 << 0,
+  SAMPLE_MEMORY = 1 << 1,
+  SAMPLE_FAN = 1 << 2,
+  SAMPLE_POWER = 1 << 3,
+  SAMPLE_POWER_LIMIT = 1 << 4,
+  SAMPLE_ALL = (1 << 5) - 1,
+  STATUS_METRICS = SAMPLE_TEMP | SAMPLE_FAN | SAMPLE_POWER,
+  SAMPLE_ENERGY = 1 << 5, // Opt-in, not part of SAMPLE_ALL or the shm/recording records
+  SAMPLE_UTILIZATION = 1 << 6, // Opt-in like SAMPLE_ENERGY
+  SAMPLE_CLOCKS = 1 << 7,       // Opt-in: SM and memory clocks and the P-state
+  SAMPLE_THROTTLE = 1 << 8,     // Opt-in: clock throttle reasons
+  SAMPLE_PCIE = 1 << 9,         // Opt-in (--io): PCIe throughput, ~20 ms per direction on real GPUs
+  SAMPLE_NVLINK = 1 << 10,      // Opt-in: NVLink data counters, summed over the active links
+  SAMPLE_MEM_CLOCK = 1 << 11,   // Set along with SAMPLE_CLOCKS when the memory clock read too
+  INFO_METRICS = SAMPLE_ALL | SAMPLE_UTILIZATION | SAMPLE_CLOCKS | SAMPLE_THROTTLE
+};
+
+typedef struct {
+  unsigned int valid;       // SAMPLE_* flags that were read successfully
+  unsigned int temperature; // Celsius
+  nvmlMemory_t memory;
+  unsigned int fan_speed;   // Percent
+  unsigned int power_usage; // mW
+  unsigned int power_limit; // mW
+  unsigned long long energy; // mJ since the driver was loaded
+  nvmlUtilization_t utilization; // Percent of time the GPU and memory were busy
+  unsigned int sm_clock, mem_clock;    // MHz
+  unsigned int pstate;                 // 0-15, NVML_PSTATE_UNKNOWN if it could not be read
+  unsigned long long throttle_reasons; // nvmlClocksThrottleReason* bits
+  unsigned int pcie_tx, pcie_rx;       // KiB/s (NVML's "KB")
+  unsigned long long nvlink_tx, nvlink_rx; // KiB, counters
+} device_sample_t;
+
+// Per-device plan: which metrics are served by one nvmlDeviceGetFieldValues batch.
+// Fields the device rejects are dropped from the plan and fall back to per-call getters.
+typedef struct {
+  unsigned int requested; // SAMPLE_* flags the caller wants
+  unsigned int batched;   // Subset of requested currently served by the batch
+  int field_count;
+  nvmlFieldValue_t fields[MAX_FIELDS];
+  unsigned int field_metric[MAX_FIELDS]; // SAMPLE_* flag filled by fields[i]
+  int nvlink_probed;
+  unsigned int nvlink_links; // Bitmask of active NVLink links, probed on the first read
+} field_plan_t;
+
+// Absolute-deadline tick scheduler (CLOCK_MONOTONIC, immune to accumulated sleep drift)
+typedef struct {
+  long long interval_ns;
+  long long start_ns;
+  long long next_ns;      // Absolute deadline of the next tick
+  unsigned long ticks;    // Ticks delivered
+  unsigned long overruns; // Deadlines missed because a tick took longer than the interval
+  long long drift_ns;     // Wakeup latency of the last tick relative to its deadline
+  long long last_ns;      // When the last tick fired
+} tick_scheduler_t;
+
 // Global variables for signal handling
 static volatile int running = 1;
 static nvmlDevice_t controlled_devices[MAX_DEVICES];
@@ -56,6 +290,12 @@ static int is_terminal = 0;
 static void signal_handler(int signum) {
   (void)signum;
   running = 0;
+}
+
+// Hand the fans back to the driver. Runs on the main thread once the sampler workers are
+// stopped, so no control write can land after it, whichever way fanctl exits.
+static void restore_fan_control(void) {
+  if (controlled_device_count == 0) return;
   printf("\nRestoring automatic fan control...\n");
 
   for (int i = 0; i < controlled_device_count; i++) {
@@ -94,11 +334,6 @@ static int parse_setpoints(int argc, char* argv[], int start_idx, setpoint_t* se
     count++;
   }
 
-  if (count == 0) {
-    fprintf(stderr, "Error: No valid setpoints provided\n");
-    return -1;
-  }
-
   // Sort setpoints by temperature
   for (int i = 0; i < count - 1; i++) {
     for (int j = i + 1; j < count; j++) {
@@ -130,218 +365,6459 @@ static unsigned int interpolate_fan_speed(unsigned int current_temp, const setpo
       unsigned int fan_range = setpoints[i + 1].fan - setpoints[i].fan;
       unsigned int temp_offset = current_temp - setpoints[i].temp;
 
-      return setpoints[i].fan + (fan_range * temp_offset) / temp_range;
-    }
-  }
+      return setpoints[i].fan + (fan_range * temp_offset) / temp_range;
+    }
+  }
+
+  return setpoints[0].fan; // Fallback
+}
+
+// One PID step for a reading taken `dt` seconds after the previous one. The derivative acts on
+// the measurement so target changes and hysteresis edges don't kick the fans, and the integral
+// only accumulates while the output isn't already pinned in the same direction (anti-windup).
+static unsigned int pid_update(const pid_config_t* cfg, pid_state_t* st, double temp, double dt) {
+  double error = temp - cfg->target; // Positive when too hot
+  if (error <= cfg->hysteresis && error >= -cfg->hysteresis) error = 0;
+
+  int first = !st->primed;
+  if (first) {
+    st->primed = 1;
+    st->integral = cfg->min_fan;
+    st->prev_temp = temp;
+    dt = 0;
+  }
+
+  // Inside the band the derivative is ignored too, or sensor noise would still move the fans
+  double derivative = dt > 0 && error != 0 ? (temp - st->prev_temp) / dt : 0;
+  double integral = st->integral + cfg->ki * error * dt;
+  double output = cfg->kp * error + integral + cfg->kd * derivative;
+
+  if (!(output > cfg->max_fan && error > 0) && !(output < cfg->min_fan && error < 0))
+    st->integral = integral;
+  if (st->integral > cfg->max_fan) st->integral = cfg->max_fan;
+  if (st->integral < cfg->min_fan) st->integral = cfg->min_fan;
+
+  if (output > cfg->max_fan) output = cfg->max_fan;
+  if (output < cfg->min_fan) output = cfg->min_fan;
+  if (!first && cfg->slew > 0) {
+    double step = cfg->slew * dt;
+    if (output > st->output + step) output = st->output + step;
+    if (output < st->output - step) output = st->output - step;
+  }
+
+  st->output = output;
+  st->prev_temp = temp;
+  return (unsigned int)(output + 0.5);
+}
+
+// Fan speed for a temperature reading under the configured fanctl mode
+static unsigned int fanctl_target(const cli_args_t* args, pid_state_t* pid, double temp,
+                                  double dt) {
+  if (args->fan_mode == FAN_MODE_PID) return pid_update(&args->pid, pid, temp, dt);
+  return interpolate_fan_speed((unsigned int)(temp + 0.5), args->setpoints, args->setpoint_count);
+}
+
+static long long now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void tick_scheduler_init(tick_scheduler_t* sched, unsigned int interval_ms) {
+  memset(sched, 0, sizeof(*sched));
+  sched->interval_ns = interval_ms * 1000000LL;
+  sched->start_ns = now_ns();
+  sched->next_ns = sched->start_ns; // First tick fires immediately
+}
+
+// Account for a tick that fired at `now` and move to the next deadline
+static void tick_scheduler_advance(tick_scheduler_t* sched, long long now) {
+  sched->drift_ns = now - sched->next_ns;
+  sched->last_ns = now;
+  sched->next_ns += sched->interval_ns;
+
+  // Skip deadlines that already passed rather than firing a burst of catch-up ticks
+  if (now >= sched->next_ns) {
+    long long missed = (now - sched->next_ns) / sched->interval_ns + 1;
+    sched->overruns += missed;
+    sched->next_ns += missed * sched->interval_ns;
+  }
+
+  sched->ticks++;
+}
+
+// Sleep until the next deadline. Returns 0 when interrupted by a stop request.
+static int tick_scheduler_wait(tick_scheduler_t* sched) {
+  struct timespec deadline = {sched->next_ns / 1000000000LL, sched->next_ns % 1000000000LL};
+
+  while (running) {
+    int rc = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL);
+    if (rc == 0) break;
+    if (rc != EINTR) return 0;
+  }
+  if (!running) return 0;
+
+  tick_scheduler_advance(sched, now_ns());
+  return 1;
+}
+
+// Non-blocking variant for event loops: fire the tick if its deadline has passed
+static int tick_scheduler_due(tick_scheduler_t* sched) {
+  long long now = now_ns();
+  if (now < sched->next_ns) return 0;
+  tick_scheduler_advance(sched, now);
+  return 1;
+}
+
+// Milliseconds until the next deadline, rounded up, for use as a poll() timeout
+static int tick_scheduler_timeout_ms(const tick_scheduler_t* sched) {
+  long long remaining = sched->next_ns - now_ns();
+  if (remaining <= 0) return 0;
+  return (int)((remaining + 999999) / 1000000);
+}
+
+// Change the interval; the pending deadline moves so it stays one interval after the last tick
+static void tick_scheduler_set_interval(tick_scheduler_t* sched, long long interval_ns) {
+  sched->next_ns += interval_ns - sched->interval_ns;
+  sched->interval_ns = interval_ns;
+}
+
+// tick_scheduler_wait that also wakes when `fd` (an eventfd, or -1) becomes readable. An early
+// wakeup fires the tick at once and restarts the interval from there, but at most one every
+// EVENT_TICK_MIN_MS: a burst of events (clock changes come in storms while boosting) is
+// coalesced into a single tick at the end of that window. Returns 0 when stopped, 1 for a
+// deadline tick and 2 for an fd tick.
+static int tick_scheduler_wait_fd(tick_scheduler_t* sched, int fd) {
+  int event_pending = 0;
+  while (running) {
+    long long now = now_ns();
+    if (now >= sched->next_ns) {
+      tick_scheduler_advance(sched, now);
+      return event_pending ? 2 : 1;
+    }
+
+    struct pollfd pfd = {fd, POLLIN, 0};
+    int rc = poll(&pfd, fd >= 0 ? 1 : 0, tick_scheduler_timeout_ms(sched));
+    if (rc < 0 && errno != EINTR) return 0;
+    if (rc > 0) {
+      uint64_t events;
+      if (read(fd, &events, sizeof(events)) < 0) continue;
+      now = now_ns();
+      long long earliest = sched->last_ns + EVENT_TICK_MIN_MS * 1000000LL;
+      if (sched->ticks > 0 && now < earliest) {
+        // Too soon after the last tick: bring the deadline forward instead of firing now
+        if (earliest < sched->next_ns) {
+          sched->next_ns = earliest;
+          event_pending = 1;
+        }
+        continue;
+      }
+      sched->next_ns = now;
+      tick_scheduler_advance(sched, now);
+      return 2;
+    }
+  }
+  return 0;
+}
+
+static int write_all(int fd, const void* buf, size_t len) {
+  const char* p = buf;
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return -1;
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+// Drop `n` written bytes from the front of an iovec array, along with any empty entries.
+// Returns the number of iovecs left; *iov moves to the first of them.
+static int iov_consume(struct iovec** iov, int count, size_t n) {
+  struct iovec* v = *iov;
+  while (count > 0 && n >= v->iov_len) {
+    n -= v->iov_len;
+    v++;
+    count--;
+  }
+  if (count > 0) {
+    v->iov_base = (char*)v->iov_base + n;
+    v->iov_len -= n;
+  }
+  *iov = v;
+  return count;
+}
+
+// Output writer. Formatters append to a preallocated frame using the integer and fixed-point
+// formatting below, and the frame goes out with a single write(2) (or one fwrite() for FILE
+// sinks such as the daemon's memstreams) instead of a printf per field through stdio. A frame
+// that outgrows the buffer is flushed early rather than truncated.
+typedef struct {
+  int fd;     // Sink file descriptor, or -1 to write to `file`
+  FILE* file;
+  size_t len;
+  unsigned long long flushed; // Bytes handed to the sink so far
+  int failed;                 // A write failed (e.g. EPIPE); later output is dropped
+  char data[OUT_BUF_SIZE];
+} out_t;
+
+static void out_init_fd(out_t* o, int fd) {
+  o->fd = fd;
+  o->file = NULL;
+  o->len = 0;
+  o->flushed = 0;
+  o->failed = 0;
+}
+
+static void out_init_file(out_t* o, FILE* file) {
+  out_init_fd(o, -1);
+  o->file = file;
+}
+
+static int out_flush(out_t* o) {
+  if (o->len > 0 && !o->failed) {
+    if (o->fd >= 0)
+      o->failed = write_all(o->fd, o->data, o->len) != 0;
+    else
+      o->failed = fwrite(o->data, 1, o->len, o->file) != o->len;
+    o->flushed += o->len;
+  }
+  o->len = 0;
+  return o->failed ? -1 : 0;
+}
+
+// Room for n more bytes, n <= OUT_BUF_SIZE
+static char* out_reserve(out_t* o, size_t n) {
+  if (o->len + n > OUT_BUF_SIZE) out_flush(o);
+  return o->data + o->len;
+}
+
+static void out_mem(out_t* o, const char* s, size_t n) {
+  while (n > 0) {
+    size_t chunk = n < OUT_BUF_SIZE ? n : OUT_BUF_SIZE;
+    memcpy(out_reserve(o, chunk), s, chunk);
+    o->len += chunk;
+    s += chunk;
+    n -= chunk;
+  }
+}
+
+static void out_str(out_t* o, const char* s) { out_mem(o, s, strlen(s)); }
+
+static void out_char(out_t* o, char c) {
+  *out_reserve(o, 1) = c;
+  o->len++;
+}
+
+static const char digit_pairs[] = "00010203040506070809101112131415161718192021222324"
+                                  "25262728293031323334353637383940414243444546474849"
+                                  "50515253545556575859606162636465666768697071727374"
+                                  "75767778798081828384858687888990919293949596979899";
+
+// Write the decimal digits of v so they end just before `end`; returns the first digit
+static char* format_u64(char* end, unsigned long long v) {
+  while (v >= 100) {
+    const char* pair = &digit_pairs[(v % 100) * 2];
+    v /= 100;
+    *--end = pair[1];
+    *--end = pair[0];
+  }
+  if (v >= 10) {
+    *--end = digit_pairs[v * 2 + 1];
+    *--end = digit_pairs[v * 2];
+  } else {
+    *--end = (char)('0' + v);
+  }
+  return end;
+}
+
+static void out_u64(out_t* o, unsigned long long v) {
+  char buf[20];
+  char* first = format_u64(buf + sizeof(buf), v);
+  out_mem(o, first, buf + sizeof(buf) - first);
+}
+
+static void out_i64(out_t* o, long long v) {
+  if (v < 0) {
+    out_char(o, '-');
+    out_u64(o, -(unsigned long long)v);
+  } else {
+    out_u64(o, v);
+  }
+}
+
+// scaled / 10^decimals with exactly `decimals` digits after the point, decimals <= 6
+static void out_ufixed(out_t* o, unsigned long long scaled, int decimals) {
+  static const unsigned long long pow10[] = {1, 10, 100, 1000, 10000, 100000, 1000000};
+  out_u64(o, scaled / pow10[decimals]);
+  if (decimals == 0) return;
+
+  // The fraction plus 10^decimals keeps its leading zeros; the extra leading 1 becomes the point
+  char buf[8];
+  char* end = buf + decimals + 1;
+  char* first = format_u64(end, scaled % pow10[decimals] + pow10[decimals]);
+  *first = '.';
+  out_mem(o, first, end - first);
+}
+
+static void out_fixed(out_t* o, long long scaled, int decimals) {
+  if (scaled < 0) {
+    out_char(o, '-');
+    out_ufixed(o, -(unsigned long long)scaled, decimals);
+  } else {
+    out_ufixed(o, scaled, decimals);
+  }
+}
+
+// v / d rounded half away from zero, the fixed-point counterpart of printf's %.Nf
+static long long div_round(long long v, long long d) {
+  return v >= 0 ? (v + d / 2) / d : -((-v + d / 2) / d);
+}
+
+// Temperature in `unit` (C, F or K), in tenths of a degree. Kelvin uses 273.1 rather than 273.15:
+// it is what %.1f used to print for t + 273.15 at every integer t, so the output is unchanged.
+static long long temperature_tenths(unsigned int temp_c, char unit) {
+  switch (unit) {
+  case 'F': return temp_c * 18LL + 320;
+  case 'K': return temp_c * 10LL + 2731;
+  default: return temp_c * 10LL;
+  }
+}
+
+// Tenths of a MB/s (10^6 bytes) for a KiB/s rate, as NVML reports PCIe throughput. NVLink rates
+// and the exporter's bytes per second use the same 1024-byte KiB.
+static long long kib_to_mb_tenths(unsigned long long kib) {
+  return div_round((long long)(kib * 1024), 100000);
+}
+
+// Tenths of a percent of part / whole, 0 if whole is 0
+static long long percent_tenths(unsigned long long part, unsigned long long whole) {
+  return whole ? div_round((long long)(part * 1000), (long long)whole) : 0;
+}
+
+static void clear_lines(out_t* out, int count) {
+  if (is_terminal && count > 0) {
+    // Move cursor up and clear lines
+    for (int i = 0; i < count; i++) out_str(out, "\033[1A\033[2K"); // Move up one line and clear it
+  }
+}
+
+static void print_usage(const char* name) {
+  printf("Usage: %s <command> [subcommand] [options] [args]\n", name);
+  printf("\nCommands:\n");
+  printf("  info [json]         Show comprehensive device information\n");
+  printf("  power [set VALUE]   Show/set power usage and limits\n");
+  printf("  fan [set VALUE]     Show/set fan speed (NVML v12+)\n");
+  printf("  fan restore         Restore automatic fan control\n");
+  printf("  fanctl SETPOINTS    Dynamic fan control with temperature setpoints\n");
+  printf("  powerctl --budget W Share a power budget between devices by load (limits)\n");
+  printf("  temp                Show temperature\n");
+  printf("  status              Show compact status overview\n");
+  printf("  list                List all GPUs with index, UUID, and name\n");
+  printf("  watch               Continuously sample status at a fixed interval\n");
+  printf("  serve               Run a daemon answering read-only commands over a socket\n");
+  printf("  shm [json]          Show the latest samples published by watch --shm\n");
+  printf("  exporter            Serve Prometheus/OpenMetrics metrics over HTTP\n");
+  printf("  bench [json]        Time every NVML getter the tool uses (latency percentiles)\n");
+  printf("  record -o FILE      Sample devices into a compact binary recording\n");
+  printf("  replay [json] FILE  Print a recording as status (or info json) output per tick\n");
+  printf("  stats [json]        Rolling min/mean/p50/p95/p99/max of temperature, power and fan\n");
+  printf("  energy              Show energy used since the driver was loaded\n");
+  printf("  energy start FILE   Save the energy counters to a marker file\n");
+  printf("  energy stop FILE    Show energy used since the marker (per device, total, avg W)\n");
+  printf("  procs [json]        List GPU processes: memory, SM/memory utilization, cgroup\n");
+  printf("  samples [json]      Drain the driver's buffered power/utilization/clock samples\n");
+  printf("  agent               Push samples to an aggregate collector over TCP\n");
+  printf("  aggregate           Collect agents; answer fleet-wide status, list and info json\n");
+  printf("\nDevice Selection:\n");
+  printf("  -d, --device LIST   Select devices (default: all)\n");
+  printf("                      Examples: -d 0  -d 0-2  -d 0,2,4\n");
+  printf("  -u, --uuid LIST     Select devices by UUID or UUID prefix (comma-separated)\n");
+  printf("  --pci LIST          Select devices by PCI bus ID (comma-separated)\n");
+  printf("\nOutput Options:\n");
+  printf("  --temp-unit UNIT    Temperature unit: C, F, K (default: C)\n");
+  printf("  -i, --interval MS   Sampling interval for watch/exporter/record/stats/procs/samples "
+         "(default: %d)\n",
+         DEFAULT_WATCH_INTERVAL_MS);
+  printf("  -n, --count N       Stop watch/record/replay/samples after N ticks (default: until "
+         "Ctrl-C)\n");
+  printf("                      bench: iterations per getter (default: %d)\n",
+         DEFAULT_BENCH_ITERATIONS);
+  printf("                      procs: snapshots to print, 0 until Ctrl-C (default: 1)\n");
+  printf("  --shm NAME          watch: publish samples to a shared-memory ring (shm: read it)\n");
+  printf("  -e, --events        watch: also sample on clock/P-state/Xid events\n");
+  printf("  --energy            watch: append the energy used since the previous tick\n");
+  printf("  --throttle          watch: append P-state, SM/memory clocks and throttle reasons;\n");
+  printf("                      time spent in each throttle state is summarized on exit\n");
+  printf("  --io                watch: append GPU/memory utilization, PCIe and NVLink MB/s\n");
+  printf("                      info/exporter: add PCIe throughput (~40 ms per device)\n");
+  printf("                      status: append GPU/memory utilization\n");
+  printf("  --formatters        bench: time status/info json output, printf vs the writer\n");
+  printf("  -o, --output FILE   record: recording to write\n");
+  printf("  --encoding ENC      record: gorilla (default, bit-packed) or delta (varints)\n");
+  printf("  --from T, --to T    replay/--simulate: time range, seconds from the start or @UNIX\n");
+  printf("  --window DURATION   stats: window to summarize, e.g. 30s, 5m, 1h (default: 5m)\n");
+  printf("  --every DURATION    stats: report interval (default: the window; also on SIGUSR1)\n");
+  printf("  -l, --listen ADDR   exporter: HTTP listen address (default: %s)\n",
+         DEFAULT_EXPORTER_ADDR);
+  printf("                      aggregate: agent listen address (default: %s)\n",
+         DEFAULT_AGGREGATE_ADDR);
+  printf("  -S, --socket PATH   Daemon socket (default: $%s, serve: %s)\n", SOCKET_ENV,
+         DEFAULT_SOCKET_PATH);
+  printf("                      aggregate: query socket (default: %s)\n",
+         DEFAULT_AGGREGATE_SOCKET);
+  printf("  --connect ADDR      agent: aggregator HOST:PORT\n");
+  printf("  --node NAME         agent: node name to report (default: hostname)\n");
+  printf("  --nodes N           agent: simulate N nodes, one connection each (load testing)\n");
+  printf("  -h, --help          Show this help\n");
+  printf("\nfanctl Options:\n");
+  printf("  --mode MODE         linear (setpoints, default) or pid\n");
+  printf("  --target TEMP       pid: temperature to hold (C)\n");
+  printf("  --gains KP:KI:KD    pid: gains in %%/C, %%/(C*s), %%/(C/s) (default: %.1f:%.1f:%.1f)\n",
+         PID_DEFAULT_KP, PID_DEFAULT_KI, PID_DEFAULT_KD);
+  printf("  --slew PCT          pid: max fan change per second, 0 for none (default: %.0f)\n",
+         PID_DEFAULT_SLEW);
+  printf("  --hysteresis C      pid: band around the target treated as on target (default: %.0f)\n",
+         PID_DEFAULT_HYSTERESIS);
+  printf("  --fan-range MIN:MAX pid: output limits in percent (default: 30:100)\n");
+  printf("  --simulate TRACE    Replay a text trace ('-': stdin) or recording, fans untouched\n");
+  printf("\npowerctl Options:\n");
+  printf("  --budget WATTS      Total of the power limits of the selected devices\n");
+  printf("  --deadband WATTS    Skip limit changes this small or smaller (default: %d)\n",
+         POWERCTL_DEFAULT_DEADBAND_W);
+  printf("\nExamples:\n");
+  printf("  %s info                    # Show info for all devices\n", name);
+  printf("  %s info -d 0              # Show info for device 0\n", name);
+  printf("  %s power -d 0-2           # Show power for devices 0,1,2\n", name);
+  printf("  %s power set 250 -d 1     # Set 250W limit on device 1\n", name);
+  printf("  %s fan                    # Show fan speeds for all devices\n", name);
+  printf("  %s fan set 80 -d 1        # Set 80%% fan speed on device 1\n", name);
+  printf("  %s fan restore            # Restore automatic control\n", name);
+  printf("  %s fanctl 50:30 70:60 80:90 -d 0  # Dynamic fan control (Ctrl-C to exit)\n", name);
+  printf("  %s fanctl --mode pid --target 70 -d 0  # Hold device 0 at 70C\n", name);
+  printf("  %s powerctl --budget 1200 -d 0-3  # Share 1200W between devices 0-3\n", name);
+  printf("  %s info json              # JSON info for all devices\n", name);
+  printf("  %s watch -i 100 -d 0-7     # Sample devices 0-7 every 100 ms\n", name);
+  printf("  %s status -S /run/nvml-tool.sock  # Query a running serve daemon\n", name);
+  printf("  %s bench json -n 10000 -d 0  # Getter latency on device 0, as JSON\n", name);
+  printf("  %s record -i 100 -o gpus.nvtr  # Record all devices at 10 Hz\n", name);
+  printf("  %s energy start job.mark && ./job && %s energy stop job.mark\n", name, name);
+  printf("  %s agent --connect collector:9402  # Push samples to a collector\n", name);
+  printf("  %s status -S %s  # Fleet status\n", name, DEFAULT_AGGREGATE_SOCKET);
+}
+
+static int parse_device_range(const char* range_str, int* devices, int max_devices) {
+  char* str = strdup(range_str);
+  char* token = strtok(str, ",");
+  int count = 0;
+
+  while (token && count < max_devices) {
+    char* dash = strchr(token, '-');
+    if (dash) {
+      *dash = '\0';
+      int start = atoi(token);
+      int end = atoi(dash + 1);
+      for (int i = start; i <= end && count < max_devices; i++) devices[count++] = i;
+    } else {
+      devices[count++] = atoi(token);
+    }
+    token = strtok(NULL, ",");
+  }
+
+  free(str);
+  return count;
+}
+
+// Bounded copy that always terminates and silently truncates
+static void copy_string(char* dst, size_t dst_len, const char* src) {
+  size_t n = strnlen(src, dst_len - 1);
+  memcpy(dst, src, n);
+  dst[n] = '\0';
+}
+
+// Device handles are looked up once per process and reused; serve keeps them for its lifetime
+static nvmlDevice_t handle_cache[MAX_DEVICES];
+static unsigned char handle_cached[MAX_DEVICES];
+
+static nvmlReturn_t get_device_handle(int device_id, nvmlDevice_t* device) {
+  if (device_id < 0 || device_id >= MAX_DEVICES)
+    return nvmlDeviceGetHandleByIndex(device_id, device);
+  if (!handle_cached[device_id]) {
+    nvmlReturn_t result = nvmlDeviceGetHandleByIndex(device_id, &handle_cache[device_id]);
+    if (result != NVML_SUCCESS) return result;
+    handle_cached[device_id] = 1;
+  }
+  *device = handle_cache[device_id];
+  return NVML_SUCCESS;
+}
+
+// Record a handle that was found some other way (by UUID or bus ID) and return its index
+static int remember_device_handle(nvmlDevice_t device, unsigned int index) {
+  if (index < MAX_DEVICES) {
+    handle_cache[index] = device;
+    handle_cached[index] = 1;
+  }
+  return index;
+}
+
+// On-disk cache of attributes that only change with a reboot or driver reload. It is keyed by
+// the driver version and the set of PCI bus IDs, both of which can be read from /proc without
+// initializing NVML, so a valid cache lets list and UUID selection skip NVML entirely.
+typedef struct {
+  char bus_id[PCI_BUS_ID_LEN]; // Normalized dddd:bb:dd.f
+  char uuid[MAX_UUID_LEN];
+  char name[MAX_NAME_LEN];
+  nvmlReturn_t power_result; // Result of the constraints query, replayed on lookup
+  unsigned int power_min, power_max;
+  nvmlReturn_t fans_result;
+  unsigned int num_fans;
+} cached_device_t;
+
+static struct {
+  int loaded; // Cache file matched the running driver and GPUs
+  int keyed;  // The /proc key could be read, so the cache may be (re)written
+  char driver[NVML_SYSTEM_DRIVER_VERSION_BUFFER_SIZE];
+  int count;
+  char bus_ids[MAX_DEVICES][PCI_BUS_ID_LEN]; // Sorted bus IDs from /proc
+  int bus_count;
+  cached_device_t devices[MAX_DEVICES];
+} device_cache;
+
+static int normalize_bus_id(const char* in, char* out, size_t out_len) {
+  unsigned int domain, bus, dev, fn;
+  if (sscanf(in, "%x:%x:%x.%x", &domain, &bus, &dev, &fn) != 4) return -1;
+  snprintf(out, out_len, "%04x:%02x:%02x.%x", domain & 0xffff, bus & 0xff, dev & 0xff, fn & 0xf);
+  return 0;
+}
+
+static int compare_strings(const void* a, const void* b) {
+  return strcmp((const char*)a, (const char*)b);
+}
+
+// Read the cache key (driver version, GPU bus IDs) straight from the kernel module
+static int read_cache_key(void) {
+  FILE* f = fopen("/proc/driver/nvidia/version", "r");
+  if (!f) return -1;
+
+  char line[512];
+  int found = 0;
+  if (fgets(line, sizeof(line), f)) {
+    // "NVRM version: NVIDIA UNIX x86_64 Kernel Module  535.104.05  <date>" (wording varies)
+    for (char* tok = strtok(line, " \t\n"); tok && !found; tok = strtok(NULL, " \t\n")) {
+      if (isdigit((unsigned char)tok[0]) && strchr(tok, '.')) {
+        copy_string(device_cache.driver, sizeof(device_cache.driver), tok);
+        found = 1;
+      }
+    }
+  }
+  fclose(f);
+  if (!found) return -1;
+
+  DIR* dir = opendir("/proc/driver/nvidia/gpus");
+  if (!dir) return -1;
+  struct dirent* ent;
+  device_cache.bus_count = 0;
+  while ((ent = readdir(dir)) && device_cache.bus_count < MAX_DEVICES) {
+    if (normalize_bus_id(ent->d_name, device_cache.bus_ids[device_cache.bus_count],
+                         PCI_BUS_ID_LEN) == 0)
+      device_cache.bus_count++;
+  }
+  closedir(dir);
+
+  qsort(device_cache.bus_ids, device_cache.bus_count, PCI_BUS_ID_LEN, compare_strings);
+  return 0;
+}
+
+static void device_cache_path(char* path, size_t len) {
+  const char* dir = getenv(CACHE_DIR_ENV);
+  snprintf(path, len, "%s/" CACHE_FILE, dir ? dir : DEFAULT_CACHE_DIR);
+}
+
+// Load the cache if it matches the running driver and GPU set
+static void device_cache_load(void) {
+  if (read_cache_key() != 0) return;
+  device_cache.keyed = 1;
+
+  char path[PATH_MAX];
+  device_cache_path(path, sizeof(path));
+  FILE* f = fopen(path, "r");
+  if (!f) return;
+
+  char line[1024];
+  int version = 0, count = 0, ok = 1;
+  char driver[sizeof(device_cache.driver)] = "";
+
+  if (!fgets(line, sizeof(line), f) || sscanf(line, "nvml-tool-cache %d", &version) != 1 ||
+      version != CACHE_VERSION)
+    ok = 0;
+  if (ok && (!fgets(line, sizeof(line), f) || sscanf(line, "driver %79s", driver) != 1)) ok = 0;
+
+  while (ok && fgets(line, sizeof(line), f)) {
+    cached_device_t* d = &device_cache.devices[count];
+    char* fields[9];
+    int n = 0;
+    line[strcspn(line, "\n")] = '\0';
+    for (char* p = line; n < 9; n++) {
+      fields[n] = p;
+      p = strchr(p, '\t');
+      if (!p) {
+        n++;
+        break;
+      }
+      *p++ = '\0';
+    }
+
+    // device <index> <bus id> <uuid> <power result> <min> <max> <fans result> <fans> <name>
+    if (n != 9 || count >= MAX_DEVICES || strncmp(fields[0], "device ", 7) != 0 ||
+        atoi(fields[0] + 7) != count) {
+      ok = 0;
+      break;
+    }
+    copy_string(d->bus_id, sizeof(d->bus_id), fields[1]);
+    copy_string(d->uuid, sizeof(d->uuid), fields[2]);
+    d->power_result = atoi(fields[3]);
+    d->power_min = strtoul(fields[4], NULL, 10);
+    d->power_max = strtoul(fields[5], NULL, 10);
+    d->fans_result = atoi(fields[6]);
+    d->num_fans = strtoul(fields[7], NULL, 10);
+    copy_string(d->name, sizeof(d->name), fields[8]);
+    count++;
+  }
+  fclose(f);
+
+  if (!ok || count != device_cache.bus_count || strcmp(driver, device_cache.driver) != 0) return;
+
+  // Every cached bus ID must still be present
+  for (int i = 0; i < count; i++) {
+    if (!bsearch(device_cache.devices[i].bus_id, device_cache.bus_ids, device_cache.bus_count,
+                 PCI_BUS_ID_LEN, compare_strings))
+      return;
+  }
+
+  device_cache.count = count;
+  device_cache.loaded = 1;
+}
+
+// Query the static attributes of every device and write them out atomically
+static void device_cache_refresh(unsigned int device_count) {
+  // NVML and /proc must agree on the GPU set (they don't in some containers)
+  if (!device_cache.keyed || (int)device_count != device_cache.bus_count) return;
+
+  char driver[sizeof(device_cache.driver)];
+  if (nvmlSystemGetDriverVersion(driver, sizeof(driver)) != NVML_SUCCESS ||
+      strcmp(driver, device_cache.driver) != 0)
+    return; // Driver mid-reload or /proc disagrees with NVML: don't cache
+
+  for (unsigned int i = 0; i < device_count; i++) {
+    cached_device_t* d = &device_cache.devices[i];
+    nvmlDevice_t device;
+    nvmlPciInfo_t pci;
+
+    if (get_device_handle(i, &device) != NVML_SUCCESS ||
+        nvmlDeviceGetPciInfo(device, &pci) != NVML_SUCCESS ||
+        normalize_bus_id(pci.busId, d->bus_id, sizeof(d->bus_id)) != 0 ||
+        nvmlDeviceGetUUID(device, d->uuid, sizeof(d->uuid)) != NVML_SUCCESS ||
+        nvmlDeviceGetName(device, d->name, sizeof(d->name)) != NVML_SUCCESS)
+      return;
+    d->power_result = nvmlDeviceGetPowerManagementLimitConstraints(device, &d->power_min,
+                                                                   &d->power_max);
+    d->fans_result = nvmlDeviceGetNumFans(device, &d->num_fans);
+    for (char* p = d->name; *p; p++)
+      if (*p == '\t' || *p == '\n') *p = ' ';
+  }
+  device_cache.count = device_count;
+  device_cache.loaded = 1;
+
+  char path[PATH_MAX], tmp[PATH_MAX + 16];
+  device_cache_path(path, sizeof(path));
+  snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+
+  char* slash = strrchr(path, '/');
+  if (slash) {
+    *slash = '\0';
+    mkdir(path, 0755); // Best effort; fails harmlessly when it exists or we lack permission
+    *slash = '/';
+  }
+
+  FILE* f = fopen(tmp, "w");
+  if (!f) return;
+  fprintf(f, "nvml-tool-cache %d\ndriver %s\n", CACHE_VERSION, device_cache.driver);
+  for (int i = 0; i < device_cache.count; i++) {
+    const cached_device_t* d = &device_cache.devices[i];
+    fprintf(f, "device %d\t%s\t%s\t%d\t%u\t%u\t%d\t%u\t%s\n", i, d->bus_id, d->uuid,
+            d->power_result, d->power_min, d->power_max, d->fans_result, d->num_fans, d->name);
+  }
+  if (fclose(f) != 0 || rename(tmp, path) != 0) unlink(tmp);
+}
+
+static const cached_device_t* device_cache_get(int device_id) {
+  if (!device_cache.loaded || device_id < 0 || device_id >= device_cache.count) return NULL;
+  return &device_cache.devices[device_id];
+}
+
+static nvmlReturn_t get_device_name(nvmlDevice_t device, int device_id, char* name,
+                                    unsigned int len) {
+  const cached_device_t* d = device_cache_get(device_id);
+  if (!d) return nvmlDeviceGetName(device, name, len);
+  copy_string(name, len, d->name);
+  return NVML_SUCCESS;
+}
+
+static nvmlReturn_t get_device_uuid(nvmlDevice_t device, int device_id, char* uuid,
+                                    unsigned int len) {
+  const cached_device_t* d = device_cache_get(device_id);
+  if (!d) return nvmlDeviceGetUUID(device, uuid, len);
+  copy_string(uuid, len, d->uuid);
+  return NVML_SUCCESS;
+}
+
+static nvmlReturn_t get_power_constraints(nvmlDevice_t device, int device_id,
+                                          unsigned int* min_limit, unsigned int* max_limit) {
+  const cached_device_t* d = device_cache_get(device_id);
+  if (!d) return nvmlDeviceGetPowerManagementLimitConstraints(device, min_limit, max_limit);
+  *min_limit = d->power_min;
+  *max_limit = d->power_max;
+  return d->power_result;
+}
+
+static nvmlReturn_t get_num_fans(nvmlDevice_t device, int device_id, unsigned int* num_fans) {
+  const cached_device_t* d = device_cache_get(device_id);
+  if (!d) return nvmlDeviceGetNumFans(device, num_fans);
+  *num_fans = d->num_fans;
+  return d->fans_result;
+}
+
+// Per-run index for UUID and PCI bus ID selection. Built once, from the device cache when it is
+// valid or with a single NVML enumeration otherwise, then searched by binary search.
+typedef struct {
+  char key[MAX_UUID_LEN];
+  int index;
+} index_entry_t;
+
+static struct {
+  int built;
+  int count;
+  index_entry_t by_uuid[MAX_DEVICES];
+  index_entry_t by_bus_id[MAX_DEVICES];
+} device_index;
+
+static int compare_index_entries(const void* a, const void* b) {
+  return strcmp(((const index_entry_t*)a)->key, ((const index_entry_t*)b)->key);
+}
+
+static void device_index_build(unsigned int device_count) {
+  if (device_index.built) return;
+  device_index.built = 1;
+  device_index.count = 0;
+
+  if (device_cache.loaded) {
+    for (int i = 0; i < device_cache.count; i++) {
+      const cached_device_t* d = &device_cache.devices[i];
+      copy_string(device_index.by_uuid[i].key, MAX_UUID_LEN, d->uuid);
+      copy_string(device_index.by_bus_id[i].key, MAX_UUID_LEN, d->bus_id);
+      device_index.by_uuid[i].index = device_index.by_bus_id[i].index = i;
+    }
+    device_index.count = device_cache.count;
+  } else {
+    for (unsigned int i = 0; i < device_count && i < MAX_DEVICES; i++) {
+      index_entry_t* u = &device_index.by_uuid[device_index.count];
+      index_entry_t* b = &device_index.by_bus_id[device_index.count];
+      nvmlDevice_t device;
+      nvmlPciInfo_t pci;
+
+      if (get_device_handle(i, &device) != NVML_SUCCESS ||
+          nvmlDeviceGetUUID(device, u->key, sizeof(u->key)) != NVML_SUCCESS)
+        continue;
+      if (nvmlDeviceGetPciInfo(device, &pci) != NVML_SUCCESS ||
+          normalize_bus_id(pci.busId, b->key, sizeof(b->key)) != 0)
+        b->key[0] = '\0';
+      u->index = b->index = i;
+      device_index.count++;
+    }
+  }
+
+  qsort(device_index.by_uuid, device_index.count, sizeof(index_entry_t), compare_index_entries);
+  qsort(device_index.by_bus_id, device_index.count, sizeof(index_entry_t), compare_index_entries);
+}
+
+// Binary search for the unique entry whose key starts with prefix. Returns its device index,
+// -1 if nothing matches, or -2 if the prefix is ambiguous.
+static int device_index_find(const index_entry_t* entries, int count, const char* prefix) {
+  size_t len = strlen(prefix);
+  int lo = 0, hi = count;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (strncmp(entries[mid].key, prefix, len) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  if (lo >= count || strncmp(entries[lo].key, prefix, len) != 0) return -1;
+  if (lo + 1 < count && strncmp(entries[lo + 1].key, prefix, len) == 0) return -2;
+  return entries[lo].index;
+}
+
+// Resolve one -u selector. Full UUIDs go straight to NVML; prefixes (with or without the
+// "GPU-" part) use the index, and anything else falls back to the old substring match.
+static int resolve_uuid(const char* selector, unsigned int device_count) {
+  nvmlDevice_t device;
+  unsigned int index;
+
+  if (!device_cache.loaded && !device_index.built && strlen(selector) >= FULL_UUID_LEN &&
+      nvmlDeviceGetHandleByUUID(selector, &device) == NVML_SUCCESS &&
+      nvmlDeviceGetIndex(device, &index) == NVML_SUCCESS)
+    return remember_device_handle(device, index);
+
+  device_index_build(device_count);
+  int found = device_index_find(device_index.by_uuid, device_index.count, selector);
+  if (found == -1 && strncmp(selector, "GPU-", 4) != 0) {
+    char prefixed[MAX_UUID_LEN];
+    snprintf(prefixed, sizeof(prefixed), "GPU-%s", selector);
+    found = device_index_find(device_index.by_uuid, device_index.count, prefixed);
+  }
+  if (found != -1) return found;
+
+  for (int i = 0; i < device_index.count; i++)
+    if (strstr(device_index.by_uuid[i].key, selector)) return device_index.by_uuid[i].index;
+  return -1;
+}
+
+// Resolve one --pci selector: "domain:bus:device.function" or "bus:device.function"
+static int resolve_pci(const char* selector, unsigned int device_count) {
+  char bus_id[PCI_BUS_ID_LEN], full[PCI_BUS_ID_LEN + 8];
+  nvmlDevice_t device;
+  unsigned int index;
+
+  snprintf(full, sizeof(full), strchr(selector, ':') == strrchr(selector, ':') ? "0:%s" : "%s",
+           selector);
+  if (normalize_bus_id(full, bus_id, sizeof(bus_id)) != 0) return -1;
+
+  if (!device_cache.loaded && !device_index.built &&
+      nvmlDeviceGetHandleByPciBusId(bus_id, &device) == NVML_SUCCESS &&
+      nvmlDeviceGetIndex(device, &index) == NVML_SUCCESS)
+    return remember_device_handle(device, index);
+
+  device_index_build(device_count);
+  int found = device_index_find(device_index.by_bus_id, device_index.count, bus_id);
+  return found >= 0 ? found : -1;
+}
+
+// Resolve a comma-separated selector list, appending new device indices to targets
+static int resolve_selectors(const char* list, int is_pci, unsigned int device_count,
+                             int* targets, int count, FILE* err) {
+  char buf[MAX_SELECTOR_LEN];
+  char* save = NULL;
+  copy_string(buf, sizeof(buf), list);
+
+  for (char* sel = strtok_r(buf, ",", &save); sel; sel = strtok_r(NULL, ",", &save)) {
+    int device_id = is_pci ? resolve_pci(sel, device_count) : resolve_uuid(sel, device_count);
+    if (device_id == -2) {
+      fprintf(err, "Error: UUID prefix '%s' matches more than one device\n", sel);
+      return -1;
+    }
+    if (device_id < 0) {
+      if (is_pci)
+        fprintf(err, "Error: Device with PCI bus ID '%s' not found\n", sel);
+      else
+        fprintf(err, "Error: Device with UUID '%s' not found\n", sel);
+      return -1;
+    }
+
+    int seen = 0;
+    for (int i = 0; i < count && !seen; i++) seen = targets[i] == device_id;
+    if (!seen && count < MAX_DEVICES) targets[count++] = device_id;
+  }
+  return count;
+}
+
+// Metrics that have an NVML field ID. Anything not listed here is always read per call.
+static const struct {
+  unsigned int metric;
+  unsigned int field_id;
+} field_map[] = {
+#ifdef NVML_FI_DEV_POWER_INSTANT
+    {SAMPLE_POWER, NVML_FI_DEV_POWER_INSTANT},
+#endif
+#ifdef NVML_FI_DEV_POWER_CURRENT_LIMIT
+    {SAMPLE_POWER_LIMIT, NVML_FI_DEV_POWER_CURRENT_LIMIT},
+#endif
+#ifdef NVML_FI_DEV_TOTAL_ENERGY_CONSUMPTION
+    {SAMPLE_ENERGY, NVML_FI_DEV_TOTAL_ENERGY_CONSUMPTION},
+#endif
+    {0, 0}};
+
+static void field_plan_init(field_plan_t* plan, unsigned int requested) {
+  memset(plan, 0, sizeof(*plan));
+  plan->requested = requested;
+
+  for (size_t i = 0; field_map[i].metric && plan->field_count < MAX_FIELDS; i++) {
+    if (!(requested & field_map[i].metric)) continue;
+    plan->fields[plan->field_count].fieldId = field_map[i].field_id;
+    plan->field_metric[plan->field_count] = field_map[i].metric;
+    plan->batched |= field_map[i].metric;
+    plan->field_count++;
+  }
+}
+
+static void field_plan_drop(field_plan_t* plan, int idx) {
+  plan->batched &= ~plan->field_metric[idx];
+  plan->field_count--;
+  for (int i = idx; i < plan->field_count; i++) {
+    plan->fields[i] = plan->fields[i + 1];
+    plan->field_metric[i] = plan->field_metric[i + 1];
+  }
+}
+
+// Field values and buffered samples both come as a typed nvmlValue_t
+static unsigned long long value_u64(nvmlValueType_t type, const nvmlValue_t* value) {
+  switch (type) {
+  case NVML_VALUE_TYPE_DOUBLE: return (unsigned long long)value->dVal;
+  case NVML_VALUE_TYPE_UNSIGNED_INT: return value->uiVal;
+  case NVML_VALUE_TYPE_UNSIGNED_LONG: return value->ulVal;
+  case NVML_VALUE_TYPE_UNSIGNED_LONG_LONG: return value->ullVal;
+  case NVML_VALUE_TYPE_SIGNED_LONG_LONG: return (unsigned long long)value->sllVal;
+  default: return value->uiVal;
+  }
+}
+
+static void field_plan_store(device_sample_t* sample, unsigned int metric, unsigned long long v) {
+  switch (metric) {
+  case SAMPLE_POWER: sample->power_usage = (unsigned int)v; break;
+  case SAMPLE_POWER_LIMIT: sample->power_limit = (unsigned int)v; break;
+  case SAMPLE_ENERGY: sample->energy = v; break;
+  default: return;
+  }
+  sample->valid |= metric;
+}
+
+// NVLink data counters of every active link in one field-value call, summed. Links are probed
+// on the first read; without any, SAMPLE_NVLINK is dropped from the plan.
+static nvmlReturn_t read_nvlink_counters(nvmlDevice_t device, field_plan_t* plan,
+                                         device_sample_t* sample) {
+#if defined(NVML_FI_DEV_NVLINK_THROUGHPUT_DATA_TX) && defined(NVML_FI_DEV_NVLINK_THROUGHPUT_DATA_RX)
+  if (!plan->nvlink_probed) {
+    plan->nvlink_probed = 1;
+    for (unsigned int link = 0; link < NVML_NVLINK_MAX_LINKS; link++) {
+      nvmlEnableState_t active;
+      if (nvmlDeviceGetNvLinkState(device, link, &active) == NVML_SUCCESS &&
+          active == NVML_FEATURE_ENABLED)
+        plan->nvlink_links |= 1u << link;
+    }
+  }
+  if (!plan->nvlink_links) {
+    plan->requested &= ~SAMPLE_NVLINK;
+    return NVML_ERROR_NOT_SUPPORTED;
+  }
+
+  nvmlFieldValue_t fields[2 * NVML_NVLINK_MAX_LINKS];
+  int n = 0;
+  memset(fields, 0, sizeof(fields));
+  for (unsigned int link = 0; link < NVML_NVLINK_MAX_LINKS; link++) {
+    if (!(plan->nvlink_links & (1u << link))) continue;
+    fields[n].fieldId = NVML_FI_DEV_NVLINK_THROUGHPUT_DATA_TX;
+    fields[n++].scopeId = link;
+    fields[n].fieldId = NVML_FI_DEV_NVLINK_THROUGHPUT_DATA_RX;
+    fields[n++].scopeId = link;
+  }
+  nvmlReturn_t result = nvmlDeviceGetFieldValues(device, n, fields);
+  if (result != NVML_SUCCESS) return result;
+
+  sample->nvlink_tx = sample->nvlink_rx = 0;
+  for (int i = 0; i < n; i++) {
+    if (fields[i].nvmlReturn != NVML_SUCCESS) return fields[i].nvmlReturn;
+    unsigned long long v = value_u64(fields[i].valueType, &fields[i].value);
+    if (i % 2)
+      sample->nvlink_rx += v;
+    else
+      sample->nvlink_tx += v;
+  }
+  return NVML_SUCCESS;
+#else
+  (void)device;
+  (void)sample;
+  plan->requested &= ~SAMPLE_NVLINK;
+  return NVML_ERROR_NOT_SUPPORTED;
+#endif
+}
+
+// Read all requested metrics: one batched driver call for the planned fields, then
+// individual getters for whatever the batch could not serve.
+static void sample_device(nvmlDevice_t device, field_plan_t* plan, device_sample_t* sample) {
+  memset(sample, 0, sizeof(*sample));
+
+  if (plan->field_count > 0) {
+    for (int i = 0; i < plan->field_count; i++) {
+      unsigned int field_id = plan->fields[i].fieldId;
+      memset(&plan->fields[i], 0, sizeof(plan->fields[i]));
+      plan->fields[i].fieldId = field_id;
+    }
+
+    nvmlReturn_t result = nvmlDeviceGetFieldValues(device, plan->field_count, plan->fields);
+    if (result == NVML_SUCCESS) {
+      for (int i = plan->field_count - 1; i >= 0; i--) {
+        nvmlReturn_t field_result = plan->fields[i].nvmlReturn;
+        const nvmlFieldValue_t* fv = &plan->fields[i];
+        if (field_result == NVML_SUCCESS)
+          field_plan_store(sample, plan->field_metric[i], value_u64(fv->valueType, &fv->value));
+        else if (field_result == NVML_ERROR_NOT_SUPPORTED)
+          field_plan_drop(plan, i);
+      }
+    } else if (result == NVML_ERROR_NOT_SUPPORTED || result == NVML_ERROR_FUNCTION_NOT_FOUND) {
+      plan->field_count = 0;
+      plan->batched = 0;
+    }
+  }
+
+  unsigned int missing = plan->requested & ~sample->valid;
+  if ((missing & SAMPLE_TEMP) &&
+      nvmlDeviceGetTemperature(device, NVML_TEMPERATURE_GPU, &sample->temperature) == NVML_SUCCESS)
+    sample->valid |= SAMPLE_TEMP;
+  if ((missing & SAMPLE_MEMORY) && nvmlDeviceGetMemoryInfo(device, &sample->memory) == NVML_SUCCESS)
+    sample->valid |= SAMPLE_MEMORY;
+  if ((missing & SAMPLE_FAN) && nvmlDeviceGetFanSpeed(device, &sample->fan_speed) == NVML_SUCCESS)
+    sample->valid |= SAMPLE_FAN;
+  if ((missing & SAMPLE_POWER) &&
+      nvmlDeviceGetPowerUsage(device, &sample->power_usage) == NVML_SUCCESS)
+    sample->valid |= SAMPLE_POWER;
+  if ((missing & SAMPLE_POWER_LIMIT) &&
+      nvmlDeviceGetPowerManagementLimit(device, &sample->power_limit) == NVML_SUCCESS)
+    sample->valid |= SAMPLE_POWER_LIMIT;
+  if ((missing & SAMPLE_ENERGY) &&
+      nvmlDeviceGetTotalEnergyConsumption(device, &sample->energy) == NVML_SUCCESS)
+    sample->valid |= SAMPLE_ENERGY;
+  if ((missing & SAMPLE_UTILIZATION) &&
+      nvmlDeviceGetUtilizationRates(device, &sample->utilization) == NVML_SUCCESS)
+    sample->valid |= SAMPLE_UTILIZATION;
+  if ((missing & SAMPLE_CLOCKS) &&
+      nvmlDeviceGetClockInfo(device, NVML_CLOCK_SM, &sample->sm_clock) == NVML_SUCCESS) {
+    nvmlPstates_t pstate = NVML_PSTATE_UNKNOWN;
+    if (nvmlDeviceGetClockInfo(device, NVML_CLOCK_MEM, &sample->mem_clock) == NVML_SUCCESS)
+      sample->valid |= SAMPLE_MEM_CLOCK;
+    if (nvmlDeviceGetPerformanceState(device, &pstate) != NVML_SUCCESS)
+      pstate = NVML_PSTATE_UNKNOWN;
+    sample->pstate = pstate;
+    sample->valid |= SAMPLE_CLOCKS;
+  }
+  if ((missing & SAMPLE_THROTTLE) &&
+      nvmlDeviceGetCurrentClocksThrottleReasons(device, &sample->throttle_reasons) == NVML_SUCCESS)
+    sample->valid |= SAMPLE_THROTTLE;
+  if ((missing & SAMPLE_PCIE) &&
+      nvmlDeviceGetPcieThroughput(device, NVML_PCIE_UTIL_TX_BYTES, &sample->pcie_tx) ==
+          NVML_SUCCESS &&
+      nvmlDeviceGetPcieThroughput(device, NVML_PCIE_UTIL_RX_BYTES, &sample->pcie_rx) ==
+          NVML_SUCCESS)
+    sample->valid |= SAMPLE_PCIE;
+  if ((missing & SAMPLE_NVLINK) && read_nvlink_counters(device, plan, sample) == NVML_SUCCESS)
+    sample->valid |= SAMPLE_NVLINK;
+}
+
+// Throttle reasons reported by name, in output order
+static const struct {
+  unsigned long long mask;
+  const char* name;
+} throttle_reasons[] = {{nvmlClocksThrottleReasonGpuIdle, "idle"},
+                        {nvmlClocksThrottleReasonApplicationsClocksSetting, "app_clocks"},
+                        {nvmlClocksThrottleReasonSwPowerCap, "sw_power_cap"},
+                        {nvmlClocksThrottleReasonHwSlowdown, "hw_slowdown"},
+                        {nvmlClocksThrottleReasonSyncBoost, "sync_boost"},
+                        {nvmlClocksThrottleReasonSwThermalSlowdown, "sw_thermal"},
+                        {nvmlClocksThrottleReasonHwThermalSlowdown, "hw_thermal"},
+                        {nvmlClocksThrottleReasonHwPowerBrakeSlowdown, "hw_power_brake"},
+                        {nvmlClocksThrottleReasonDisplayClockSetting, "display_clocks"}};
+
+#define THROTTLE_REASONS (sizeof(throttle_reasons) / sizeof(throttle_reasons[0]))
+
+// Time spent in each throttle state, built up one sample at a time: the interval between two
+// samples is charged to the reasons active at the first one, so nothing is kept per sample.
+typedef struct {
+  int primed;
+  long long last_ns;       // Monotonic time of the previous sample
+  unsigned long long last; // Reasons active at the previous sample
+  double seconds[THROTTLE_REASONS];
+  unsigned long entered[THROTTLE_REASONS]; // Times the reason went from inactive to active
+  double observed;                         // Seconds covered so far
+} throttle_account_t;
+
+static void throttle_account(throttle_account_t* acc, unsigned long long reasons, long long now) {
+  if (acc->primed && now > acc->last_ns) {
+    double dt = (now - acc->last_ns) / 1e9;
+    acc->observed += dt;
+    for (size_t r = 0; r < THROTTLE_REASONS; r++)
+      if (acc->last & throttle_reasons[r].mask) acc->seconds[r] += dt;
+  }
+  for (size_t r = 0; r < THROTTLE_REASONS; r++) {
+    unsigned long long mask = throttle_reasons[r].mask;
+    if ((reasons & mask) && (!acc->primed || !(acc->last & mask))) acc->entered[r]++;
+  }
+  acc->last = reasons;
+  acc->last_ns = now;
+  acc->primed = 1;
+}
+
+// Counters turned into rates between consecutive samples of one device
+typedef struct {
+  int primed;
+  long long last_ns; // Monotonic time of the previous sample
+  unsigned long long nvlink_tx, nvlink_rx;
+} counter_rates_t;
+
+// NVLink KiB/s since the previous sample. Returns 0 if there is no rate yet: on the first
+// sample, or when a counter went backwards (driver reload) and the delta is meaningless.
+static int nvlink_rates(counter_rates_t* r, const device_sample_t* sample, long long now,
+                        double* tx, double* rx) {
+  int ok = r->primed && now > r->last_ns && sample->nvlink_tx >= r->nvlink_tx &&
+           sample->nvlink_rx >= r->nvlink_rx;
+  if (ok) {
+    double dt = (now - r->last_ns) / 1e9;
+    *tx = (sample->nvlink_tx - r->nvlink_tx) / dt;
+    *rx = (sample->nvlink_rx - r->nvlink_rx) / dt;
+  }
+  r->nvlink_tx = sample->nvlink_tx;
+  r->nvlink_rx = sample->nvlink_rx;
+  r->last_ns = now;
+  r->primed = 1;
+  return ok;
+}
+
+// Active reason names joined by `sep`, or "none"
+static void out_throttle_reasons(out_t* out, unsigned long long reasons, const char* sep) {
+  int any = 0;
+  for (size_t r = 0; r < THROTTLE_REASONS; r++) {
+    if (!(reasons & throttle_reasons[r].mask)) continue;
+    if (any) out_str(out, sep);
+    out_str(out, throttle_reasons[r].name);
+    any = 1;
+  }
+  if (!any) out_str(out, "none");
+}
+
+static void out_pstate(out_t* out, unsigned int pstate) {
+  out_char(out, 'P');
+  if (pstate <= 15)
+    out_u64(out, pstate);
+  else
+    out_char(out, '?');
+}
+
+static void print_device_info_human(out_t* out, nvmlDevice_t device, int device_id,
+                                    char temp_unit, unsigned int metrics) {
+  nvmlReturn_t result;
+  char name[MAX_NAME_LEN];
+  char uuid[MAX_UUID_LEN];
+  field_plan_t plan;
+  device_sample_t sample;
+
+  field_plan_init(&plan, metrics);
+  sample_device(device, &plan, &sample);
+
+  out_str(out, "=== Device ");
+  out_i64(out, device_id);
+
+  result = get_device_name(device, device_id, name, sizeof(name));
+  if (result == NVML_SUCCESS) {
+    out_str(out, ": ");
+    out_str(out, name);
+  }
+  out_str(out, " ===\n");
+
+  result = get_device_uuid(device, device_id, uuid, sizeof(uuid));
+  if (result == NVML_SUCCESS) {
+    out_str(out, "UUID:        ");
+    out_str(out, uuid);
+    out_char(out, '\n');
+  }
+
+  if (sample.valid & SAMPLE_TEMP) {
+    out_str(out, "Temperature: ");
+    out_fixed(out, temperature_tenths(sample.temperature, temp_unit), 1);
+    out_char(out, temp_unit);
+    out_char(out, '\n');
+  }
+
+  if (sample.valid & SAMPLE_MEMORY) {
+    out_str(out, "Memory:      ");
+    out_u64(out, sample.memory.used / (1024 * 1024));
+    out_str(out, " MB / ");
+    out_u64(out, sample.memory.total / (1024 * 1024));
+    out_str(out, " MB (");
+    out_fixed(out, percent_tenths(sample.memory.used, sample.memory.total), 1);
+    out_str(out, "%)\n");
+  }
+
+  if (sample.valid & SAMPLE_FAN) {
+    out_str(out, "Fan Speed:   ");
+    out_u64(out, sample.fan_speed);
+    out_str(out, "%\n");
+  }
+
+  if (sample.valid & SAMPLE_POWER) {
+    out_str(out, "Power:       ");
+    out_fixed(out, div_round(sample.power_usage, 10), 2);
+    out_str(out, "W / ");
+    out_fixed(out, div_round(sample.power_limit, 10), 2);
+    out_str(out, "W (");
+    out_fixed(out, percent_tenths(sample.power_usage, sample.power_limit), 1);
+    out_str(out, "%)\n");
+  }
+
+  if (sample.valid & SAMPLE_UTILIZATION) {
+    out_str(out, "Utilization: GPU ");
+    out_u64(out, sample.utilization.gpu);
+    out_str(out, "%, Memory ");
+    out_u64(out, sample.utilization.memory);
+    out_str(out, "%\n");
+  }
+
+  if (sample.valid & SAMPLE_PCIE) {
+    out_str(out, "PCIe:        TX ");
+    out_fixed(out, kib_to_mb_tenths(sample.pcie_tx), 1);
+    out_str(out, " MB/s, RX ");
+    out_fixed(out, kib_to_mb_tenths(sample.pcie_rx), 1);
+    out_str(out, " MB/s\n");
+  }
+
+  if (sample.valid & SAMPLE_CLOCKS) {
+    out_str(out, "Clocks:      SM ");
+    out_u64(out, sample.sm_clock);
+    if (sample.valid & SAMPLE_MEM_CLOCK) {
+      out_str(out, " MHz, Memory ");
+      out_u64(out, sample.mem_clock);
+    }
+    out_str(out, " MHz (");
+    out_pstate(out, sample.pstate);
+    out_str(out, ")\n");
+  }
+
+  if (sample.valid & SAMPLE_THROTTLE) {
+    out_str(out, "Throttling:  ");
+    out_throttle_reasons(out, sample.throttle_reasons, ", ");
+    out_char(out, '\n');
+  }
+
+  out_char(out, '\n');
+}
+
+// `node` names the host the device is on (aggregate), NULL for local devices
+static void print_sample_json(out_t* out, const char* node, const device_sample_t* sample,
+                              const char* name, const char* uuid, int device_id, char temp_unit,
+                              int is_last) {
+  out_str(out, "  {\n");
+  if (node) {
+    out_str(out, "    \"node\": \"");
+    out_str(out, node);
+    out_str(out, "\",\n");
+  }
+  out_str(out, "    \"device_id\": ");
+  out_i64(out, device_id);
+  out_str(out, ",\n    \"name\": \"");
+  out_str(out, name);
+  out_str(out, "\",\n    \"uuid\": \"");
+  out_str(out, uuid);
+  out_str(out, "\",\n    \"temperature\": ");
+  out_fixed(out, temperature_tenths(sample->temperature, temp_unit), 1);
+  out_str(out, ",\n    \"temperature_unit\": \"");
+  out_char(out, temp_unit);
+  out_str(out, "\",\n    \"memory_total_mb\": ");
+  out_u64(out, sample->memory.total / (1024 * 1024));
+  out_str(out, ",\n    \"memory_used_mb\": ");
+  out_u64(out, sample->memory.used / (1024 * 1024));
+  out_str(out, ",\n    \"memory_free_mb\": ");
+  out_u64(out, sample->memory.free / (1024 * 1024));
+  out_str(out, ",\n    \"fan_speed_percent\": ");
+  out_u64(out, sample->fan_speed);
+  out_str(out, ",\n    \"power_usage_watts\": ");
+  out_fixed(out, div_round(sample->power_usage, 10), 2);
+  out_str(out, ",\n    \"power_limit_watts\": ");
+  out_fixed(out, div_round(sample->power_limit, 10), 2);
+  if (sample->valid & SAMPLE_UTILIZATION) {
+    out_str(out, ",\n    \"gpu_utilization_percent\": ");
+    out_u64(out, sample->utilization.gpu);
+    out_str(out, ",\n    \"memory_utilization_percent\": ");
+    out_u64(out, sample->utilization.memory);
+  }
+  if (sample->valid & SAMPLE_PCIE) {
+    out_str(out, ",\n    \"pcie_tx_kb_per_s\": ");
+    out_u64(out, sample->pcie_tx);
+    out_str(out, ",\n    \"pcie_rx_kb_per_s\": ");
+    out_u64(out, sample->pcie_rx);
+  }
+  if (sample->valid & SAMPLE_CLOCKS) {
+    out_str(out, ",\n    \"sm_clock_mhz\": ");
+    out_u64(out, sample->sm_clock);
+    out_str(out, ",\n    \"memory_clock_mhz\": ");
+    if (sample->valid & SAMPLE_MEM_CLOCK)
+      out_u64(out, sample->mem_clock);
+    else
+      out_str(out, "null");
+    out_str(out, ",\n    \"pstate\": ");
+    if (sample->pstate <= 15)
+      out_u64(out, sample->pstate);
+    else
+      out_str(out, "null");
+  }
+  if (sample->valid & SAMPLE_THROTTLE) {
+    out_str(out, ",\n    \"throttle_reasons\": [");
+    int any = 0;
+    for (size_t r = 0; r < THROTTLE_REASONS; r++) {
+      if (!(sample->throttle_reasons & throttle_reasons[r].mask)) continue;
+      out_str(out, any ? ", \"" : "\"");
+      out_str(out, throttle_reasons[r].name);
+      out_char(out, '"');
+      any = 1;
+    }
+    out_char(out, ']');
+  }
+  out_str(out, is_last ? "\n  }\n" : "\n  },\n");
+}
+
+static void print_device_info_json(out_t* out, nvmlDevice_t device, int device_id,
+                                   char temp_unit, unsigned int metrics, int is_last) {
+  char name[MAX_NAME_LEN] = "Unknown";
+  char uuid[MAX_UUID_LEN] = "Unknown";
+  field_plan_t plan;
+  device_sample_t sample;
+
+  get_device_name(device, device_id, name, sizeof(name));
+  get_device_uuid(device, device_id, uuid, sizeof(uuid));
+  field_plan_init(&plan, metrics);
+  sample_device(device, &plan, &sample);
+  print_sample_json(out, NULL, &sample, name, uuid, device_id, temp_unit, is_last);
+}
+
+static void print_power_cli(out_t* out, FILE* err, nvmlDevice_t device, int device_id) {
+  unsigned int power_usage;
+  nvmlReturn_t result = nvmlDeviceGetPowerUsage(device, &power_usage);
+
+  if (result == NVML_SUCCESS) {
+    out_i64(out, device_id);
+    out_char(out, ':');
+    out_fixed(out, div_round(power_usage, 10), 2);
+    out_char(out, '\n');
+  } else {
+    fprintf(err, "%d:Error: %s\n", device_id, nvmlErrorString(result));
+  }
+}
+
+static void print_fan_cli(out_t* out, FILE* err, nvmlDevice_t device, int device_id) {
+  unsigned int fan_speed;
+  nvmlReturn_t result = nvmlDeviceGetFanSpeed(device, &fan_speed);
+
+  if (result == NVML_SUCCESS) {
+    out_i64(out, device_id);
+    out_char(out, ':');
+    out_u64(out, fan_speed);
+    out_char(out, '\n');
+  } else {
+    fprintf(err, "%d:Error: %s\n", device_id, nvmlErrorString(result));
+  }
+}
+
+static void print_temp_cli(out_t* out, FILE* err, nvmlDevice_t device, int device_id,
+                           char temp_unit) {
+  unsigned int temperature;
+  nvmlReturn_t result = nvmlDeviceGetTemperature(device, NVML_TEMPERATURE_GPU, &temperature);
+
+  if (result == NVML_SUCCESS) {
+    out_i64(out, device_id);
+    out_char(out, ':');
+    out_fixed(out, temperature_tenths(temperature, temp_unit), 1);
+    out_char(out, '\n');
+  } else {
+    fprintf(err, "%d:Error: %s\n", device_id, nvmlErrorString(result));
+  }
+}
+
+// The status line without its newline, so watch can append fields to it
+static void print_status_fields(out_t* out, const device_sample_t* sample, int device_id,
+                                char temp_unit) {
+  out_i64(out, device_id);
+  out_char(out, ':');
+  out_fixed(out, temperature_tenths(sample->temperature, temp_unit), 1);
+  out_char(out, temp_unit);
+  out_char(out, ',');
+  out_u64(out, sample->fan_speed);
+  out_str(out, "%,");
+  out_fixed(out, div_round(sample->power_usage, 100), 1);
+  out_char(out, 'W');
+}
+
+// ",util:GPU/MEM%" as appended by watch and status --io, nothing if utilization wasn't read
+static void out_utilization(out_t* out, const device_sample_t* sample) {
+  if (!(sample->valid & SAMPLE_UTILIZATION)) return;
+  out_str(out, ",util:");
+  out_u64(out, sample->utilization.gpu);
+  out_char(out, '/');
+  out_u64(out, sample->utilization.memory);
+  out_char(out, '%');
+}
+
+static void print_status_cli(out_t* out, const device_sample_t* sample, int device_id,
+                             char temp_unit) {
+  print_status_fields(out, sample, device_id, temp_unit);
+  out_char(out, '\n');
+}
+
+// Create (or reuse) the shared-memory ring and map it read-write. Returns NULL on failure.
+static nvt_shm_header_t* shm_ring_create(const char* name) {
+  size_t size = nvt_shm_size(NVT_SHM_SLOTS);
+  int fd = shm_open(name, O_RDWR | O_CREAT, 0644);
+  if (fd < 0) {
+    fprintf(stderr, "Error: Cannot create shared memory '%s' (%s)\n", name, strerror(errno));
+    return NULL;
+  }
+
+  void* map = MAP_FAILED;
+  if (ftruncate(fd, size) == 0) map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    fprintf(stderr, "Error: Cannot map shared memory '%s' (%s)\n", name, strerror(errno));
+    return NULL;
+  }
+
+  // Start a fresh ring; readers reject it until the magic is published
+  nvt_shm_header_t* hdr = map;
+  __atomic_store_n(&hdr->magic, 0, __ATOMIC_RELEASE);
+  memset((char*)hdr + sizeof(hdr->magic), 0, size - sizeof(hdr->magic));
+  hdr->version = NVT_SHM_VERSION;
+  hdr->record_size = sizeof(nvt_shm_record_t);
+  hdr->slot_count = NVT_SHM_SLOTS;
+  __atomic_store_n(&hdr->magic, NVT_SHM_MAGIC, __ATOMIC_RELEASE);
+  return hdr;
+}
+
+static void shm_ring_publish(nvt_shm_header_t* hdr, const nvt_shm_record_t* record) {
+  uint64_t index = hdr->head; // Single writer, no need for an atomic read
+  nvt_shm_slot_t* slot = &hdr->slots[index % hdr->slot_count];
+
+  uint64_t seq = slot->seq;
+  __atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  slot->index = index;
+  slot->record = *record;
+  __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+
+  if (record->device_id >= 0 && record->device_id < NVT_SHM_MAX_DEVICES)
+    __atomic_store_n(&hdr->latest[record->device_id], index + 1, __ATOMIC_RELEASE);
+  __atomic_store_n(&hdr->head, index + 1, __ATOMIC_RELEASE);
+}
+
+static void sample_to_shm_record(const device_sample_t* sample, int device_id, uint64_t tick,
+                                 const char* name, const char* uuid, nvt_shm_record_t* record) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+
+  memset(record, 0, sizeof(*record));
+  record->timestamp_ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  record->tick = tick;
+  record->device_id = device_id;
+  // SAMPLE_* and NVT_SHM_* flags share bit positions; opt-in metrics have no field in the record
+  record->valid = sample->valid & NVT_SHM_ALL;
+  record->temperature_c = sample->temperature;
+  record->fan_speed_percent = sample->fan_speed;
+  record->power_usage_mw = sample->power_usage;
+  record->power_limit_mw = sample->power_limit;
+  record->memory_total = sample->memory.total;
+  record->memory_used = sample->memory.used;
+  record->memory_free = sample->memory.free;
+  copy_string(record->name, sizeof(record->name), name);
+  copy_string(record->uuid, sizeof(record->uuid), uuid);
+}
+
+static void shm_record_to_sample(const nvt_shm_record_t* record, device_sample_t* sample) {
+  memset(sample, 0, sizeof(*sample));
+  sample->valid = record->valid & NVT_SHM_ALL;
+  sample->temperature = record->temperature_c;
+  sample->fan_speed = record->fan_speed_percent;
+  sample->power_usage = record->power_usage_mw;
+  sample->power_limit = record->power_limit_mw;
+  sample->memory.total = record->memory_total;
+  sample->memory.used = record->memory_used;
+  sample->memory.free = record->memory_free;
+}
+
+// Print the newest published sample of each selected device without touching NVML
+static int run_shm_read(const cli_args_t* args) {
+  const char* name = args->shm_name ? args->shm_name : NVT_SHM_DEFAULT_NAME;
+  const nvt_shm_header_t* hdr = nvt_shm_open(name);
+  if (!hdr) {
+    fprintf(stderr, "Error: No sample ring at shared memory '%s' (is watch --shm running?)\n",
+            name);
+    return 1;
+  }
+
+  nvt_shm_record_t records[NVT_SHM_MAX_DEVICES];
+  int count = 0;
+  for (int id = 0; id < NVT_SHM_MAX_DEVICES; id++) {
+    int selected = args->all_devices;
+    for (int i = 0; i < args->device_count && !selected; i++) selected = args->devices[i] == id;
+    if (selected && nvt_shm_latest(hdr, id, &records[count]) == 0) count++;
+  }
+
+  if (count == 0) {
+    fprintf(stderr, "Error: No samples published for the selected devices\n");
+    return 1;
+  }
+
+  static out_t out;
+  out_init_fd(&out, STDOUT_FILENO);
+  if (args->subcommand == SUBCMD_JSON) out_str(&out, "[\n");
+  for (int i = 0; i < count; i++) {
+    device_sample_t sample;
+    shm_record_to_sample(&records[i], &sample);
+    if (args->subcommand == SUBCMD_JSON)
+      print_sample_json(&out, NULL, &sample, records[i].name, records[i].uuid,
+                        records[i].device_id, args->temp_unit, i == count - 1);
+    else
+      print_status_cli(&out, &sample, records[i].device_id, args->temp_unit);
+  }
+  if (args->subcommand == SUBCMD_JSON) out_str(&out, "]\n");
+  return out_flush(&out) != 0;
+}
+
+// Recording format written by `record` and read by `replay` and `fanctl --simulate`. All
+// integers are little-endian, so recordings move between hosts:
+//   header: "NVTR", u16 version, u16 device count, u32 interval ms, u32 encoding,
+//           then per device: i32 device id, name[REC_NAME_LEN], uuid[REC_NAME_LEN]
+//   blocks: "NVTB", varint tick count, varint first timestamp, varint last - first timestamp,
+//           varint payload length, payload
+//   index:  "NVTI", u32 block count, then per block: u64 file offset, u64 first, u64 last
+//           timestamp; then u64 offset of "NVTI" and "NVTE" as the last 12 bytes of the file
+// Timestamps are CLOCK_REALTIME in ms. A block holds up to REC_BLOCK_TICKS ticks stored column
+// by column: the timestamps, then every field of every device in turn, so each column decodes
+// on its own and similar values sit next to each other. A missed sample has valid == 0.
+//
+// REC_ENCODING_DELTA stores every column as zigzag varint deltas. REC_ENCODING_GORILLA packs
+// bits as in Facebook's Gorilla TSDB: timestamps as delta-of-delta in '0' / '10' / '110' /
+// '1110' / '1111' prefixed buckets, values as the XOR with the previous value ('0' when
+// unchanged, otherwise only the bits between the leading and trailing zeros). Our values are
+// integers, so the XOR works on their 64-bit patterns rather than on doubles; the effect is the
+// same: a flat temperature costs one bit per tick and a wandering power reading a dozen.
+//
+// The index is only written when the recording is closed. Block headers carry their time
+// range too, so an interrupted recording is indexed by scanning the headers instead.
+//
+// Version 1 recordings are still read. Their header has no encoding (it is always delta), their
+// block headers are just "NVTB", varint tick count, varint payload length, timestamps are in us
+// and there is no index: one is built at open by decoding each block's timestamp column.
+#define REC_MAGIC "NVTR"
+#define REC_BLOCK_MAGIC "NVTB"
+#define REC_INDEX_MAGIC "NVTI"
+#define REC_END_MAGIC "NVTE"
+#define REC_VERSION 2
+#define REC_NAME_LEN 96
+#define REC_BLOCK_TICKS 256
+#define REC_HEADER_LEN 16
+#define REC_V1_HEADER_LEN 12
+#define REC_DEVICE_LEN (4 + 2 * REC_NAME_LEN)
+#define REC_INDEX_ENTRY_LEN 24
+#define REC_TRAILER_LEN 12
+
+typedef enum { REC_ENCODING_DELTA, REC_ENCODING_GORILLA } rec_encoding_t;
+
+enum {
+  REC_FIELD_VALID,
+  REC_FIELD_TEMP,
+  REC_FIELD_FAN,
+  REC_FIELD_POWER,
+  REC_FIELD_POWER_LIMIT,
+  REC_FIELD_MEMORY_TOTAL,
+  REC_FIELD_MEMORY_USED,
+  REC_FIELD_MEMORY_FREE,
+  REC_FIELDS
+};
+
+typedef struct {
+  uint64_t offset; // File offset of the block's "NVTB"
+  uint64_t first_ms, last_ms;
+} rec_index_entry_t;
+
+typedef struct {
+  FILE* f;
+  rec_encoding_t encoding;
+  int device_count;
+  int ticks; // Ticks buffered in the current block
+  uint64_t timestamp_ms[REC_BLOCK_TICKS];
+  device_sample_t* samples; // [tick * device_count + device]
+  unsigned char* buf;       // Encoded block
+  rec_index_entry_t* index;
+  size_t index_count, index_cap;
+  unsigned long long bytes; // Written so far
+  int failed;
+} rec_writer_t;
+
+typedef struct {
+  FILE* f;
+  int version;
+  rec_encoding_t encoding;
+  int device_count;
+  unsigned int interval_ms;
+  int device_ids[MAX_DEVICES];
+  char names[MAX_DEVICES][REC_NAME_LEN];
+  char uuids[MAX_DEVICES][REC_NAME_LEN];
+  rec_index_entry_t* index;
+  size_t index_count;
+  unsigned long blocks_read;
+  size_t next_block;       // Index entry of the block rec_reader_block reads next
+  uint64_t from_ms, to_ms; // Time range returned by rec_reader_next
+  int ticks;               // Ticks decoded from the current block
+  int pos;                 // Next tick to return
+  uint64_t timestamp_ms[REC_BLOCK_TICKS];
+  device_sample_t* samples; // [tick * device_count + device]
+  unsigned char* buf;
+} rec_reader_t;
+
+// MSB-first bit stream over a byte buffer
+typedef struct {
+  unsigned char* buf;
+  size_t bits; // Bits written, or read so far
+  size_t limit; // Reader: bits available
+} bit_stream_t;
+
+static uint64_t rec_field_get(const device_sample_t* s, int field) {
+  switch (field) {
+  case REC_FIELD_VALID: return s->valid;
+  case REC_FIELD_TEMP: return s->temperature;
+  case REC_FIELD_FAN: return s->fan_speed;
+  case REC_FIELD_POWER: return s->power_usage;
+  case REC_FIELD_POWER_LIMIT: return s->power_limit;
+  case REC_FIELD_MEMORY_TOTAL: return s->memory.total;
+  case REC_FIELD_MEMORY_USED: return s->memory.used;
+  default: return s->memory.free;
+  }
+}
+
+static void rec_field_set(device_sample_t* s, int field, uint64_t v) {
+  switch (field) {
+  case REC_FIELD_VALID: s->valid = (unsigned int)v; break;
+  case REC_FIELD_TEMP: s->temperature = (unsigned int)v; break;
+  case REC_FIELD_FAN: s->fan_speed = (unsigned int)v; break;
+  case REC_FIELD_POWER: s->power_usage = (unsigned int)v; break;
+  case REC_FIELD_POWER_LIMIT: s->power_limit = (unsigned int)v; break;
+  case REC_FIELD_MEMORY_TOTAL: s->memory.total = v; break;
+  case REC_FIELD_MEMORY_USED: s->memory.used = v; break;
+  default: s->memory.free = v; break;
+  }
+}
+
+static size_t put_varint(unsigned char* p, uint64_t v) {
+  size_t n = 0;
+  while (v >= 0x80) {
+    p[n++] = (unsigned char)(v | 0x80);
+    v >>= 7;
+  }
+  p[n++] = (unsigned char)v;
+  return n;
+}
+
+static int get_varint(const unsigned char** p, const unsigned char* end, uint64_t* v) {
+  uint64_t value = 0;
+  for (int shift = 0; shift < 64 && *p < end; shift += 7) {
+    unsigned char byte = *(*p)++;
+    value |= (uint64_t)(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      *v = value;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+static int read_varint(FILE* f, uint64_t* v) {
+  uint64_t value = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    int byte = getc(f);
+    if (byte == EOF) return -1;
+    value |= (uint64_t)(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      *v = value;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+// Deltas wrap modulo 2^64, so any pair of values round-trips
+static uint64_t zigzag(uint64_t delta) {
+  return (delta << 1) ^ (uint64_t)((int64_t)delta >> 63);
+}
+
+static uint64_t unzigzag(uint64_t v) {
+  return (v >> 1) ^ (uint64_t)-(int64_t)(v & 1);
+}
+
+static void put_le(unsigned char* p, uint64_t v, int bytes) {
+  for (int i = 0; i < bytes; i++) p[i] = (unsigned char)(v >> (8 * i));
+}
+
+static uint64_t get_le(const unsigned char* p, int bytes) {
+  uint64_t v = 0;
+  for (int i = 0; i < bytes; i++) v |= (uint64_t)p[i] << (8 * i);
+  return v;
+}
+
+static void put_bits(bit_stream_t* s, uint64_t value, int count) {
+  while (count > 0) {
+    int used = s->bits & 7;
+    int take = 8 - used < count ? 8 - used : count;
+    unsigned int chunk = (unsigned int)(value >> (count - take)) & ((1u << take) - 1);
+    if (used == 0) s->buf[s->bits >> 3] = 0;
+    s->buf[s->bits >> 3] |= chunk << (8 - used - take);
+    s->bits += take;
+    count -= take;
+  }
+}
+
+static int get_bits(bit_stream_t* s, int count, uint64_t* value) {
+  if (s->limit - s->bits < (size_t)count) return -1;
+  uint64_t v = 0;
+  while (count > 0) {
+    int used = s->bits & 7;
+    int take = 8 - used < count ? 8 - used : count;
+    unsigned int byte = s->buf[s->bits >> 3];
+    v = (v << take) | ((byte >> (8 - used - take)) & ((1u << take) - 1));
+    s->bits += take;
+    count -= take;
+  }
+  *value = v;
+  return 0;
+}
+
+// Number of leading '1' bits before a '0', up to `max`
+static int get_prefix(bit_stream_t* s, int max) {
+  int ones = 0;
+  uint64_t bit;
+  while (ones < max) {
+    if (get_bits(s, 1, &bit) != 0) return -1;
+    if (!bit) break;
+    ones++;
+  }
+  return ones;
+}
+
+// Delta-of-delta buckets: value bits after a prefix of 0, 1, 2, 3 or 4 '1's (zigzag encoded)
+static const int dod_bits[] = {0, 7, 9, 12, 64};
+
+static void put_dod(bit_stream_t* s, uint64_t dod) {
+  uint64_t z = zigzag(dod);
+  int bucket = 0;
+  while (bucket < 4 && (dod_bits[bucket] == 0 ? z != 0 : z >> dod_bits[bucket] != 0)) bucket++;
+  put_bits(s, bucket < 4 ? ((1u << bucket) - 1) << 1 : 0xf, bucket < 4 ? bucket + 1 : 4);
+  put_bits(s, z, dod_bits[bucket]);
+}
+
+static int get_dod(bit_stream_t* s, uint64_t* dod) {
+  int bucket = get_prefix(s, 4);
+  uint64_t z = 0;
+  if (bucket < 0 || get_bits(s, dod_bits[bucket], &z) != 0) return -1;
+  *dod = unzigzag(z);
+  return 0;
+}
+
+// XOR window of the previous value in a column: '10' reuses it, '11' sends a new one
+typedef struct {
+  uint64_t prev;
+  int leading, trailing; // leading < 0 until a window has been sent
+} xor_state_t;
+
+static void put_xor(bit_stream_t* s, xor_state_t* st, uint64_t v) {
+  uint64_t x = v ^ st->prev;
+  st->prev = v;
+  if (x == 0) {
+    put_bits(s, 0, 1);
+    return;
+  }
+
+  int leading = __builtin_clzll(x);
+  int trailing = __builtin_ctzll(x);
+  if (st->leading >= 0 && leading >= st->leading && trailing >= st->trailing) {
+    put_bits(s, 2, 2);
+    put_bits(s, x >> st->trailing, 64 - st->leading - st->trailing);
+    return;
+  }
+
+  int length = 64 - leading - trailing;
+  put_bits(s, 3, 2);
+  put_bits(s, leading, 6);
+  put_bits(s, length - 1, 6);
+  put_bits(s, x >> trailing, length);
+  st->leading = leading;
+  st->trailing = trailing;
+}
+
+static int get_xor(bit_stream_t* s, xor_state_t* st, uint64_t* v) {
+  uint64_t bit, x;
+  if (get_bits(s, 1, &bit) != 0) return -1;
+  if (!bit) {
+    *v = st->prev;
+    return 0;
+  }
+  if (get_bits(s, 1, &bit) != 0) return -1;
+  if (bit) {
+    uint64_t leading, length;
+    if (get_bits(s, 6, &leading) != 0 || get_bits(s, 6, &length) != 0) return -1;
+    if (leading + length + 1 > 64) return -1;
+    st->leading = (int)leading;
+    st->trailing = 64 - (int)leading - (int)length - 1;
+  } else if (st->leading < 0) {
+    return -1;
+  }
+  if (get_bits(s, 64 - st->leading - st->trailing, &x) != 0) return -1;
+  st->prev ^= x << st->trailing;
+  *v = st->prev;
+  return 0;
+}
+
+// Worst case for one encoded block: every value at 10 bytes (a full varint, or 78 bits)
+static size_t rec_block_max(int device_count) {
+  return (size_t)REC_BLOCK_TICKS * (1 + device_count * REC_FIELDS) * 10;
+}
+
+static size_t rec_encode_delta(const rec_writer_t* w) {
+  size_t len = 0;
+  uint64_t prev = 0;
+  for (int t = 0; t < w->ticks; t++) {
+    len += put_varint(w->buf + len, zigzag(w->timestamp_ms[t] - prev));
+    prev = w->timestamp_ms[t];
+  }
+  for (int d = 0; d < w->device_count; d++) {
+    for (int field = 0; field < REC_FIELDS; field++) {
+      prev = 0;
+      for (int t = 0; t < w->ticks; t++) {
+        uint64_t v = rec_field_get(&w->samples[t * w->device_count + d], field);
+        len += put_varint(w->buf + len, zigzag(v - prev));
+        prev = v;
+      }
+    }
+  }
+  return len;
+}
+
+static size_t rec_encode_gorilla(const rec_writer_t* w) {
+  bit_stream_t s = {w->buf, 0, 0};
+  uint64_t prev_delta = 0;
+  for (int t = 1; t < w->ticks; t++) {
+    uint64_t delta = w->timestamp_ms[t] - w->timestamp_ms[t - 1];
+    put_dod(&s, delta - prev_delta);
+    prev_delta = delta;
+  }
+  for (int d = 0; d < w->device_count; d++) {
+    for (int field = 0; field < REC_FIELDS; field++) {
+      xor_state_t st = {0, -1, 0};
+      for (int t = 0; t < w->ticks; t++)
+        put_xor(&s, &st, rec_field_get(&w->samples[t * w->device_count + d], field));
+    }
+  }
+  return (s.bits + 7) / 8;
+}
+
+static int rec_decode_delta(rec_reader_t* r, size_t len, int ticks) {
+  const unsigned char* p = r->buf;
+  const unsigned char* end = r->buf + len;
+  uint64_t v, prev = 0;
+  for (int t = 0; t < ticks; t++) {
+    if (get_varint(&p, end, &v) != 0) return -1;
+    prev += unzigzag(v);
+    r->timestamp_ms[t] = prev;
+  }
+  for (int d = 0; d < r->device_count; d++) {
+    for (int field = 0; field < REC_FIELDS; field++) {
+      prev = 0;
+      for (int t = 0; t < ticks; t++) {
+        if (get_varint(&p, end, &v) != 0) return -1;
+        prev += unzigzag(v);
+        rec_field_set(&r->samples[t * r->device_count + d], field, prev);
+      }
+    }
+  }
+  return 0;
+}
+
+// The first timestamp comes from the block header
+static int rec_decode_gorilla(rec_reader_t* r, size_t len, int ticks) {
+  bit_stream_t s = {r->buf, 0, len * 8};
+  uint64_t dod, delta = 0;
+  for (int t = 1; t < ticks; t++) {
+    if (get_dod(&s, &dod) != 0) return -1;
+    delta += dod;
+    r->timestamp_ms[t] = r->timestamp_ms[t - 1] + delta;
+  }
+  for (int d = 0; d < r->device_count; d++) {
+    for (int field = 0; field < REC_FIELDS; field++) {
+      xor_state_t st = {0, -1, 0};
+      for (int t = 0; t < ticks; t++) {
+        uint64_t v;
+        if (get_xor(&s, &st, &v) != 0) return -1;
+        rec_field_set(&r->samples[t * r->device_count + d], field, v);
+      }
+    }
+  }
+  return 0;
+}
+
+static int rec_writer_open(rec_writer_t* w, const char* path, rec_encoding_t encoding,
+                           const int* device_ids, char names[][MAX_NAME_LEN],
+                           char uuids[][MAX_UUID_LEN], int count, unsigned int interval_ms) {
+  memset(w, 0, sizeof(*w));
+  w->encoding = encoding;
+  w->device_count = count;
+  w->samples = calloc((size_t)REC_BLOCK_TICKS * count, sizeof(device_sample_t));
+  w->buf = malloc(rec_block_max(count));
+  w->f = fopen(path, "wb");
+  if (!w->samples || !w->buf || !w->f) {
+    fprintf(stderr, "Error: Cannot create recording '%s' (%s)\n", path, strerror(errno));
+    if (w->f) fclose(w->f);
+    free(w->samples);
+    free(w->buf);
+    return -1;
+  }
+
+  unsigned char header[REC_HEADER_LEN];
+  memcpy(header, REC_MAGIC, 4);
+  put_le(header + 4, REC_VERSION, 2);
+  put_le(header + 6, count, 2);
+  put_le(header + 8, interval_ms, 4);
+  put_le(header + 12, encoding, 4);
+  fwrite(header, 1, sizeof(header), w->f);
+
+  for (int i = 0; i < count; i++) {
+    unsigned char device[REC_DEVICE_LEN] = {0};
+    put_le(device, (uint32_t)device_ids[i], 4);
+    copy_string((char*)device + 4, REC_NAME_LEN, names[i]);
+    copy_string((char*)device + 4 + REC_NAME_LEN, REC_NAME_LEN, uuids[i]);
+    fwrite(device, 1, sizeof(device), w->f);
+  }
+  w->bytes = REC_HEADER_LEN + (unsigned long long)count * REC_DEVICE_LEN;
+  return 0;
+}
+
+static void rec_writer_flush(rec_writer_t* w) {
+  if (w->ticks == 0) return;
+
+  if (w->index_count == w->index_cap) {
+    size_t cap = w->index_cap ? w->index_cap * 2 : 64;
+    rec_index_entry_t* index = realloc(w->index, cap * sizeof(*index));
+    if (!index) {
+      w->failed = 1;
+      return;
+    }
+    w->index = index;
+    w->index_cap = cap;
+  }
+  uint64_t first = w->timestamp_ms[0], last = w->timestamp_ms[w->ticks - 1];
+  w->index[w->index_count++] = (rec_index_entry_t){w->bytes, first, last};
+
+  size_t len = w->encoding == REC_ENCODING_GORILLA ? rec_encode_gorilla(w) : rec_encode_delta(w);
+  unsigned char header[4 + 4 * 10];
+  size_t header_len = 4;
+  memcpy(header, REC_BLOCK_MAGIC, 4);
+  header_len += put_varint(header + header_len, w->ticks);
+  header_len += put_varint(header + header_len, first);
+  header_len += put_varint(header + header_len, last - first);
+  header_len += put_varint(header + header_len, len);
+  if (fwrite(header, 1, header_len, w->f) != header_len || fwrite(w->buf, 1, len, w->f) != len ||
+      fflush(w->f) != 0)
+    w->failed = 1;
+  w->bytes += header_len + len;
+  w->ticks = 0;
+}
+
+// Append one tick; `samples` holds one entry per device. Returns -1 once a write has failed.
+static int rec_writer_append(rec_writer_t* w, uint64_t timestamp_ms,
+                             const device_sample_t* samples) {
+  w->timestamp_ms[w->ticks] = timestamp_ms;
+  memcpy(&w->samples[w->ticks * w->device_count], samples,
+         w->device_count * sizeof(device_sample_t));
+  if (++w->ticks == REC_BLOCK_TICKS) rec_writer_flush(w);
+  return w->failed ? -1 : 0;
+}
+
+static int rec_writer_close(rec_writer_t* w) {
+  rec_writer_flush(w);
+
+  unsigned char buf[REC_INDEX_ENTRY_LEN];
+  uint64_t index_offset = w->bytes;
+  memcpy(buf, REC_INDEX_MAGIC, 4);
+  put_le(buf + 4, w->index_count, 4);
+  fwrite(buf, 1, 8, w->f);
+  for (size_t i = 0; i < w->index_count; i++) {
+    put_le(buf, w->index[i].offset, 8);
+    put_le(buf + 8, w->index[i].first_ms, 8);
+    put_le(buf + 16, w->index[i].last_ms, 8);
+    fwrite(buf, 1, REC_INDEX_ENTRY_LEN, w->f);
+  }
+  put_le(buf, index_offset, 8);
+  memcpy(buf + 8, REC_END_MAGIC, 4);
+  fwrite(buf, 1, REC_TRAILER_LEN, w->f);
+  w->bytes += 8 + w->index_count * REC_INDEX_ENTRY_LEN + REC_TRAILER_LEN;
+
+  if (ferror(w->f)) w->failed = 1;
+  if (fclose(w->f) != 0) w->failed = 1;
+  free(w->samples);
+  free(w->buf);
+  free(w->index);
+  return w->failed ? -1 : 0;
+}
+
+// Read the block header at the current position. Returns 1 on success, 0 at the index or the
+// end of the file, -1 if it is corrupt. Version 1 headers have no time range; both are 0 then.
+static int rec_read_block_header(FILE* f, int version, uint64_t* ticks, uint64_t* first_ms,
+                                 uint64_t* last_ms, uint64_t* len) {
+  unsigned char magic[4];
+  size_t got = fread(magic, 1, sizeof(magic), f);
+  if ((got == 0 && feof(f)) || (got == 4 && memcmp(magic, REC_INDEX_MAGIC, 4) == 0)) return 0;
+
+  uint64_t span = 0;
+  *first_ms = 0;
+  if (got != sizeof(magic) || memcmp(magic, REC_BLOCK_MAGIC, 4) != 0 ||
+      read_varint(f, ticks) != 0 ||
+      (version > 1 && (read_varint(f, first_ms) != 0 || read_varint(f, &span) != 0)) ||
+      read_varint(f, len) != 0 || *ticks == 0 || *ticks > REC_BLOCK_TICKS)
+    return -1;
+  *last_ms = *first_ms + span;
+  return 1;
+}
+
+// Version 1: time range of a block from its payload, which starts with the timestamp column
+static int rec_v1_time_range(const unsigned char* buf, size_t len, uint64_t ticks,
+                             uint64_t* first_ms, uint64_t* last_ms) {
+  const unsigned char* p = buf;
+  uint64_t v, us = 0;
+  for (uint64_t t = 0; t < ticks; t++) {
+    if (get_varint(&p, buf + len, &v) != 0) return -1;
+    us += unzigzag(v);
+    if (t == 0) *first_ms = us / 1000;
+  }
+  *last_ms = us / 1000;
+  return 0;
+}
+
+// Load the index written at close. Returns 0 on success, -1 if there is none (or it is bad).
+static int rec_load_index(rec_reader_t* r) {
+  unsigned char buf[REC_INDEX_ENTRY_LEN];
+  if (fseek(r->f, -REC_TRAILER_LEN, SEEK_END) != 0 || fread(buf, 1, REC_TRAILER_LEN, r->f) !=
+      REC_TRAILER_LEN || memcmp(buf + 8, REC_END_MAGIC, 4) != 0)
+    return -1;
+  long end = ftell(r->f);
+  uint64_t offset = get_le(buf, 8);
+  if (offset + 8 + REC_TRAILER_LEN > (uint64_t)end || fseek(r->f, (long)offset, SEEK_SET) != 0 ||
+      fread(buf, 1, 8, r->f) != 8 || memcmp(buf, REC_INDEX_MAGIC, 4) != 0)
+    return -1;
+
+  size_t count = get_le(buf + 4, 4);
+  if (offset + 8 + count * REC_INDEX_ENTRY_LEN + REC_TRAILER_LEN != (uint64_t)end) return -1;
+  r->index = malloc((count ? count : 1) * sizeof(*r->index));
+  if (!r->index) return -1;
+  for (size_t i = 0; i < count; i++) {
+    if (fread(buf, 1, REC_INDEX_ENTRY_LEN, r->f) != REC_INDEX_ENTRY_LEN) return -1;
+    r->index[i].offset = get_le(buf, 8);
+    r->index[i].first_ms = get_le(buf + 8, 8);
+    r->index[i].last_ms = get_le(buf + 16, 8);
+  }
+  r->index_count = count;
+  return 0;
+}
+
+// No index (the recording was interrupted, or is version 1): build one from the block headers,
+// stopping at the first block that is cut off
+static void rec_scan_index(rec_reader_t* r, long data_start) {
+  size_t cap = 0;
+  uint64_t ticks, first, last, len;
+  free(r->index);
+  r->index = NULL;
+  r->index_count = 0;
+  fseek(r->f, 0, SEEK_END);
+  long size = ftell(r->f);
+  fseek(r->f, data_start, SEEK_SET);
+  for (;;) {
+    long offset = ftell(r->f);
+    if (rec_read_block_header(r->f, r->version, &ticks, &first, &last, &len) <= 0) break;
+    if (len > (uint64_t)(size - ftell(r->f))) break;
+    if (r->version == 1) {
+      if (len > rec_block_max(r->device_count) || fread(r->buf, 1, len, r->f) != len ||
+          rec_v1_time_range(r->buf, len, ticks, &first, &last) != 0)
+        break;
+    } else if (fseek(r->f, (long)len, SEEK_CUR) != 0) {
+      break;
+    }
+    if (r->index_count == cap) {
+      cap = cap ? cap * 2 : 64;
+      rec_index_entry_t* index = realloc(r->index, cap * sizeof(*index));
+      if (!index) break;
+      r->index = index;
+    }
+    r->index[r->index_count++] = (rec_index_entry_t){(uint64_t)offset, first, last};
+  }
+}
+
+static int rec_reader_open(rec_reader_t* r, const char* path) {
+  memset(r, 0, sizeof(*r));
+  r->to_ms = UINT64_MAX;
+  r->f = fopen(path, "rb");
+  if (!r->f) {
+    fprintf(stderr, "Error: Cannot open recording '%s' (%s)\n", path, strerror(errno));
+    return -1;
+  }
+
+  unsigned char header[REC_HEADER_LEN];
+  if (fread(header, 1, 6, r->f) != 6 || memcmp(header, REC_MAGIC, 4) != 0) {
+    fprintf(stderr, "Error: '%s' is not an nvml-tool recording\n", path);
+    fclose(r->f);
+    return -1;
+  }
+  r->version = (int)get_le(header + 4, 2);
+  if (r->version < 1 || r->version > REC_VERSION) {
+    fprintf(stderr, "Error: '%s' has unsupported recording version %d\n", path, r->version);
+    fclose(r->f);
+    return -1;
+  }
+  size_t header_len = r->version == 1 ? REC_V1_HEADER_LEN : REC_HEADER_LEN;
+  if (fread(header + 6, 1, header_len - 6, r->f) != header_len - 6) {
+    fprintf(stderr, "Error: '%s' is truncated\n", path);
+    fclose(r->f);
+    return -1;
+  }
+
+  r->device_count = (int)get_le(header + 6, 2);
+  r->interval_ms = (unsigned int)get_le(header + 8, 4);
+  r->encoding = r->version == 1 ? REC_ENCODING_DELTA : (rec_encoding_t)get_le(header + 12, 4);
+  if (r->device_count > MAX_DEVICES || r->encoding > REC_ENCODING_GORILLA) {
+    fprintf(stderr, "Error: '%s' has an unsupported layout\n", path);
+    fclose(r->f);
+    return -1;
+  }
+
+  for (int i = 0; i < r->device_count; i++) {
+    unsigned char device[REC_DEVICE_LEN];
+    if (fread(device, 1, sizeof(device), r->f) != sizeof(device)) {
+      fprintf(stderr, "Error: '%s' is truncated\n", path);
+      fclose(r->f);
+      return -1;
+    }
+    r->device_ids[i] = (int32_t)get_le(device, 4);
+    memcpy(r->names[i], device + 4, REC_NAME_LEN);
+    memcpy(r->uuids[i], device + 4 + REC_NAME_LEN, REC_NAME_LEN);
+    r->names[i][REC_NAME_LEN - 1] = '\0';
+    r->uuids[i][REC_NAME_LEN - 1] = '\0';
+  }
+
+  r->samples = calloc((size_t)REC_BLOCK_TICKS * (r->device_count ? r->device_count : 1),
+                      sizeof(device_sample_t));
+  r->buf = malloc(rec_block_max(r->device_count));
+  if (!r->samples || !r->buf) {
+    fprintf(stderr, "Error: Out of memory\n");
+    fclose(r->f);
+    free(r->samples);
+    free(r->buf);
+    return -1;
+  }
+
+  long data_start = ftell(r->f);
+  if (r->version == 1 || rec_load_index(r) != 0) rec_scan_index(r, data_start);
+  fseek(r->f, data_start, SEEK_SET);
+  return 0;
+}
+
+// Only return ticks in [from_ms, to_ms], starting at the first block that can contain from_ms.
+// Blocks are found by a binary search of the index (blocks are in time order), so nothing
+// before them is read or decoded.
+static void rec_reader_seek(rec_reader_t* r, uint64_t from_ms, uint64_t to_ms) {
+  r->from_ms = from_ms;
+  r->to_ms = to_ms;
+  r->ticks = r->pos = 0;
+
+  size_t lo = 0, hi = r->index_count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (r->index[mid].last_ms < from_ms)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  r->next_block = lo;
+  if (lo < r->index_count)
+    fseek(r->f, (long)r->index[lo].offset, SEEK_SET);
+  else
+    fseek(r->f, 0, SEEK_END); // Everything is older than from_ms
+}
+
+// First timestamp in the recording, 0 if it has no blocks
+static uint64_t rec_reader_start_ms(const rec_reader_t* r) {
+  return r->index_count ? r->index[0].first_ms : 0;
+}
+
+// Read and decode the next block. Returns 1 on success, 0 at the end, -1 if it is corrupt.
+static int rec_reader_block(rec_reader_t* r) {
+  // The index knows where the next block starts, so a block past --to is never read
+  if (r->next_block < r->index_count && r->index[r->next_block].first_ms > r->to_ms) return 0;
+
+  uint64_t ticks, first, last, len;
+  int status = rec_read_block_header(r->f, r->version, &ticks, &first, &last, &len);
+  if (status <= 0) return status;
+  if (len > rec_block_max(r->device_count) || fread(r->buf, 1, len, r->f) != len) return -1;
+
+  r->timestamp_ms[0] = first;
+  int decoded = r->encoding == REC_ENCODING_GORILLA ? rec_decode_gorilla(r, len, (int)ticks)
+                                                    : rec_decode_delta(r, len, (int)ticks);
+  if (decoded != 0) return -1;
+  if (r->version == 1)
+    for (uint64_t t = 0; t < ticks; t++) r->timestamp_ms[t] /= 1000; // Stored in us
+
+  r->next_block++;
+  r->ticks = (int)ticks;
+  r->pos = 0;
+  r->blocks_read++;
+  return 1;
+}
+
+// Next tick: its timestamp and one sample per recorded device. Returns 1 on success, 0 at the
+// end of the recording (or of the seek range), -1 if it is corrupt or truncated.
+static int rec_reader_next(rec_reader_t* r, uint64_t* timestamp_ms,
+                           const device_sample_t** samples) {
+  do {
+    if (r->pos == r->ticks) {
+      int status = rec_reader_block(r);
+      if (status <= 0) return status;
+    }
+    *timestamp_ms = r->timestamp_ms[r->pos];
+    *samples = &r->samples[r->pos * r->device_count];
+    r->pos++;
+  } while (*timestamp_ms < r->from_ms);
+  return *timestamp_ms <= r->to_ms;
+}
+
+static void rec_reader_close(rec_reader_t* r) {
+  fclose(r->f);
+  free(r->samples);
+  free(r->buf);
+  free(r->index);
+}
+
+// Resolve a --from/--to bound: seconds since the start of the recording, or @UNIX_SECONDS
+static int rec_time_bound(const rec_reader_t* r, const char* arg, uint64_t* ms) {
+  char* end;
+  int absolute = arg[0] == '@';
+  double seconds = strtod(arg + absolute, &end);
+  if (end == arg + absolute || *end || seconds < 0) {
+    fprintf(stderr, "Error: Invalid time '%s' (seconds from the start, or @UNIX_SECONDS)\n", arg);
+    return -1;
+  }
+  *ms = (uint64_t)(seconds * 1000) + (absolute ? 0 : rec_reader_start_ms(r));
+  return 0;
+}
+
+// Apply --from/--to to an open recording
+static int rec_reader_apply_range(rec_reader_t* r, const cli_args_t* args) {
+  uint64_t from = 0, to = UINT64_MAX;
+  if (args->from && rec_time_bound(r, args->from, &from) != 0) return -1;
+  if (args->to && rec_time_bound(r, args->to, &to) != 0) return -1;
+  if (args->from || args->to) rec_reader_seek(r, from, to);
+  return 0;
+}
+
+static int device_selected(const cli_args_t* args, int device_id) {
+  if (args->all_devices) return 1;
+  for (int i = 0; i < args->device_count; i++)
+    if (args->devices[i] == device_id) return 1;
+  return 0;
+}
+
+// Print a recording through the same output paths as status / info json, one block per tick
+static int run_replay(const cli_args_t* args) {
+  rec_reader_t r;
+  if (rec_reader_open(&r, args->input) != 0) return 1;
+  if (rec_reader_apply_range(&r, args) != 0) {
+    rec_reader_close(&r);
+    return 1;
+  }
+
+  uint64_t timestamp_ms;
+  const device_sample_t* samples;
+  unsigned long ticks = 0;
+  int status;
+  static out_t out;
+  out_init_fd(&out, STDOUT_FILENO);
+  while ((status = rec_reader_next(&r, &timestamp_ms, &samples)) > 0) {
+    ticks++;
+    int last = -1;
+    for (int d = 0; d < r.device_count; d++)
+      if (device_selected(args, r.device_ids[d]) && samples[d].valid) last = d;
+
+    if (args->subcommand == SUBCMD_JSON) {
+      out_str(&out, "[\n");
+    } else {
+      out_str(&out, "tick:");
+      out_u64(&out, ticks);
+      out_str(&out, ",time:");
+      out_fixed(&out, timestamp_ms, 3);
+      out_char(&out, '\n');
+    }
+    for (int d = 0; d < r.device_count; d++) {
+      if (!device_selected(args, r.device_ids[d])) continue;
+      if (!samples[d].valid) {
+        fprintf(stderr, "%d:Error: No sample this tick (device not responding)\n",
+                r.device_ids[d]);
+        continue;
+      }
+      if (args->subcommand == SUBCMD_JSON)
+        print_sample_json(&out, NULL, &samples[d], r.names[d], r.uuids[d], r.device_ids[d],
+                          args->temp_unit, d == last);
+      else
+        print_status_cli(&out, &samples[d], r.device_ids[d], args->temp_unit);
+    }
+    if (args->subcommand == SUBCMD_JSON) out_str(&out, "]\n");
+    if (out_flush(&out) != 0) break; // Reader went away
+
+    if (args->count && ticks >= args->count) {
+      status = 0;
+      break;
+    }
+  }
+
+  if (status < 0) fprintf(stderr, "Error: '%s' is corrupt or truncated\n", args->input);
+  fprintf(stderr, "replay: %lu ticks from %lu of %zu blocks, %d devices, recorded every %u ms\n",
+          ticks, r.blocks_read, r.index_count, r.device_count, r.interval_ms);
+  rec_reader_close(&r);
+  return status < 0;
+}
+
+// fanctl --simulate state for one trace, or one device of a recording
+typedef struct {
+  pid_state_t pid;
+  double prev_time;
+  unsigned int prev_fan;
+  unsigned long readings, changes;
+  double abs_error; // Sum of |temp - target|
+} sim_channel_t;
+
+static void simulate_reading(const cli_args_t* args, sim_channel_t* ch, int device_id, double time,
+                             double temp) {
+  unsigned int fan = fanctl_target(args, &ch->pid, temp, ch->readings ? time - ch->prev_time : 0);
+  if (ch->readings > 0 && fan != ch->prev_fan) ch->changes++;
+  ch->abs_error += temp > args->pid.target ? temp - args->pid.target : args->pid.target - temp;
+  if (device_id >= 0)
+    printf("%.3f:%d:%.1fC -> %u%%\n", time, device_id, temp, fan);
+  else
+    printf("%.3f:%.1fC -> %u%%\n", time, temp, fan);
+
+  ch->prev_fan = fan;
+  ch->prev_time = time;
+  ch->readings++;
+}
+
+static void simulate_summary(const cli_args_t* args, const char* label, const sim_channel_t* ch) {
+  fprintf(stderr, "simulate:%s %lu readings, %lu fan speed changes", label, ch->readings,
+          ch->changes);
+  if (args->fan_mode == FAN_MODE_PID && ch->readings > 0)
+    fprintf(stderr, ", mean |temp - target| %.2fC", ch->abs_error / ch->readings);
+  fprintf(stderr, "\n");
+}
+
+// Drive every selected device of a recording through the controller, each with its own state
+static int simulate_recording(const cli_args_t* args) {
+  rec_reader_t r;
+  if (rec_reader_open(&r, args->simulate) != 0) return 1;
+  if (rec_reader_apply_range(&r, args) != 0) {
+    rec_reader_close(&r);
+    return 1;
+  }
+
+  static sim_channel_t channels[MAX_DEVICES];
+  memset(channels, 0, sizeof(channels));
+  uint64_t timestamp_ms, start_ms = rec_reader_start_ms(&r);
+  const device_sample_t* samples;
+  int status;
+  while ((status = rec_reader_next(&r, &timestamp_ms, &samples)) > 0) {
+    for (int d = 0; d < r.device_count; d++) {
+      if (!device_selected(args, r.device_ids[d]) || !(samples[d].valid & SAMPLE_TEMP)) continue;
+      simulate_reading(args, &channels[d], r.device_ids[d], (timestamp_ms - start_ms) / 1e3,
+                       samples[d].temperature);
+    }
+  }
+
+  if (status < 0) fprintf(stderr, "Error: '%s' is corrupt or truncated\n", args->simulate);
+  for (int d = 0; d < r.device_count; d++) {
+    if (!device_selected(args, r.device_ids[d])) continue;
+    char label[16];
+    snprintf(label, sizeof(label), "%d:", r.device_ids[d]);
+    simulate_summary(args, label, &channels[d]);
+  }
+  rec_reader_close(&r);
+  return status < 0;
+}
+
+// fanctl --simulate: run the controller over a temperature trace without touching any device.
+// The trace is either a recording made by `record`, or text with one "SECONDS TEMP" or just
+// "TEMP" (one reading per FANCTL_INTERVAL_MS) per line, where '#' starts a comment. The replay
+// is open loop: the simulated fan speed does not feed back into the trace.
+static int run_fanctl_simulation(const cli_args_t* args) {
+  FILE* f = strcmp(args->simulate, "-") == 0 ? stdin : fopen(args->simulate, "r");
+  if (!f) {
+    fprintf(stderr, "Error: Cannot open trace '%s' (%s)\n", args->simulate, strerror(errno));
+    return 1;
+  }
+
+  char line[256];
+  int c = getc(f);
+  if (c == REC_MAGIC[0] && f != stdin) {
+    fclose(f);
+    return simulate_recording(args);
+  }
+  if (c != EOF) ungetc(c, f);
+
+  sim_channel_t ch;
+  memset(&ch, 0, sizeof(ch));
+  int status = 0;
+  while (fgets(line, sizeof(line), f)) {
+    char* comment = strchr(line, '#');
+    if (comment) *comment = '\0';
+
+    double a, b, time, temp;
+    int fields = sscanf(line, "%lf%*[ \t,]%lf", &a, &b);
+    if (fields == 2) {
+      time = a;
+      temp = b;
+    } else if (fields == 1) {
+      time = ch.readings * (FANCTL_INTERVAL_MS / 1000.0);
+      temp = a;
+    } else {
+      continue;
+    }
+
+    if (ch.readings > 0 && time < ch.prev_time) {
+      fprintf(stderr, "Error: Trace goes back in time at %.3fs\n", time);
+      status = 1;
+      break;
+    }
+    simulate_reading(args, &ch, -1, time, temp);
+  }
+
+  if (f != stdin) fclose(f);
+  simulate_summary(args, "", &ch);
+  return status;
+}
+
+// Per-device sampler threads. Each worker owns one device and answers aggregator ticks by
+// pushing into its own single-producer/single-consumer queue, so a slow or hung GPU only
+// delays its own samples: a tick costs the slowest device, not the sum over all devices.
+typedef struct {
+  unsigned long tick;      // Aggregator tick this sample answers
+  long long sampled_ns;    // CLOCK_MONOTONIC when the worker finished
+  device_sample_t sample;
+  nvmlReturn_t result;     // fanctl: temperature or fan write error, NVML_SUCCESS otherwise
+  int failed_fan;          // fanctl: fan whose write failed, -1 if it was the temperature read
+  unsigned int fan_target; // fanctl: speed applied to every fan
+  unsigned long fan_writes;     // fanctl: fan writes issued so far
+  unsigned long fan_suppressed; // fanctl: writes skipped because the speed was unchanged
+} sampler_msg_t;
+
+typedef struct {
+  pthread_t thread;
+  nvmlDevice_t device;
+  int device_id;
+  field_plan_t plan;                  // Only touched by the worker
+  const cli_args_t* fanctl;           // fanctl: drive the fans from the worker after each read
+  pid_state_t pid;                    // fanctl --mode pid controller state
+  long long control_ns;               // fanctl: when the previous reading was taken
+  unsigned int fan_speed[MAX_FANS];   // fanctl: last speed written to each fan
+  long long fan_written_ns[MAX_FANS]; // fanctl: when it was written, 0 if unknown
+  unsigned long fan_writes, fan_suppressed;
+  unsigned long done_tick; // Last tick answered, worker only
+  int busy;                // Set while the worker is inside NVML
+  unsigned long head;      // Next slot to write, advanced by the worker
+  unsigned long tail;      // Next slot to read, advanced by the aggregator
+  unsigned long dropped;   // Samples lost to a full queue
+  sampler_msg_t queue[SAMPLER_QUEUE_LEN];
+} sampler_t;
+
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t tick_cond;
+  unsigned long tick; // Latest tick requested by the aggregator
+  int stop;
+  int notify_fd; // eventfd bumped by workers after each push
+  sampler_t* workers;
+  int count;
+} sampler_pool = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0, -1, NULL, 0};
+
+static void sampler_push(sampler_t* s, const sampler_msg_t* msg) {
+  unsigned long head = s->head;
+  if (head - __atomic_load_n(&s->tail, __ATOMIC_ACQUIRE) == SAMPLER_QUEUE_LEN) {
+    s->dropped++; // Aggregator fell behind; keep the samples it has not seen yet
+    return;
+  }
+  s->queue[head % SAMPLER_QUEUE_LEN] = *msg;
+  __atomic_store_n(&s->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static int sampler_pop(sampler_t* s, sampler_msg_t* msg) {
+  unsigned long tail = s->tail;
+  if (tail == __atomic_load_n(&s->head, __ATOMIC_ACQUIRE)) return 0;
+  *msg = s->queue[tail % SAMPLER_QUEUE_LEN];
+  __atomic_store_n(&s->tail, tail + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+// fanctl: read the temperature and drive every fan to the speed the controller asks for
+static void sampler_control(sampler_t* s, sampler_msg_t* msg) {
+  msg->failed_fan = -1;
+  msg->result = nvmlDeviceGetTemperature(s->device, NVML_TEMPERATURE_GPU, &msg->sample.temperature);
+  if (msg->result != NVML_SUCCESS) return;
+  msg->sample.valid |= SAMPLE_TEMP;
+
+  long long now = now_ns();
+  double dt = s->control_ns ? (now - s->control_ns) / 1e9 : 0;
+  s->control_ns = now;
+  msg->fan_target = fanctl_target(s->fanctl, &s->pid, msg->sample.temperature, dt);
+
+  // Only write fans whose speed changes, plus a periodic refresh in case something else (a
+  // driver reset, another tool) changed them behind our back
+  unsigned int num_fans = 0;
+  get_num_fans(s->device, s->device_id, &num_fans);
+  for (unsigned int fan = 0; fan < num_fans && running; fan++) {
+    int tracked = fan < MAX_FANS;
+    if (tracked && s->fan_written_ns[fan] && s->fan_speed[fan] == msg->fan_target &&
+        now - s->fan_written_ns[fan] < FANCTL_REFRESH_MS * 1000000LL) {
+      s->fan_suppressed++;
+      continue;
+    }
+
+    nvmlReturn_t result = nvmlDeviceSetFanSpeed_v2(s->device, fan, msg->fan_target);
+    s->fan_writes++;
+    if (result != NVML_SUCCESS) {
+      if (tracked) s->fan_written_ns[fan] = 0; // Unknown state, write again next time
+      msg->result = result;
+      msg->failed_fan = fan;
+      break;
+    }
+    if (tracked) {
+      s->fan_speed[fan] = msg->fan_target;
+      s->fan_written_ns[fan] = now;
+    }
+  }
+  msg->fan_writes = s->fan_writes;
+  msg->fan_suppressed = s->fan_suppressed;
+}
+
+// Start a helper thread with SIGINT/SIGTERM blocked, so those stay with the main thread, which
+// restores the fans on its way out. Returns 0 or an errno value.
+static int spawn_thread(pthread_t* thread, void* (*fn)(void*), void* arg) {
+  sigset_t block, old;
+  sigemptyset(&block);
+  sigaddset(&block, SIGINT);
+  sigaddset(&block, SIGTERM);
+  sigaddset(&block, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &block, &old);
+  int rc = pthread_create(thread, NULL, fn, arg);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  return rc;
+}
+
+static void* sampler_thread(void* arg) {
+  sampler_t* s = arg;
+
+  for (;;) {
+    pthread_mutex_lock(&sampler_pool.lock);
+    while (!sampler_pool.stop && sampler_pool.tick == s->done_tick)
+      pthread_cond_wait(&sampler_pool.tick_cond, &sampler_pool.lock);
+    unsigned long tick = sampler_pool.tick;
+    int stop = sampler_pool.stop;
+    pthread_mutex_unlock(&sampler_pool.lock);
+    if (stop) break;
+
+    // Ticks requested while this device was stuck are skipped, not replayed
+    sampler_msg_t msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.tick = s->done_tick = tick;
+    __atomic_store_n(&s->busy, 1, __ATOMIC_RELEASE);
+    if (s->fanctl)
+      sampler_control(s, &msg);
+    else
+      sample_device(s->device, &s->plan, &msg.sample);
+    __atomic_store_n(&s->busy, 0, __ATOMIC_RELEASE);
+    msg.sampled_ns = now_ns();
+
+    sampler_push(s, &msg);
+    uint64_t one = 1;
+    if (write(sampler_pool.notify_fd, &one, sizeof(one)) < 0) {
+      // Counter saturation is harmless; the aggregator drains every queue when it wakes
+    }
+  }
+  return NULL;
+}
+
+// Start one worker per device. With fanctl set, workers run fan control instead of sampling
+// `metrics`. Returns 0 on success.
+static int sampler_start(nvmlDevice_t* devices, const int* device_ids, int count,
+                         unsigned int metrics, const cli_args_t* fanctl) {
+  sampler_pool.notify_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  sampler_pool.workers = calloc(count, sizeof(sampler_t));
+  if (sampler_pool.notify_fd < 0 || !sampler_pool.workers) {
+    fprintf(stderr, "Error: Cannot set up sampler threads (%s)\n", strerror(errno));
+    return -1;
+  }
+
+  for (int i = 0; i < count; i++) {
+    sampler_t* s = &sampler_pool.workers[i];
+    s->device = devices[i];
+    s->device_id = device_ids[i];
+    s->fanctl = fanctl;
+    field_plan_init(&s->plan, metrics);
+
+    int rc = spawn_thread(&s->thread, sampler_thread, s);
+    if (rc != 0) {
+      fprintf(stderr, "%d:Error: Cannot start sampler thread (%s)\n", device_ids[i], strerror(rc));
+      break;
+    }
+    sampler_pool.count++;
+  }
+
+  return sampler_pool.count == count ? 0 : -1;
+}
+
+static void sampler_request_tick(unsigned long tick) {
+  pthread_mutex_lock(&sampler_pool.lock);
+  sampler_pool.tick = tick;
+  pthread_cond_broadcast(&sampler_pool.tick_cond);
+  pthread_mutex_unlock(&sampler_pool.lock);
+}
+
+// Drain every queue into latest[] until all devices have answered `tick` or deadline_ns passes.
+// fresh[i] tells whether latest[i] answers this tick. Returns the number of fresh devices.
+static int sampler_collect(unsigned long tick, long long deadline_ns, sampler_msg_t* latest,
+                           int* fresh) {
+  int answered = 0;
+  memset(fresh, 0, sampler_pool.count * sizeof(int));
+
+  for (;;) {
+    for (int i = 0; i < sampler_pool.count; i++) {
+      sampler_msg_t msg;
+      while (sampler_pop(&sampler_pool.workers[i], &msg)) {
+        latest[i] = msg;
+        if (msg.tick == tick && !fresh[i]) {
+          fresh[i] = 1;
+          answered++;
+        }
+      }
+    }
+    if (answered == sampler_pool.count || !running) break;
+
+    long long remaining = deadline_ns - now_ns();
+    if (remaining <= 0) break;
+    struct pollfd pfd = {sampler_pool.notify_fd, POLLIN, 0};
+    if (poll(&pfd, 1, (int)((remaining + 999999) / 1000000)) > 0) {
+      uint64_t events;
+      if (read(sampler_pool.notify_fd, &events, sizeof(events)) < 0) {
+        // Spurious wakeup; the queues are checked again either way
+      }
+    }
+  }
+  return answered;
+}
+
+// Stop the workers. Threads stuck inside the driver are detached rather than waited for, and
+// the pool is then leaked on purpose since they may still touch it.
+static void sampler_stop(void) {
+  int stuck = 0;
+
+  pthread_mutex_lock(&sampler_pool.lock);
+  sampler_pool.stop = 1;
+  pthread_cond_broadcast(&sampler_pool.tick_cond);
+  pthread_mutex_unlock(&sampler_pool.lock);
+
+  for (int i = 0; i < sampler_pool.count; i++) {
+    sampler_t* s = &sampler_pool.workers[i];
+    if (__atomic_load_n(&s->busy, __ATOMIC_ACQUIRE)) {
+      fprintf(stderr, "%d:Warning: Device not responding, abandoning its sampler\n", s->device_id);
+      pthread_detach(s->thread);
+      stuck = 1;
+      continue;
+    }
+    pthread_join(s->thread, NULL);
+    if (s->dropped) fprintf(stderr, "%d:Warning: %lu samples dropped\n", s->device_id, s->dropped);
+  }
+
+  if (!stuck) {
+    close(sampler_pool.notify_fd);
+    free(sampler_pool.workers);
+  }
+  sampler_pool.workers = NULL;
+  sampler_pool.count = 0;
+}
+
+// NVML event wakeups for fanctl and watch --events. A helper thread blocks in nvmlEventSetWait
+// and bumps an eventfd, so the control loop can sleep in poll() and still react immediately to
+// clock, P-state, power-source and Xid events.
+#define WATCHED_EVENTS                                                                             \
+  (nvmlEventTypeClock | nvmlEventTypePState | nvmlEventTypeXidCriticalError |                      \
+   nvmlEventTypePowerSourceChange)
+
+static struct {
+  nvmlEventSet_t set;
+  pthread_t thread;
+  int fd; // eventfd bumped on every event, -1 when events are unavailable
+  int stop;
+  unsigned long long last_type; // nvmlEventType* of the most recent event
+  nvmlDevice_t last_device;
+  int unwatched; // Devices left to plain polling: no event support, or the wait thread failed
+} event_watch = {NULL, 0, -1, 0, 0, NULL, 0};
+
+static const char* event_type_name(unsigned long long type) {
+  if (type & nvmlEventTypeXidCriticalError) return "xid";
+  if (type & nvmlEventTypePState) return "pstate";
+  if (type & nvmlEventTypeClock) return "clock";
+  if (type & nvmlEventTypePowerSourceChange) return "power_source";
+  return "other";
+}
+
+static void* event_watch_thread(void* arg) {
+  (void)arg;
+  while (!__atomic_load_n(&event_watch.stop, __ATOMIC_ACQUIRE)) {
+    nvmlEventData_t data;
+    nvmlReturn_t result = nvmlEventSetWait(event_watch.set, &data, EVENT_WAIT_TIMEOUT_MS);
+    if (result == NVML_ERROR_TIMEOUT) continue;
+    if (result != NVML_SUCCESS) { // Fall back to plain polling
+      __atomic_store_n(&event_watch.unwatched, MAX_DEVICES, __ATOMIC_RELAXED);
+      break;
+    }
+
+    __atomic_store_n(&event_watch.last_type, data.eventType, __ATOMIC_RELAXED);
+    __atomic_store_n(&event_watch.last_device, data.device, __ATOMIC_RELAXED);
+    uint64_t one = 1;
+    if (write(event_watch.fd, &one, sizeof(one)) < 0) {
+      // Counter saturation is harmless; one wakeup covers any number of events
+    }
+  }
+  return NULL;
+}
+
+// Register every device for the events it supports. Returns the eventfd to poll, or -1 when no
+// device supports events (the caller then just polls on its interval).
+static int event_watch_start(nvmlDevice_t* devices, const int* device_ids, int count) {
+  event_watch.unwatched = count;
+  if (nvmlEventSetCreate(&event_watch.set) != NVML_SUCCESS) return -1;
+
+  int registered = 0;
+  for (int i = 0; i < count; i++) {
+    unsigned long long supported = 0;
+    if (nvmlDeviceGetSupportedEventTypes(devices[i], &supported) != NVML_SUCCESS) continue;
+    supported &= WATCHED_EVENTS;
+    if (supported &&
+        nvmlDeviceRegisterEvents(devices[i], supported, event_watch.set) == NVML_SUCCESS)
+      registered++;
+    else
+      fprintf(stderr, "%d:Warning: No event support, polling only\n", device_ids[i]);
+  }
+
+  if (registered > 0) event_watch.fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (event_watch.fd >= 0 && spawn_thread(&event_watch.thread, event_watch_thread, NULL) != 0) {
+    close(event_watch.fd);
+    event_watch.fd = -1;
+  }
+  if (event_watch.fd < 0) {
+    nvmlEventSetFree(event_watch.set);
+    event_watch.set = NULL;
+  } else {
+    event_watch.unwatched = count - registered;
+  }
+  return event_watch.fd;
+}
+
+static void event_watch_stop(void) {
+  if (event_watch.fd < 0) return;
+  __atomic_store_n(&event_watch.stop, 1, __ATOMIC_RELEASE);
+  pthread_join(event_watch.thread, NULL); // Wakes within EVENT_WAIT_TIMEOUT_MS
+  nvmlEventSetFree(event_watch.set);
+  close(event_watch.fd);
+  event_watch.fd = -1;
+}
+
+// Device index of the most recent event's device within `devices`, or -1
+static int event_watch_last_device(nvmlDevice_t* devices, int count) {
+  nvmlDevice_t device = __atomic_load_n(&event_watch.last_device, __ATOMIC_RELAXED);
+  for (int i = 0; i < count; i++)
+    if (devices[i] == device) return i;
+  return -1;
+}
+
+// fanctl: poll faster while temperatures move and back off while they are flat. `delta` is the
+// largest temperature change of any device since the previous tick. Backing off past
+// FANCTL_INTERVAL_MS is only safe while events cover every device; a device left to polling
+// would otherwise go up to FANCTL_MAX_INTERVAL_MS without a look at its temperature.
+static long long adapt_fanctl_interval(long long interval_ns, unsigned int delta) {
+  long long max_ns = (event_watch.fd >= 0 &&
+                      __atomic_load_n(&event_watch.unwatched, __ATOMIC_RELAXED) == 0
+                          ? FANCTL_MAX_INTERVAL_MS
+                          : FANCTL_INTERVAL_MS) *
+                     1000000LL;
+  if (delta >= FANCTL_FAST_DELTA_C) return FANCTL_MIN_INTERVAL_MS * 1000000LL;
+  if (delta > 0) return interval_ns < max_ns ? interval_ns : max_ns;
+  interval_ns = interval_ns * 3 / 2;
+  return interval_ns > max_ns ? max_ns : interval_ns;
+}
+
+// energy: the driver's total energy counter, in mJ since it was loaded. It is 64 bits wide, so
+// a real wrap needs a counter close to 2^64; a smaller reading than before almost always means
+// the driver was reloaded and the counter restarted from 0.
+#define ENERGY_MARKER_MAGIC "nvml-tool-energy 1"
+
+// Energy used between two counter readings. Sets *reset when the counter restarted, in which
+// case only the energy since the restart is known.
+static unsigned long long energy_delta(unsigned long long from, unsigned long long to,
+                                       int* reset) {
+  *reset = 0;
+  if (to >= from) return to - from;
+  if (from > (1ULL << 63)) return to - from; // Wrapped; unsigned arithmetic is modulo 2^64
+  *reset = 1;
+  return to;
+}
+
+static long long realtime_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int read_energy(nvmlDevice_t device, int device_id, unsigned long long* energy) {
+  field_plan_t plan;
+  device_sample_t sample;
+  field_plan_init(&plan, SAMPLE_ENERGY);
+  sample_device(device, &plan, &sample);
+  if (!(sample.valid & SAMPLE_ENERGY)) {
+    unsigned long long unused;
+    fprintf(stderr, "%d:Error: Cannot read energy counter (%s)\n", device_id,
+            nvmlErrorString(nvmlDeviceGetTotalEnergyConsumption(device, &unused)));
+    return -1;
+  }
+  *energy = sample.energy;
+  return 0;
+}
+
+// `energy start FILE`: record the counters with a wall-clock timestamp. Markers are files so
+// that start and stop can be separate invocations (e.g. around a batch job).
+static int energy_start(const cli_args_t* args, nvmlDevice_t* devices, const int* device_ids,
+                        int count) {
+  FILE* f = fopen(args->marker, "w");
+  if (!f) {
+    fprintf(stderr, "Error: Cannot create %s: %s\n", args->marker, strerror(errno));
+    return 1;
+  }
+
+  int error_count = 0;
+  fprintf(f, "%s %lld\n", ENERGY_MARKER_MAGIC, realtime_ns());
+  for (int i = 0; i < count; i++) {
+    char uuid[MAX_UUID_LEN] = "Unknown";
+    unsigned long long energy;
+    if (read_energy(devices[i], device_ids[i], &energy) != 0) {
+      error_count++;
+      continue;
+    }
+    get_device_uuid(devices[i], device_ids[i], uuid, sizeof(uuid));
+    fprintf(f, "%d %s %llu\n", device_ids[i], uuid, energy);
+  }
+
+  if (fclose(f) != 0) {
+    fprintf(stderr, "Error: Cannot write %s: %s\n", args->marker, strerror(errno));
+    return 1;
+  }
+  return error_count;
+}
+
+// "<J>J in <s>s (<W>W avg)" for energy stop
+static void out_energy_used(out_t* out, unsigned long long mj, long long elapsed_ns) {
+  out_ufixed(out, mj, 3);
+  out_str(out, "J in ");
+  out_fixed(out, div_round(elapsed_ns, 100000000), 1);
+  out_str(out, "s (");
+  out_fixed(out, elapsed_ns > 0 ? (long long)(mj * 1e7 / elapsed_ns + 0.5) : 0, 1);
+  out_str(out, "W avg)\n");
+}
+
+// `energy stop FILE`: energy used by each device since the marker. Devices are matched by UUID,
+// so renumbering between start and stop doesn't mix them up. The marker is left in place, so
+// stop can be repeated for lap times.
+static int energy_stop(const cli_args_t* args, nvmlDevice_t* devices, const int* device_ids,
+                       int count) {
+  FILE* f = fopen(args->marker, "r");
+  if (!f) {
+    fprintf(stderr, "Error: Cannot open %s: %s\n", args->marker, strerror(errno));
+    return 1;
+  }
+
+  static struct {
+    char uuid[MAX_UUID_LEN];
+    unsigned long long energy;
+  } marks[MAX_DEVICES];
+  char line[256];
+  long long started_ns = 0;
+  int mark_count = 0;
+  if (!fgets(line, sizeof(line), f) ||
+      strncmp(line, ENERGY_MARKER_MAGIC " ", strlen(ENERGY_MARKER_MAGIC) + 1) != 0 ||
+      sscanf(line + strlen(ENERGY_MARKER_MAGIC), "%lld", &started_ns) != 1) {
+    fprintf(stderr, "Error: %s is not an energy marker\n", args->marker);
+    fclose(f);
+    return 1;
+  }
+  while (mark_count < MAX_DEVICES && fgets(line, sizeof(line), f)) {
+    int id;
+    if (sscanf(line, "%d %79s %llu", &id, marks[mark_count].uuid, &marks[mark_count].energy) == 3)
+      mark_count++;
+  }
+  fclose(f);
+
+  long long elapsed_ns = realtime_ns() - started_ns;
+  unsigned long long total_mj = 0;
+  int error_count = 0;
+  static out_t out;
+  out_init_fd(&out, STDOUT_FILENO);
+  for (int i = 0; i < count; i++) {
+    char uuid[MAX_UUID_LEN] = "Unknown";
+    unsigned long long energy;
+    if (read_energy(devices[i], device_ids[i], &energy) != 0) {
+      error_count++;
+      continue;
+    }
+    get_device_uuid(devices[i], device_ids[i], uuid, sizeof(uuid));
+
+    int m = 0;
+    while (m < mark_count && strcmp(marks[m].uuid, uuid) != 0) m++;
+    if (m == mark_count) {
+      fprintf(stderr, "%d:Error: Device %s not in %s\n", device_ids[i], uuid, args->marker);
+      error_count++;
+      continue;
+    }
+
+    int reset;
+    unsigned long long mj = energy_delta(marks[m].energy, energy, &reset);
+    if (reset)
+      fprintf(stderr, "%d:Warning: Energy counter restarted (driver reload?), counting from then\n",
+              device_ids[i]);
+    out_i64(&out, device_ids[i]);
+    out_char(&out, ':');
+    out_energy_used(&out, mj, elapsed_ns);
+    total_mj += mj;
+  }
+  if (count > 1) {
+    out_str(&out, "total:");
+    out_energy_used(&out, total_mj, elapsed_ns);
+  }
+  out_flush(&out);
+  return error_count;
+}
+
+static int run_energy(const cli_args_t* args, nvmlDevice_t* devices, const int* device_ids,
+                      int count) {
+  if (args->subcommand == SUBCMD_START) return energy_start(args, devices, device_ids, count);
+  if (args->subcommand == SUBCMD_STOP) return energy_stop(args, devices, device_ids, count);
+
+  int error_count = 0;
+  static out_t out;
+  out_init_fd(&out, STDOUT_FILENO);
+  for (int i = 0; i < count; i++) {
+    unsigned long long energy;
+    if (read_energy(devices[i], device_ids[i], &energy) != 0) {
+      error_count++;
+      continue;
+    }
+    out_i64(&out, device_ids[i]);
+    out_char(&out, ':');
+    out_ufixed(&out, energy, 3); // The raw counter can be close to 2^64
+    out_str(&out, "J\n");
+  }
+  out_flush(&out);
+  return error_count;
+}
+
+static void run_watch(nvmlDevice_t* devices, const int* device_ids, int count,
+                      const cli_args_t* args) {
+  tick_scheduler_t sched;
+  static char names[MAX_DEVICES][MAX_NAME_LEN];
+  static char uuids[MAX_DEVICES][MAX_UUID_LEN];
+  nvt_shm_header_t* ring = NULL;
+  static sampler_msg_t latest[MAX_DEVICES];
+  int fresh[MAX_DEVICES];
+  unsigned long long energy_prev[MAX_DEVICES]; // --energy: counter at the previous tick
+  int energy_primed[MAX_DEVICES] = {0};
+  unsigned long long energy_total = 0; // mJ
+  static throttle_account_t throttle[MAX_DEVICES]; // --throttle: time in each throttle state
+  static counter_rates_t rates[MAX_DEVICES];        // --io: NVLink counters at the previous tick
+  static out_t out;
+  out_init_fd(&out, STDOUT_FILENO);
+
+  signal(SIGINT, signal_handler);
+  signal(SIGTERM, signal_handler);
+
+  unsigned int metrics = STATUS_METRICS;
+  if (args->shm_name) {
+    ring = shm_ring_create(args->shm_name);
+    if (!ring) return;
+    metrics = SAMPLE_ALL; // Publish the full info record
+    for (int i = 0; i < count; i++) {
+      strcpy(names[i], "Unknown");
+      strcpy(uuids[i], "Unknown");
+      get_device_name(devices[i], device_ids[i], names[i], sizeof(names[i]));
+      get_device_uuid(devices[i], device_ids[i], uuids[i], sizeof(uuids[i]));
+    }
+  }
+  if (args->energy) metrics |= SAMPLE_ENERGY;
+  if (args->throttle) metrics |= SAMPLE_CLOCKS | SAMPLE_THROTTLE;
+  if (args->io) metrics |= SAMPLE_UTILIZATION | SAMPLE_PCIE | SAMPLE_NVLINK;
+
+  // Plans live in the workers and persist across ticks, so unsupported fields are probed once
+  if (sampler_start(devices, device_ids, count, metrics, NULL) != 0) {
+    sampler_stop();
+    return;
+  }
+
+  int event_fd = args->events ? event_watch_start(devices, device_ids, count) : -1;
+  int woke;
+  tick_scheduler_init(&sched, args->interval_ms);
+  while ((woke = event_fd >= 0 ? tick_scheduler_wait_fd(&sched, event_fd)
+                               : tick_scheduler_wait(&sched)) != 0) {
+    // Wait for the slowest device, but never past the next deadline
+    sampler_request_tick(sched.ticks);
+    sampler_collect(sched.ticks, sched.next_ns, latest, fresh);
+
+    out_str(&out, "tick:");
+    out_u64(&out, sched.ticks);
+    out_str(&out, sched.drift_ns < 0 ? ",drift:" : ",drift:+");
+    out_fixed(&out, div_round(sched.drift_ns, 1000), 3);
+    out_str(&out, "ms,overruns:");
+    out_u64(&out, sched.overruns);
+    if (woke == 2) {
+      int d = event_watch_last_device(devices, count);
+      out_str(&out, ",event:");
+      out_str(&out, event_type_name(event_watch.last_type));
+      out_str(&out, ",device:");
+      out_i64(&out, d >= 0 ? device_ids[d] : -1);
+    }
+    out_char(&out, '\n');
+    for (int i = 0; i < count; i++) {
+      if (!fresh[i]) {
+        fprintf(stderr, "%d:Error: No sample this tick (device not responding)\n", device_ids[i]);
+        continue;
+      }
+      const device_sample_t* sample = &latest[i].sample;
+      print_status_fields(&out, sample, device_ids[i], args->temp_unit);
+      if (args->energy && (sample->valid & SAMPLE_ENERGY)) {
+        // Joules since the previous tick, nothing on the first one
+        if (energy_primed[i]) {
+          int reset;
+          unsigned long long mj = energy_delta(energy_prev[i], sample->energy, &reset);
+          out_char(&out, ',');
+          out_fixed(&out, mj, 3);
+          out_char(&out, 'J');
+          energy_total += mj;
+        }
+        energy_prev[i] = sample->energy;
+        energy_primed[i] = 1;
+      }
+      if (args->throttle && (sample->valid & SAMPLE_CLOCKS)) {
+        out_char(&out, ',');
+        out_pstate(&out, sample->pstate);
+        out_char(&out, ',');
+        out_u64(&out, sample->sm_clock);
+        out_char(&out, '/');
+        if (sample->valid & SAMPLE_MEM_CLOCK)
+          out_u64(&out, sample->mem_clock);
+        else
+          out_char(&out, '?');
+        out_str(&out, "MHz");
+      }
+      if (args->throttle && (sample->valid & SAMPLE_THROTTLE)) {
+        out_char(&out, ',');
+        out_throttle_reasons(&out, sample->throttle_reasons, "+");
+        throttle_account(&throttle[i], sample->throttle_reasons, latest[i].sampled_ns);
+      }
+      if (args->io) out_utilization(&out, sample);
+      if (args->io && (sample->valid & SAMPLE_PCIE)) {
+        out_str(&out, ",pcie:");
+        out_fixed(&out, kib_to_mb_tenths(sample->pcie_tx), 1);
+        out_char(&out, '/');
+        out_fixed(&out, kib_to_mb_tenths(sample->pcie_rx), 1);
+        out_str(&out, "MB/s");
+      }
+      double tx, rx; // NVLink KiB/s, nothing on the first tick
+      if (args->io && (sample->valid & SAMPLE_NVLINK) &&
+          nvlink_rates(&rates[i], sample, latest[i].sampled_ns, &tx, &rx)) {
+        out_str(&out, ",nvlink:");
+        out_fixed(&out, (long long)(tx * 1024 / 100000 + 0.5), 1);
+        out_char(&out, '/');
+        out_fixed(&out, (long long)(rx * 1024 / 100000 + 0.5), 1);
+        out_str(&out, "MB/s");
+      }
+      out_char(&out, '\n');
+
+      if (ring) {
+        nvt_shm_record_t record;
+        sample_to_shm_record(sample, device_ids[i], sched.ticks, names[i], uuids[i], &record);
+        shm_ring_publish(ring, &record);
+      }
+    }
+    if (out_flush(&out) != 0) break; // Reader went away
+
+    if (args->count && sched.ticks >= args->count) break;
+  }
+
+  event_watch_stop();
+  sampler_stop();
+
+  fprintf(stderr, "watch: %lu ticks, %lu overruns", sched.ticks, sched.overruns);
+  if (args->energy) fprintf(stderr, ", %.3fJ", energy_total / 1000.0);
+  fprintf(stderr, "\n");
+
+  // Time in each throttle state, also as seconds per hour so runs of any length compare
+  for (int i = 0; args->throttle && i < count; i++) {
+    const throttle_account_t* acc = &throttle[i];
+    if (acc->observed <= 0) continue;
+    fprintf(stderr, "%d:throttle over %.1fs:", device_ids[i], acc->observed);
+    int any = 0;
+    for (size_t r = 0; r < THROTTLE_REASONS; r++) {
+      if (!acc->entered[r]) continue;
+      fprintf(stderr, " %s %.1fs (%.0fs/h, %lux)", throttle_reasons[r].name, acc->seconds[r],
+              acc->seconds[r] * 3600 / acc->observed, acc->entered[r]);
+      any = 1;
+    }
+    fprintf(stderr, any ? "\n" : " none\n");
+  }
+}
+
+// stats: streaming per-device summaries over a sliding window in fixed memory. The window is
+// split into STATS_SLICES slices, each with its own histogram; the oldest slice is cleared as
+// time moves on, and a report merges the live ones. So the window slides in steps of
+// window / STATS_SLICES and memory doesn't depend on the sample rate.
+//
+// Histograms are log-linear (as in HdrHistogram): exact below 2^sub_bits, then
+// 2^(sub_bits - 1) buckets per power of two, so a reported percentile (the bucket midpoint) is
+// within 2^-sub_bits of the true value. min, max and mean are exact. Temperature and fan speed
+// are small integers and always exact; power is in mW and gets 512 buckets per power of two,
+// about 0.25 W wide at 150 W.
+#define STATS_SLICES 10
+#define HIST_BUCKETS(sub_bits, max_bits) (((max_bits) - (sub_bits) + 2) << ((sub_bits) - 1))
+#define HIST_MAX_BUCKETS HIST_BUCKETS(10, 21)
+
+typedef struct {
+  uint32_t* counts; // HIST_BUCKETS(sub_bits, max_bits) entries
+  uint64_t count, sum;
+  uint32_t min, max;
+  int sub_bits, max_bits; // Values from 2^max_bits up are clamped
+} histogram_t;
+
+// Temperatures are kept in C and converted to --temp-unit when reported
+static const struct {
+  unsigned int metric;
+  const char* name;
+  double scale; // Raw value to the reported unit
+  int sub_bits, max_bits;
+} stats_metrics[] = {{SAMPLE_TEMP, "temperature", 1, 7, 9},
+                     {SAMPLE_POWER, "power_w", 1e-3, 10, 21}, // Up to 2.1 kW
+                     {SAMPLE_FAN, "fan_percent", 1, 7, 8}};
+
+#define STATS_METRICS (sizeof(stats_metrics) / sizeof(stats_metrics[0]))
+
+typedef struct {
+  histogram_t slices[STATS_METRICS][STATS_SLICES];
+} device_stats_t;
+
+static volatile int report_requested = 0;
+
+static void report_signal_handler(int signum) {
+  (void)signum;
+  report_requested = 1;
+}
+
+static int hist_index(const histogram_t* h, uint32_t v) {
+  int half = 1 << (h->sub_bits - 1);
+  if (v >= 1u << h->max_bits) v = (1u << h->max_bits) - 1;
+  if (v < 1u << h->sub_bits) return (int)v;
+  int shift = 31 - __builtin_clz(v) - h->sub_bits + 1;
+  return shift * half + (int)(v >> shift);
+}
+
+// Midpoint of the values that land in a bucket
+static double hist_value(const histogram_t* h, int index) {
+  int half = 1 << (h->sub_bits - 1);
+  if (index < 1 << h->sub_bits) return index;
+  int shift = index / half - 1;
+  uint32_t low = (uint32_t)(index - shift * half) << shift;
+  return low + ((1u << shift) - 1) / 2.0;
+}
+
+static void hist_clear(histogram_t* h) {
+  memset(h->counts, 0, HIST_BUCKETS(h->sub_bits, h->max_bits) * sizeof(uint32_t));
+  h->count = h->sum = 0;
+  h->min = h->max = 0;
+}
+
+static void hist_add(histogram_t* h, uint32_t v) {
+  h->counts[hist_index(h, v)]++;
+  if (h->count == 0 || v < h->min) h->min = v;
+  if (h->count == 0 || v > h->max) h->max = v;
+  h->count++;
+  h->sum += v;
+}
+
+static void hist_merge(histogram_t* dst, const histogram_t* src) {
+  if (src->count == 0) return;
+  for (int i = 0; i < HIST_BUCKETS(src->sub_bits, src->max_bits); i++)
+    dst->counts[i] += src->counts[i];
+  if (dst->count == 0 || src->min < dst->min) dst->min = src->min;
+  if (dst->count == 0 || src->max > dst->max) dst->max = src->max;
+  dst->count += src->count;
+  dst->sum += src->sum;
+}
+
+static double hist_percentile(const histogram_t* h, double p) {
+  uint64_t rank = (uint64_t)(p * h->count + 0.999999);
+  if (rank == 0) rank = 1;
+  uint64_t seen = 0;
+  for (int i = 0; i < HIST_BUCKETS(h->sub_bits, h->max_bits); i++) {
+    seen += h->counts[i];
+    if (seen >= rank) {
+      double v = hist_value(h, i);
+      return v < h->min ? h->min : v > h->max ? h->max : v;
+    }
+  }
+  return h->max;
+}
+
+// Parse "500ms", "30s", "5m", "1h" (a bare number is seconds). Returns 0 on success.
+static int parse_duration_ms(const char* str, unsigned long long* ms) {
+  char* end;
+  double value = strtod(str, &end);
+  double scale = 1000;
+  if (end == str || value <= 0) return -1;
+  if (strcmp(end, "ms") == 0)
+    scale = 1;
+  else if (strcmp(end, "m") == 0)
+    scale = 60000;
+  else if (strcmp(end, "h") == 0)
+    scale = 3600000;
+  else if (*end && strcmp(end, "s") != 0)
+    return -1;
+  *ms = (unsigned long long)(value * scale);
+  return *ms > 0 ? 0 : -1;
+}
+
+// The stats report stays on stdio: it goes out once per --every window rather than every tick,
+// and its table columns need printf's field widths.
+static void print_stats(const cli_args_t* args, device_stats_t* stats, const int* device_ids,
+                        char names[][MAX_NAME_LEN], int count) {
+  int json = args->subcommand == SUBCMD_JSON;
+  if (json) printf("{\"window_s\": %.3f, \"devices\": [", args->window_ms / 1e3);
+
+  for (int d = 0; d < count; d++) {
+    if (json)
+      printf("%s{\"device_id\": %d, \"name\": \"%s\"", d ? ", " : "", device_ids[d], names[d]);
+    else
+      printf("\n=== Device %d: %s (last %.0fs) ===\n%-14s %8s %9s %9s %9s %9s %9s %9s\n",
+             device_ids[d], names[d], args->window_ms / 1e3, "Metric", "samples", "min", "mean",
+             "p50", "p95", "p99", "max");
+
+    for (size_t m = 0; m < STATS_METRICS; m++) {
+      static uint32_t window_counts[HIST_MAX_BUCKETS];
+      histogram_t window = {window_counts, 0, 0, 0, 0, stats_metrics[m].sub_bits,
+                            stats_metrics[m].max_bits};
+      hist_clear(&window);
+      for (int s = 0; s < STATS_SLICES; s++) hist_merge(&window, &stats[d].slices[m][s]);
+
+      // Every statistic reported is affine in the raw value, so converting each one is the
+      // same as converting the samples. Temperatures go through temperature_tenths like every
+      // other output: offset = its value at 0 C, scale = its step per C.
+      char name[32];
+      double scale = stats_metrics[m].scale, offset = 0;
+      snprintf(name, sizeof(name), "%s", stats_metrics[m].name);
+      if (stats_metrics[m].metric == SAMPLE_TEMP) {
+        offset = temperature_tenths(0, args->temp_unit) / 10.0;
+        scale = (temperature_tenths(10, args->temp_unit) - temperature_tenths(0, args->temp_unit)) /
+                100.0;
+        snprintf(name, sizeof(name), "%s_%c", stats_metrics[m].name,
+                 args->temp_unit == 'F' ? 'f' : args->temp_unit == 'K' ? 'k' : 'c');
+      }
+
+      double stat[6];
+      if (window.count) {
+        stat[0] = window.min;
+        stat[1] = (double)window.sum / window.count;
+        stat[2] = hist_percentile(&window, 0.50);
+        stat[3] = hist_percentile(&window, 0.95);
+        stat[4] = hist_percentile(&window, 0.99);
+        stat[5] = window.max;
+        for (int i = 0; i < 6; i++) stat[i] = stat[i] * scale + offset;
+      }
+
+      if (json) {
+        printf(", \"%s\": {\"samples\": %llu", name, (unsigned long long)window.count);
+        if (window.count)
+          printf(", \"min\": %.3f, \"mean\": %.3f, \"p50\": %.3f, \"p95\": %.3f, \"p99\": %.3f, "
+                 "\"max\": %.3f",
+                 stat[0], stat[1], stat[2], stat[3], stat[4], stat[5]);
+        printf("}");
+      } else if (window.count) {
+        printf("%-14s %8llu %9.2f %9.2f %9.2f %9.2f %9.2f %9.2f\n", name,
+               (unsigned long long)window.count, stat[0], stat[1], stat[2], stat[3], stat[4],
+               stat[5]);
+      } else {
+        printf("%-14s %8d\n", name, 0);
+      }
+    }
+    if (json) printf("}");
+  }
+
+  if (json) printf("]}\n");
+  fflush(stdout);
+}
+
+// Sample on the --interval schedule and report the window every --every, on SIGUSR1 and on exit
+static int run_stats(const cli_args_t* args, nvmlDevice_t* devices, const int* device_ids,
+                     int count) {
+  tick_scheduler_t sched;
+  static char names[MAX_DEVICES][MAX_NAME_LEN];
+  static sampler_msg_t latest[MAX_DEVICES];
+  int fresh[MAX_DEVICES];
+
+  // All bucket arrays live in one allocation, carved up per device, metric and slice
+  size_t buckets_per_device = 0;
+  for (size_t m = 0; m < STATS_METRICS; m++)
+    buckets_per_device +=
+        STATS_SLICES * HIST_BUCKETS(stats_metrics[m].sub_bits, stats_metrics[m].max_bits);
+  device_stats_t* stats = calloc(count, sizeof(device_stats_t));
+  uint32_t* buckets = calloc(count * buckets_per_device, sizeof(uint32_t));
+  if (!stats || !buckets) {
+    fprintf(stderr, "Error: Cannot allocate statistics for %d devices\n", count);
+    free(stats);
+    free(buckets);
+    return 1;
+  }
+  uint32_t* next_buckets = buckets;
+  for (int d = 0; d < count; d++) {
+    for (size_t m = 0; m < STATS_METRICS; m++) {
+      for (int s = 0; s < STATS_SLICES; s++) {
+        histogram_t* h = &stats[d].slices[m][s];
+        h->counts = next_buckets;
+        h->sub_bits = stats_metrics[m].sub_bits;
+        h->max_bits = stats_metrics[m].max_bits;
+        next_buckets += HIST_BUCKETS(h->sub_bits, h->max_bits);
+      }
+    }
+  }
+  for (int i = 0; i < count; i++) {
+    strcpy(names[i], "Unknown");
+    get_device_name(devices[i], device_ids[i], names[i], sizeof(names[i]));
+  }
+
+  signal(SIGINT, signal_handler);
+  signal(SIGTERM, signal_handler);
+  signal(SIGUSR1, report_signal_handler);
+
+  int error_count = 0;
+  if (sampler_start(devices, device_ids, count, STATUS_METRICS, NULL) != 0) {
+    error_count++;
+    running = 0;
+  }
+
+  long long slice_ns = args->window_ms * 1000000LL / STATS_SLICES;
+  long long every_ns = (args->every_ms ? args->every_ms : args->window_ms) * 1000000LL;
+  long long start = now_ns();
+  long long next_report = start + every_ns;
+  long long slice = 0; // Slices elapsed since start; slice % STATS_SLICES is the live one
+  tick_scheduler_init(&sched, args->interval_ms);
+  while (running && tick_scheduler_wait(&sched)) {
+    sampler_request_tick(sched.ticks);
+    sampler_collect(sched.ticks, sched.next_ns, latest, fresh);
+
+    // Clear the slices that fell out of the window since the last sample
+    long long now = now_ns();
+    long long now_slice = (now - start) / slice_ns;
+    for (long long s = slice + 1; s <= now_slice && s <= slice + STATS_SLICES; s++)
+      for (int d = 0; d < count; d++)
+        for (size_t m = 0; m < STATS_METRICS; m++)
+          hist_clear(&stats[d].slices[m][s % STATS_SLICES]);
+    slice = now_slice;
+
+    for (int d = 0; d < count; d++) {
+      if (!fresh[d]) continue;
+      const device_sample_t* sample = &latest[d].sample;
+      for (size_t m = 0; m < STATS_METRICS; m++) {
+        if (!(sample->valid & stats_metrics[m].metric)) continue;
+        uint32_t v = stats_metrics[m].metric == SAMPLE_TEMP    ? sample->temperature
+                     : stats_metrics[m].metric == SAMPLE_POWER ? sample->power_usage
+                                                               : sample->fan_speed;
+        hist_add(&stats[d].slices[m][slice % STATS_SLICES], v);
+      }
+    }
+
+    if (report_requested || now >= next_report) {
+      report_requested = 0;
+      print_stats(args, stats, device_ids, names, count);
+      while (next_report <= now) next_report += every_ns;
+    }
+    if (args->count && sched.ticks >= args->count) break;
+  }
+
+  sampler_stop();
+  if (sched.ticks > 0) print_stats(args, stats, device_ids, names, count);
+  free(buckets);
+  free(stats);
+  return error_count;
+}
+
+// Sample the selected devices on the --interval schedule into a recording (see REC_MAGIC)
+static int run_record(const cli_args_t* args, nvmlDevice_t* devices, const int* device_ids,
+                      int count) {
+  tick_scheduler_t sched;
+  static char names[MAX_DEVICES][MAX_NAME_LEN];
+  static char uuids[MAX_DEVICES][MAX_UUID_LEN];
+  static sampler_msg_t latest[MAX_DEVICES];
+  static device_sample_t samples[MAX_DEVICES];
+  int fresh[MAX_DEVICES];
+  rec_writer_t writer;
+
+  for (int i = 0; i < count; i++) {
+    strcpy(names[i], "Unknown");
+    strcpy(uuids[i], "Unknown");
+    get_device_name(devices[i], device_ids[i], names[i], sizeof(names[i]));
+    get_device_uuid(devices[i], device_ids[i], uuids[i], sizeof(uuids[i]));
+  }
+  if (rec_writer_open(&writer, args->output, args->encoding, device_ids, names, uuids, count,
+                      args->interval_ms) != 0)
+    return 1;
+
+  signal(SIGINT, signal_handler);
+  signal(SIGTERM, signal_handler);
+
+  int error_count = 0;
+  unsigned long missed = 0;
+  if (sampler_start(devices, device_ids, count, SAMPLE_ALL, NULL) != 0) {
+    error_count++;
+    running = 0;
+  }
+
+  tick_scheduler_init(&sched, args->interval_ms);
+  while (running && tick_scheduler_wait(&sched)) {
+    sampler_request_tick(sched.ticks);
+    sampler_collect(sched.ticks, sched.next_ns, latest, fresh);
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    for (int i = 0; i < count; i++) {
+      if (fresh[i]) {
+        samples[i] = latest[i].sample;
+      } else {
+        memset(&samples[i], 0, sizeof(samples[i]));
+        missed++;
+      }
+    }
+
+    if (rec_writer_append(&writer, ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000, samples) != 0) {
+      fprintf(stderr, "Error: Cannot write recording '%s' (%s)\n", args->output, strerror(errno));
+      error_count++;
+      break;
+    }
+    if (args->count && sched.ticks >= args->count) break;
+  }
+
+  sampler_stop();
+  if (rec_writer_close(&writer) != 0 && error_count == 0) {
+    fprintf(stderr, "Error: Cannot write recording '%s' (%s)\n", args->output, strerror(errno));
+    error_count++;
+  }
+
+  unsigned long samples_written = sched.ticks * (unsigned long)count;
+  fprintf(stderr, "record: %lu ticks, %lu missed samples, %llu bytes (%.1f bytes per sample)\n",
+          sched.ticks, missed, writer.bytes,
+          samples_written ? (double)writer.bytes / samples_written : 0.0);
+  return error_count;
+}
+
+// powerctl: share a node-wide power budget between the selected GPUs. Every tick each device is
+// offered its minimum limit, then the rest of the budget goes to what the devices ask for: the
+// draw plus some headroom, or the maximum limit for a device that is pinned at its current
+// limit (it is being power-capped). A device held below what it asked for by a tight budget
+// also draws up to its limit, so it keeps its previous ask rather than being taken for capped,
+// which would swing its limit between the maximum and its draw every other tick. Whatever is
+// still left is shared by utilization, so idle devices keep room to ramp up. Limits are written
+// only when they move by more than the deadband, lowered before anything is raised so the sum
+// never exceeds the budget, and put back to their starting values on exit.
+#define POWERCTL_CAPPED_PCT 95   // Draw at this share of the limit counts as power-capped
+#define POWERCTL_HEADROOM_PCT 15 // Asked for on top of the draw of a device that isn't capped
+
+typedef struct {
+  unsigned int min_mw, max_mw; // Limit constraints
+  unsigned int limit_mw;       // Limit currently applied
+  unsigned int original_mw;    // Limit at startup, restored on exit
+  unsigned int target_mw;      // Allocation from the latest tick
+  unsigned int want_mw;        // What it asked for in the latest tick
+} powerctl_device_t;
+
+// Hand out `spare` in proportion to weight[i], never lifting alloc[i] above ceiling[i]. Devices
+// that reach their ceiling drop out and the remainder is shared again. Returns what is left.
+static double water_fill(double* alloc, const double* ceiling, const double* weight, int count,
+                         double spare) {
+  while (spare >= 1) {
+    double total = 0, placed = 0;
+    for (int i = 0; i < count; i++)
+      if (alloc[i] < ceiling[i] && weight[i] > 0) total += weight[i];
+    if (total <= 0) break;
+
+    for (int i = 0; i < count; i++) {
+      if (alloc[i] >= ceiling[i] || weight[i] <= 0) continue;
+      double give = spare * weight[i] / total;
+      if (give > ceiling[i] - alloc[i]) give = ceiling[i] - alloc[i];
+      alloc[i] += give;
+      placed += give;
+    }
+    spare -= placed;
+  }
+  return spare;
+}
+
+// Set target_mw of every device from the latest samples; devices without a fresh sample keep
+// their current limit. Targets are whole watts and add up to at most budget_mw.
+static void powerctl_allocate(powerctl_device_t* devs, const sampler_msg_t* latest,
+                              const int* fresh, int count, unsigned int budget_mw,
+                              unsigned int deadband_mw) {
+  double alloc[MAX_DEVICES], want[MAX_DEVICES], ceiling[MAX_DEVICES], weight[MAX_DEVICES];
+  int fixed[MAX_DEVICES];
+  double spare = budget_mw;
+
+  for (int i = 0; i < count; i++) {
+    const device_sample_t* s = &latest[i].sample;
+    fixed[i] = !fresh[i] || !(s->valid & SAMPLE_POWER);
+    if (fixed[i]) {
+      alloc[i] = want[i] = ceiling[i] = devs[i].limit_mw;
+      weight[i] = 0;
+    } else {
+      double draw = s->power_usage;
+      if (draw * 100 < (double)devs[i].limit_mw * POWERCTL_CAPPED_PCT)
+        want[i] = draw * (100 + POWERCTL_HEADROOM_PCT) / 100 + deadband_mw;
+      else if (devs[i].limit_mw >= devs[i].want_mw)
+        want[i] = devs[i].max_mw; // Got all it asked for and still pinned
+      else
+        want[i] = devs[i].want_mw;
+      if (want[i] < devs[i].min_mw) want[i] = devs[i].min_mw;
+      if (want[i] > devs[i].max_mw) want[i] = devs[i].max_mw;
+      devs[i].want_mw = (unsigned int)want[i];
+      alloc[i] = devs[i].min_mw;
+      ceiling[i] = devs[i].max_mw;
+      weight[i] = want[i] - alloc[i];
+    }
+    spare -= alloc[i];
+  }
+
+  if (spare > 0) {
+    spare = water_fill(alloc, want, weight, count, spare);
+    for (int i = 0; i < count; i++) {
+      const device_sample_t* s = &latest[i].sample;
+      if (!fixed[i]) weight[i] = 1 + ((s->valid & SAMPLE_UTILIZATION) ? s->utilization.gpu : 0);
+    }
+    water_fill(alloc, ceiling, weight, count, spare);
+  }
+
+  for (int i = 0; i < count; i++) {
+    unsigned int target = (unsigned int)alloc[i] / 1000 * 1000;
+    if (target < devs[i].min_mw) target = devs[i].min_mw;
+    devs[i].target_mw = fixed[i] ? devs[i].limit_mw : target;
+  }
+}
+
+static int powerctl_write(out_t* out, powerctl_device_t* d, nvmlDevice_t device, int device_id,
+                          const device_sample_t* sample) {
+  nvmlReturn_t result = nvmlDeviceSetPowerManagementLimit(device, d->target_mw);
+  if (result != NVML_SUCCESS) {
+    fprintf(stderr, "%d:Error: Failed to set power limit (%s)\n", device_id,
+            nvmlErrorString(result));
+    if (result == NVML_ERROR_NO_PERMISSION) running = 0; // Every later write would fail too
+    return -1;
+  }
+  out_i64(out, device_id);
+  out_str(out, ":Power limit ");
+  out_i64(out, div_round(d->limit_mw, 1000));
+  out_str(out, "W -> ");
+  out_i64(out, div_round(d->target_mw, 1000));
+  out_str(out, "W (");
+  out_fixed(out, div_round(sample->power_usage, 100), 1);
+  out_str(out, "W drawn");
+  if (sample->valid & SAMPLE_UTILIZATION) {
+    out_str(out, ", ");
+    out_u64(out, sample->utilization.gpu);
+    out_str(out, "% busy");
+  }
+  out_str(out, ")\n");
+  d->limit_mw = d->target_mw;
+  return 0;
+}
+
+static int run_powerctl(const cli_args_t* args, nvmlDevice_t* devices, const int* device_ids,
+                        int count) {
+  static powerctl_device_t devs[MAX_DEVICES];
+  static sampler_msg_t latest[MAX_DEVICES];
+  int fresh[MAX_DEVICES];
+  unsigned int budget_mw = args->budget_w * 1000;
+  unsigned int deadband_mw = args->deadband_w * 1000;
+  unsigned long long min_sum = 0, max_sum = 0;
+
+  for (int i = 0; i < count; i++) {
+    powerctl_device_t* d = &devs[i];
+    nvmlReturn_t result =
+        get_power_constraints(devices[i], device_ids[i], &d->min_mw, &d->max_mw);
+    if (result == NVML_SUCCESS)
+      result = nvmlDeviceGetPowerManagementLimit(devices[i], &d->limit_mw);
+    if (result != NVML_SUCCESS) {
+      fprintf(stderr, "%d:Error: Cannot read power limits (%s)\n", device_ids[i],
+              nvmlErrorString(result));
+      return 1;
+    }
+    d->original_mw = d->target_mw = d->limit_mw;
+    d->want_mw = 0;
+    min_sum += d->min_mw;
+    max_sum += d->max_mw;
+  }
+
+  if (budget_mw < min_sum) {
+    fprintf(stderr, "Error: Budget %uW is below the sum of the minimum limits (%.0fW)\n",
+            args->budget_w, min_sum / 1000.0);
+    return 1;
+  }
+  if (budget_mw >= max_sum)
+    fprintf(stderr, "Warning: Budget %uW covers every maximum limit (%.0fW), nothing to share\n",
+            args->budget_w, max_sum / 1000.0);
+
+  signal(SIGINT, signal_handler);
+  signal(SIGTERM, signal_handler);
+
+  static out_t out;
+  out_init_fd(&out, STDOUT_FILENO);
+  out_str(&out, "Sharing ");
+  out_u64(&out, args->budget_w);
+  out_str(&out, "W between ");
+  out_i64(&out, count);
+  out_str(&out, " device(s), deadband ");
+  out_u64(&out, args->deadband_w);
+  out_str(&out, "W (Ctrl-C to exit)\n");
+  out_flush(&out);
+
+  int error_count = 0;
+  unsigned long writes = 0, suppressed = 0;
+  unsigned int metrics = SAMPLE_POWER | SAMPLE_POWER_LIMIT | SAMPLE_UTILIZATION;
+  if (sampler_start(devices, device_ids, count, metrics, NULL) != 0) {
+    error_count++;
+    running = 0;
+  }
+
+  tick_scheduler_t sched;
+  tick_scheduler_init(&sched, args->interval_ms);
+  while (running && tick_scheduler_wait(&sched)) {
+    sampler_request_tick(sched.ticks);
+    sampler_collect(sched.ticks, sched.next_ns, latest, fresh);
+
+    // Pick up limits changed behind our back, e.g. by a driver reload or another tool
+    for (int i = 0; i < count; i++)
+      if (fresh[i] && (latest[i].sample.valid & SAMPLE_POWER_LIMIT))
+        devs[i].limit_mw = latest[i].sample.power_limit;
+    powerctl_allocate(devs, latest, fresh, count, budget_mw, deadband_mw);
+
+    // Decide what to write. Moves within the deadband are skipped, unless skipping a decrease
+    // would leave the applied limits above the budget.
+    int apply[MAX_DEVICES];
+    unsigned long long limit_sum = 0;
+    for (int i = 0; i < count; i++) {
+      unsigned int diff = devs[i].target_mw > devs[i].limit_mw
+                              ? devs[i].target_mw - devs[i].limit_mw
+                              : devs[i].limit_mw - devs[i].target_mw;
+      apply[i] = diff > deadband_mw;
+      if (diff && !apply[i]) suppressed++;
+      limit_sum += apply[i] ? devs[i].target_mw : devs[i].limit_mw;
+    }
+    for (int i = 0; i < count && limit_sum > budget_mw; i++) {
+      if (apply[i] || devs[i].target_mw >= devs[i].limit_mw) continue;
+      apply[i] = 1;
+      suppressed--;
+      limit_sum -= devs[i].limit_mw - devs[i].target_mw;
+    }
+
+    // Decreases first; if one fails, raising others could overshoot, so wait for the next tick
+    int failed = 0;
+    for (int pass = 0; pass < 2 && !failed; pass++) {
+      for (int i = 0; i < count; i++) {
+        int raise = devs[i].target_mw > devs[i].limit_mw;
+        if (!apply[i] || raise != pass) continue;
+        if (powerctl_write(&out, &devs[i], devices[i], device_ids[i], &latest[i].sample) != 0) {
+          error_count++;
+          failed = 1;
+        }
+        writes++;
+      }
+    }
+    out_flush(&out);
+
+    if (args->count && sched.ticks >= args->count) break;
+  }
+
+  sampler_stop();
+  for (int i = 0; i < count; i++) {
+    if (devs[i].limit_mw == devs[i].original_mw) continue;
+    nvmlReturn_t result = nvmlDeviceSetPowerManagementLimit(devices[i], devs[i].original_mw);
+    if (result == NVML_SUCCESS) {
+      out_i64(&out, device_ids[i]);
+      out_str(&out, ":Power limit restored to ");
+      out_i64(&out, div_round(devs[i].original_mw, 1000));
+      out_str(&out, "W\n");
+    } else {
+      fprintf(stderr, "%d:Error: Cannot restore power limit %.0fW (%s)\n", device_ids[i],
+              devs[i].original_mw / 1000.0, nvmlErrorString(result));
+      error_count++;
+    }
+  }
+  out_flush(&out);
+  fprintf(stderr, "powerctl: %lu ticks, %lu limit writes, %lu suppressed by the deadband\n",
+          sched.ticks, writes, suppressed);
+  return error_count;
+}
+
+// samples: drain the driver's own sample buffers instead of polling. The driver records power,
+// utilization and clocks several times a second and keeps a few seconds of each, so one
+// nvmlDeviceGetSamples call per metric per tick, with the newest timestamp already seen as the
+// cursor, returns everything recorded since the previous tick. Short power spikes that a
+// once-per-tick nvmlDeviceGetPowerUsage poll would miss come out at the same polling cost.
+static const struct {
+  nvmlSamplingType_t type;
+  const char* name;      // Human output
+  const char* json_name; // JSON output
+  const char* unit;
+  int decimals; // Raw value to the unit, as for out_fixed()
+} sample_metrics[] = {{NVML_TOTAL_POWER_SAMPLES, "power", "power_watts", "W", 3},
+                      {NVML_GPU_UTILIZATION_SAMPLES, "gpu_util", "gpu_utilization_percent", "%", 0},
+                      {NVML_MEMORY_UTILIZATION_SAMPLES, "mem_util", "memory_utilization_percent",
+                       "%", 0},
+                      {NVML_PROCESSOR_CLK_SAMPLES, "sm_clock", "sm_clock_mhz", "MHz", 0},
+                      {NVML_MEMORY_CLK_SAMPLES, "mem_clock", "memory_clock_mhz", "MHz", 0}};
+
+#define SAMPLE_METRICS (sizeof(sample_metrics) / sizeof(sample_metrics[0]))
+
+typedef struct {
+  nvmlSample_t* buf[SAMPLE_METRICS]; // NULL for metrics the device doesn't buffer
+  unsigned int capacity[SAMPLE_METRICS];
+  unsigned long long last_seen_us[SAMPLE_METRICS]; // Newest sample already consumed
+  unsigned int history_len[SAMPLE_METRICS];       // Samples the driver keeps, 0 if unknown
+  unsigned long long period_us[SAMPLE_METRICS];   // How often it takes them, 0 until learned
+  unsigned long gaps; // Polls that found samples missing since the previous one
+  unsigned long long lost_us;
+  unsigned long long interval_us;
+  int interval_checked; // Whether --interval was compared with the driver's history yet
+  unsigned long long power_peak_mw, power_peak_us, power_sum_mw;
+  unsigned long power_samples;
+} sample_buffers_t;
+
+// Size each buffer from the driver's history length; metrics it doesn't buffer are skipped
+static int sample_buffers_init(sample_buffers_t* b, nvmlDevice_t device, int device_id,
+                               unsigned long long start_us, unsigned long long interval_us) {
+  b->interval_us = interval_us;
+  for (size_t m = 0; m < SAMPLE_METRICS; m++) {
+    nvmlValueType_t value_type;
+    unsigned int count = 0;
+    nvmlReturn_t result = nvmlDeviceGetSamples(device, sample_metrics[m].type, 0, &value_type,
+                                               &count, NULL);
+    if (result == NVML_ERROR_NOT_SUPPORTED) {
+      fprintf(stderr, "%d:Warning: No %s samples on this device\n", device_id,
+              sample_metrics[m].name);
+      continue;
+    }
+    if (result != NVML_SUCCESS) {
+      fprintf(stderr, "%d:Error: Cannot read %s samples (%s)\n", device_id,
+              sample_metrics[m].name, nvmlErrorString(result));
+      return -1;
+    }
+    b->capacity[m] = count ? count : 64;
+    b->buf[m] = malloc(b->capacity[m] * sizeof(nvmlSample_t));
+    if (!b->buf[m]) {
+      fprintf(stderr, "%d:Error: Cannot allocate sample buffers\n", device_id);
+      return -1;
+    }
+    b->history_len[m] = count;
+    b->last_seen_us[m] = start_us;
+  }
+  return 0;
+}
+
+// Samples newer than the cursor: one call, unless the buffer has to grow
+static nvmlReturn_t get_buffered_samples(nvmlDevice_t device, sample_buffers_t* b, size_t m,
+                                         nvmlValueType_t* value_type, unsigned int* count) {
+  for (;;) {
+    *count = b->capacity[m];
+    nvmlReturn_t result = nvmlDeviceGetSamples(device, sample_metrics[m].type,
+                                               b->last_seen_us[m], value_type, count, b->buf[m]);
+    if (result == NVML_ERROR_NOT_FOUND) {
+      *count = 0; // Nothing recorded since the cursor
+      return NVML_SUCCESS;
+    }
+    if (result != NVML_ERROR_INSUFFICIENT_SIZE) return result;
+
+    unsigned int capacity = *count + *count / 4 + 8;
+    nvmlSample_t* grown = realloc(b->buf[m], capacity * sizeof(*grown));
+    if (!grown) return NVML_ERROR_MEMORY;
+    b->buf[m] = grown;
+    b->capacity[m] = capacity;
+  }
+}
+
+// Oldest and newest timestamps among the samples newer than `after`. Returns how many there are.
+static unsigned int sample_span(const nvmlSample_t* samples, unsigned int count,
+                                unsigned long long after, unsigned long long* oldest,
+                                unsigned long long* newest) {
+  unsigned int fresh = 0;
+  *oldest = *newest = 0;
+  for (unsigned int k = 0; k < count; k++) {
+    unsigned long long t = samples[k].timeStamp;
+    if (t <= after) continue;
+    if (!fresh || t < *oldest) *oldest = t;
+    if (!fresh || t > *newest) *newest = t;
+    fresh++;
+  }
+  return fresh;
+}
+
+// Drain every metric of one device into the frame. Returns the number of errors.
+static int samples_poll_device(out_t* out, int json, nvmlDevice_t device, int device_id,
+                               sample_buffers_t* b, int* first, unsigned long* total) {
+  int error_count = 0;
+  unsigned long long lost_us = 0, lost_from_us = 0; // Longest gap over the metrics
+  if (json) {
+    out_str(out, *first ? "{\"device_id\": " : ", {\"device_id\": ");
+    out_i64(out, device_id);
+    *first = 0;
+  }
+
+  for (size_t m = 0; m < SAMPLE_METRICS; m++) {
+    if (!b->buf[m]) continue;
+    nvmlValueType_t value_type;
+    unsigned int count;
+    nvmlReturn_t result = get_buffered_samples(device, b, m, &value_type, &count);
+    if (result != NVML_SUCCESS) {
+      fprintf(stderr, "%d:Error: Cannot read %s samples (%s)\n", device_id,
+              sample_metrics[m].name, nvmlErrorString(result));
+      error_count++;
+      continue;
+    }
+
+    if (json) {
+      out_str(out, ", \"");
+      out_str(out, sample_metrics[m].json_name);
+      out_str(out, "\": [");
+    }
+    unsigned long long oldest, newest, last = b->last_seen_us[m];
+    unsigned int fresh = sample_span(b->buf[m], count, last, &oldest, &newest);
+    if (!b->period_us[m] && fresh >= 2) {
+      // The driver's sampling period is learned from the first poll with enough samples, which
+      // also tells how much time its history covers
+      b->period_us[m] = (newest - oldest) / (fresh - 1);
+      unsigned long long history_us = b->history_len[m] * b->period_us[m];
+      if (!b->interval_checked && history_us && b->interval_us > history_us)
+        fprintf(stderr, "%d:Warning: --interval %.3fs is longer than the %.1fs of samples the "
+                        "driver keeps; samples between ticks will be lost\n",
+                device_id, b->interval_us / 1e6, history_us / 1e6);
+      if (history_us) b->interval_checked = 1;
+    }
+
+    // A poll whose oldest new sample is more than a sampling period past the cursor came too
+    // late: the driver's history wrapped and dropped what was in between
+    if (fresh && b->period_us[m] && oldest - last > 2 * b->period_us[m] &&
+        oldest - last - b->period_us[m] > lost_us) {
+      lost_us = oldest - last - b->period_us[m];
+      lost_from_us = last;
+    }
+
+    int shown = 0;
+    for (unsigned int k = 0; k < count; k++) {
+      const nvmlSample_t* s = &b->buf[m][k];
+      if (s->timeStamp <= b->last_seen_us[m]) continue; // Already reported
+      unsigned long long v = value_u64(value_type, &s->sampleValue);
+      if (json) {
+        out_str(out, shown ? ", [" : "[");
+        out_u64(out, s->timeStamp);
+        out_str(out, ", ");
+        out_fixed(out, v, sample_metrics[m].decimals);
+        out_char(out, ']');
+      } else {
+        out_i64(out, device_id);
+        out_char(out, ':');
+        out_str(out, sample_metrics[m].name);
+        out_char(out, ',');
+        out_fixed(out, s->timeStamp, 6);
+        out_char(out, ',');
+        out_fixed(out, v, sample_metrics[m].decimals);
+        out_str(out, sample_metrics[m].unit);
+        out_char(out, '\n');
+      }
+      if (sample_metrics[m].type == NVML_TOTAL_POWER_SAMPLES) {
+        if (v > b->power_peak_mw) {
+          b->power_peak_mw = v;
+          b->power_peak_us = s->timeStamp;
+        }
+        b->power_sum_mw += v;
+        b->power_samples++;
+      }
+      shown++;
+    }
+    // Cursor moves after the loop so samples sharing a timestamp all come out
+    if (fresh) b->last_seen_us[m] = newest;
+    if (json) out_char(out, ']');
+    *total += shown;
+  }
+
+  if (json) out_char(out, '}');
+  if (lost_us) {
+    if (!b->gaps)
+      fprintf(stderr, "%d:Warning: %.3fs of samples lost after %.6f, the driver's history "
+                      "overran between ticks (lower --interval)\n",
+              device_id, lost_us / 1e6, lost_from_us / 1e6);
+    b->gaps++;
+    b->lost_us += lost_us;
+  }
+  return error_count;
+}
+
+static int run_samples(const cli_args_t* args, nvmlDevice_t* devices, const int* device_ids,
+                       int count) {
+  tick_scheduler_t sched;
+  static out_t out;
+  sample_buffers_t* buffers = calloc(count, sizeof(sample_buffers_t));
+  if (!buffers) {
+    fprintf(stderr, "Error: Cannot allocate sample buffers for %d devices\n", count);
+    return 1;
+  }
+
+  // Like procs, the first tick covers the interval before it
+  unsigned long long start_us = realtime_ns() / 1000 - args->interval_ms * 1000ULL;
+  int error_count = 0;
+  for (int i = 0; i < count && error_count == 0; i++)
+    if (sample_buffers_init(&buffers[i], devices[i], device_ids[i], start_us,
+                            args->interval_ms * 1000ULL) != 0)
+      error_count++;
+
+  signal(SIGINT, signal_handler);
+  signal(SIGTERM, signal_handler);
+
+  unsigned long total = 0;
+  int json = args->subcommand == SUBCMD_JSON;
+  out_init_fd(&out, STDOUT_FILENO);
+  tick_scheduler_init(&sched, args->interval_ms);
+  // Read errors are counted and the next tick tries again, as in watch
+  int setup_failed = error_count != 0;
+  while (!setup_failed && tick_scheduler_wait(&sched)) {
+    int first = 1;
+    if (json) {
+      out_str(&out, "[");
+    } else {
+      out_str(&out, "tick:");
+      out_u64(&out, sched.ticks);
+      out_char(&out, '\n');
+    }
+    for (int i = 0; i < count; i++)
+      error_count += samples_poll_device(&out, json, devices[i], device_ids[i], &buffers[i],
+                                         &first, &total);
+    if (json) out_str(&out, "]\n");
+    if (out_flush(&out) != 0) break; // Reader went away
+
+    if (args->count && sched.ticks >= args->count) break;
+  }
+
+  fprintf(stderr, "samples: %lu ticks, %lu samples\n", sched.ticks, total);
+  for (int i = 0; i < count; i++) {
+    const sample_buffers_t* b = &buffers[i];
+    if (b->power_samples)
+      fprintf(stderr, "%d:power peak %.3fW at %.6f, mean %.3fW over %lu samples\n", device_ids[i],
+              b->power_peak_mw / 1000.0, b->power_peak_us / 1e6,
+              b->power_sum_mw / 1000.0 / b->power_samples, b->power_samples);
+    if (b->gaps)
+      fprintf(stderr, "%d:%lu gaps in the sample history, %.3fs of samples lost\n",
+              device_ids[i], b->gaps, b->lost_us / 1e6);
+    for (size_t m = 0; m < SAMPLE_METRICS; m++) free(b->buf[m]);
+  }
+  free(buffers);
+  return error_count;
+}
+
+// procs: per-process GPU memory and utilization, joined with /proc for the process name and
+// cgroup. NVML only knows PIDs, so each one needs a couple of /proc reads; those results are
+// cached per PID and only redone for PIDs that are new, or whose entry is older than
+// PROC_CACHE_TTL_MS (to notice cgroup moves and PID reuse). PIDs that leave the GPUs are
+// dropped after every poll, so polling a busy node once a second reads /proc only for the
+// processes that came and went.
+#define PROC_CACHE_SIZE 4096 // Processes tracked at once; more are shown without a name/cgroup
+#define PROC_HASH_BUCKETS 1024
+#define PROC_CACHE_TTL_MS 30000
+#define MAX_CGROUP_LEN 256
+#define CONTAINER_ID_LEN 12 // Short form, as docker ps prints it
+
+#ifndef NVML_VALUE_NOT_AVAILABLE
+#define NVML_VALUE_NOT_AVAILABLE (-1)
+#endif
+
+typedef struct {
+  unsigned int pid;
+  int next;              // Next entry in the hash chain or the free list, -1 at the end
+  unsigned long seen;    // Poll that last found the PID on a GPU
+  long long resolved_ns; // When the /proc fields below were read
+  char name[32];         // /proc/PID/comm, "?" if the PID isn't visible here
+  char cgroup[MAX_CGROUP_LEN];
+  char container[CONTAINER_ID_LEN + 1]; // From the cgroup path, "" if not in a container
+  unsigned long sm_sum, mem_sum, util_samples; // Utilization samples on the current device
+} proc_entry_t;
+
+static struct {
+  proc_entry_t entries[PROC_CACHE_SIZE];
+  int buckets[PROC_HASH_BUCKETS];
+  int free_list;
+  int initialized;
+  unsigned long lookups; // /proc resolutions, to show what the cache saves
+} proc_cache;
+
+static void proc_cache_init(void) {
+  for (int i = 0; i < PROC_HASH_BUCKETS; i++) proc_cache.buckets[i] = -1;
+  for (int i = 0; i < PROC_CACHE_SIZE; i++) proc_cache.entries[i].next = i + 1;
+  proc_cache.entries[PROC_CACHE_SIZE - 1].next = -1;
+  proc_cache.free_list = 0;
+  proc_cache.initialized = 1;
+}
+
+static proc_entry_t* proc_cache_find(unsigned int pid) {
+  for (int i = proc_cache.buckets[pid % PROC_HASH_BUCKETS]; i >= 0; i = proc_cache.entries[i].next)
+    if (proc_cache.entries[i].pid == pid) return &proc_cache.entries[i];
+  return NULL;
+}
+
+// Keep a /proc string printable and free of the separators used in the output
+static void sanitize_proc_string(char* s) {
+  for (; *s; s++)
+    if ((unsigned char)*s < 0x20 || *s == ',' || *s == '"' || *s == '\\') *s = '_';
+}
+
+// Read the first line of a /proc file, without its newline. Returns 0 on success.
+static int read_proc_line(const char* path, char* buf, size_t len) {
+  FILE* f = fopen(path, "r");
+  if (!f) return -1;
+  int ok = fgets(buf, len, f) != NULL;
+  fclose(f);
+  if (!ok) return -1;
+  buf[strcspn(buf, "\n")] = '\0';
+  return 0;
+}
+
+// The v1 memory controller's path on v1 and hybrid hosts, which is where container runtimes
+// account GPU jobs, else the unified (v2) path
+static int read_proc_cgroup(unsigned int pid, char* cgroup, size_t len) {
+  char path[64], line[MAX_CGROUP_LEN + 64];
+  snprintf(path, sizeof(path), "/proc/%u/cgroup", pid);
+  FILE* f = fopen(path, "r");
+  if (!f) return -1;
+
+  int best = 0; // 3: memory controller, 2: unified, 1: anything else
+  while (best < 3 && fgets(line, sizeof(line), f)) {
+    line[strcspn(line, "\n")] = '\0';
+    char* controllers = strchr(line, ':');
+    char* cgroup_path = controllers ? strchr(controllers + 1, ':') : NULL;
+    if (!cgroup_path) continue;
+    *cgroup_path++ = '\0';
+    controllers++;
+
+    int rank = strstr(controllers, "memory") ? 3 : strcmp(line, "0") == 0 && !*controllers ? 2 : 1;
+    if (rank > best) {
+      copy_string(cgroup, len, cgroup_path);
+      best = rank;
+    }
+  }
+  fclose(f);
+  return best ? 0 : -1;
+}
+
+// Container runtimes name the cgroup after the container ID: docker-<id>.scope,
+// cri-containerd-<id>.scope, crio-<id>.scope, /docker/<id>, ... so take the last run of 64 hex
+// digits in the path
+static void container_id(const char* cgroup, char* id, size_t len) {
+  id[0] = '\0';
+  size_t run = 0;
+  for (const char* p = cgroup;; p++) {
+    if (*p && isxdigit((unsigned char)*p) && !isupper((unsigned char)*p)) {
+      run++;
+      continue;
+    }
+    if (run == 64) {
+      size_t n = len - 1 < CONTAINER_ID_LEN ? len - 1 : CONTAINER_ID_LEN;
+      memcpy(id, p - run, n);
+      id[n] = '\0';
+    }
+    run = 0;
+    if (!*p) break;
+  }
+}
+
+static void proc_entry_resolve(proc_entry_t* e, long long now) {
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/%u/comm", e->pid);
+  if (read_proc_line(path, e->name, sizeof(e->name)) != 0) strcpy(e->name, "?");
+  if (read_proc_cgroup(e->pid, e->cgroup, sizeof(e->cgroup)) != 0) strcpy(e->cgroup, "?");
+  sanitize_proc_string(e->name);
+  sanitize_proc_string(e->cgroup);
+  container_id(e->cgroup, e->container, sizeof(e->container));
+  e->resolved_ns = now;
+  proc_cache.lookups++;
+}
+
+// Entry for a PID found on a GPU in poll `poll`, resolving it if it is new or stale. Returns
+// NULL when the cache is full.
+static proc_entry_t* proc_cache_get(unsigned int pid, unsigned long poll, long long now) {
+  if (!proc_cache.initialized) proc_cache_init();
+
+  proc_entry_t* e = proc_cache_find(pid);
+  if (!e) {
+    if (proc_cache.free_list < 0) return NULL;
+    int idx = proc_cache.free_list;
+    e = &proc_cache.entries[idx];
+    proc_cache.free_list = e->next;
+    memset(e, 0, sizeof(*e));
+    e->pid = pid;
+    e->next = proc_cache.buckets[pid % PROC_HASH_BUCKETS];
+    proc_cache.buckets[pid % PROC_HASH_BUCKETS] = idx;
+    proc_entry_resolve(e, now);
+  } else if (now - e->resolved_ns > PROC_CACHE_TTL_MS * 1000000LL) {
+    proc_entry_resolve(e, now);
+  }
+  e->seen = poll;
+  return e;
+}
+
+// Drop PIDs that were not on any GPU in poll `poll`
+static void proc_cache_sweep(unsigned long poll) {
+  if (!proc_cache.initialized) return;
+  for (int b = 0; b < PROC_HASH_BUCKETS; b++) {
+    int* link = &proc_cache.buckets[b];
+    while (*link >= 0) {
+      int idx = *link;
+      proc_entry_t* e = &proc_cache.entries[idx];
+      if (e->seen == poll) {
+        link = &e->next;
+        continue;
+      }
+      *link = e->next;
+      e->next = proc_cache.free_list;
+      proc_cache.free_list = idx;
+    }
+  }
+}
+
+// Per-device buffers for the two NVML lists, grown on NVML_ERROR_INSUFFICIENT_SIZE
+typedef struct {
+  nvmlProcessInfo_t* procs;
+  unsigned int proc_capacity;
+  nvmlProcessUtilizationSample_t* util;
+  unsigned int util_capacity;
+  unsigned long long last_seen_us; // Newest utilization sample already consumed
+} proc_buffers_t;
+
+static nvmlReturn_t get_running_processes(nvmlDevice_t device, proc_buffers_t* b,
+                                          unsigned int* count) {
+  for (;;) {
+    *count = b->proc_capacity;
+    nvmlReturn_t result = nvmlDeviceGetComputeRunningProcesses(device, count, b->procs);
+    if (result != NVML_ERROR_INSUFFICIENT_SIZE) return result;
+
+    unsigned int capacity = *count + *count / 4 + 8; // Room for processes starting meanwhile
+    nvmlProcessInfo_t* grown = realloc(b->procs, capacity * sizeof(*grown));
+    if (!grown) return NVML_ERROR_MEMORY;
+    b->procs = grown;
+    b->proc_capacity = capacity;
+  }
+}
+
+// Utilization samples newer than the cursor. The driver keeps a short history, so
+// averaging everything since the previous poll covers the whole interval.
+static nvmlReturn_t get_process_utilization(nvmlDevice_t device, proc_buffers_t* b,
+                                            unsigned int* count) {
+  for (;;) {
+    *count = b->util_capacity;
+    nvmlReturn_t result =
+        nvmlDeviceGetProcessUtilization(device, b->util, count, b->last_seen_us);
+    if (result == NVML_ERROR_NOT_FOUND) {
+      *count = 0; // Nothing ran since the cursor
+      return NVML_SUCCESS;
+    }
+    if (result != NVML_ERROR_INSUFFICIENT_SIZE) return result;
+
+    unsigned int capacity = *count + *count / 4 + 8;
+    nvmlProcessUtilizationSample_t* grown = realloc(b->util, capacity * sizeof(*grown));
+    if (!grown) return NVML_ERROR_MEMORY;
+    b->util = grown;
+    b->util_capacity = capacity;
+  }
+}
+
+// One poll of one device: resolve every process and print it
+static int procs_poll_device(const cli_args_t* args, out_t* out, nvmlDevice_t device,
+                             int device_id, proc_buffers_t* b, unsigned long poll, int* first) {
+  unsigned int proc_count, util_count;
+  nvmlReturn_t result = get_running_processes(device, b, &proc_count);
+  if (result != NVML_SUCCESS) {
+    fprintf(stderr, "%d:Error: Cannot list processes (%s)\n", device_id, nvmlErrorString(result));
+    return 1;
+  }
+  result = get_process_utilization(device, b, &util_count);
+  if (result != NVML_SUCCESS && result != NVML_ERROR_NOT_SUPPORTED) {
+    fprintf(stderr, "%d:Error: Cannot read process utilization (%s)\n", device_id,
+            nvmlErrorString(result));
+    return 1;
+  }
+  int have_util = result == NVML_SUCCESS;
+  if (!have_util) util_count = 0;
+
+  long long now = now_ns();
+  static proc_entry_t* entries[PROC_CACHE_SIZE];
+  unsigned int shown = proc_count < PROC_CACHE_SIZE ? proc_count : PROC_CACHE_SIZE;
+  for (unsigned int i = 0; i < shown; i++) {
+    entries[i] = proc_cache_get(b->procs[i].pid, poll, now);
+    if (entries[i]) entries[i]->sm_sum = entries[i]->mem_sum = entries[i]->util_samples = 0;
+  }
+  for (unsigned int i = 0; i < util_count; i++) {
+    proc_entry_t* e = proc_cache_find(b->util[i].pid);
+    if (e && e->seen == poll) {
+      e->sm_sum += b->util[i].smUtil;
+      e->mem_sum += b->util[i].memUtil;
+      e->util_samples++;
+    }
+    if (b->util[i].timeStamp > b->last_seen_us) b->last_seen_us = b->util[i].timeStamp;
+  }
+
+  int json = args->subcommand == SUBCMD_JSON;
+  for (unsigned int i = 0; i < shown; i++) {
+    const nvmlProcessInfo_t* p = &b->procs[i];
+    const proc_entry_t* e = entries[i];
+    unsigned long samples = e ? e->util_samples : 0;
+    // Processes without samples since the last poll were idle
+    unsigned int sm = samples ? e->sm_sum / samples : 0, mem = samples ? e->mem_sum / samples : 0;
+    int memory_known = p->usedGpuMemory != (unsigned long long)NVML_VALUE_NOT_AVAILABLE;
+
+    if (json) {
+      out_str(out, *first ? "{\"device_id\":" : ",{\"device_id\":");
+      out_i64(out, device_id);
+      out_str(out, ",\"pid\":");
+      out_u64(out, p->pid);
+      out_str(out, ",\"name\":\"");
+      out_str(out, e ? e->name : "?");
+      out_char(out, '"');
+      if (memory_known) {
+        out_str(out, ",\"used_memory_mb\":");
+        out_u64(out, p->usedGpuMemory / (1024 * 1024));
+      }
+      if (have_util) {
+        out_str(out, ",\"sm_util_percent\":");
+        out_u64(out, sm);
+        out_str(out, ",\"mem_util_percent\":");
+        out_u64(out, mem);
+      }
+      out_str(out, ",\"cgroup\":\"");
+      out_str(out, e ? e->cgroup : "?");
+      out_char(out, '"');
+      if (e && e->container[0]) {
+        out_str(out, ",\"container\":\"");
+        out_str(out, e->container);
+        out_char(out, '"');
+      }
+      out_char(out, '}');
+    } else {
+      out_i64(out, device_id);
+      out_char(out, ':');
+      out_u64(out, p->pid);
+      out_char(out, ',');
+      out_str(out, e ? e->name : "?");
+      out_char(out, ',');
+      if (memory_known) {
+        out_u64(out, p->usedGpuMemory / (1024 * 1024));
+        out_str(out, "MiB,");
+      } else {
+        out_str(out, "-,");
+      }
+      if (have_util) {
+        out_u64(out, sm);
+        out_str(out, "%,");
+        out_u64(out, mem);
+        out_str(out, "%,");
+      } else {
+        out_str(out, "-,-,");
+      }
+      out_str(out, e ? e->cgroup : "?");
+      if (e && e->container[0]) {
+        out_char(out, ',');
+        out_str(out, e->container);
+      }
+      out_char(out, '\n');
+    }
+    *first = 0;
+  }
+  if (proc_count > shown)
+    fprintf(stderr, "%d:Warning: %u processes not shown\n", device_id, proc_count - shown);
+  return 0;
+}
+
+static int run_procs(const cli_args_t* args, nvmlDevice_t* devices, const int* device_ids,
+                     int count) {
+  tick_scheduler_t sched;
+  proc_buffers_t* buffers = calloc(count, sizeof(proc_buffers_t));
+  if (!buffers) {
+    fprintf(stderr, "Error: Cannot allocate process buffers for %d devices\n", count);
+    return 1;
+  }
+
+  signal(SIGINT, signal_handler);
+  signal(SIGTERM, signal_handler);
+
+  // The first poll averages utilization over the interval before it, like every later one
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  unsigned long long start_us = ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+  for (int i = 0; i < count; i++) buffers[i].last_seen_us = start_us - args->interval_ms * 1000ULL;
+
+  int error_count = 0;
+  int json = args->subcommand == SUBCMD_JSON;
+  static out_t out;
+  out_init_fd(&out, STDOUT_FILENO);
+  tick_scheduler_init(&sched, args->interval_ms);
+  while (tick_scheduler_wait(&sched)) {
+    int first = 1;
+    if (args->count != 1 && !json) {
+      out_str(&out, "tick:");
+      out_u64(&out, sched.ticks);
+      out_char(&out, '\n');
+    }
+    if (json) out_char(&out, '[');
+    for (int i = 0; i < count; i++)
+      error_count += procs_poll_device(args, &out, devices[i], device_ids[i], &buffers[i],
+                                       sched.ticks, &first);
+    if (json) out_str(&out, "]\n");
+    proc_cache_sweep(sched.ticks);
+    if (out_flush(&out) != 0) break; // Reader went away
+
+    if (args->count && sched.ticks >= args->count) break;
+  }
+
+  if (args->count != 1)
+    fprintf(stderr, "procs: %lu polls, %lu /proc lookups\n", sched.ticks, proc_cache.lookups);
+  for (int i = 0; i < count; i++) {
+    free(buffers[i].procs);
+    free(buffers[i].util);
+  }
+  free(buffers);
+  return error_count;
+}
+
+// Resolve the device selection into a list of indices. Returns the count, or -1 on error.
+static int select_devices(const cli_args_t* args, unsigned int device_count, int* targets,
+                          FILE* err) {
+  if (args->all_devices) {
+    int count = 0;
+    for (unsigned int i = 0; i < device_count && i < MAX_DEVICES; i++) targets[count++] = i;
+    return count;
+  }
+
+  int count = args->device_count;
+  memcpy(targets, args->devices, count * sizeof(int));
+  if (args->uuid_list[0])
+    count = resolve_selectors(args->uuid_list, 0, device_count, targets, count, err);
+  if (count >= 0 && args->pci_list[0])
+    count = resolve_selectors(args->pci_list, 1, device_count, targets, count, err);
+  return count;
+}
+
+// list straight from the device cache, without initializing NVML
+static int run_list_cached(const cli_args_t* args) {
+  int targets[MAX_DEVICES];
+  int target_count = select_devices(args, device_cache.count, targets, stderr);
+  if (target_count < 0) return 1;
+
+  int error_count = 0;
+  for (int i = 0; i < target_count; i++) {
+    const cached_device_t* d = device_cache_get(targets[i]);
+    if (!d) {
+      fprintf(stderr, "Error: Device ID %d not found (available: 0-%d)\n", targets[i],
+              device_cache.count - 1);
+      error_count++;
+      continue;
+    }
+    printf("%d:%s %s\n", targets[i], d->uuid, d->name);
+  }
+  return error_count;
+}
+
+// Read-only commands that can be answered by a serve daemon
+static int is_query_command(const cli_args_t* args) {
+  switch (args->command) {
+  case CMD_INFO:
+  case CMD_TEMP:
+  case CMD_STATUS:
+  case CMD_LIST: return 1;
+  case CMD_POWER:
+  case CMD_FAN: return args->subcommand == SUBCMD_NONE;
+  default: return 0;
+  }
+}
+
+// Run a read-only command against the selected devices. Returns the number of errors.
+static int run_query(const cli_args_t* args, unsigned int device_count, FILE* file, FILE* err) {
+  int targets[MAX_DEVICES];
+  int target_count = select_devices(args, device_count, targets, err);
+  if (target_count < 0) return 1;
+  unsigned int info_metrics = INFO_METRICS | (args->io ? SAMPLE_PCIE : 0);
+
+  static out_t frame;
+  out_t* out = &frame;
+  out_init_file(out, file);
+
+  // JSON output header
+  if (args->subcommand == SUBCMD_JSON && args->command == CMD_INFO) out_str(out, "[\n");
+
+  int error_count = 0;
+  for (int i = 0; i < target_count; i++) {
+    int device_id = targets[i];
+
+    if (device_id >= (int)device_count) {
+      fprintf(err, "Error: Device ID %d not found (available: 0-%d)\n", device_id,
+              device_count - 1);
+      error_count++;
+      continue;
+    }
+
+    nvmlDevice_t device;
+    nvmlReturn_t result = get_device_handle(device_id, &device);
+    if (result != NVML_SUCCESS) {
+      fprintf(err, "Error: Failed to get device handle for device %d (%s)\n", device_id,
+              nvmlErrorString(result));
+      error_count++;
+      continue;
+    }
+
+    switch (args->command) {
+    case CMD_INFO:
+      if (args->subcommand == SUBCMD_JSON)
+        print_device_info_json(out, device, device_id, args->temp_unit, info_metrics,
+                               i == target_count - 1);
+      else
+        print_device_info_human(out, device, device_id, args->temp_unit, info_metrics);
+      break;
+
+    case CMD_POWER: print_power_cli(out, err, device, device_id); break;
+
+    case CMD_FAN: print_fan_cli(out, err, device, device_id); break;
+
+    case CMD_TEMP: print_temp_cli(out, err, device, device_id, args->temp_unit); break;
+
+    case CMD_STATUS: {
+      field_plan_t plan;
+      device_sample_t sample;
+      field_plan_init(&plan, STATUS_METRICS | (args->io ? SAMPLE_UTILIZATION : 0));
+      sample_device(device, &plan, &sample);
+      print_status_fields(out, &sample, device_id, args->temp_unit);
+      if (args->io) out_utilization(out, &sample);
+      out_char(out, '\n');
+    } break;
+
+    case CMD_LIST: {
+      char uuid[NVML_DEVICE_UUID_BUFFER_SIZE];
+      char name[NVML_DEVICE_NAME_BUFFER_SIZE];
+
+      get_device_uuid(device, device_id, uuid, sizeof(uuid));
+      get_device_name(device, device_id, name, sizeof(name));
+
+      out_i64(out, device_id);
+      out_char(out, ':');
+      out_str(out, uuid);
+      out_char(out, ' ');
+      out_str(out, name);
+      out_char(out, '\n');
+    } break;
+
+    default: break;
+    }
+  }
+
+  // JSON output footer
+  if (args->subcommand == SUBCMD_JSON && args->command == CMD_INFO) out_str(out, "]\n");
+
+  out_flush(out);
+  return error_count;
+}
+
+static int read_all(int fd, void* buf, size_t len) {
+  char* p = buf;
+  while (len > 0) {
+    ssize_t n = read(fd, p, len);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return -1;
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static void set_socket_timeout(int fd, int timeout_ms) {
+  struct timeval tv = {timeout_ms / 1000, (timeout_ms % 1000) * 1000};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+static const char* resolve_socket_path(const cli_args_t* args) {
+  if (args->socket_path[0]) return args->socket_path;
+  return getenv(SOCKET_ENV);
+}
+
+// Answers one decoded query into out/err. Returns the error count sent back to the client.
+typedef int (*query_answer_t)(const cli_args_t* args, FILE* out, FILE* err, void* ctx);
+
+static int answer_local_query(const cli_args_t* args, FILE* out, FILE* err, void* ctx) {
+  if (!is_query_command(args)) {
+    fprintf(err, "Error: Command not supported by nvml-tool daemon\n");
+    return 1;
+  }
+  return run_query(args, *(const unsigned int*)ctx, out, err);
+}
+
+// A query's reply: the response header, then the captured stdout and stderr
+typedef struct {
+  query_response_t resp;
+  char *out_buf, *err_buf;
+  struct iovec iov[3];
+} query_reply_t;
+
+// Answer a request into `reply`, whose iov is then ready for writev. Returns 0 on success.
+static int query_reply(const query_request_t* req, query_answer_t answer, void* ctx,
+                       query_reply_t* reply) {
+  size_t out_len = 0, err_len = 0;
+  memset(reply, 0, sizeof(*reply));
+  reply->resp.magic = QUERY_MAGIC;
+
+  FILE* out = open_memstream(&reply->out_buf, &out_len);
+  FILE* err = open_memstream(&reply->err_buf, &err_len);
+  if (!out || !err) {
+    if (out) fclose(out);
+    if (err) fclose(err);
+    free(reply->out_buf);
+    free(reply->err_buf);
+    return -1;
+  }
+
+  cli_args_t args;
+  memset(&args, 0, sizeof(args));
+  args.command = req->command;
+  args.subcommand = req->subcommand;
+  args.temp_unit = req->temp_unit;
+  args.io = req->io;
+  args.all_devices = req->all_devices;
+  args.device_count = req->device_count < MAX_DEVICES ? req->device_count : MAX_DEVICES;
+  for (int i = 0; i < args.device_count; i++) args.devices[i] = req->devices[i];
+  copy_string(args.uuid_list, sizeof(args.uuid_list), req->uuid_list);
+  copy_string(args.pci_list, sizeof(args.pci_list), req->pci_list);
+
+  if (req->magic != QUERY_MAGIC || req->version != QUERY_VERSION) {
+    fprintf(err, "Error: Protocol mismatch with nvml-tool daemon\n");
+    reply->resp.status = 1;
+  } else {
+    reply->resp.status = answer(&args, out, err, ctx);
+  }
+
+  fclose(out);
+  fclose(err);
+  reply->resp.out_len = out_len;
+  reply->resp.err_len = err_len;
+  reply->iov[0] = (struct iovec){&reply->resp, sizeof(reply->resp)};
+  reply->iov[1] = (struct iovec){reply->out_buf, out_len};
+  reply->iov[2] = (struct iovec){reply->err_buf, err_len};
+  return 0;
+}
+
+static void query_reply_free(query_reply_t* reply) {
+  free(reply->out_buf);
+  free(reply->err_buf);
+  reply->out_buf = reply->err_buf = NULL;
+}
+
+// A query client of serve or aggregate. The request is read, answered and the reply written
+// back a piece at a time as the socket allows, so a slow client holds up only itself.
+typedef struct {
+  int fd; // -1 while the slot is free
+  short events; // POLLIN while the request is incomplete, POLLOUT while the reply is blocked
+  size_t got; // Request bytes read so far
+  query_request_t req;
+  query_reply_t reply;
+  struct iovec* iov; // Unsent part of reply.iov, NULL until the request is complete
+  int iov_count;
+  long long deadline_ns;
+} query_client_t;
+
+typedef struct {
+  query_client_t clients[QUERY_MAX_CLIENTS];
+  int count;
+  query_answer_t answer;
+  void* ctx;
+} query_server_t;
+
+static void query_server_init(query_server_t* qs, query_answer_t answer, void* ctx) {
+  memset(qs, 0, sizeof(*qs));
+  for (int i = 0; i < QUERY_MAX_CLIENTS; i++) qs->clients[i].fd = -1;
+  qs->answer = answer;
+  qs->ctx = ctx;
+}
+
+static void query_client_close(query_server_t* qs, query_client_t* c) {
+  close(c->fd);
+  if (c->iov) query_reply_free(&c->reply);
+  c->fd = -1;
+  qs->count--;
+}
+
+// Accept one pending client into a free slot. Returns the slot, or -1 if none is pending or
+// every slot is taken.
+static int query_server_accept(query_server_t* qs, int listen_fd) {
+  if (qs->count >= QUERY_MAX_CLIENTS) return -1;
+  int slot = 0;
+  while (qs->clients[slot].fd >= 0) slot++;
+  int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+  if (fd < 0) return -1;
+
+  query_client_t* c = &qs->clients[slot];
+  memset(c, 0, sizeof(*c));
+  c->fd = fd;
+  c->events = POLLIN;
+  c->deadline_ns = now_ns() + QUERY_TIMEOUT_MS * 1000000LL;
+  qs->count++;
+  return slot;
+}
+
+// Make progress on a query client. Returns 0 while it has more to do, with c->events set to
+// what it waits for, nonzero when it is done or failed and should be closed.
+static int query_client_io(query_server_t* qs, query_client_t* c) {
+  if (!c->iov) {
+    ssize_t n = read(c->fd, (char*)&c->req + c->got, sizeof(c->req) - c->got);
+    if (n == 0) return 1;
+    if (n < 0) return errno != EAGAIN && errno != EINTR;
+    c->got += n;
+    if (c->got < sizeof(c->req)) return 0;
+    if (query_reply(&c->req, qs->answer, qs->ctx, &c->reply) != 0) return 1;
+    c->iov = c->reply.iov;
+    c->iov_count = 3;
+  }
+
+  c->iov_count = iov_consume(&c->iov, c->iov_count, 0);
+  while (c->iov_count > 0) {
+    ssize_t n = writev(c->fd, c->iov, c->iov_count);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0 && errno == EAGAIN) {
+      c->events = POLLOUT;
+      return 0;
+    }
+    if (n <= 0) return 1;
+    c->iov_count = iov_consume(&c->iov, c->iov_count, n);
+  }
+  return 1;
+}
+
+// Close query clients past their deadline. Returns the poll timeout until the nearest
+// remaining one, -1 if there are none.
+static int query_server_sweep(query_server_t* qs) {
+  long long now = now_ns(), next = -1;
+  for (int slot = 0; slot < QUERY_MAX_CLIENTS && qs->count > 0; slot++) {
+    query_client_t* c = &qs->clients[slot];
+    if (c->fd < 0) continue;
+    if (c->deadline_ns <= now) {
+      query_client_close(qs, c);
+      continue;
+    }
+    if (next < 0 || c->deadline_ns < next) next = c->deadline_ns;
+  }
+  return next < 0 ? -1 : (int)((next - now + 999999) / 1000000);
+}
+
+// Bind the nonblocking query socket, replacing a stale one but never one a running daemon
+// still answers on. Returns the fd, or -1 with an error printed.
+static int unix_listen(const char* path) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Error: Socket path too long: %s\n", path);
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    perror("socket");
+    return -1;
+  }
+
+  int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  int live = probe >= 0 && connect(probe, (struct sockaddr*)&addr, sizeof(addr)) == 0;
+  if (probe >= 0) close(probe);
+  if (live) {
+    fprintf(stderr, "Error: Another daemon is already listening on %s\n", path);
+    close(fd);
+    return -1;
+  }
+
+  unlink(path);
+  if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, 64) != 0) {
+    fprintf(stderr, "Error: Cannot listen on %s (%s)\n", path, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  chmod(path, 0666); // Queries are read-only, let unprivileged health checks connect
+  return fd;
+}
+
+static int run_serve(const cli_args_t* args, unsigned int device_count) {
+  const char* path = resolve_socket_path(args);
+  if (!path) path = DEFAULT_SOCKET_PATH;
+
+  // Warm the handle cache so queries never pay for handle lookup
+  for (unsigned int i = 0; i < device_count && i < MAX_DEVICES; i++) {
+    nvmlDevice_t device;
+    get_device_handle(i, &device);
+  }
+
+  int listen_fd = unix_listen(path);
+  if (listen_fd < 0) return 1;
+
+  signal(SIGINT, signal_handler);
+  signal(SIGTERM, signal_handler);
+  signal(SIGPIPE, SIG_IGN);
+
+  fprintf(stderr, "Serving %u device(s) on %s\n", device_count, path);
+
+  // Clients are nonblocking slots with a deadline each, so one that connects and stays silent
+  // holds up only itself
+  static query_server_t server;
+  query_server_init(&server, answer_local_query, &device_count);
+  while (running) {
+    struct pollfd pfds[QUERY_MAX_CLIENTS + 1];
+    int slots[QUERY_MAX_CLIENTS];
+    int timeout = query_server_sweep(&server);
+    int n = 0;
+    for (int slot = 0; slot < QUERY_MAX_CLIENTS; slot++) {
+      if (server.clients[slot].fd < 0) continue;
+      pfds[n] = (struct pollfd){server.clients[slot].fd, server.clients[slot].events, 0};
+      slots[n++] = slot;
+    }
+    // While every slot is taken the rest wait in the backlog
+    int accepting = server.count < QUERY_MAX_CLIENTS;
+    if (accepting) pfds[n] = (struct pollfd){listen_fd, POLLIN, 0};
+
+    if (poll(pfds, n + accepting, timeout) <= 0) continue; // EINTR re-checks running
+    for (int i = 0; i < n; i++) {
+      query_client_t* c = &server.clients[slots[i]];
+      if (pfds[i].revents && query_client_io(&server, c) != 0) query_client_close(&server, c);
+    }
+    if (accepting && pfds[n].revents)
+      while (query_server_accept(&server, listen_fd) >= 0) {}
+  }
+
+  for (int i = 0; i < QUERY_MAX_CLIENTS; i++)
+    if (server.clients[i].fd >= 0) query_client_close(&server, &server.clients[i]);
+  close(listen_fd);
+  unlink(path);
+  return 0;
+}
+
+// Answer a query through a serve daemon. Returns the command's exit status, or -1 if no
+// daemon could be reached and the caller should fall back to querying NVML directly.
+static int query_daemon(const cli_args_t* args) {
+  const char* path = resolve_socket_path(args);
+  if (!path) return -1;
+
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(addr.sun_path)) return -1;
+  strcpy(addr.sun_path, path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) return -1;
+  if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+    close(fd);
+    return -1;
+  }
+  set_socket_timeout(fd, QUERY_TIMEOUT_MS);
+
+  query_request_t req;
+  memset(&req, 0, sizeof(req));
+  req.magic = QUERY_MAGIC;
+  req.version = QUERY_VERSION;
+  req.command = args->command;
+  req.subcommand = args->subcommand;
+  req.all_devices = args->all_devices;
+  req.device_count = args->device_count;
+  req.temp_unit = args->temp_unit;
+  req.io = args->io;
+  for (int i = 0; i < args->device_count; i++) req.devices[i] = args->devices[i];
+  memcpy(req.uuid_list, args->uuid_list, sizeof(req.uuid_list));
+  memcpy(req.pci_list, args->pci_list, sizeof(req.pci_list));
+
+  query_response_t resp;
+  if (write_all(fd, &req, sizeof(req)) != 0 || read_all(fd, &resp, sizeof(resp)) != 0 ||
+      resp.magic != QUERY_MAGIC) {
+    close(fd);
+    return -1;
+  }
+
+  char* buf = malloc(resp.out_len + resp.err_len + 1);
+  if (!buf || read_all(fd, buf, resp.out_len + resp.err_len) != 0) {
+    free(buf);
+    close(fd);
+    return -1;
+  }
+  close(fd);
+
+  fwrite(buf, 1, resp.out_len, stdout);
+  fwrite(buf + resp.out_len, 1, resp.err_len, stderr);
+  free(buf);
+  return resp.status;
+}
+
+// Split "HOST:PORT", "[V6]:PORT", ":PORT" or "PORT" into host (NULL = any) and port
+static int parse_listen_addr(const char* addr, char* host, size_t host_len, char* port,
+                             size_t port_len) {
+  const char* colon = strrchr(addr, ':');
+  const char* host_start = addr;
+  size_t n = colon ? (size_t)(colon - addr) : 0;
+
+  if (addr[0] == '[') {
+    const char* close = strchr(addr, ']');
+    if (!close || close[1] != ':') return -1;
+    host_start = addr + 1;
+    n = close - host_start;
+    colon = close + 1;
+  }
+
+  if (n >= host_len || strlen(colon ? colon + 1 : addr) >= port_len) return -1;
+  memcpy(host, host_start, n);
+  host[n] = '\0';
+  strcpy(port, colon ? colon + 1 : addr);
+  return port[0] ? 0 : -1;
+}
+
+// Bind a listening TCP socket. Returns the fd, or -1 with an error printed.
+static int tcp_listen(const char* addr, int backlog) {
+  char host[256], port[32];
+  if (parse_listen_addr(addr, host, sizeof(host), port, sizeof(port)) != 0) {
+    fprintf(stderr, "Error: Invalid listen address '%s' (expected HOST:PORT or :PORT)\n", addr);
+    return -1;
+  }
+
+  struct addrinfo hints = {.ai_flags = AI_PASSIVE, .ai_family = AF_UNSPEC,
+                           .ai_socktype = SOCK_STREAM};
+  struct addrinfo* res;
+  int rc = getaddrinfo(host[0] ? host : NULL, port, &hints, &res);
+  if (rc != 0) {
+    fprintf(stderr, "Error: Cannot resolve '%s' (%s)\n", addr, gai_strerror(rc));
+    return -1;
+  }
+
+  int fd = -1;
+  for (struct addrinfo* ai = res; ai; ai = ai->ai_next) {
+    fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+    if (fd < 0) continue;
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, backlog) == 0) break;
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(res);
+
+  if (fd < 0) fprintf(stderr, "Error: Cannot listen on %s (%s)\n", addr, strerror(errno));
+  return fd;
+}
+
+// Static per-device attributes plus the latest sample the exporter renders from
+typedef struct {
+  nvmlDevice_t device;
+  char labels[1024]; // gpu="N",uuid="...",name="..." with label values escaped
+  unsigned int num_fans;
+  unsigned int power_min, power_max; // mW, 0 if unavailable
+  field_plan_t plan;
+  device_sample_t sample;
+  unsigned int fan_speeds[EXPORTER_MAX_FANS];
+  unsigned int fan_valid; // Bitmask of fans whose speed was read
+  throttle_account_t throttle;
+  counter_rates_t rates;
+  int nvlink_rate_valid;
+  double nvlink_tx_rate, nvlink_rx_rate; // KiB/s over the last interval
+} exporter_device_t;
+
+static void escape_label_value(char* dst, size_t dst_len, const char* src) {
+  size_t o = 0;
+  for (; *src && o + 2 < dst_len; src++) {
+    if (*src == '"' || *src == '\\') dst[o++] = '\\';
+    if (*src == '\n') {
+      dst[o++] = '\\';
+      dst[o++] = 'n';
+      continue;
+    }
+    dst[o++] = *src;
+  }
+  dst[o] = '\0';
+}
+
+static void exporter_sample(exporter_device_t* devs, int count) {
+  for (int i = 0; i < count; i++) {
+    exporter_device_t* d = &devs[i];
+    sample_device(d->device, &d->plan, &d->sample);
+    if (d->sample.valid & SAMPLE_THROTTLE)
+      throttle_account(&d->throttle, d->sample.throttle_reasons, now_ns());
+    d->nvlink_rate_valid = (d->sample.valid & SAMPLE_NVLINK) &&
+                           nvlink_rates(&d->rates, &d->sample, now_ns(), &d->nvlink_tx_rate,
+                                        &d->nvlink_rx_rate);
+    d->fan_valid = 0;
+    for (unsigned int fan = 0; fan < d->num_fans && fan < EXPORTER_MAX_FANS; fan++)
+      if (nvmlDeviceGetFanSpeed_v2(d->device, fan, &d->fan_speeds[fan]) == NVML_SUCCESS)
+        d->fan_valid |= 1u << fan;
+  }
+}
+
+static void metric_header(FILE* out, const char* name, const char* type, const char* help) {
+  fprintf(out, "# TYPE %s %s\n# HELP %s %s\n", name, type, name, help);
+}
+
+// Render one OpenMetrics exposition, preceded by its HTTP response header
+static void render_metrics(FILE* out, const exporter_device_t* devs, int count,
+                           const tick_scheduler_t* sched, long long sample_ns) {
+  char* body = NULL;
+  size_t body_len = 0;
+  FILE* b = open_memstream(&body, &body_len);
+  if (!b) return;
+
+  metric_header(b, "nvml_temperature_celsius", "gauge", "GPU core temperature.");
+  for (int i = 0; i < count; i++)
+    if (devs[i].sample.valid & SAMPLE_TEMP)
+      fprintf(b, "nvml_temperature_celsius{%s} %u\n", devs[i].labels, devs[i].sample.temperature);
+
+  metric_header(b, "nvml_memory_total_bytes", "gauge", "Total framebuffer memory.");
+  for (int i = 0; i < count; i++)
+    if (devs[i].sample.valid & SAMPLE_MEMORY)
+      fprintf(b, "nvml_memory_total_bytes{%s} %llu\n", devs[i].labels,
+              devs[i].sample.memory.total);
+
+  metric_header(b, "nvml_memory_used_bytes", "gauge", "Used framebuffer memory.");
+  for (int i = 0; i < count; i++)
+    if (devs[i].sample.valid & SAMPLE_MEMORY)
+      fprintf(b, "nvml_memory_used_bytes{%s} %llu\n", devs[i].labels, devs[i].sample.memory.used);
+
+  metric_header(b, "nvml_memory_free_bytes", "gauge", "Free framebuffer memory.");
+  for (int i = 0; i < count; i++)
+    if (devs[i].sample.valid & SAMPLE_MEMORY)
+      fprintf(b, "nvml_memory_free_bytes{%s} %llu\n", devs[i].labels, devs[i].sample.memory.free);
+
+  metric_header(b, "nvml_fan_speed_percent", "gauge", "Intended fan speed.");
+  for (int i = 0; i < count; i++)
+    if (devs[i].sample.valid & SAMPLE_FAN)
+      fprintf(b, "nvml_fan_speed_percent{%s} %u\n", devs[i].labels, devs[i].sample.fan_speed);
+
+  metric_header(b, "nvml_fan_speed_per_fan_percent", "gauge", "Intended speed of each fan.");
+  for (int i = 0; i < count; i++)
+    for (unsigned int fan = 0; fan < EXPORTER_MAX_FANS; fan++)
+      if (devs[i].fan_valid & (1u << fan))
+        fprintf(b, "nvml_fan_speed_per_fan_percent{%s,fan=\"%u\"} %u\n", devs[i].labels, fan,
+                devs[i].fan_speeds[fan]);
+
+  metric_header(b, "nvml_power_usage_watts", "gauge", "Power draw.");
+  for (int i = 0; i < count; i++)
+    if (devs[i].sample.valid & SAMPLE_POWER)
+      fprintf(b, "nvml_power_usage_watts{%s} %.3f\n", devs[i].labels,
+              devs[i].sample.power_usage / 1000.0);
+
+  metric_header(b, "nvml_power_limit_watts", "gauge", "Current power management limit.");
+  for (int i = 0; i < count; i++)
+    if (devs[i].sample.valid & SAMPLE_POWER_LIMIT)
+      fprintf(b, "nvml_power_limit_watts{%s} %.3f\n", devs[i].labels,
+              devs[i].sample.power_limit / 1000.0);
+
+  metric_header(b, "nvml_power_limit_min_watts", "gauge", "Minimum settable power limit.");
+  for (int i = 0; i < count; i++)
+    if (devs[i].power_max)
+      fprintf(b, "nvml_power_limit_min_watts{%s} %.3f\n", devs[i].labels,
+              devs[i].power_min / 1000.0);
+
+  metric_header(b, "nvml_power_limit_max_watts", "gauge", "Maximum settable power limit.");
+  for (int i = 0; i < count; i++)
+    if (devs[i].power_max)
+      fprintf(b, "nvml_power_limit_max_watts{%s} %.3f\n", devs[i].labels,
+              devs[i].power_max / 1000.0);
+
+  metric_header(b, "nvml_gpu_utilization_percent", "gauge",
+                "Share of the last sample period a kernel was running.");
+  for (int i = 0; i < count; i++)
+    if (devs[i].sample.valid & SAMPLE_UTILIZATION)
+      fprintf(b, "nvml_gpu_utilization_percent{%s} %u\n", devs[i].labels,
+              devs[i].sample.utilization.gpu);
+
+  metric_header(b, "nvml_memory_utilization_percent", "gauge",
+                "Share of the last sample period device memory was read or written.");
+  for (int i = 0; i < count; i++)
+    if (devs[i].sample.valid & SAMPLE_UTILIZATION)
+      fprintf(b, "nvml_memory_utilization_percent{%s} %u\n", devs[i].labels,
+              devs[i].sample.utilization.memory);
+
+  metric_header(b, "nvml_pcie_throughput_bytes_per_second", "gauge", "PCIe traffic.");
+  for (int i = 0; i < count; i++) {
+    if (!(devs[i].sample.valid & SAMPLE_PCIE)) continue;
+    fprintf(b, "nvml_pcie_throughput_bytes_per_second{%s,direction=\"tx\"} %llu\n",
+            devs[i].labels, devs[i].sample.pcie_tx * 1024ULL);
+    fprintf(b, "nvml_pcie_throughput_bytes_per_second{%s,direction=\"rx\"} %llu\n",
+            devs[i].labels, devs[i].sample.pcie_rx * 1024ULL);
+  }
+
+  metric_header(b, "nvml_nvlink_data_bytes", "counter", "NVLink data traffic over all links.");
+  for (int i = 0; i < count; i++) {
+    if (!(devs[i].sample.valid & SAMPLE_NVLINK)) continue;
+    fprintf(b, "nvml_nvlink_data_bytes_total{%s,direction=\"tx\"} %llu\n", devs[i].labels,
+            devs[i].sample.nvlink_tx * 1024);
+    fprintf(b, "nvml_nvlink_data_bytes_total{%s,direction=\"rx\"} %llu\n", devs[i].labels,
+            devs[i].sample.nvlink_rx * 1024);
+  }
+
+  metric_header(b, "nvml_nvlink_throughput_bytes_per_second", "gauge",
+                "NVLink data traffic over all links during the last sampling interval.");
+  for (int i = 0; i < count; i++) {
+    if (!devs[i].nvlink_rate_valid) continue;
+    fprintf(b, "nvml_nvlink_throughput_bytes_per_second{%s,direction=\"tx\"} %.0f\n",
+            devs[i].labels, devs[i].nvlink_tx_rate * 1024);
+    fprintf(b, "nvml_nvlink_throughput_bytes_per_second{%s,direction=\"rx\"} %.0f\n",
+            devs[i].labels, devs[i].nvlink_rx_rate * 1024);
+  }
+
+  metric_header(b, "nvml_clock_hertz", "gauge", "Current SM and memory clocks.");
+  for (int i = 0; i < count; i++) {
+    if (!(devs[i].sample.valid & SAMPLE_CLOCKS)) continue;
+    fprintf(b, "nvml_clock_hertz{%s,clock=\"sm\"} %u000000\n", devs[i].labels,
+            devs[i].sample.sm_clock);
+    if (devs[i].sample.valid & SAMPLE_MEM_CLOCK)
+      fprintf(b, "nvml_clock_hertz{%s,clock=\"memory\"} %u000000\n", devs[i].labels,
+              devs[i].sample.mem_clock);
+  }
+
+  metric_header(b, "nvml_pstate", "gauge", "Performance state, 0 (fastest) to 15.");
+  for (int i = 0; i < count; i++)
+    if ((devs[i].sample.valid & SAMPLE_CLOCKS) && devs[i].sample.pstate <= 15)
+      fprintf(b, "nvml_pstate{%s} %u\n", devs[i].labels, devs[i].sample.pstate);
+
+  metric_header(b, "nvml_throttle_active", "gauge",
+                "1 while the clocks are held back for this reason.");
+  for (int i = 0; i < count; i++)
+    for (size_t r = 0; r < THROTTLE_REASONS && (devs[i].sample.valid & SAMPLE_THROTTLE); r++)
+      fprintf(b, "nvml_throttle_active{%s,reason=\"%s\"} %d\n", devs[i].labels,
+              throttle_reasons[r].name,
+              (devs[i].sample.throttle_reasons & throttle_reasons[r].mask) != 0);
+
+  metric_header(b, "nvml_throttle_seconds", "counter",
+                "Time the clocks were held back for this reason, as seen by the sampler.");
+  for (int i = 0; i < count; i++)
+    for (size_t r = 0; r < THROTTLE_REASONS && devs[i].throttle.primed; r++)
+      fprintf(b, "nvml_throttle_seconds_total{%s,reason=\"%s\"} %.3f\n", devs[i].labels,
+              throttle_reasons[r].name, devs[i].throttle.seconds[r]);
+
+  metric_header(b, "nvml_throttle_transitions", "counter",
+                "Times this reason went from inactive to active.");
+  for (int i = 0; i < count; i++)
+    for (size_t r = 0; r < THROTTLE_REASONS && devs[i].throttle.primed; r++)
+      fprintf(b, "nvml_throttle_transitions_total{%s,reason=\"%s\"} %lu\n", devs[i].labels,
+              throttle_reasons[r].name, devs[i].throttle.entered[r]);
+
+  metric_header(b, "nvml_exporter_sample_duration_seconds", "gauge",
+                "Time the last sampling pass spent in NVML.");
+  fprintf(b, "nvml_exporter_sample_duration_seconds %.6f\n", sample_ns / 1e9);
+  metric_header(b, "nvml_exporter_sample_overruns", "counter",
+                "Sampling deadlines missed because a pass overran the interval.");
+  fprintf(b, "nvml_exporter_sample_overruns_total %lu\n", sched->overruns);
+  fprintf(b, "# EOF\n");
+  fclose(b);
+
+  fprintf(out,
+          "HTTP/1.1 200 OK\r\n"
+          "Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n"
+          "Content-Length: %zu\r\n"
+          "Connection: close\r\n\r\n",
+          body_len);
+  fwrite(body, 1, body_len, out);
+  free(body);
+}
+
+typedef struct {
+  int fd;
+  size_t len;
+  long long deadline_ns; // Drop clients that haven't sent a full request by then
+  char buf[EXPORTER_REQUEST_MAX];
+} exporter_client_t;
+
+static void exporter_respond(exporter_client_t* c, const char* metrics, size_t metrics_len) {
+  static const char not_found[] = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n"
+                                  "Connection: close\r\n\r\n";
+  c->buf[c->len < sizeof(c->buf) ? c->len : sizeof(c->buf) - 1] = '\0';
+
+  // Serve the pre-rendered buffer as-is: no NVML access and no formatting per scrape
+  if (!strncmp(c->buf, "GET /metrics ", 13) || !strncmp(c->buf, "GET / ", 6))
+    write_all(c->fd, metrics, metrics_len);
+  else
+    write_all(c->fd, not_found, sizeof(not_found) - 1);
+}
+
+static int run_exporter(const cli_args_t* args, nvmlDevice_t* devices, const int* device_ids,
+                        int count) {
+  static exporter_device_t devs[MAX_DEVICES];
+  static exporter_client_t clients[EXPORTER_MAX_CLIENTS];
+  int client_count = 0;
+
+  int listen_fd = tcp_listen(args->listen_addr, 128);
+  if (listen_fd < 0) return 1;
+
+  // Attributes that don't change while the driver is loaded are read once
+  for (int i = 0; i < count; i++) {
+    char name[MAX_NAME_LEN] = "Unknown", uuid[MAX_UUID_LEN] = "Unknown";
+    char ename[2 * MAX_NAME_LEN], euuid[2 * MAX_UUID_LEN];
+
+    devs[i].device = devices[i];
+    get_device_name(devices[i], device_ids[i], name, sizeof(name));
+    get_device_uuid(devices[i], device_ids[i], uuid, sizeof(uuid));
+    escape_label_value(ename, sizeof(ename), name);
+    escape_label_value(euuid, sizeof(euuid), uuid);
+    snprintf(devs[i].labels, sizeof(devs[i].labels), "gpu=\"%d\",uuid=\"%s\",name=\"%s\"",
+             device_ids[i], euuid, ename);
+    if (get_num_fans(devices[i], device_ids[i], &devs[i].num_fans) != NVML_SUCCESS)
+      devs[i].num_fans = 0;
+    if (get_power_constraints(devices[i], device_ids[i], &devs[i].power_min,
+                              &devs[i].power_max) != NVML_SUCCESS)
+      devs[i].power_min = devs[i].power_max = 0;
+    field_plan_init(&devs[i].plan,
+                    INFO_METRICS | SAMPLE_NVLINK | (args->io ? SAMPLE_PCIE : 0));
+  }
+
+  signal(SIGINT, signal_handler);
+  signal(SIGTERM, signal_handler);
+  signal(SIGPIPE, SIG_IGN);
+
+  fprintf(stderr, "Exporting %d device(s) on %s every %u ms\n", count, args->listen_addr,
+          args->interval_ms);
+
+  // Each tick renders a complete response; scrapes only ever write the newest one out
+  char* front = NULL;
+  size_t front_len = 0;
+  tick_scheduler_t sched;
+  tick_scheduler_init(&sched, args->interval_ms);
+
+  while (running) {
+    if (tick_scheduler_due(&sched)) {
+      long long start = now_ns();
+      exporter_sample(devs, count);
+      long long elapsed = now_ns() - start;
+
+      char* back = NULL;
+      size_t back_len = 0;
+      FILE* out = open_memstream(&back, &back_len);
+      if (out) {
+        render_metrics(out, devs, count, &sched, elapsed);
+        fclose(out);
+        free(front);
+        front = back;
+        front_len = back_len;
+      }
+    }
+
+    // Clients first; the listen socket goes last and only while there is room to accept,
+    // otherwise a pending connection would keep poll returning immediately
+    struct pollfd pfds[EXPORTER_MAX_CLIENTS + 1];
+    int timeout = tick_scheduler_timeout_ms(&sched);
+    long long now = now_ns();
+    for (int i = 0; i < client_count; i++) {
+      pfds[i] = (struct pollfd){clients[i].fd, POLLIN, 0};
+      long long left_ms = (clients[i].deadline_ns - now + 999999) / 1000000;
+      if (left_ms < 0) left_ms = 0;
+      if (left_ms < timeout) timeout = (int)left_ms;
+    }
+    int nfds = client_count;
+    if (client_count < EXPORTER_MAX_CLIENTS) pfds[nfds++] = (struct pollfd){listen_fd, POLLIN, 0};
+
+    poll(pfds, nfds, timeout); // On EINTR revents stay 0 and running is re-checked
+
+    // Deadlines are swept on every pass, including timeouts, so a stalled client can't hold
+    // a slot past QUERY_TIMEOUT_MS
+    now = now_ns();
+    int accept_ready = nfds > client_count && (pfds[client_count].revents & POLLIN);
+    for (int i = client_count - 1; i >= 0; i--) {
+      exporter_client_t* c = &clients[i];
+      int done = 0;
+
+      if (pfds[i].revents) {
+        ssize_t n = read(c->fd, c->buf + c->len, sizeof(c->buf) - 1 - c->len);
+        if (n <= 0) {
+          done = 1;
+        } else {
+          c->len += n;
+          c->buf[c->len] = '\0';
+          if (strstr(c->buf, "\r\n\r\n") || strstr(c->buf, "\n\n") ||
+              c->len == sizeof(c->buf) - 1) {
+            if (front) exporter_respond(c, front, front_len);
+            done = 1;
+          }
+        }
+      } else if (now > c->deadline_ns) {
+        done = 1;
+      }
+
+      if (done) {
+        close(c->fd);
+        clients[i] = clients[--client_count];
+      }
+    }
+
+    if (accept_ready && client_count < EXPORTER_MAX_CLIENTS) {
+      int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+      if (fd >= 0) {
+        set_socket_timeout(fd, QUERY_TIMEOUT_MS);
+        clients[client_count].fd = fd;
+        clients[client_count].len = 0;
+        clients[client_count].deadline_ns = now + QUERY_TIMEOUT_MS * 1000000LL;
+        client_count++;
+      }
+    }
+  }
+
+  for (int i = 0; i < client_count; i++) close(clients[i].fd);
+  close(listen_fd);
+  free(front);
+  return 0;
+}
+
+// Fleet fan-in. `agent` pushes compact binary samples of the local GPUs to an `aggregate`
+// collector over TCP. The collector keeps the latest sample per node and GPU in memory and
+// answers status, list and info json for the whole fleet on its query socket, speaking the
+// serve protocol, so the usual client works against it with -S.
+//
+// The agent stream is a sequence of little-endian frames: a header of AGENT_HEADER_LEN bytes
+// (u16 payload length, u8 type, u8 reserved) and the payload. The first frame is a hello:
+//   "NVTA" u16 version, u32 interval_ms, str node, u8 device count,
+//   per device: u8 id, str name, str uuid                       (str: u8 length + bytes)
+// then one samples frame per tick: u64 realtime ms, u8 device count, and AGENT_SAMPLE_LEN bytes
+// per device in hello order: u8 valid flags, u8 temperature C, u8 fan %, u8 reserved,
+// u32 power mW, u32 power limit mW, u32 memory total/used/free MiB.
+#define AGENT_MAGIC "NVTA"
+#define AGENT_VERSION 1
+#define AGENT_FRAME_HELLO 1
+#define AGENT_FRAME_SAMPLES 2
+#define AGENT_HEADER_LEN 4
+#define AGENT_SAMPLE_LEN 24
+#define AGENT_MAX_FRAME (AGENT_HEADER_LEN + 65535)
+#define AGENT_CONNECT_TIMEOUT_MS 5000
+#define AGENT_MIN_BACKOFF_MS 500
+#define AGENT_MAX_BACKOFF_MS 30000
+#define AGGREGATE_STALE_INTERVALS 3 // Agent intervals without samples before a node is stale
+#define AGGREGATE_EXPIRE_INTERVALS 30 // Agent intervals after a disconnect before it is dropped
+#define AGGREGATE_SWEEP_MS 1000
+#define AGGREGATE_HASH_BUCKETS 4096
+#define AGGREGATE_MAX_EVENTS 256
+#define NODE_NAME_LEN 64
+
+// Thousands of sockets need more than the usual soft limit of 1024 descriptors
+static rlim_t raise_fd_limit(void) {
+  struct rlimit rl;
+  if (getrlimit(RLIMIT_NOFILE, &rl) != 0) return 1024;
+  if (rl.rlim_cur < rl.rlim_max) {
+    rl.rlim_cur = rl.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &rl) != 0) getrlimit(RLIMIT_NOFILE, &rl);
+  }
+  return rl.rlim_cur;
+}
+
+static size_t agent_put_string(unsigned char* p, const char* s) {
+  size_t n = strnlen(s, 255);
+  p[0] = n;
+  memcpy(p + 1, s, n);
+  return n + 1;
+}
+
+// Fill in the header of a frame whose payload ends at `end`. Returns the frame length.
+static size_t agent_finish_frame(unsigned char* frame, const unsigned char* end, int type) {
+  size_t payload = end - frame - AGENT_HEADER_LEN;
+  put_le(frame, payload, 2);
+  frame[2] = type;
+  frame[3] = 0;
+  return AGENT_HEADER_LEN + payload;
+}
+
+static size_t agent_encode_hello(unsigned char* frame, const char* node, unsigned int interval_ms,
+                                 const int* device_ids, char names[][MAX_NAME_LEN],
+                                 char uuids[][MAX_UUID_LEN], int count) {
+  unsigned char* p = frame + AGENT_HEADER_LEN;
+  memcpy(p, AGENT_MAGIC, 4);
+  put_le(p + 4, AGENT_VERSION, 2);
+  put_le(p + 6, interval_ms, 4);
+  p += 10;
+  p += agent_put_string(p, node);
+  *p++ = count;
+  for (int i = 0; i < count; i++) {
+    *p++ = device_ids[i];
+    p += agent_put_string(p, names[i]);
+    p += agent_put_string(p, uuids[i]);
+  }
+  return agent_finish_frame(frame, p, AGENT_FRAME_HELLO);
+}
+
+static size_t agent_encode_samples(unsigned char* frame, uint64_t timestamp_ms,
+                                   const device_sample_t* samples, int count) {
+  unsigned char* p = frame + AGENT_HEADER_LEN;
+  put_le(p, timestamp_ms, 8);
+  p[8] = count;
+  p += 9;
+  for (int i = 0; i < count; i++, p += AGENT_SAMPLE_LEN) {
+    const device_sample_t* s = &samples[i];
+    p[0] = s->valid & SAMPLE_ALL;
+    p[1] = s->temperature < 255 ? s->temperature : 255;
+    p[2] = s->fan_speed < 255 ? s->fan_speed : 255;
+    p[3] = 0;
+    put_le(p + 4, s->power_usage, 4);
+    put_le(p + 8, s->power_limit, 4);
+    put_le(p + 12, s->memory.total >> 20, 4);
+    put_le(p + 16, s->memory.used >> 20, 4);
+    put_le(p + 20, s->memory.free >> 20, 4);
+  }
+  return agent_finish_frame(frame, p, AGENT_FRAME_SAMPLES);
+}
+
+static void agent_decode_sample(const unsigned char* p, device_sample_t* s) {
+  memset(s, 0, sizeof(*s));
+  s->valid = p[0] & SAMPLE_ALL;
+  s->temperature = p[1];
+  s->fan_speed = p[2];
+  s->power_usage = get_le(p + 4, 4);
+  s->power_limit = get_le(p + 8, 4);
+  s->memory.total = get_le(p + 12, 4) << 20;
+  s->memory.used = get_le(p + 16, 4) << 20;
+  s->memory.free = get_le(p + 20, 4) << 20;
+}
+
+// Read a length-prefixed string, sanitized for the text and JSON output. Returns 0 on success,
+// -1 if it runs past `end`.
+static int agent_get_string(const unsigned char** p, const unsigned char* end, char* dst,
+                            size_t dst_len) {
+  if (*p >= end || (size_t)(end - *p) < 1u + **p) return -1;
+  size_t n = **p;
+  char buf[256];
+  memcpy(buf, *p + 1, n);
+  buf[n] = '\0';
+  copy_string(dst, dst_len, buf);
+  sanitize_proc_string(dst);
+  *p += 1 + n;
+  return 0;
+}
+
+// Resolve "HOST:PORT" to connect to. Returns 0, or -1 with an error printed.
+static int resolve_connect_addr(const char* addr, struct sockaddr_storage* sa, socklen_t* len) {
+  char host[256], port[32];
+  if (parse_listen_addr(addr, host, sizeof(host), port, sizeof(port)) != 0 || !host[0]) {
+    fprintf(stderr, "Error: Invalid address '%s' (expected HOST:PORT)\n", addr);
+    return -1;
+  }
+
+  struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+  struct addrinfo* res;
+  int rc = getaddrinfo(host, port, &hints, &res);
+  if (rc != 0) {
+    fprintf(stderr, "Error: Cannot resolve '%s' (%s)\n", addr, gai_strerror(rc));
+    return -1;
+  }
+  memcpy(sa, res->ai_addr, res->ai_addrlen);
+  *len = res->ai_addrlen;
+  freeaddrinfo(res);
+  return 0;
+}
+
+typedef enum { AGENT_IDLE, AGENT_CONNECTING, AGENT_CONNECTED } agent_state_t;
+
+// One connection to the aggregator; --nodes opens one per simulated node
+typedef struct {
+  int fd;
+  agent_state_t state;
+  long long since_ns;   // IDLE: when to retry; CONNECTING: when the attempt started
+  long long backoff_ns; // Wait after the next failure, doubled per failure up to the maximum
+  char node[NODE_NAME_LEN];
+} agent_conn_t;
+
+static struct {
+  struct sockaddr_storage addr;
+  socklen_t addr_len;
+  const char* addr_name;
+  int verbose; // Report connection changes; off for simulated nodes, which only print totals
+  unsigned long sent, dropped, reconnects;
+} agent;
+
+static void agent_disconnect(agent_conn_t* c, long long now, int error) {
+  int was_connected = c->state == AGENT_CONNECTED;
+  if (c->fd >= 0) close(c->fd);
+  if (was_connected) agent.reconnects++;
+  c->fd = -1;
+  c->state = AGENT_IDLE;
+  c->backoff_ns = c->backoff_ns ? c->backoff_ns * 2 : AGENT_MIN_BACKOFF_MS * 1000000LL;
+  if (c->backoff_ns > AGENT_MAX_BACKOFF_MS * 1000000LL)
+    c->backoff_ns = AGENT_MAX_BACKOFF_MS * 1000000LL;
+  c->since_ns = now + c->backoff_ns;
+  if (agent.verbose)
+    fprintf(stderr, "Error: %s %s (%s), retrying in %.1fs\n",
+            was_connected ? "Lost connection to" : "Cannot connect to", agent.addr_name,
+            strerror(error), c->backoff_ns / 1e9);
+}
+
+// Queue a whole frame without blocking. A frame that doesn't fit in the socket buffer is dropped
+// (the aggregator only keeps the latest one anyway); a partial write would break the framing,
+// so that and any error close the connection. Returns 1 if sent, 0 if dropped, -1 on error.
+static int agent_send(agent_conn_t* c, const unsigned char* frame, size_t len, long long now) {
+  ssize_t n = send(c->fd, frame, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+  if (n == (ssize_t)len) return 1;
+  if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+  agent_disconnect(c, now, n < 0 ? errno : EPIPE);
+  return -1;
+}
+
+static void agent_established(agent_conn_t* c, const unsigned char* hello, size_t len,
+                              long long now) {
+  c->state = AGENT_CONNECTED;
+  if (agent_send(c, hello, len, now) != 1) {
+    if (c->state == AGENT_CONNECTED) agent_disconnect(c, now, EAGAIN);
+    return;
+  }
+  c->backoff_ns = 0;
+  if (agent.verbose) fprintf(stderr, "Connected to %s as %s\n", agent.addr_name, c->node);
+}
+
+static void agent_connect(agent_conn_t* c, long long now) {
+  c->fd = socket(agent.addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (c->fd < 0) {
+    agent_disconnect(c, now, errno);
+    return;
+  }
+  int one = 1;
+  setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)); // One small frame per tick
+
+  c->state = AGENT_CONNECTING;
+  c->since_ns = now;
+  if (connect(c->fd, (struct sockaddr*)&agent.addr, agent.addr_len) != 0 && errno != EINPROGRESS)
+    agent_disconnect(c, now, errno);
+}
+
+// Finish pending connects and notice connections the aggregator closed (it never sends
+// anything, so a readable socket means EOF or an error)
+static void agent_poll(agent_conn_t* conns, int count, struct pollfd* pfds,
+                       const unsigned char* hellos, const size_t* hello_lens, size_t hello_cap,
+                       long long now) {
+  for (int i = 0; i < count; i++) {
+    pfds[i].fd = conns[i].state == AGENT_IDLE ? -1 : conns[i].fd;
+    pfds[i].events = conns[i].state == AGENT_CONNECTING ? POLLOUT : POLLIN;
+    pfds[i].revents = 0;
+  }
+  if (count <= 0 || poll(pfds, count, 0) < 0) return;
+
+  for (int i = 0; i < count; i++) {
+    agent_conn_t* c = &conns[i];
+    if (c->state == AGENT_CONNECTING) {
+      if (pfds[i].revents) {
+        int error = 0;
+        socklen_t len = sizeof(error);
+        getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &error, &len);
+        if (error)
+          agent_disconnect(c, now, error);
+        else
+          agent_established(c, hellos + i * hello_cap, hello_lens[i], now);
+      } else if (now - c->since_ns > AGENT_CONNECT_TIMEOUT_MS * 1000000LL) {
+        agent_disconnect(c, now, ETIMEDOUT);
+      }
+    } else if (c->state == AGENT_CONNECTED && pfds[i].revents) {
+      agent_disconnect(c, now, ECONNRESET);
+    }
+  }
+}
+
+// Sample the selected devices every --interval and push them to the aggregator, reconnecting
+// with exponential backoff whenever it goes away
+static int run_agent(const cli_args_t* args, nvmlDevice_t* devices, const int* device_ids,
+                     int count) {
+  static char names[MAX_DEVICES][MAX_NAME_LEN];
+  static char uuids[MAX_DEVICES][MAX_UUID_LEN];
+  static sampler_msg_t latest[MAX_DEVICES];
+  static device_sample_t samples[MAX_DEVICES];
+  static unsigned char frame[AGENT_MAX_FRAME];
+  int fresh[MAX_DEVICES];
+  int node_count = args->agent_nodes ? args->agent_nodes : 1;
+
+  if (resolve_connect_addr(args->connect_addr, &agent.addr, &agent.addr_len) != 0) return 1;
+  agent.addr_name = args->connect_addr;
+  agent.verbose = args->agent_nodes == 0;
+
+  rlim_t fd_limit = raise_fd_limit();
+  if ((rlim_t)node_count + 64 > fd_limit) {
+    fprintf(stderr, "Error: --nodes %d needs more file descriptors than the limit (%llu)\n",
+            node_count, (unsigned long long)fd_limit);
+    return 1;
+  }
+
+  char host[NODE_NAME_LEN] = "localhost";
+  if (args->node_name)
+    copy_string(host, sizeof(host), args->node_name);
+  else
+    gethostname(host, sizeof(host) - 1);
+
+  for (int i = 0; i < count; i++) {
+    strcpy(names[i], "Unknown");
+    strcpy(uuids[i], "Unknown");
+    get_device_name(devices[i], device_ids[i], names[i], sizeof(names[i]));
+    get_device_uuid(devices[i], device_ids[i], uuids[i], sizeof(uuids[i]));
+  }
+
+  // Hellos are encoded once per connection; they only differ in the node name
+  size_t hello_cap = AGENT_HEADER_LEN + 11 + NODE_NAME_LEN + count * (3 + 255 + MAX_UUID_LEN);
+  agent_conn_t* conns = calloc(node_count, sizeof(*conns));
+  struct pollfd* pfds = calloc(node_count, sizeof(*pfds));
+  unsigned char* hellos = malloc(node_count * hello_cap);
+  size_t* hello_lens = calloc(node_count, sizeof(*hello_lens));
+  if (!conns || !pfds || !hellos || !hello_lens) {
+    fprintf(stderr, "Error: Out of memory for %d connections\n", node_count);
+    free(conns);
+    free(pfds);
+    free(hellos);
+    free(hello_lens);
+    return 1;
+  }
+  for (int i = 0; i < node_count; i++) {
+    agent_conn_t* c = &conns[i];
+    c->fd = -1;
+    if (args->agent_nodes)
+      snprintf(c->node, sizeof(c->node), "%.48s-sim%04d", host, i);
+    else
+      copy_string(c->node, sizeof(c->node), host);
+    hello_lens[i] = agent_encode_hello(hellos + i * hello_cap, c->node, args->interval_ms,
+                                       device_ids, names, uuids, count);
+  }
+
+  signal(SIGINT, signal_handler);
+  signal(SIGTERM, signal_handler);
+  signal(SIGPIPE, SIG_IGN);
+
+  int error_count = 0;
+  if (sampler_start(devices, device_ids, count, SAMPLE_ALL, NULL) != 0) {
+    error_count++;
+    running = 0;
+  }
+
+  tick_scheduler_t sched;
+  tick_scheduler_init(&sched, args->interval_ms);
+  while (running && tick_scheduler_wait(&sched)) {
+    // Start due connects first, so the handshakes overlap with sampling
+    long long now = now_ns();
+    for (int i = 0; i < node_count; i++)
+      if (conns[i].state == AGENT_IDLE && now >= conns[i].since_ns) agent_connect(&conns[i], now);
+
+    sampler_request_tick(sched.ticks);
+    sampler_collect(sched.ticks, sched.next_ns, latest, fresh);
+    for (int i = 0; i < count; i++) {
+      if (fresh[i])
+        samples[i] = latest[i].sample;
+      else
+        memset(&samples[i], 0, sizeof(samples[i])); // Sent as invalid
+    }
+    size_t len = agent_encode_samples(frame, realtime_ns() / 1000000, samples, count);
+
+    now = now_ns();
+    agent_poll(conns, node_count, pfds, hellos, hello_lens, hello_cap, now);
+    for (int i = 0; i < node_count; i++) {
+      if (conns[i].state != AGENT_CONNECTED) continue;
+      int rc = agent_send(&conns[i], frame, len, now);
+      if (rc > 0) agent.sent++;
+      if (rc == 0) agent.dropped++;
+    }
+
+    if (args->count && sched.ticks >= args->count) break;
+  }
+
+  sampler_stop();
+  int connected = 0;
+  for (int i = 0; i < node_count; i++) {
+    if (conns[i].state == AGENT_CONNECTED) connected++;
+    if (conns[i].fd >= 0) close(conns[i].fd);
+  }
+  fprintf(stderr, "agent: %lu ticks, %d/%d connected, %lu frames sent, %lu dropped, "
+                  "%lu reconnects\n",
+          sched.ticks, connected, node_count, agent.sent, agent.dropped, agent.reconnects);
+
+  free(conns);
+  free(pfds);
+  free(hellos);
+  free(hello_lens);
+  return error_count;
+}
+
+typedef struct {
+  int device_id;
+  char name[MAX_NAME_LEN];
+  char uuid[MAX_UUID_LEN];
+  device_sample_t sample;
+} fleet_device_t;
+
+typedef struct fleet_conn fleet_conn_t;
+
+typedef struct {
+  char name[NODE_NAME_LEN];
+  int next; // Next node in the hash chain, -1 at the end
+  unsigned int interval_ms;
+  int device_count;
+  fleet_device_t* devices;
+  long long updated_ns; // When the latest samples arrived, 0 before the first
+  long long left_ns;    // When its agent disconnected
+  fleet_conn_t* conn;   // Connection feeding the node, NULL while its agent is away
+} fleet_node_t;
+
+struct fleet_conn {
+  int fd;
+  int node; // Index into fleet.nodes, -1 until the hello
+  size_t len, cap;
+  unsigned char* buf;
+  fleet_conn_t *prev, *next; // In fleet.conns, whether or not a hello has arrived
+};
+
+// A node whose agent disconnects stays in the table, reported as such, for
+// AGGREGATE_EXPIRE_INTERVALS of its interval, then is dropped. An agent with the same name
+// saying hello again in the meantime takes it over.
+static struct {
+  fleet_node_t* nodes;
+  int node_count, node_cap;
+  int buckets[AGGREGATE_HASH_BUCKETS];
+  fleet_conn_t* conns;
+  unsigned long connections, frames, rejected, expired;
+  unsigned long long bytes;
+} fleet;
+
+static query_server_t fleet_queries;
+
+// epoll data for the two listening sockets and the query slots (FLEET_QUERY_CLIENT + slot);
+// anything else is a fleet_conn_t pointer
+enum { FLEET_AGENT_LISTENER = 1, FLEET_QUERY_LISTENER = 2, FLEET_QUERY_CLIENT = 16 };
+
+static unsigned int fleet_hash(const char* name) {
+  unsigned int h = 2166136261u; // FNV-1a
+  for (; *name; name++) h = (h ^ (unsigned char)*name) * 16777619u;
+  return h % AGGREGATE_HASH_BUCKETS;
+}
+
+// Find or add a node. Returns its index, or -1 when out of memory.
+static int fleet_node_get(const char* name) {
+  unsigned int bucket = fleet_hash(name);
+  for (int i = fleet.buckets[bucket]; i >= 0; i = fleet.nodes[i].next)
+    if (strcmp(fleet.nodes[i].name, name) == 0) return i;
+
+  if (fleet.node_count == fleet.node_cap) {
+    int cap = fleet.node_cap ? fleet.node_cap * 2 : 256;
+    fleet_node_t* nodes = realloc(fleet.nodes, cap * sizeof(*nodes));
+    if (!nodes) return -1;
+    fleet.nodes = nodes;
+    fleet.node_cap = cap;
+  }
+  int idx = fleet.node_count++;
+  fleet_node_t* node = &fleet.nodes[idx];
+  memset(node, 0, sizeof(*node));
+  copy_string(node->name, sizeof(node->name), name);
+  node->next = fleet.buckets[bucket];
+  fleet.buckets[bucket] = idx;
+  return idx;
+}
+
+// Drop a node, moving the last one into its slot
+static void fleet_node_remove(int idx) {
+  int* link = &fleet.buckets[fleet_hash(fleet.nodes[idx].name)];
+  while (*link != idx) link = &fleet.nodes[*link].next;
+  *link = fleet.nodes[idx].next;
+  free(fleet.nodes[idx].devices);
+
+  int last = --fleet.node_count;
+  if (idx == last) return;
+  fleet_node_t* moved = &fleet.nodes[last];
+  link = &fleet.buckets[fleet_hash(moved->name)];
+  while (*link != last) link = &fleet.nodes[*link].next;
+  *link = idx;
+  if (moved->conn) moved->conn->node = idx;
+  fleet.nodes[idx] = *moved;
+}
+
+// Drop nodes whose agent has been gone for AGGREGATE_EXPIRE_INTERVALS of its interval
+static void fleet_expire_nodes(long long now) {
+  for (int i = fleet.node_count - 1; i >= 0; i--) {
+    const fleet_node_t* node = &fleet.nodes[i];
+    if (node->conn ||
+        now - node->left_ns <= AGGREGATE_EXPIRE_INTERVALS * node->interval_ms * 1000000LL)
+      continue;
+    fleet_node_remove(i);
+    fleet.expired++;
+  }
+}
+
+static int fleet_apply_hello(fleet_conn_t* c, const unsigned char* p, size_t len) {
+  static fleet_device_t devices[MAX_DEVICES];
+  const unsigned char* end = p + len;
+  char name[NODE_NAME_LEN];
+
+  if (c->node >= 0 || len < 11 || memcmp(p, AGENT_MAGIC, 4) != 0 ||
+      get_le(p + 4, 2) != AGENT_VERSION) {
+    fleet.rejected++;
+    return -1;
+  }
+  unsigned int interval_ms = get_le(p + 6, 4);
+  p += 10;
+  if (agent_get_string(&p, end, name, sizeof(name)) != 0 || !name[0] || p >= end) return -1;
+  int count = *p++;
+  if (count > MAX_DEVICES) return -1;
+  for (int i = 0; i < count; i++) {
+    if (p >= end) return -1;
+    memset(&devices[i], 0, sizeof(devices[i]));
+    devices[i].device_id = *p++;
+    if (agent_get_string(&p, end, devices[i].name, sizeof(devices[i].name)) != 0 ||
+        agent_get_string(&p, end, devices[i].uuid, sizeof(devices[i].uuid)) != 0)
+      return -1;
+  }
+
+  int idx = fleet_node_get(name);
+  if (idx < 0) return -1;
+  fleet_node_t* node = &fleet.nodes[idx];
+  fleet_device_t* copy = realloc(node->devices, (count ? count : 1) * sizeof(*copy));
+  if (!copy) return -1;
+  memcpy(copy, devices, count * sizeof(*copy));
+
+  // A restarted agent usually reconnects before the old connection times out. The newest one
+  // wins; the old one is shut down here and closed when its EOF comes out of epoll, so a
+  // pointer to it in the current batch of events stays valid.
+  if (node->conn && node->conn != c) {
+    node->conn->node = -1;
+    shutdown(node->conn->fd, SHUT_RDWR);
+  }
+
+  node->devices = copy;
+  node->device_count = count;
+  node->interval_ms = interval_ms ? interval_ms : DEFAULT_WATCH_INTERVAL_MS;
+  node->updated_ns = 0;
+  node->conn = c;
+  c->node = idx;
+  return 0;
+}
+
+static int fleet_apply_samples(fleet_conn_t* c, const unsigned char* p, size_t len) {
+  if (c->node < 0 || len < 9) return -1;
+  fleet_node_t* node = &fleet.nodes[c->node];
+  int count = p[8];
+  if (count != node->device_count || len != 9 + (size_t)count * AGENT_SAMPLE_LEN) return -1;
+
+  p += 9;
+  for (int i = 0; i < count; i++, p += AGENT_SAMPLE_LEN)
+    agent_decode_sample(p, &node->devices[i].sample);
+  node->updated_ns = now_ns();
+  fleet.frames++;
+  return 0;
+}
+
+// Read what the agent sent and apply every complete frame. Returns -1 when the connection
+// should be closed (EOF, error, or a protocol violation).
+static int fleet_conn_read(fleet_conn_t* c) {
+  if (c->len == c->cap) {
+    // Complete frames are consumed below, so a full buffer holds less than one maximum frame
+    size_t cap = c->cap * 2;
+    unsigned char* buf = realloc(c->buf, cap);
+    if (!buf) return -1;
+    c->buf = buf;
+    c->cap = cap;
+  }
+
+  ssize_t n = read(c->fd, c->buf + c->len, c->cap - c->len);
+  if (n == 0) return -1;
+  if (n < 0) return errno == EAGAIN || errno == EINTR ? 0 : -1;
+  c->len += n;
+  fleet.bytes += n;
+
+  size_t pos = 0;
+  while (c->len - pos >= AGENT_HEADER_LEN) {
+    const unsigned char* frame = c->buf + pos;
+    size_t payload = get_le(frame, 2);
+    if (c->len - pos < AGENT_HEADER_LEN + payload) break;
+
+    const unsigned char* p = frame + AGENT_HEADER_LEN;
+    int rc = frame[2] == AGENT_FRAME_HELLO     ? fleet_apply_hello(c, p, payload)
+             : frame[2] == AGENT_FRAME_SAMPLES ? fleet_apply_samples(c, p, payload)
+                                               : 0; // Unknown frames are skipped
+    if (rc != 0) return -1;
+    pos += AGENT_HEADER_LEN + payload;
+  }
+  memmove(c->buf, c->buf + pos, c->len - pos);
+  c->len -= pos;
+  return 0;
+}
+
+static void fleet_conn_close(fleet_conn_t* c) {
+  if (c->node >= 0 && fleet.nodes[c->node].conn == c) {
+    fleet.nodes[c->node].conn = NULL;
+    fleet.nodes[c->node].left_ns = now_ns();
+  }
+  if (c->prev)
+    c->prev->next = c->next;
+  else
+    fleet.conns = c->next;
+  if (c->next) c->next->prev = c->prev;
+  close(c->fd); // Also removes it from the epoll set
+  free(c->buf);
+  free(c);
+}
+
+// Accept every pending agent. When out of descriptors, the spare one is given up to accept and
+// drop the connection, since a connection left in the backlog would keep epoll spinning.
+static void fleet_accept(int epoll_fd, int listen_fd, int* spare_fd) {
+  for (;;) {
+    int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      if ((errno == EMFILE || errno == ENFILE) && *spare_fd >= 0) {
+        close(*spare_fd);
+        fd = accept(listen_fd, NULL, NULL);
+        if (fd >= 0) close(fd);
+        *spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        fprintf(stderr, "Warning: Out of file descriptors, refused an agent\n");
+        continue;
+      }
+      return; // EAGAIN: backlog drained
+    }
+
+    fleet_conn_t* c = calloc(1, sizeof(*c));
+    if (c) c->buf = malloc(c->cap = 1024);
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = c};
+    if (!c || !c->buf || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+      if (c) free(c->buf);
+      free(c);
+      close(fd);
+      continue;
+    }
+    c->fd = fd;
+    c->node = -1;
+    c->next = fleet.conns;
+    if (c->next) c->next->prev = c;
+    fleet.conns = c;
+    fleet.connections++;
+  }
+}
+
+static int fleet_compare_nodes(const void* a, const void* b) {
+  return strcmp(fleet.nodes[*(const int*)a].name, fleet.nodes[*(const int*)b].name);
+}
+
+// Why a node has no current samples, NULL if it has them
+static const char* fleet_node_problem(const fleet_node_t* node, long long now) {
+  if (!node->conn) return "Agent disconnected";
+  if (!node->updated_ns) return "No samples yet";
+  if (now - node->updated_ns > AGGREGATE_STALE_INTERVALS * node->interval_ms * 1000000LL)
+    return "Samples are stale";
+  return NULL;
+}
+
+// Answer status, list or info json from the latest samples of every node, sorted by node name.
+// Devices are selected by index (-d) on every node.
+static int answer_fleet_query(const cli_args_t* args, FILE* file, FILE* err, void* ctx) {
+  static int* order;
+  static int order_cap;
+  static struct {
+    int node, device;
+  }* rows;
+  static int row_cap;
+  (void)ctx;
+
+  int json = args->command == CMD_INFO && args->subcommand == SUBCMD_JSON;
+  if (args->command != CMD_STATUS && args->command != CMD_LIST && !json) {
+    fprintf(err, "Error: nvml-tool aggregate answers status, list and info json only\n");
+    return 1;
+  }
+  if (args->uuid_list[0] || args->pci_list[0]) {
+    fprintf(err, "Error: Select devices with -d when querying nvml-tool aggregate\n");
+    return 1;
+  }
+
+  int row_count = 0, total = 0;
+  for (int i = 0; i < fleet.node_count; i++) total += fleet.nodes[i].device_count;
+  if (!rows || fleet.node_count > order_cap || total > row_cap) {
+    free(order);
+    free(rows);
+    order_cap = fleet.node_count * 2 + 256;
+    row_cap = total * 2 + 1024;
+    order = malloc(order_cap * sizeof(*order));
+    rows = malloc(row_cap * sizeof(*rows));
+    if (!order || !rows) {
+      order_cap = row_cap = 0;
+      fprintf(err, "Error: Out of memory\n");
+      return 1;
+    }
+  }
+  for (int i = 0; i < fleet.node_count; i++) order[i] = i;
+  qsort(order, fleet.node_count, sizeof(*order), fleet_compare_nodes);
+
+  // Errors go out as they are found; the rows are printed after, once the last one is known
+  int error_count = 0;
+  long long now = now_ns();
+  for (int i = 0; i < fleet.node_count; i++) {
+    const fleet_node_t* node = &fleet.nodes[order[i]];
+    const char* problem = fleet_node_problem(node, now);
+    if (problem) {
+      fprintf(err, "%s:Error: %s\n", node->name, problem);
+      error_count++;
+      continue;
+    }
+    for (int d = 0; d < node->device_count; d++) {
+      const fleet_device_t* dev = &node->devices[d];
+      if (!device_selected(args, dev->device_id)) continue;
+      if (!dev->sample.valid && args->command != CMD_LIST) {
+        fprintf(err, "%s:%d:Error: No sample (device not responding)\n", node->name,
+                dev->device_id);
+        error_count++;
+        continue;
+      }
+      rows[row_count].node = order[i];
+      rows[row_count].device = d;
+      row_count++;
+    }
+  }
+
+  static out_t frame;
+  out_t* out = &frame;
+  out_init_file(out, file);
+  if (json) out_str(out, "[\n");
+  for (int r = 0; r < row_count; r++) {
+    const fleet_node_t* node = &fleet.nodes[rows[r].node];
+    const fleet_device_t* dev = &node->devices[rows[r].device];
+    if (json) {
+      print_sample_json(out, node->name, &dev->sample, dev->name, dev->uuid, dev->device_id,
+                        args->temp_unit, r == row_count - 1);
+      continue;
+    }
+
+    out_str(out, node->name);
+    out_char(out, ':');
+    if (args->command == CMD_STATUS) {
+      print_status_cli(out, &dev->sample, dev->device_id, args->temp_unit);
+    } else {
+      out_i64(out, dev->device_id);
+      out_char(out, ':');
+      out_str(out, dev->uuid);
+      out_char(out, ' ');
+      out_str(out, dev->name);
+      out_char(out, '\n');
+    }
+  }
+  if (json) out_str(out, "]\n");
+  out_flush(out);
+  return error_count;
+}
+
+// Accept pending query clients and add them to the epoll set
+static void fleet_query_accept(int epoll_fd, int query_fd) {
+  int slot;
+  while ((slot = query_server_accept(&fleet_queries, query_fd)) >= 0) {
+    query_client_t* c = &fleet_queries.clients[slot];
+    struct epoll_event ev = {.events = EPOLLIN, .data.u64 = FLEET_QUERY_CLIENT + slot};
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, c->fd, &ev) != 0) query_client_close(&fleet_queries, c);
+  }
+}
+
+// Make progress on a query client, switching its epoll interest to EPOLLOUT once the reply
+// blocks. Returns nonzero when it should be closed.
+static int fleet_query_io(int epoll_fd, int slot) {
+  query_client_t* c = &fleet_queries.clients[slot];
+  short events = c->events;
+  if (query_client_io(&fleet_queries, c) != 0) return 1;
+  if (c->events == events) return 0;
+  struct epoll_event ev = {.events = EPOLLOUT, .data.u64 = FLEET_QUERY_CLIENT + slot};
+  return epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &ev) != 0;
+}
+
+// Collect agent streams on --listen and answer fleet queries on the -S socket, from one epoll
+// loop. Query clients are nonblocking members of the same set, bounded by QUERY_MAX_CLIENTS.
+static int run_aggregate(const cli_args_t* args) {
+  const char* path = args->socket_path[0] ? args->socket_path : DEFAULT_AGGREGATE_SOCKET;
+  for (int i = 0; i < AGGREGATE_HASH_BUCKETS; i++) fleet.buckets[i] = -1;
+  query_server_init(&fleet_queries, answer_fleet_query, NULL);
+
+  rlim_t fd_limit = raise_fd_limit();
+  int listen_fd = tcp_listen(args->listen_addr, 4096);
+  if (listen_fd < 0) return 1;
+  int query_fd = unix_listen(path);
+  if (query_fd < 0) {
+    close(listen_fd);
+    return 1;
+  }
+  fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL) | O_NONBLOCK);
+
+  int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  struct epoll_event agent_ev = {.events = EPOLLIN, .data.u64 = FLEET_AGENT_LISTENER};
+  struct epoll_event query_ev = {.events = EPOLLIN, .data.u64 = FLEET_QUERY_LISTENER};
+  if (epoll_fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &agent_ev) != 0 ||
+      epoll_ctl(epoll_fd, EPOLL_CTL_ADD, query_fd, &query_ev) != 0) {
+    fprintf(stderr, "Error: Cannot set up epoll (%s)\n", strerror(errno));
+    if (epoll_fd >= 0) close(epoll_fd);
+    close(listen_fd);
+    close(query_fd);
+    unlink(path);
+    return 1;
+  }
+  int spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+  signal(SIGINT, signal_handler);
+  signal(SIGTERM, signal_handler);
+  signal(SIGPIPE, SIG_IGN);
+
+  fprintf(stderr, "Aggregating agents on %s (up to %llu connections), queries on %s\n",
+          args->listen_addr, (unsigned long long)fd_limit, path);
+
+  struct epoll_event events[AGGREGATE_MAX_EVENTS];
+  int query_listening = 1;
+  long long next_sweep_ns = 0;
+  while (running) {
+    // Stop watching the query listener while every slot is taken, or it would keep epoll
+    // spinning; the clients wait in the backlog until one frees up
+    int accepting = fleet_queries.count < QUERY_MAX_CLIENTS;
+    if (accepting != query_listening) {
+      query_ev.events = accepting ? EPOLLIN : 0;
+      epoll_ctl(epoll_fd, EPOLL_CTL_MOD, query_fd, &query_ev);
+      query_listening = accepting;
+    }
+
+    long long now = now_ns();
+    if (now >= next_sweep_ns) {
+      fleet_expire_nodes(now);
+      next_sweep_ns = now + AGGREGATE_SWEEP_MS * 1000000LL;
+    }
+    int timeout = query_server_sweep(&fleet_queries);
+    if (timeout < 0 || timeout > AGGREGATE_SWEEP_MS) timeout = AGGREGATE_SWEEP_MS;
+    int n = epoll_wait(epoll_fd, events, AGGREGATE_MAX_EVENTS, timeout); // EINTR: re-check
+    for (int i = 0; i < n; i++) {
+      uint64_t tag = events[i].data.u64;
+      if (tag == FLEET_AGENT_LISTENER) {
+        fleet_accept(epoll_fd, listen_fd, &spare_fd);
+      } else if (tag == FLEET_QUERY_LISTENER) {
+        fleet_query_accept(epoll_fd, query_fd);
+      } else if (tag >= FLEET_QUERY_CLIENT && tag < FLEET_QUERY_CLIENT + QUERY_MAX_CLIENTS) {
+        int slot = tag - FLEET_QUERY_CLIENT;
+        if (fleet_queries.clients[slot].fd >= 0 && fleet_query_io(epoll_fd, slot) != 0)
+          query_client_close(&fleet_queries, &fleet_queries.clients[slot]);
+      } else {
+        fleet_conn_t* c = events[i].data.ptr;
+        if (fleet_conn_read(c) != 0) fleet_conn_close(c);
+      }
+    }
+  }
+
+  int connected = 0;
+  for (int i = 0; i < fleet.node_count; i++) {
+    if (fleet.nodes[i].conn) connected++;
+    free(fleet.nodes[i].devices);
+  }
+  while (fleet.conns) fleet_conn_close(fleet.conns); // Including those that never said hello
+  fprintf(stderr, "aggregate: %d nodes (%d connected), %lu connections, %lu sample frames, "
+                  "%llu bytes received, %lu rejected, %lu expired\n",
+          fleet.node_count, connected, fleet.connections, fleet.frames, fleet.bytes,
+          fleet.rejected, fleet.expired);
+
+  for (int i = 0; i < QUERY_MAX_CLIENTS; i++)
+    if (fleet_queries.clients[i].fd >= 0)
+      query_client_close(&fleet_queries, &fleet_queries.clients[i]);
+  free(fleet.nodes);
+  if (spare_fd >= 0) close(spare_fd);
+  close(epoll_fd);
+  close(listen_fd);
+  close(query_fd);
+  unlink(path);
+  return 0;
+}
+
+// Getters timed by bench. Each wrapper makes exactly one driver call, except sample_device,
+// which is the full batched sample used by watch, status and info.
+typedef nvmlReturn_t (*bench_fn_t)(nvmlDevice_t device, field_plan_t* plan);
+
+static nvmlReturn_t bench_temperature(nvmlDevice_t device, field_plan_t* plan) {
+  unsigned int temp;
+  (void)plan;
+  return nvmlDeviceGetTemperature(device, NVML_TEMPERATURE_GPU, &temp);
+}
+
+static nvmlReturn_t bench_memory(nvmlDevice_t device, field_plan_t* plan) {
+  nvmlMemory_t memory;
+  (void)plan;
+  return nvmlDeviceGetMemoryInfo(device, &memory);
+}
+
+static nvmlReturn_t bench_power_usage(nvmlDevice_t device, field_plan_t* plan) {
+  unsigned int power;
+  (void)plan;
+  return nvmlDeviceGetPowerUsage(device, &power);
+}
+
+static nvmlReturn_t bench_power_limit(nvmlDevice_t device, field_plan_t* plan) {
+  unsigned int limit;
+  (void)plan;
+  return nvmlDeviceGetPowerManagementLimit(device, &limit);
+}
+
+static nvmlReturn_t bench_power_constraints(nvmlDevice_t device, field_plan_t* plan) {
+  unsigned int min_limit, max_limit;
+  (void)plan;
+  return nvmlDeviceGetPowerManagementLimitConstraints(device, &min_limit, &max_limit);
+}
+
+static nvmlReturn_t bench_fan_speed(nvmlDevice_t device, field_plan_t* plan) {
+  unsigned int speed;
+  (void)plan;
+  return nvmlDeviceGetFanSpeed(device, &speed);
+}
+
+static nvmlReturn_t bench_fan_speed_v2(nvmlDevice_t device, field_plan_t* plan) {
+  unsigned int speed;
+  (void)plan;
+  return nvmlDeviceGetFanSpeed_v2(device, 0, &speed);
+}
+
+static nvmlReturn_t bench_num_fans(nvmlDevice_t device, field_plan_t* plan) {
+  unsigned int count;
+  (void)plan;
+  return nvmlDeviceGetNumFans(device, &count);
+}
+
+static nvmlReturn_t bench_utilization(nvmlDevice_t device, field_plan_t* plan) {
+  nvmlUtilization_t utilization;
+  (void)plan;
+  return nvmlDeviceGetUtilizationRates(device, &utilization);
+}
+
+static nvmlReturn_t bench_pcie_throughput(nvmlDevice_t device, field_plan_t* plan) {
+  unsigned int value;
+  (void)plan;
+  return nvmlDeviceGetPcieThroughput(device, NVML_PCIE_UTIL_RX_BYTES, &value);
+}
+
+static nvmlReturn_t bench_name(nvmlDevice_t device, field_plan_t* plan) {
+  char name[MAX_NAME_LEN];
+  (void)plan;
+  return nvmlDeviceGetName(device, name, sizeof(name));
+}
 
-  return setpoints[0].fan; // Fallback
+static nvmlReturn_t bench_uuid(nvmlDevice_t device, field_plan_t* plan) {
+  char uuid[MAX_UUID_LEN];
+  (void)plan;
+  return nvmlDeviceGetUUID(device, uuid, sizeof(uuid));
 }
 
-static void clear_lines(int count) {
-  if (is_terminal && count > 0) {
-    // Move cursor up and clear lines
-    for (int i = 0; i < count; i++) printf("\033[1A\033[2K"); // Move up one line and clear it
-  }
+static nvmlReturn_t bench_pci_info(nvmlDevice_t device, field_plan_t* plan) {
+  nvmlPciInfo_t pci;
+  (void)plan;
+  return nvmlDeviceGetPciInfo(device, &pci);
 }
 
-static void print_usage(const char* name) {
-  printf("Usage: %s <command> [subcommand] [options] [args]\n", name);
-  printf("\nCommands:\n");
-  printf("  info [json]         Show comprehensive device information\n");
-  printf("  power [set VALUE]   Show/set power usage and limits\n");
-  printf("  fan [set VALUE]     Show/set fan speed (NVML v12+)\n");
-  printf("  fan restore         Restore automatic fan control\n");
-  printf("  fanctl SETPOINTS    Dynamic fan control with temperature setpoints\n");
-  printf("  temp                Show temperature\n");
-  printf("  status              Show compact status overview\n");
-  printf("  list                List all GPUs with index, UUID, and name\n");
-  printf("\nDevice Selection:\n");
-  printf("  -d, --device LIST   Select devices (default: all)\n");
-  printf("                      Examples: -d 0  -d 0-2  -d 0,2,4\n");
-  printf("  -u, --uuid UUID     Select device by UUID\n");
-  printf("\nOutput Options:\n");
-  printf("  --temp-unit UNIT    Temperature unit: C, F, K (default: C)\n");
-  printf("  -h, --help          Show this help\n");
-  printf("\nExamples:\n");
-  printf("  %s info                    # Show info for all devices\n", name);
-  printf("  %s info -d 0              # Show info for device 0\n", name);
-  printf("  %s power -d 0-2           # Show power for devices 0,1,2\n", name);
-  printf("  %s power set 250 -d 1     # Set 250W limit on device 1\n", name);
-  printf("  %s fan                    # Show fan speeds for all devices\n", name);
-  printf("  %s fan set 80 -d 1        # Set 80%% fan speed on device 1\n", name);
-  printf("  %s fan restore            # Restore automatic control\n", name);
-  printf("  %s fanctl 50:30 70:60 80:90 -d 0  # Dynamic fan control (Ctrl-C to exit)\n", name);
-  printf("  %s info json              # JSON info for all devices\n", name);
+static nvmlReturn_t bench_field_values(nvmlDevice_t device, field_plan_t* plan) {
+  if (plan->field_count == 0) return NVML_ERROR_NOT_SUPPORTED;
+  return nvmlDeviceGetFieldValues(device, plan->field_count, plan->fields);
 }
 
-static double convert_temperature(unsigned int temp_c, char unit) {
-  switch (unit) {
-  case 'C': return temp_c;
-  case 'F': return (temp_c * 9.0 / 5.0) + 32.0;
-  case 'K': return temp_c + 273.15;
-  default: return temp_c;
-  }
+static nvmlReturn_t bench_sample(nvmlDevice_t device, field_plan_t* plan) {
+  device_sample_t sample;
+  field_plan_t copy = *plan; // Keep the plan unchanged for the next iteration
+  sample_device(device, &copy, &sample);
+  return sample.valid ? NVML_SUCCESS : NVML_ERROR_NOT_SUPPORTED;
 }
 
-static int parse_device_range(const char* range_str, int* devices, int max_devices) {
-  char* str = strdup(range_str);
-  char* token = strtok(str, ",");
-  int count = 0;
+static const struct {
+  const char* name;
+  bench_fn_t fn;
+} bench_getters[] = {{"nvmlDeviceGetTemperature", bench_temperature},
+                     {"nvmlDeviceGetMemoryInfo", bench_memory},
+                     {"nvmlDeviceGetPowerUsage", bench_power_usage},
+                     {"nvmlDeviceGetPowerManagementLimit", bench_power_limit},
+                     {"nvmlDeviceGetPowerManagementLimitConstraints", bench_power_constraints},
+                     {"nvmlDeviceGetFanSpeed", bench_fan_speed},
+                     {"nvmlDeviceGetFanSpeed_v2", bench_fan_speed_v2},
+                     {"nvmlDeviceGetNumFans", bench_num_fans},
+                     {"nvmlDeviceGetUtilizationRates", bench_utilization},
+                     {"nvmlDeviceGetPcieThroughput", bench_pcie_throughput},
+                     {"nvmlDeviceGetName", bench_name},
+                     {"nvmlDeviceGetUUID", bench_uuid},
+                     {"nvmlDeviceGetPciInfo", bench_pci_info},
+                     {"nvmlDeviceGetFieldValues", bench_field_values},
+                     {"sample_device", bench_sample}};
 
-  while (token && count < max_devices) {
-    char* dash = strchr(token, '-');
-    if (dash) {
-      *dash = '\0';
-      int start = atoi(token);
-      int end = atoi(dash + 1);
-      for (int i = start; i <= end && count < max_devices; i++) devices[count++] = i;
-    } else {
-      devices[count++] = atoi(token);
-    }
-    token = strtok(NULL, ",");
-  }
+typedef struct {
+  nvmlReturn_t status; // Result of the first (untimed) call; nothing is timed if it failed
+  long long p50_ns, p99_ns, max_ns;
+  double mean_ns;
+  double calls_per_sec;
+} bench_result_t;
 
-  free(str);
-  return count;
+static int compare_ll(const void* a, const void* b) {
+  long long x = *(const long long*)a, y = *(const long long*)b;
+  return (x > y) - (x < y);
 }
 
-static int find_device_by_uuid(const char* uuid, unsigned int device_count) {
-  for (unsigned int i = 0; i < device_count; i++) {
-    nvmlDevice_t device;
-    char device_uuid[MAX_UUID_LEN];
+static void bench_getter(bench_fn_t fn, nvmlDevice_t device, field_plan_t* plan,
+                         unsigned long iterations, long long* times, bench_result_t* res) {
+  memset(res, 0, sizeof(*res));
+  res->status = fn(device, plan); // Warm-up: resolves the symbol and fills driver caches
+  if (res->status != NVML_SUCCESS) return;
 
-    if (nvmlDeviceGetHandleByIndex(i, &device) == NVML_SUCCESS &&
-        nvmlDeviceGetUUID(device, device_uuid, sizeof(device_uuid)) == NVML_SUCCESS) {
-      if (strstr(device_uuid, uuid) != NULL) return i;
-    }
+  long long total = 0;
+  for (unsigned long i = 0; i < iterations; i++) {
+    long long start = now_ns();
+    fn(device, plan);
+    times[i] = now_ns() - start;
+    total += times[i];
   }
-  return -1;
-}
 
-static void print_device_info_human(nvmlDevice_t device, int device_id, char temp_unit) {
-  nvmlReturn_t result;
-  char name[MAX_NAME_LEN];
-  char uuid[MAX_UUID_LEN];
-  unsigned int temperature;
-  nvmlMemory_t memory;
-  unsigned int fan_speed;
-  unsigned int power_usage, power_limit;
+  qsort(times, iterations, sizeof(times[0]), compare_ll);
+  res->p50_ns = times[(iterations - 1) * 50 / 100];
+  res->p99_ns = times[(iterations - 1) * 99 / 100];
+  res->max_ns = times[iterations - 1];
+  res->mean_ns = (double)total / iterations;
+  res->calls_per_sec = total > 0 ? iterations * 1e9 / total : 0;
+}
 
-  printf("=== Device %d", device_id);
+// bench --formatters: frames per second of the status and info json output, formatted the old
+// way (a printf per field through stdio, flushed per frame) and with the frame writer, both into
+// /dev/null so only formatting and the write calls are measured. Samples are real ones taken
+// once from the selected devices.
+typedef void (*format_fn_t)(FILE* file, out_t* out, const device_sample_t* samples,
+                            const int* device_ids, int count);
 
-  result = nvmlDeviceGetName(device, name, sizeof(name));
-  if (result == NVML_SUCCESS) printf(": %s", name);
-  printf(" ===\n");
+static void format_status_printf(FILE* file, out_t* out, const device_sample_t* samples,
+                                 const int* device_ids, int count) {
+  (void)out;
+  for (int i = 0; i < count; i++)
+    fprintf(file, "%d:%.1f%c,%u%%,%.1fW\n", device_ids[i], (double)samples[i].temperature, 'C',
+            samples[i].fan_speed, samples[i].power_usage / 1000.0);
+  fflush(file);
+}
 
-  result = nvmlDeviceGetUUID(device, uuid, sizeof(uuid));
-  if (result == NVML_SUCCESS) printf("UUID:        %s\n", uuid);
+static void format_status_writer(FILE* file, out_t* out, const device_sample_t* samples,
+                                 const int* device_ids, int count) {
+  (void)file;
+  for (int i = 0; i < count; i++) print_status_cli(out, &samples[i], device_ids[i], 'C');
+  out_flush(out);
+}
 
-  result = nvmlDeviceGetTemperature(device, NVML_TEMPERATURE_GPU, &temperature);
-  if (result == NVML_SUCCESS) {
-    double temp = convert_temperature(temperature, temp_unit);
-    printf("Temperature: %.1f%c\n", temp, temp_unit);
+static void format_json_printf(FILE* file, out_t* out, const device_sample_t* samples,
+                               const int* device_ids, int count) {
+  (void)out;
+  fprintf(file, "[\n");
+  for (int i = 0; i < count; i++) {
+    const device_sample_t* sample = &samples[i];
+    fprintf(file, "  {\n");
+    fprintf(file, "    \"device_id\": %d,\n", device_ids[i]);
+    fprintf(file, "    \"name\": \"%s\",\n", "NVIDIA Benchmark GPU");
+    fprintf(file, "    \"uuid\": \"%s\",\n", "GPU-00000000-0000-0000-0000-000000000000");
+    fprintf(file, "    \"temperature\": %.1f,\n", (double)sample->temperature);
+    fprintf(file, "    \"temperature_unit\": \"%c\",\n", 'C');
+    fprintf(file, "    \"memory_total_mb\": %llu,\n", sample->memory.total / (1024 * 1024));
+    fprintf(file, "    \"memory_used_mb\": %llu,\n", sample->memory.used / (1024 * 1024));
+    fprintf(file, "    \"memory_free_mb\": %llu,\n", sample->memory.free / (1024 * 1024));
+    fprintf(file, "    \"fan_speed_percent\": %u,\n", sample->fan_speed);
+    fprintf(file, "    \"power_usage_watts\": %.2f,\n", sample->power_usage / 1000.0);
+    fprintf(file, "    \"power_limit_watts\": %.2f\n", sample->power_limit / 1000.0);
+    fprintf(file, "  }%s\n", i == count - 1 ? "" : ",");
   }
+  fprintf(file, "]\n");
+  fflush(file);
+}
 
-  result = nvmlDeviceGetMemoryInfo(device, &memory);
-  if (result == NVML_SUCCESS) {
-    double used_pct = (double)memory.used / memory.total * 100.0;
-    printf("Memory:      %llu MB / %llu MB (%.1f%%)\n", memory.used / (1024 * 1024),
-           memory.total / (1024 * 1024), used_pct);
+static void format_json_writer(FILE* file, out_t* out, const device_sample_t* samples,
+                               const int* device_ids, int count) {
+  (void)file;
+  out_str(out, "[\n");
+  for (int i = 0; i < count; i++)
+    print_sample_json(out, NULL, &samples[i], "NVIDIA Benchmark GPU",
+                      "GPU-00000000-0000-0000-0000-000000000000", device_ids[i], 'C',
+                      i == count - 1);
+  out_str(out, "]\n");
+  out_flush(out);
+}
+
+static const struct {
+  const char* name;
+  format_fn_t fn;
+  int writer; // Uses the frame writer (and reports its frame size)
+} bench_formatters[] = {{"status (printf)", format_status_printf, 0},
+                        {"status (writer)", format_status_writer, 1},
+                        {"info json (printf)", format_json_printf, 0},
+                        {"info json (writer)", format_json_writer, 1}};
+
+static int run_format_bench(const cli_args_t* args, nvmlDevice_t* devices, const int* device_ids,
+                            int count) {
+  int json = args->subcommand == SUBCMD_JSON;
+  unsigned long iterations = args->count ? args->count : DEFAULT_BENCH_ITERATIONS;
+  size_t formatter_count = sizeof(bench_formatters) / sizeof(bench_formatters[0]);
+  static device_sample_t samples[MAX_DEVICES];
+  static out_t out;
+
+  int fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+  FILE* file = fd >= 0 ? fdopen(dup(fd), "w") : NULL;
+  long long* times = malloc(iterations * sizeof(long long));
+  if (fd < 0 || !file || !times) {
+    fprintf(stderr, "Error: Cannot set up the formatter benchmark (%s)\n", strerror(errno));
+    if (file) fclose(file);
+    if (fd >= 0) close(fd);
+    free(times);
+    return 1;
+  }
+  out_init_fd(&out, fd);
+  for (int i = 0; i < count; i++) {
+    field_plan_t plan;
+    field_plan_init(&plan, SAMPLE_ALL);
+    sample_device(devices[i], &plan, &samples[i]);
   }
 
-  result = nvmlDeviceGetFanSpeed(device, &fan_speed);
-  if (result == NVML_SUCCESS) printf("Fan Speed:   %u%%\n", fan_speed);
+  if (json)
+    printf("{\n  \"devices\": %d,\n  \"iterations\": %lu,\n  \"formatters\": [\n", count,
+           iterations);
+  else
+    printf("%d devices per frame, %lu frames per formatter\n%-22s %10s %10s %10s %12s %10s\n",
+           count, iterations, "Formatter", "p50 us", "p99 us", "max us", "frames/s", "MB/s");
 
-  result = nvmlDeviceGetPowerUsage(device, &power_usage);
-  if (result == NVML_SUCCESS) {
-    nvmlDeviceGetPowerManagementLimit(device, &power_limit);
-    double power_pct = (double)power_usage / power_limit * 100.0;
-    printf("Power:       %.2fW / %.2fW (%.1f%%)\n", power_usage / 1000.0, power_limit / 1000.0,
-           power_pct);
+  for (size_t f = 0; f < formatter_count; f++) {
+    // Warm-up. Each printf variant is followed by its writer variant, which prints the same
+    // bytes, so frame sizes come from the writer.
+    unsigned long long flushed = out.flushed;
+    bench_formatters[f].fn(file, &out, samples, device_ids, count);
+    size_t frame_bytes = bench_formatters[f].writer ? out.flushed - flushed : 0;
+    if (!bench_formatters[f].writer && f + 1 < formatter_count) {
+      flushed = out.flushed;
+      bench_formatters[f + 1].fn(file, &out, samples, device_ids, count);
+      frame_bytes = out.flushed - flushed;
+    }
+    long long total = 0;
+    for (unsigned long i = 0; i < iterations; i++) {
+      long long start = now_ns();
+      bench_formatters[f].fn(file, &out, samples, device_ids, count);
+      times[i] = now_ns() - start;
+      total += times[i];
+    }
+
+    qsort(times, iterations, sizeof(times[0]), compare_ll);
+    double frames_per_sec = total > 0 ? iterations * 1e9 / total : 0;
+    double mb_per_sec = frames_per_sec * frame_bytes / 1e6;
+    long long p50 = times[(iterations - 1) * 50 / 100], p99 = times[(iterations - 1) * 99 / 100];
+    if (json)
+      printf("    {\"formatter\": \"%s\", \"frame_bytes\": %zu, \"p50_ns\": %lld, \"p99_ns\": "
+             "%lld, \"max_ns\": %lld, \"frames_per_sec\": %.1f, \"mb_per_sec\": %.1f}%s\n",
+             bench_formatters[f].name, frame_bytes, p50, p99, times[iterations - 1],
+             frames_per_sec, mb_per_sec, f + 1 < formatter_count ? "," : "");
+    else
+      printf("%-22s %10.2f %10.2f %10.2f %12.0f %10.1f\n", bench_formatters[f].name, p50 / 1e3,
+             p99 / 1e3, times[iterations - 1] / 1e3, frames_per_sec, mb_per_sec);
   }
 
-  printf("\n");
+  if (json) printf("  ]\n}\n");
+  fclose(file);
+  close(fd);
+  free(times);
+  return 0;
 }
 
-static void print_device_info_json(nvmlDevice_t device, int device_id, char temp_unit,
-                                   int is_last) {
-  char name[MAX_NAME_LEN] = "Unknown";
-  char uuid[MAX_UUID_LEN] = "Unknown";
-  unsigned int temperature = 0;
-  nvmlMemory_t memory = {0};
-  unsigned int fan_speed = 0;
-  unsigned int power_usage = 0, power_limit = 0;
-
-  nvmlDeviceGetName(device, name, sizeof(name));
-  nvmlDeviceGetUUID(device, uuid, sizeof(uuid));
-  nvmlDeviceGetTemperature(device, NVML_TEMPERATURE_GPU, &temperature);
-  nvmlDeviceGetMemoryInfo(device, &memory);
-  nvmlDeviceGetFanSpeed(device, &fan_speed);
-  nvmlDeviceGetPowerUsage(device, &power_usage);
-  nvmlDeviceGetPowerManagementLimit(device, &power_limit);
-
-  printf("  {\n");
-  printf("    \"device_id\": %d,\n", device_id);
-  printf("    \"name\": \"%s\",\n", name);
-  printf("    \"uuid\": \"%s\",\n", uuid);
-  printf("    \"temperature\": %.1f,\n", convert_temperature(temperature, temp_unit));
-  printf("    \"temperature_unit\": \"%c\",\n", temp_unit);
-  printf("    \"memory_total_mb\": %llu,\n", memory.total / (1024 * 1024));
-  printf("    \"memory_used_mb\": %llu,\n", memory.used / (1024 * 1024));
-  printf("    \"memory_free_mb\": %llu,\n", memory.free / (1024 * 1024));
-  printf("    \"fan_speed_percent\": %u,\n", fan_speed);
-  printf("    \"power_usage_watts\": %.2f,\n", power_usage / 1000.0);
-  printf("    \"power_limit_watts\": %.2f\n", power_limit / 1000.0);
-  printf("  }%s\n", is_last ? "" : ",");
-}
-
-static void print_power_cli(nvmlDevice_t device, int device_id) {
-  unsigned int power_usage;
-  nvmlReturn_t result = nvmlDeviceGetPowerUsage(device, &power_usage);
+// Time every getter the tool uses, one device at a time, and report latency percentiles
+static int run_bench(const cli_args_t* args, nvmlDevice_t* devices, const int* device_ids,
+                     int count) {
+  if (args->formatters) return run_format_bench(args, devices, device_ids, count);
 
-  if (result == NVML_SUCCESS)
-    printf("%d:%.2f\n", device_id, power_usage / 1000.0);
-  else
-    fprintf(stderr, "%d:Error: %s\n", device_id, nvmlErrorString(result));
-}
+  int json = args->subcommand == SUBCMD_JSON;
+  unsigned long iterations = args->count ? args->count : DEFAULT_BENCH_ITERATIONS;
+  size_t getter_count = sizeof(bench_getters) / sizeof(bench_getters[0]);
 
-static void print_fan_cli(nvmlDevice_t device, int device_id) {
-  unsigned int fan_speed;
-  nvmlReturn_t result = nvmlDeviceGetFanSpeed(device, &fan_speed);
+  long long* times = malloc(iterations * sizeof(long long));
+  if (!times) {
+    fprintf(stderr, "Error: Cannot allocate %lu samples\n", iterations);
+    return 1;
+  }
+
+  char driver[NVML_SYSTEM_DRIVER_VERSION_BUFFER_SIZE] = "Unknown";
+  nvmlSystemGetDriverVersion(driver, sizeof(driver));
 
-  if (result == NVML_SUCCESS)
-    printf("%d:%u\n", device_id, fan_speed);
+  if (json)
+    printf("{\n  \"driver_version\": \"%s\",\n  \"iterations\": %lu,\n  \"devices\": [\n", driver,
+           iterations);
   else
-    fprintf(stderr, "%d:Error: %s\n", device_id, nvmlErrorString(result));
-}
+    printf("Driver %s, %lu iterations per getter\n", driver, iterations);
 
-static void print_temp_cli(nvmlDevice_t device, int device_id, char temp_unit) {
-  unsigned int temperature;
-  nvmlReturn_t result = nvmlDeviceGetTemperature(device, NVML_TEMPERATURE_GPU, &temperature);
+  for (int d = 0; d < count; d++) {
+    char name[MAX_NAME_LEN] = "Unknown";
+    field_plan_t plan;
+    get_device_name(devices[d], device_ids[d], name, sizeof(name));
+    field_plan_init(&plan, SAMPLE_ALL);
 
-  if (result == NVML_SUCCESS) {
-    double temp = convert_temperature(temperature, temp_unit);
-    printf("%d:%.1f\n", device_id, temp);
-  } else {
-    fprintf(stderr, "%d:Error: %s\n", device_id, nvmlErrorString(result));
+    if (json)
+      printf("    {\n      \"device_id\": %d,\n      \"name\": \"%s\",\n      \"getters\": [\n",
+             device_ids[d], name);
+    else
+      printf("\n=== Device %d: %s ===\n%-46s %10s %10s %10s %12s\n", device_ids[d], name, "Getter",
+             "p50 us", "p99 us", "max us", "calls/s");
+
+    for (size_t g = 0; g < getter_count; g++) {
+      bench_result_t res;
+      bench_getter(bench_getters[g].fn, devices[d], &plan, iterations, times, &res);
+
+      if (json) {
+        printf("        {\"getter\": \"%s\", \"status\": \"%s\"", bench_getters[g].name,
+               nvmlErrorString(res.status));
+        if (res.status == NVML_SUCCESS)
+          printf(", \"p50_ns\": %lld, \"p99_ns\": %lld, \"max_ns\": %lld, \"mean_ns\": %.1f, "
+                 "\"calls_per_sec\": %.1f",
+                 res.p50_ns, res.p99_ns, res.max_ns, res.mean_ns, res.calls_per_sec);
+        printf("}%s\n", g + 1 < getter_count ? "," : "");
+      } else if (res.status == NVML_SUCCESS) {
+        printf("%-46s %10.2f %10.2f %10.2f %12.0f\n", bench_getters[g].name, res.p50_ns / 1e3,
+               res.p99_ns / 1e3, res.max_ns / 1e3, res.calls_per_sec);
+      } else {
+        printf("%-46s %s\n", bench_getters[g].name, nvmlErrorString(res.status));
+      }
+    }
+
+    if (json) printf("      ]\n    }%s\n", d + 1 < count ? "," : "");
   }
-}
 
-static void print_status_cli(nvmlDevice_t device, int device_id, char temp_unit) {
-  unsigned int temperature = 0, fan_speed = 0, power_usage = 0;
+  if (json) printf("  ]\n}\n");
+  free(times);
+  return 0;
+}
 
-  nvmlDeviceGetTemperature(device, NVML_TEMPERATURE_GPU, &temperature);
-  nvmlDeviceGetFanSpeed(device, &fan_speed);
-  nvmlDeviceGetPowerUsage(device, &power_usage);
+// Parse a whole-string decimal number within [min, max]. Returns 0 on success.
+static int parse_double_in(const char* str, double min, double max, double* value) {
+  char* end;
+  errno = 0;
+  double v = strtod(str, &end);
+  if (end == str || *end || errno == ERANGE || !(v >= min && v <= max)) return -1;
+  *value = v;
+  return 0;
+}
 
-  double temp = convert_temperature(temperature, temp_unit);
-  printf("%d:%.1f%c,%u%%,%.1fW\n", device_id, temp, temp_unit, fan_speed, power_usage / 1000.0);
+static int parse_uint_in(const char* str, unsigned long min, unsigned long max,
+                         unsigned int* value) {
+  char* end;
+  errno = 0;
+  unsigned long v = strtoul(str, &end, 10);
+  // strtoul accepts a sign and negates, so "-1" would come back as ULONG_MAX
+  if (end == str || *end || errno == ERANGE || strchr(str, '-') || v < min || v > max) return -1;
+  *value = v;
+  return 0;
 }
 
 static int parse_args(int argc, char* argv[], cli_args_t* args) {
   memset(args, 0, sizeof(cli_args_t));
   args->temp_unit = 'C';
   args->all_devices = 1;
+  args->interval_ms = DEFAULT_WATCH_INTERVAL_MS;
+  args->listen_addr = DEFAULT_EXPORTER_ADDR;
+  args->encoding = REC_ENCODING_GORILLA;
+  args->window_ms = DEFAULT_STATS_WINDOW_MS;
+  args->deadband_w = POWERCTL_DEFAULT_DEADBAND_W;
+  args->pid = (pid_config_t){0, PID_DEFAULT_KP, PID_DEFAULT_KI, PID_DEFAULT_KD,
+                             PID_DEFAULT_SLEW, PID_DEFAULT_HYSTERESIS, 30, 100};
 
   if (argc < 2) return -1;
 
@@ -351,16 +6827,24 @@ static int parse_args(int argc, char* argv[], cli_args_t* args) {
     command_t cmd;
   } commands[] = {{"info", CMD_INFO},     {"power", CMD_POWER}, {"fan", CMD_FAN},
                   {"fanctl", CMD_FANCTL}, {"temp", CMD_TEMP},   {"status", CMD_STATUS},
-                  {"list", CMD_LIST}};
+                  {"list", CMD_LIST},     {"watch", CMD_WATCH}, {"serve", CMD_SERVE},
+                  {"shm", CMD_SHM},       {"exporter", CMD_EXPORTER},
+                  {"bench", CMD_BENCH},   {"record", CMD_RECORD},
+                  {"replay", CMD_REPLAY}, {"stats", CMD_STATS},
+                  {"energy", CMD_ENERGY}, {"procs", CMD_PROCS},
+                  {"agent", CMD_AGENT},   {"aggregate", CMD_AGGREGATE},
+                  {"powerctl", CMD_POWERCTL}, {"samples", CMD_SAMPLES}};
 
   args->command = CMD_NONE;
-  for (int i = 0; i < 7; i++) {
+  for (size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); i++) {
     if (strcmp(argv[1], commands[i].name) == 0) {
       args->command = commands[i].cmd;
       break;
     }
   }
   if (args->command == CMD_NONE) return -1;
+  if (args->command == CMD_PROCS) args->count = 1; // One snapshot unless -n asks for more
+  if (args->command == CMD_AGGREGATE) args->listen_addr = DEFAULT_AGGREGATE_ADDR;
 
   // Check for subcommand or fanctl setpoints
   int start_idx = 2;
@@ -392,27 +6876,73 @@ static int parse_args(int argc, char* argv[], cli_args_t* args) {
   } else if (argc > 2 && strcmp(argv[2], "json") == 0) {
     args->subcommand = SUBCMD_JSON;
     start_idx = 3;
+  } else if (argc > 2 && args->command == CMD_ENERGY &&
+             (strcmp(argv[2], "start") == 0 || strcmp(argv[2], "stop") == 0)) {
+    args->subcommand = argv[2][2] == 'a' ? SUBCMD_START : SUBCMD_STOP;
+    if (argc > 3) {
+      args->marker = argv[3];
+      start_idx = 4;
+    } else {
+      fprintf(stderr, "Error: '%s' requires a marker file\n", argv[2]);
+      return -1;
+    }
   }
 
   static struct option long_options[] = {{"device", required_argument, 0, 'd'},
                                          {"uuid", required_argument, 0, 'u'},
+                                         {"pci", required_argument, 0, 'P'},
                                          {"temp-unit", required_argument, 0, 't'},
+                                         {"interval", required_argument, 0, 'i'},
+                                         {"count", required_argument, 0, 'n'},
+                                         {"socket", required_argument, 0, 'S'},
+                                         {"shm", required_argument, 0, 'M'},
+                                         {"listen", required_argument, 0, 'l'},
+                                         {"events", no_argument, 0, 'e'},
+                                         {"output", required_argument, 0, 'o'},
+                                         {"mode", required_argument, 0, OPT_MODE},
+                                         {"target", required_argument, 0, OPT_TARGET},
+                                         {"gains", required_argument, 0, OPT_GAINS},
+                                         {"slew", required_argument, 0, OPT_SLEW},
+                                         {"hysteresis", required_argument, 0, OPT_HYSTERESIS},
+                                         {"fan-range", required_argument, 0, OPT_FAN_RANGE},
+                                         {"simulate", required_argument, 0, OPT_SIMULATE},
+                                         {"encoding", required_argument, 0, OPT_ENCODING},
+                                         {"from", required_argument, 0, OPT_FROM},
+                                         {"to", required_argument, 0, OPT_TO},
+                                         {"window", required_argument, 0, OPT_WINDOW},
+                                         {"every", required_argument, 0, OPT_EVERY},
+                                         {"energy", no_argument, 0, OPT_ENERGY},
+                                         {"throttle", no_argument, 0, OPT_THROTTLE},
+                                         {"io", no_argument, 0, OPT_IO},
+                                         {"formatters", no_argument, 0, OPT_FORMATTERS},
+                                         {"connect", required_argument, 0, OPT_CONNECT},
+                                         {"node", required_argument, 0, OPT_NODE},
+                                         {"nodes", required_argument, 0, OPT_NODES},
+                                         {"budget", required_argument, 0, OPT_BUDGET},
+                                         {"deadband", required_argument, 0, OPT_DEADBAND},
                                          {"help", no_argument, 0, 'h'},
                                          {0, 0, 0, 0}};
 
   int opt;
   optind = start_idx;
-  while ((opt = getopt_long(argc, argv, "d:u:t:h", long_options, NULL)) != -1) {
+  while ((opt = getopt_long(argc, argv, "d:u:t:i:n:S:M:l:eo:h", long_options, NULL)) != -1) {
     switch (opt) {
     case 'd':
       args->device_count = parse_device_range(optarg, args->devices, MAX_DEVICES);
       args->all_devices = 0;
       break;
     case 'u':
-      strncpy(args->uuid, optarg, sizeof(args->uuid) - 1);
-      args->use_uuid = 1;
+    case 'P': {
+      char* list = opt == 'u' ? args->uuid_list : args->pci_list;
+      size_t used = strlen(list);
+      if (used + strlen(optarg) + 2 > MAX_SELECTOR_LEN) {
+        fprintf(stderr, "Error: Too many devices selected\n");
+        return -1;
+      }
+      if (used) list[used++] = ',';
+      strcpy(list + used, optarg);
       args->all_devices = 0;
-      break;
+    } break;
     case 't':
       args->temp_unit = 0;
       if (!strcmp(optarg, "C")) args->temp_unit = 'C';
@@ -423,10 +6953,162 @@ static int parse_args(int argc, char* argv[], cli_args_t* args) {
         return -1;
       }
       break;
+    case 'i':
+      if (parse_uint_in(optarg, 1, MAX_INTERVAL_MS, &args->interval_ms) != 0) {
+        fprintf(stderr, "Error: Invalid interval '%s' (1-%d ms)\n", optarg, MAX_INTERVAL_MS);
+        return -1;
+      }
+      break;
+    case 'n': {
+      unsigned int count;
+      if (parse_uint_in(optarg, 0, UINT_MAX, &count) != 0) {
+        fprintf(stderr, "Error: Invalid count '%s' (0-%u)\n", optarg, UINT_MAX);
+        return -1;
+      }
+      args->count = count;
+    } break;
+    case 'M': args->shm_name = optarg; break;
+    case 'l': args->listen_addr = optarg; break;
+    case 'e': args->events = 1; break;
+    case 'o': args->output = optarg; break;
+    case OPT_MODE:
+      if (strcmp(optarg, "linear") == 0) {
+        args->fan_mode = FAN_MODE_LINEAR;
+      } else if (strcmp(optarg, "pid") == 0) {
+        args->fan_mode = FAN_MODE_PID;
+      } else {
+        fprintf(stderr, "Error: Invalid fan mode '%s' (linear or pid)\n", optarg);
+        return -1;
+      }
+      break;
+    case OPT_TARGET:
+      if (parse_double_in(optarg, 1, 150, &args->pid.target) != 0) {
+        fprintf(stderr, "Error: Invalid target '%s' (expected 1-150 C)\n", optarg);
+        return -1;
+      }
+      break;
+    case OPT_GAINS:
+      if (sscanf(optarg, "%lf:%lf:%lf", &args->pid.kp, &args->pid.ki, &args->pid.kd) != 3) {
+        fprintf(stderr, "Error: Invalid gains '%s' (expected KP:KI:KD)\n", optarg);
+        return -1;
+      }
+      break;
+    case OPT_SLEW:
+      if (parse_double_in(optarg, 0, 100, &args->pid.slew) != 0) {
+        fprintf(stderr, "Error: Invalid slew '%s' (expected 0-100 %%/s, 0 for unlimited)\n",
+                optarg);
+        return -1;
+      }
+      break;
+    case OPT_HYSTERESIS:
+      if (parse_double_in(optarg, 0, 20, &args->pid.hysteresis) != 0) {
+        fprintf(stderr, "Error: Invalid hysteresis '%s' (expected 0-20 C)\n", optarg);
+        return -1;
+      }
+      break;
+    case OPT_FAN_RANGE:
+      if (sscanf(optarg, "%u:%u", &args->pid.min_fan, &args->pid.max_fan) != 2 ||
+          args->pid.min_fan > args->pid.max_fan || args->pid.max_fan > 100) {
+        fprintf(stderr, "Error: Invalid fan range '%s' (expected MIN:MAX in 0-100)\n", optarg);
+        return -1;
+      }
+      break;
+    case OPT_SIMULATE: args->simulate = optarg; break;
+    case OPT_ENCODING:
+      if (strcmp(optarg, "gorilla") == 0) {
+        args->encoding = REC_ENCODING_GORILLA;
+      } else if (strcmp(optarg, "delta") == 0) {
+        args->encoding = REC_ENCODING_DELTA;
+      } else {
+        fprintf(stderr, "Error: Invalid encoding '%s' (gorilla or delta)\n", optarg);
+        return -1;
+      }
+      break;
+    case OPT_ENERGY: args->energy = 1; break;
+    case OPT_THROTTLE: args->throttle = 1; break;
+    case OPT_IO: args->io = 1; break;
+    case OPT_FORMATTERS: args->formatters = 1; break;
+    case OPT_CONNECT: args->connect_addr = optarg; break;
+    case OPT_NODE: args->node_name = optarg; break;
+    case OPT_BUDGET:
+      if (parse_uint_in(optarg, 1, POWERCTL_MAX_BUDGET_W, &args->budget_w) != 0) {
+        fprintf(stderr, "Error: Invalid budget '%s' (1-%d W)\n", optarg, POWERCTL_MAX_BUDGET_W);
+        return -1;
+      }
+      break;
+    case OPT_DEADBAND:
+      if (parse_uint_in(optarg, 0, POWERCTL_MAX_DEADBAND_W, &args->deadband_w) != 0) {
+        fprintf(stderr, "Error: Invalid deadband '%s' (0-%d W)\n", optarg,
+                POWERCTL_MAX_DEADBAND_W);
+        return -1;
+      }
+      break;
+    case OPT_NODES:
+      args->agent_nodes = atoi(optarg);
+      if (args->agent_nodes <= 0) {
+        fprintf(stderr, "Error: Invalid node count '%s' (must be >0)\n", optarg);
+        return -1;
+      }
+      break;
+    case OPT_FROM: args->from = optarg; break;
+    case OPT_TO: args->to = optarg; break;
+    case OPT_WINDOW:
+    case OPT_EVERY:
+      if (parse_duration_ms(optarg, opt == OPT_WINDOW ? &args->window_ms : &args->every_ms) != 0) {
+        fprintf(stderr, "Error: Invalid duration '%s' (e.g. 500ms, 30s, 5m, 1h)\n", optarg);
+        return -1;
+      }
+      break;
+    case 'S':
+      if (strlen(optarg) >= sizeof(args->socket_path)) {
+        fprintf(stderr, "Error: Socket path too long: %s\n", optarg);
+        return -1;
+      }
+      strcpy(args->socket_path, optarg);
+      break;
     default: return -1;
     }
   }
 
+  if (args->command == CMD_FANCTL) {
+    if (args->fan_mode == FAN_MODE_LINEAR && args->setpoint_count == 0) {
+      fprintf(stderr, "Error: No valid setpoints provided\n");
+      return -1;
+    }
+    if (args->fan_mode == FAN_MODE_PID && args->pid.target <= 0) {
+      fprintf(stderr, "Error: --mode pid requires --target TEMP\n");
+      return -1;
+    }
+  }
+  if (args->command == CMD_STATUS && (args->throttle || args->energy)) {
+    // Both report over time (throttle durations, energy between ticks); one read has neither
+    fprintf(stderr, "Error: --throttle and --energy need watch; status takes only --io\n");
+    return -1;
+  }
+  if (args->command == CMD_POWERCTL && !args->budget_w) {
+    fprintf(stderr, "Error: powerctl requires --budget WATTS\n");
+    return -1;
+  }
+  if (args->command == CMD_AGENT && !args->connect_addr) {
+    fprintf(stderr, "Error: agent requires --connect HOST:PORT\n");
+    return -1;
+  }
+  if (args->command == CMD_RECORD && !args->output) {
+    fprintf(stderr, "Error: record requires -o FILE\n");
+    return -1;
+  }
+  if (args->command == CMD_REPLAY) {
+    if (optind >= argc) {
+      fprintf(stderr, "Error: replay requires a recording file\n");
+      return -1;
+    }
+    args->input = argv[optind++];
+  }
+  if (optind < argc) {
+    fprintf(stderr, "Error: Unexpected argument '%s'\n", argv[optind]);
+    return -1;
+  }
+
   return 0;
 }
 
@@ -440,6 +7122,20 @@ int main(int argc, char* argv[]) {
     return 1;
   }
 
+  if (args.command == CMD_SHM) return run_shm_read(&args);
+  if (args.command == CMD_FANCTL && args.simulate) return run_fanctl_simulation(&args);
+  if (args.command == CMD_REPLAY) return run_replay(&args);
+  if (args.command == CMD_AGGREGATE) return run_aggregate(&args);
+
+  device_cache_load();
+  if (args.command == CMD_LIST && device_cache.loaded) return !!run_list_cached(&args);
+
+  // Prefer a running daemon for read-only queries; fall back to NVML if none answers
+  if (is_query_command(&args)) {
+    int status = query_daemon(&args);
+    if (status >= 0) return !!status;
+  }
+
   result = nvmlInit();
   if (result != NVML_SUCCESS) {
     fprintf(stderr, "Error: Failed to initialize NVML (%s)\n", nvmlErrorString(result));
@@ -459,34 +7155,33 @@ int main(int argc, char* argv[]) {
     return 1;
   }
 
-  // Handle UUID selection
-  if (args.use_uuid) {
-    int device_id = find_device_by_uuid(args.uuid, device_count);
-    if (device_id < 0) {
-      fprintf(stderr, "Error: Device with UUID '%s' not found\n", args.uuid);
-      nvmlShutdown();
-      return 1;
-    }
-    args.devices[0] = device_id;
-    args.device_count = 1;
-    args.all_devices = 0;
-  }
+  if (device_cache.loaded && device_cache.count != (int)device_count) device_cache.loaded = 0;
+  if (!device_cache.loaded) device_cache_refresh(device_count);
 
-  // Setup device list
-  static int all_devs[MAX_DEVICES];
-  int* target_devices = args.devices;
-  int target_count = args.device_count;
+  if (args.command == CMD_SERVE) {
+    int status = run_serve(&args, device_count);
+    nvmlShutdown();
+    return status;
+  }
 
-  if (args.all_devices) {
-    for (unsigned int i = 0; i < device_count && i < MAX_DEVICES; i++) all_devs[i] = i;
-    target_devices = all_devs;
-    target_count = device_count;
+  if (is_query_command(&args)) {
+    int error_count = run_query(&args, device_count, stdout, stderr);
+    nvmlShutdown();
+    return !!error_count;
   }
 
-  // JSON output header
-  if (args.subcommand == SUBCMD_JSON && args.command == CMD_INFO) printf("[\n");
+  // Setup device list
+  int target_devices[MAX_DEVICES];
+  int target_count = select_devices(&args, device_count, target_devices, stderr);
+  if (target_count < 0) {
+    nvmlShutdown();
+    return 1;
+  }
 
   // Execute command for each device
+  static nvmlDevice_t sampled_devices[MAX_DEVICES];
+  static int sampled_device_ids[MAX_DEVICES];
+  int sampled_device_count = 0;
   int error_count = 0;
   for (int i = 0; i < target_count; i++) {
     int device_id = target_devices[i];
@@ -499,7 +7194,7 @@ int main(int argc, char* argv[]) {
     }
 
     nvmlDevice_t device;
-    result = nvmlDeviceGetHandleByIndex(device_id, &device);
+    result = get_device_handle(device_id, &device);
     if (result != NVML_SUCCESS) {
       fprintf(stderr, "Error: Failed to get device handle for device %d (%s)\n", device_id,
               nvmlErrorString(result));
@@ -508,19 +7203,12 @@ int main(int argc, char* argv[]) {
     }
 
     switch (args.command) {
-    case CMD_INFO:
-      if (args.subcommand == SUBCMD_JSON)
-        print_device_info_json(device, device_id, args.temp_unit, i == target_count - 1);
-      else
-        print_device_info_human(device, device_id, args.temp_unit);
-      break;
-
     case CMD_POWER:
       if (args.subcommand == SUBCMD_SET) {
         unsigned int limit_mw = args.set_value * 1000;
         unsigned int min_limit, max_limit;
 
-        result = nvmlDeviceGetPowerManagementLimitConstraints(device, &min_limit, &max_limit);
+        result = get_power_constraints(device, device_id, &min_limit, &max_limit);
         if (result != NVML_SUCCESS) {
           fprintf(stderr, "%d:Error: Cannot get power limit constraints (%s)\n", device_id,
                   nvmlErrorString(result));
@@ -543,15 +7231,13 @@ int main(int argc, char* argv[]) {
                   nvmlErrorString(result));
           error_count++;
         }
-      } else {
-        print_power_cli(device, device_id);
       }
       break;
 
     case CMD_FAN:
       if (args.subcommand == SUBCMD_SET || args.subcommand == SUBCMD_RESTORE) {
         unsigned int num_fans = 0;
-        result = nvmlDeviceGetNumFans(device, &num_fans);
+        result = get_num_fans(device, device_id, &num_fans);
         if (result != NVML_SUCCESS) {
           fprintf(stderr, "%d:Error: Cannot get number of fans (%s)\n", device_id,
                   nvmlErrorString(result));
@@ -599,29 +7285,13 @@ int main(int argc, char* argv[]) {
         } else {
           printf("%d:All fans restored to automatic temperature-based control\n", device_id);
         }
-      } else {
-        print_fan_cli(device, device_id);
       }
       break;
 
-    case CMD_TEMP: print_temp_cli(device, device_id, args.temp_unit); break;
-
-    case CMD_STATUS: print_status_cli(device, device_id, args.temp_unit); break;
-
-    case CMD_LIST: {
-      char uuid[NVML_DEVICE_UUID_BUFFER_SIZE];
-      char name[NVML_DEVICE_NAME_BUFFER_SIZE];
-
-      nvmlDeviceGetUUID(device, uuid, sizeof(uuid));
-      nvmlDeviceGetName(device, name, sizeof(name));
-
-      printf("%d:%s %s\n", device_id, uuid, name);
-    } break;
-
     case CMD_FANCTL: {
       // Check if device supports fan control
       unsigned int num_fans = 0;
-      result = nvmlDeviceGetNumFans(device, &num_fans);
+      result = get_num_fans(device, device_id, &num_fans);
       if (result != NVML_SUCCESS || num_fans == 0) {
         fprintf(stderr, "%d:Error: Device has no controllable fans\n", device_id);
         error_count++;
@@ -636,12 +7306,56 @@ int main(int argc, char* argv[]) {
       }
     } break;
 
+    case CMD_WATCH:
+    case CMD_EXPORTER:
+    case CMD_BENCH:
+    case CMD_RECORD:
+    case CMD_STATS:
+    case CMD_ENERGY:
+    case CMD_PROCS:
+    case CMD_AGENT:
+    case CMD_POWERCTL:
+    case CMD_SAMPLES:
+      if (sampled_device_count < MAX_DEVICES) {
+        sampled_devices[sampled_device_count] = device;
+        sampled_device_ids[sampled_device_count] = device_id;
+        sampled_device_count++;
+      }
+      break;
+
     default: break;
     }
   }
 
-  // JSON output footer
-  if (args.subcommand == SUBCMD_JSON && args.command == CMD_INFO) printf("]\n");
+  if (args.command == CMD_WATCH && sampled_device_count > 0)
+    run_watch(sampled_devices, sampled_device_ids, sampled_device_count, &args);
+
+  if (args.command == CMD_EXPORTER && sampled_device_count > 0 && error_count == 0)
+    error_count += run_exporter(&args, sampled_devices, sampled_device_ids, sampled_device_count);
+
+  if (args.command == CMD_BENCH && sampled_device_count > 0)
+    error_count += run_bench(&args, sampled_devices, sampled_device_ids, sampled_device_count);
+
+  if (args.command == CMD_RECORD && sampled_device_count > 0 && error_count == 0)
+    error_count += run_record(&args, sampled_devices, sampled_device_ids, sampled_device_count);
+
+  if (args.command == CMD_STATS && sampled_device_count > 0)
+    error_count += run_stats(&args, sampled_devices, sampled_device_ids, sampled_device_count);
+
+  if (args.command == CMD_ENERGY && sampled_device_count > 0)
+    error_count += run_energy(&args, sampled_devices, sampled_device_ids, sampled_device_count);
+
+  if (args.command == CMD_PROCS && sampled_device_count > 0)
+    error_count += run_procs(&args, sampled_devices, sampled_device_ids, sampled_device_count);
+
+  if (args.command == CMD_POWERCTL && sampled_device_count > 0 && error_count == 0)
+    error_count += run_powerctl(&args, sampled_devices, sampled_device_ids, sampled_device_count);
+
+  if (args.command == CMD_SAMPLES && sampled_device_count > 0)
+    error_count += run_samples(&args, sampled_devices, sampled_device_ids, sampled_device_count);
+
+  if (args.command == CMD_AGENT && sampled_device_count > 0)
+    error_count += run_agent(&args, sampled_devices, sampled_device_ids, sampled_device_count);
 
   // Handle fanctl main loop
   if (args.command == CMD_FANCTL && controlled_device_count > 0 && error_count == 0) {
@@ -654,68 +7368,112 @@ int main(int argc, char* argv[]) {
 
     printf("Starting dynamic fan control for %d device(s) (Ctrl-C to exit)\n",
            controlled_device_count);
-    printf("Setpoints: ");
-    for (int sp = 0; sp < args.setpoint_count; sp++) {
-      printf("%u:%u%%", args.setpoints[sp].temp, args.setpoints[sp].fan);
-      if (sp < args.setpoint_count - 1) printf(" ");
+    if (args.fan_mode == FAN_MODE_PID) {
+      printf("PID: target %.1fC, kp %.2f ki %.3f kd %.2f, slew %.1f%%/s, hysteresis %.1fC, "
+             "fan %u-%u%%\n",
+             args.pid.target, args.pid.kp, args.pid.ki, args.pid.kd, args.pid.slew,
+             args.pid.hysteresis, args.pid.min_fan, args.pid.max_fan);
+    } else {
+      printf("Setpoints: ");
+      for (int sp = 0; sp < args.setpoint_count; sp++) {
+        printf("%u:%u%%", args.setpoints[sp].temp, args.setpoints[sp].fan);
+        if (sp < args.setpoint_count - 1) printf(" ");
+      }
+      printf("\n");
     }
-    printf("\n");
 
     if (is_terminal) printf("\n"); // Add blank line for device status updates
+    fflush(stdout);                  // Status frames below bypass stdio
 
-    // Main control loop
+    // Main control loop. Each device is read and driven by its own sampler thread, so a device
+    // that stops responding cannot hold back the fans of the others. The loop sleeps until an
+    // NVML event or the adaptive interval, whichever comes first.
+    tick_scheduler_t sched;
+    static sampler_msg_t latest[MAX_DEVICES];
+    int fresh[MAX_DEVICES];
+    unsigned int last_temp[MAX_DEVICES];
+    int have_last_temp[MAX_DEVICES] = {0};
+    unsigned long event_ticks = 0;
     int first_iteration = 1;
-    while (running) {
+    int woke;
+    static out_t out;
+    out_init_fd(&out, STDOUT_FILENO);
+    if (sampler_start(controlled_devices, controlled_device_ids, controlled_device_count,
+                      SAMPLE_TEMP, &args) != 0) {
+      error_count++;
+      running = 0;
+    }
+    int event_fd =
+        event_watch_start(controlled_devices, controlled_device_ids, controlled_device_count);
+    tick_scheduler_init(&sched, FANCTL_INTERVAL_MS);
+    while ((woke = tick_scheduler_wait_fd(&sched, event_fd)) != 0) {
+      unsigned int max_delta = 0;
+      int compared = 0;
+      if (woke == 2) event_ticks++;
+      sampler_request_tick(sched.ticks);
+      sampler_collect(sched.ticks, sched.next_ns, latest, fresh);
+
       if (is_terminal && !first_iteration) {
         // Clear previous device status lines
-        clear_lines(controlled_device_count);
+        clear_lines(&out, controlled_device_count);
       }
 
       for (int dev_idx = 0; dev_idx < controlled_device_count; dev_idx++) {
-        nvmlDevice_t device = controlled_devices[dev_idx];
+        const sampler_msg_t* msg = &latest[dev_idx];
         int device_id = controlled_device_ids[dev_idx]; // Get original device ID
 
-        unsigned int current_temp = 0;
-        result = nvmlDeviceGetTemperature(device, NVML_TEMPERATURE_GPU, &current_temp);
-        if (result != NVML_SUCCESS) {
-          fprintf(stderr, "%d:Error: Cannot read temperature (%s)\n", device_id,
-                  nvmlErrorString(result));
+        if (!fresh[dev_idx]) {
+          out_i64(&out, device_id);
+          out_str(&out, ":Not responding, fans left at their last speed\n");
+          continue;
+        }
+
+        if (msg->result != NVML_SUCCESS) {
+          if (msg->failed_fan < 0)
+            fprintf(stderr, "%d:Error: Cannot read temperature (%s)\n", device_id,
+                    nvmlErrorString(msg->result));
+          else
+            fprintf(stderr, "%d:Fan%d:Error: %s\n", device_id, msg->failed_fan,
+                    nvmlErrorString(msg->result));
           running = 0;
           break;
         }
 
-        unsigned int target_fan =
-            interpolate_fan_speed(current_temp, args.setpoints, args.setpoint_count);
-
-        // Set fan speed for all fans on this device
-        unsigned int num_fans = 0;
-        nvmlDeviceGetNumFans(device, &num_fans);
-
-        int fan_errors = 0;
-        for (unsigned int fan = 0; fan < num_fans; fan++) {
-          result = nvmlDeviceSetFanSpeed_v2(device, fan, target_fan);
-          if (result != NVML_SUCCESS) {
-            fprintf(stderr, "%d:Fan%u:Error: %s\n", device_id, fan, nvmlErrorString(result));
-            fan_errors++;
-          }
-        }
+        out_i64(&out, device_id);
+        out_char(&out, ':');
+        out_fixed(&out, temperature_tenths(msg->sample.temperature, args.temp_unit), 1);
+        out_char(&out, args.temp_unit);
+        out_str(&out, " -> ");
+        out_u64(&out, msg->fan_target);
+        out_str(&out, "%\n");
 
-        if (fan_errors == 0) {
-          double temp_display = convert_temperature(current_temp, args.temp_unit);
-          printf("%d:%.1f%c -> %u%%\n", device_id, temp_display, args.temp_unit, target_fan);
-        } else {
-          running = 0;
-          break;
+        unsigned int temp = msg->sample.temperature;
+        if (have_last_temp[dev_idx]) {
+          unsigned int delta =
+              temp > last_temp[dev_idx] ? temp - last_temp[dev_idx] : last_temp[dev_idx] - temp;
+          if (delta > max_delta) max_delta = delta;
+          compared = 1;
         }
+        last_temp[dev_idx] = temp;
+        have_last_temp[dev_idx] = 1;
       }
 
-      fflush(stdout); // Ensure output is displayed immediately
+      out_flush(&out); // One write per tick, displayed immediately
 
+      if (compared)
+        tick_scheduler_set_interval(&sched, adapt_fanctl_interval(sched.interval_ns, max_delta));
       first_iteration = 0;
-      if (running) sleep(2); // Update every 2 seconds
     }
+    event_watch_stop();
+    sampler_stop();
+    restore_fan_control();
 
-    // Cleanup is handled by signal handler
+    fprintf(stderr, "fanctl: %lu ticks (%lu woken by events), last interval %lld ms\n",
+            sched.ticks, event_ticks, sched.interval_ns / 1000000);
+    for (int dev_idx = 0; dev_idx < controlled_device_count; dev_idx++)
+      fprintf(stderr, "%d:fanctl: %lu fan writes, %lu suppressed as unchanged\n",
+              controlled_device_ids[dev_idx], latest[dev_idx].fan_writes,
+              latest[dev_idx].fan_suppressed);
   }
 
   nvmlShutdown();
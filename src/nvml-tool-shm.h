@@ -0,0 +1,127 @@
+// Shared-memory sample ring published by `nvml-tool watch --shm NAME`.
+//
+// The segment lives in /dev/shm and holds a fixed-size ring of per-device records. Each slot is
+// guarded by a seqlock, so readers never block the writer and never take a lock: map the segment
+// once with nvt_shm_open(), then read with nvt_shm_latest() / nvt_shm_read() without any
+// syscalls. Readers only need this header.
+#ifndef NVML_TOOL_SHM_H
+#define NVML_TOOL_SHM_H
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define NVT_SHM_MAGIC 0x4e56544du // "NVTM"
+#define NVT_SHM_VERSION 1
+#define NVT_SHM_DEFAULT_NAME "/nvml-tool"
+#define NVT_SHM_SLOTS 4096
+#define NVT_SHM_MAX_DEVICES 64
+
+// Validity flags for nvt_shm_record_t.valid
+#define NVT_SHM_TEMP (1u << 0)
+#define NVT_SHM_MEMORY (1u << 1)
+#define NVT_SHM_FAN (1u << 2)
+#define NVT_SHM_POWER (1u << 3)
+#define NVT_SHM_POWER_LIMIT (1u << 4)
+#define NVT_SHM_ALL                                                                                \
+  (NVT_SHM_TEMP | NVT_SHM_MEMORY | NVT_SHM_FAN | NVT_SHM_POWER | NVT_SHM_POWER_LIMIT)
+
+// One device sample: temperature, memory, fan and power. Utilization, clocks, throttling and
+// I/O are not carried; valid never has bits outside NVT_SHM_ALL.
+typedef struct {
+  uint64_t timestamp_ns; // CLOCK_REALTIME when the sample was taken
+  uint64_t tick;         // Writer tick number, shared by all devices sampled in the same tick
+  int32_t device_id;
+  uint32_t valid; // NVT_SHM_* flags for fields that were read successfully
+  uint32_t temperature_c;
+  uint32_t fan_speed_percent;
+  uint32_t power_usage_mw;
+  uint32_t power_limit_mw;
+  uint64_t memory_total;
+  uint64_t memory_used;
+  uint64_t memory_free;
+  char name[96];
+  char uuid[96];
+} nvt_shm_record_t;
+
+typedef struct {
+  uint64_t seq;   // Odd while the writer is updating this slot
+  uint64_t index; // Ring position (0-based publish count) of the record currently in the slot
+  nvt_shm_record_t record;
+} nvt_shm_slot_t;
+
+typedef struct {
+  uint32_t magic; // Stored last by the writer, after the rest of the header is valid
+  uint32_t version;
+  uint32_t record_size; // sizeof(nvt_shm_record_t), guards against mismatched layouts
+  uint32_t slot_count;
+  uint64_t head; // Number of records published so far
+  // Per device: ring index + 1 of its newest record, 0 if it has none
+  uint64_t latest[NVT_SHM_MAX_DEVICES];
+  nvt_shm_slot_t slots[];
+} nvt_shm_header_t;
+
+static inline size_t nvt_shm_size(uint32_t slot_count) {
+  return sizeof(nvt_shm_header_t) + (size_t)slot_count * sizeof(nvt_shm_slot_t);
+}
+
+// Map an existing ring read-only. Returns NULL if it is missing or has an incompatible layout.
+static inline const nvt_shm_header_t* nvt_shm_open(const char* name) {
+  int fd = shm_open(name, O_RDONLY, 0);
+  if (fd < 0) return NULL;
+
+  struct stat st;
+  void* map = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(nvt_shm_header_t))
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) return NULL;
+
+  const nvt_shm_header_t* hdr = (const nvt_shm_header_t*)map;
+  if (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != NVT_SHM_MAGIC ||
+      hdr->version != NVT_SHM_VERSION || hdr->record_size != sizeof(nvt_shm_record_t) ||
+      nvt_shm_size(hdr->slot_count) > (size_t)st.st_size) {
+    munmap(map, st.st_size);
+    return NULL;
+  }
+  return hdr;
+}
+
+static inline uint64_t nvt_shm_head(const nvt_shm_header_t* hdr) {
+  return __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+}
+
+// Copy record `index` (0 <= index < head). Returns 0 on success, -1 if it has already been
+// overwritten or is not published yet.
+static inline int nvt_shm_read(const nvt_shm_header_t* hdr, uint64_t index,
+                               nvt_shm_record_t* out) {
+  const nvt_shm_slot_t* slot = &hdr->slots[index % hdr->slot_count];
+
+  // Bounded so a writer that died mid-update cannot hang the reader
+  for (int attempt = 0; attempt < 1000; attempt++) {
+    uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    if (seq & 1) continue; // Writer is mid-update
+
+    uint64_t slot_index = __atomic_load_n(&slot->index, __ATOMIC_RELAXED);
+    memcpy(out, &slot->record, sizeof(*out));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq) continue; // Torn read, retry
+    return slot_index == index ? 0 : -1;
+  }
+  return -1;
+}
+
+// Copy the newest record for a device. Returns 0 on success, -1 if none is available.
+static inline int nvt_shm_latest(const nvt_shm_header_t* hdr, int device_id,
+                                 nvt_shm_record_t* out) {
+  if (device_id < 0 || device_id >= NVT_SHM_MAX_DEVICES) return -1;
+  uint64_t latest = __atomic_load_n(&hdr->latest[device_id], __ATOMIC_ACQUIRE);
+  if (latest == 0) return -1;
+  return nvt_shm_read(hdr, latest - 1, out);
+}
+
+#endif
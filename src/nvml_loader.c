@@ -0,0 +1,157 @@
+// Lazy loader for libnvidia-ml.
+//
+// The binary is not linked against NVML. Instead every NVML entry point used by nvml-tool is
+// defined here as a small shim that dlopen()s the library on first use and resolves its own
+// symbol on first call, so startup pays only for what a command actually touches and hosts
+// without the driver get a clean error instead of a loader failure. Set NVML_TOOL_LIBRARY to
+// load a different library (e.g. a test stub).
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <nvml.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define LIBRARY_ENV "NVML_TOOL_LIBRARY"
+
+// nvml.h maps the public names to versioned symbols (nvmlInit -> nvmlInit_v2, ...). Shims are
+// defined under the public names, so they get the versioned names too, and STR() expands the
+// macro before stringizing to look up the matching symbol.
+#define STR_(x) #x
+#define STR(x) STR_(x)
+
+// X(name, parameter list, argument list) for every NVML function returning nvmlReturn_t
+#define NVML_FUNCTIONS(X)                                                                          \
+  X(nvmlInit, (void), ())                                                                          \
+  X(nvmlShutdown, (void), ())                                                                      \
+  X(nvmlSystemGetDriverVersion, (char* version, unsigned int length), (version, length))          \
+  X(nvmlDeviceGetCount, (unsigned int* count), (count))                                            \
+  X(nvmlDeviceGetHandleByIndex, (unsigned int index, nvmlDevice_t* device), (index, device))       \
+  X(nvmlDeviceGetHandleByUUID, (const char* uuid, nvmlDevice_t* device), (uuid, device))           \
+  X(nvmlDeviceGetHandleByPciBusId, (const char* bus_id, nvmlDevice_t* device), (bus_id, device))   \
+  X(nvmlDeviceGetIndex, (nvmlDevice_t device, unsigned int* index), (device, index))               \
+  X(nvmlDeviceGetName, (nvmlDevice_t device, char* name, unsigned int length),                     \
+    (device, name, length))                                                                        \
+  X(nvmlDeviceGetUUID, (nvmlDevice_t device, char* uuid, unsigned int length),                     \
+    (device, uuid, length))                                                                        \
+  X(nvmlDeviceGetPciInfo, (nvmlDevice_t device, nvmlPciInfo_t* pci), (device, pci))                \
+  X(nvmlDeviceGetTemperature,                                                                      \
+    (nvmlDevice_t device, nvmlTemperatureSensors_t sensor, unsigned int* temp),                    \
+    (device, sensor, temp))                                                                        \
+  X(nvmlDeviceGetMemoryInfo, (nvmlDevice_t device, nvmlMemory_t* memory), (device, memory))        \
+  X(nvmlDeviceGetFanSpeed, (nvmlDevice_t device, unsigned int* speed), (device, speed))            \
+  X(nvmlDeviceGetFanSpeed_v2, (nvmlDevice_t device, unsigned int fan, unsigned int* speed),        \
+    (device, fan, speed))                                                                          \
+  X(nvmlDeviceGetNumFans, (nvmlDevice_t device, unsigned int* count), (device, count))             \
+  X(nvmlDeviceSetFanSpeed_v2, (nvmlDevice_t device, unsigned int fan, unsigned int speed),         \
+    (device, fan, speed))                                                                          \
+  X(nvmlDeviceSetFanControlPolicy,                                                                 \
+    (nvmlDevice_t device, unsigned int fan, nvmlFanControlPolicy_t policy), (device, fan, policy)) \
+  X(nvmlDeviceGetPowerUsage, (nvmlDevice_t device, unsigned int* power), (device, power))          \
+  X(nvmlDeviceGetPowerManagementLimit, (nvmlDevice_t device, unsigned int* limit),                 \
+    (device, limit))                                                                               \
+  X(nvmlDeviceGetPowerManagementLimitConstraints,                                                  \
+    (nvmlDevice_t device, unsigned int* min_limit, unsigned int* max_limit),                       \
+    (device, min_limit, max_limit))                                                                \
+  X(nvmlDeviceSetPowerManagementLimit, (nvmlDevice_t device, unsigned int limit), (device, limit)) \
+  X(nvmlDeviceGetUtilizationRates, (nvmlDevice_t device, nvmlUtilization_t* utilization),          \
+    (device, utilization))                                                                         \
+  X(nvmlDeviceGetClockInfo, (nvmlDevice_t device, nvmlClockType_t type, unsigned int* clock),      \
+    (device, type, clock))                                                                         \
+  X(nvmlDeviceGetPerformanceState, (nvmlDevice_t device, nvmlPstates_t* state), (device, state))   \
+  X(nvmlDeviceGetCurrentClocksThrottleReasons, (nvmlDevice_t device, unsigned long long* reasons), \
+    (device, reasons))                                                                             \
+  X(nvmlDeviceGetPcieThroughput,                                                                   \
+    (nvmlDevice_t device, nvmlPcieUtilCounter_t counter, unsigned int* value),                     \
+    (device, counter, value))                                                                      \
+  X(nvmlDeviceGetNvLinkState, (nvmlDevice_t device, unsigned int link, nvmlEnableState_t* active), \
+    (device, link, active))                                                                        \
+  X(nvmlDeviceGetTotalEnergyConsumption, (nvmlDevice_t device, unsigned long long* energy),        \
+    (device, energy))                                                                              \
+  X(nvmlDeviceGetSamples,                                                                          \
+    (nvmlDevice_t device, nvmlSamplingType_t type, unsigned long long last_seen_us,                \
+     nvmlValueType_t* value_type, unsigned int* count, nvmlSample_t* samples),                     \
+    (device, type, last_seen_us, value_type, count, samples))                                      \
+  X(nvmlDeviceGetFieldValues, (nvmlDevice_t device, int count, nvmlFieldValue_t* values),          \
+    (device, count, values))                                                                       \
+  X(nvmlDeviceGetComputeRunningProcesses,                                                          \
+    (nvmlDevice_t device, unsigned int* count, nvmlProcessInfo_t* infos), (device, count, infos))  \
+  X(nvmlDeviceGetProcessUtilization,                                                               \
+    (nvmlDevice_t device, nvmlProcessUtilizationSample_t* utilization, unsigned int* count,        \
+     unsigned long long last_seen_us),                                                             \
+    (device, utilization, count, last_seen_us))                                                    \
+  X(nvmlEventSetCreate, (nvmlEventSet_t* set), (set))                                              \
+  X(nvmlEventSetFree, (nvmlEventSet_t set), (set))                                                 \
+  X(nvmlDeviceGetSupportedEventTypes, (nvmlDevice_t device, unsigned long long* types),            \
+    (device, types))                                                                               \
+  X(nvmlDeviceRegisterEvents, (nvmlDevice_t device, unsigned long long types, nvmlEventSet_t set), \
+    (device, types, set))                                                                          \
+  X(nvmlEventSetWait, (nvmlEventSet_t set, nvmlEventData_t* data, unsigned int timeout_ms),        \
+    (set, data, timeout_ms))
+
+static void* library;
+static int library_state; // 0: not tried yet, 1: loaded, -1: failed
+static char library_error[256];
+
+// dlopen() is reference counted, so two threads racing here just load the same handle twice
+static void* nvml_library(void) {
+  int state = __atomic_load_n(&library_state, __ATOMIC_ACQUIRE);
+  if (state != 0) return state > 0 ? library : NULL;
+
+  const char* path = getenv(LIBRARY_ENV);
+  void* handle;
+  if (path && *path) {
+    handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+  } else {
+    handle = dlopen("libnvidia-ml.so.1", RTLD_NOW | RTLD_LOCAL);
+    if (!handle) handle = dlopen("libnvidia-ml.so", RTLD_NOW | RTLD_LOCAL);
+  }
+
+  if (handle) {
+    library = handle;
+    __atomic_store_n(&library_state, 1, __ATOMIC_RELEASE);
+  } else {
+    const char* error = dlerror();
+    snprintf(library_error, sizeof(library_error), "NVML library not found: %s",
+             error ? error : path);
+    __atomic_store_n(&library_state, -1, __ATOMIC_RELEASE);
+  }
+  return handle;
+}
+
+static void* nvml_symbol(const char* name) {
+  void* handle = nvml_library();
+  return handle ? dlsym(handle, name) : NULL;
+}
+
+static nvmlReturn_t nvml_unresolved(void) {
+  return nvml_library() ? NVML_ERROR_FUNCTION_NOT_FOUND : NVML_ERROR_LIBRARY_NOT_FOUND;
+}
+
+#define NVML_SHIM(name, params, args)                                                             \
+  nvmlReturn_t name params {                                                                      \
+    static nvmlReturn_t(*fn) params;                                                              \
+    nvmlReturn_t(*call) params = __atomic_load_n(&fn, __ATOMIC_ACQUIRE);                          \
+    if (!call) {                                                                                  \
+      call = (nvmlReturn_t(*) params)nvml_symbol(STR(name));                                      \
+      if (!call) return nvml_unresolved();                                                        \
+      __atomic_store_n(&fn, call, __ATOMIC_RELEASE);                                              \
+    }                                                                                             \
+    return call args;                                                                             \
+  }
+
+NVML_FUNCTIONS(NVML_SHIM)
+
+// Must work without the library, since it reports the failure to load it
+const char* nvmlErrorString(nvmlReturn_t result) {
+  static const char* (*fn)(nvmlReturn_t);
+  const char* (*call)(nvmlReturn_t) = __atomic_load_n(&fn, __ATOMIC_ACQUIRE);
+  if (!call) {
+    call = (const char* (*)(nvmlReturn_t))nvml_symbol("nvmlErrorString");
+    if (call) __atomic_store_n(&fn, call, __ATOMIC_RELEASE);
+  }
+
+  int failed = __atomic_load_n(&library_state, __ATOMIC_ACQUIRE) < 0;
+  if (result == NVML_ERROR_LIBRARY_NOT_FOUND && failed) return library_error;
+  if (call) return call(result);
+  return result == NVML_ERROR_FUNCTION_NOT_FOUND ? "Function not found" : "Unknown Error";
+}
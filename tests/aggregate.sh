@@ -0,0 +1,81 @@
+#!/bin/sh
+# agent -> aggregate -> status -S: two agents show up as nodes, one that leaves is reported as
+# disconnected and then expires, and a query client that never sends its request does not hold
+# up the others.
+set -eu
+NVML_TOOL=${NVML_TOOL:-build/nvml-tool}
+TMP=$(mktemp -d)
+PIDS=""
+trap 'kill $PIDS 2> /dev/null || true; rm -rf "$TMP"' EXIT
+
+fail() {
+  echo "FAIL: $*" >&2
+  exit 1
+}
+
+# Retry a command for up to 5 s
+wait_for() {
+  tries=50
+  until "$@"; do
+    tries=$((tries - 1))
+    [ $tries -gt 0 ] || return 1
+    sleep 0.1
+  done
+}
+
+export FAKE_NVML_DEVICES=2
+ADDR=127.0.0.1:$((20000 + $$ % 20000))
+SOCK=$TMP/agg.sock
+
+"$NVML_TOOL" aggregate -l $ADDR -S "$SOCK" 2> "$TMP/aggregate.err" &
+AGGREGATE=$!
+PIDS="$AGGREGATE"
+wait_for test -S "$SOCK" || fail "aggregate did not create its socket"
+
+"$NVML_TOOL" agent --connect $ADDR --node alpha -i 100 2> /dev/null &
+PIDS="$PIDS $!"
+"$NVML_TOOL" agent --connect $ADDR --node beta -i 100 2> /dev/null &
+BETA=$!
+PIDS="$PIDS $BETA"
+
+both_nodes() {
+  "$NVML_TOOL" status -S "$SOCK" > "$TMP/status" 2> /dev/null &&
+    [ "$(grep -c '^alpha:[01]:' "$TMP/status")" -eq 2 ] &&
+    [ "$(grep -c '^beta:[01]:' "$TMP/status")" -eq 2 ]
+}
+wait_for both_nodes || fail "status -S did not list both nodes"
+
+# A client that connects and stays silent must not delay the next query (needs python3 to hold
+# a Unix socket open)
+if command -v python3 > /dev/null; then
+  python3 -c 'import socket, sys, time
+s = socket.socket(socket.AF_UNIX)
+s.connect(sys.argv[1])
+time.sleep(5)' "$SOCK" &
+  PIDS="$PIDS $!"
+  sleep 0.2
+  START=$(date +%s%N)
+  "$NVML_TOOL" status -S "$SOCK" | grep -q '^alpha:0:' || fail "status -S behind a silent client"
+  [ $(($(date +%s%N) - START)) -lt 1000000000 ] || fail "a silent query client stalled the loop"
+fi
+
+kill $BETA
+gone() {
+  ! "$NVML_TOOL" status -S "$SOCK" 2> "$TMP/err" > /dev/null &&
+    grep -q '^beta:Error: Agent disconnected' "$TMP/err"
+}
+wait_for gone || fail "a departed agent was not reported"
+
+# 30 intervals of 100 ms, plus up to a second for the sweep
+expired() {
+  "$NVML_TOOL" status -S "$SOCK" > "$TMP/status" 2> "$TMP/err" && ! grep -q beta "$TMP/err"
+}
+wait_for expired || fail "a departed agent did not expire"
+grep -q '^alpha:1:' "$TMP/status" || fail "expiring beta lost alpha"
+
+kill $AGGREGATE
+wait $AGGREGATE || true
+grep -q '1 nodes (1 connected).*1 expired' "$TMP/aggregate.err" ||
+  fail "unexpected aggregate summary: $(tail -n 1 "$TMP/aggregate.err")"
+
+echo "PASS: aggregate"
@@ -0,0 +1,45 @@
+#!/bin/sh
+# The energy counter wrapping past 2^64: energy start/stop and watch --energy must count across
+# the wrap as energy used, not as a driver reload.
+set -eu
+NVML_TOOL=${NVML_TOOL:-build/nvml-tool}
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+fail() {
+  echo "FAIL: $*" >&2
+  exit 1
+}
+
+export FAKE_NVML_DEVICES=1
+
+# FAKE_NVML_ENERGY_START that makes the counter wrap in about $1 s. The fake draws 150 W and
+# counts from boot, so read where it is now and start that far short of 2^64.
+wrap_in() {
+  now_mj=$(FAKE_NVML_ENERGY_START=0 "$NVML_TOOL" energy | sed -n 's/^0:\(.*\)\.\(...\)J$/\1\2/p')
+  [ -n "$now_mj" ] || fail "energy did not print the counter"
+  printf '%u' $((-(now_mj + $1 * 150000)))
+}
+
+# The counter is continuous across invocations, like the driver's, as long as the offset stays
+export FAKE_NVML_ENERGY_START
+FAKE_NVML_ENERGY_START=$(wrap_in 2)
+"$NVML_TOOL" energy start "$TMP/mark" || fail "energy start exited with $?"
+grep -q '^0 [^ ]* 1844674407' "$TMP/mark" || fail "energy start did not see the counter near 2^64"
+sleep 3
+"$NVML_TOOL" energy stop "$TMP/mark" > "$TMP/stop" 2> "$TMP/stop.err" ||
+  fail "energy stop exited with $?"
+! grep -q 'restarted' "$TMP/stop.err" || fail "the wrap was taken for a counter reset"
+# The draw swings between 120 and 180 W
+awk -F'[(W]' '{ if ($2 < 100 || $2 > 200) exit 1 }' "$TMP/stop" ||
+  fail "unexpected energy across the wrap: $(cat "$TMP/stop")"
+
+# Every tick's delta is 0.5 s at 120 to 180 W, including the one across the wrap
+FAKE_NVML_ENERGY_START=$(wrap_in 1)
+"$NVML_TOOL" watch --energy -i 500 -n 6 > "$TMP/watch" 2> /dev/null ||
+  fail "watch --energy exited with $?"
+[ "$(grep -c 'J$' "$TMP/watch")" -eq 5 ] || fail "watch --energy printed $(cat "$TMP/watch")"
+grep 'J$' "$TMP/watch" | awk -F, '{ j = $NF + 0; if (j < 50 || j > 100) exit 1 }' ||
+  fail "a tick's energy is off across the wrap: $(cat "$TMP/watch")"
+
+echo "PASS: energy"
@@ -0,0 +1,57 @@
+#!/bin/sh
+# fanctl --mode pid over synthetic traces (--simulate, no device needed): the controller
+# settles after a step, never moves faster than --slew, and holds still inside --hysteresis.
+set -eu
+NVML_TOOL=${NVML_TOOL:-build/nvml-tool}
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+fail() {
+  echo "FAIL: $*" >&2
+  exit 1
+}
+
+# 10 s cool, 80 s at 10 C over the target, then 80 s just inside the hysteresis band. Readings
+# are FANCTL_INTERVAL_MS (2 s) apart.
+{
+  for i in 1 2 3 4 5; do echo 60; done
+  i=0; while [ $i -lt 40 ]; do echo 80; i=$((i + 1)); done
+  i=0; while [ $i -lt 40 ]; do echo 70.5; i=$((i + 1)); done
+} > "$TMP/step"
+"$NVML_TOOL" fanctl --mode pid --target 70 --slew 5 --simulate "$TMP/step" \
+  > "$TMP/out" 2> /dev/null || fail "simulation exited with $?"
+sed 's/.*-> \([0-9]*\)%/\1/' "$TMP/out" > "$TMP/fan"
+
+[ "$(wc -l < "$TMP/fan")" -eq 85 ] || fail "expected 85 readings"
+
+# Slew: 5 %/s over 2 s readings allows at most 10 points per step
+awk 'NR > 1 { d = $1 - prev; if (d < 0) d = -d; if (d > 10) exit 1 } { prev = $1 }' "$TMP/fan" ||
+  fail "fan speed moved faster than --slew"
+
+# The hot phase has to reach full speed, and the fan has to come back down and settle
+sed -n '45p' "$TMP/fan" | grep -qx 100 || fail "did not reach 100% while 10 C over target"
+tail -n 20 "$TMP/fan" | sort -u | awk 'END { if (NR != 1) exit 1 }' ||
+  fail "fan speed did not settle inside the hysteresis band"
+[ "$(tail -n 1 "$TMP/fan")" -lt 100 ] || fail "fan stayed at 100% back on target"
+
+# Hysteresis: +-0.5 C of noise around the target moves nothing with --hysteresis 1, but does
+# with --hysteresis 0
+i=0; while [ $i -lt 40 ]; do echo 69.5; echo 70.5; i=$((i + 1)); done > "$TMP/noise"
+"$NVML_TOOL" fanctl --mode pid --target 70 --hysteresis 1 --simulate "$TMP/noise" \
+  2> "$TMP/summary" > /dev/null
+grep -q ' 0 fan speed changes' "$TMP/summary" || fail "noise inside --hysteresis moved the fan"
+"$NVML_TOOL" fanctl --mode pid --target 70 --hysteresis 0 --simulate "$TMP/noise" \
+  2> "$TMP/summary" > /dev/null
+grep -q ' 0 fan speed changes' "$TMP/summary" && fail "--hysteresis 0 ignored the noise"
+
+# Option validation
+for opt in "--target abc" "--target 70x" "--target -5" "--slew -1" "--slew nan" \
+  "--hysteresis 1e999" "--hysteresis 30"; do
+  # shellcheck disable=SC2086
+  if "$NVML_TOOL" fanctl --mode pid --target 70 $opt --simulate "$TMP/noise" \
+    > /dev/null 2>&1; then
+    fail "accepted $opt"
+  fi
+done
+
+echo "PASS: fanctl_pid"
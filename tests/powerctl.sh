@@ -0,0 +1,30 @@
+#!/bin/sh
+# powerctl under a budget too tight for every device's ask: after the first split the limits
+# must settle instead of swinging between the maximum and the draw. Also checks that the
+# budget and deadband options reject what they cannot represent.
+set -eu
+NVML_TOOL=${NVML_TOOL:-build/nvml-tool}
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+fail() {
+  echo "FAIL: $*" >&2
+  exit 1
+}
+
+export FAKE_NVML_DEVICES=3 FAKE_NVML_UTIL=0=100,1=10,2=50
+"$NVML_TOOL" powerctl --budget 600 -i 100 -n 15 > "$TMP/out" 2> "$TMP/err" ||
+  fail "powerctl exited with $?"
+grep -q '15 ticks, 3 limit writes' "$TMP/err" ||
+  fail "limits did not settle: $(tail -n 1 "$TMP/err")"
+
+# The settled limits (one write each) use the budget without exceeding it
+SUM=$(sed -n 's/.*-> \([0-9]*\)W.*/\1/p' "$TMP/out" | awk '{ sum += $1 } END { print sum }')
+[ "$SUM" -le 600 ] && [ "$SUM" -ge 590 ] || fail "settled limits add up to ${SUM}W"
+
+for arg in "--deadband -1" "--deadband 12x" "--deadband 1001" "--budget 0" "--budget -5"; do
+  case $arg in --budget*) opts=$arg ;; *) opts="--budget 600 $arg" ;; esac
+  if "$NVML_TOOL" powerctl $opts -n 1 > /dev/null 2>&1; then fail "accepted $arg"; fi
+done
+
+echo "PASS: powerctl"
@@ -0,0 +1,62 @@
+#!/bin/sh
+# serve -> status -S: queries are answered through the daemon, a client that never sends its
+# request does not hold up the others, and a second serve on the same socket is refused.
+set -eu
+NVML_TOOL=${NVML_TOOL:-build/nvml-tool}
+TMP=$(mktemp -d)
+PIDS=""
+trap 'kill $PIDS 2> /dev/null || true; rm -rf "$TMP"' EXIT
+
+fail() {
+  echo "FAIL: $*" >&2
+  exit 1
+}
+
+# Retry a command for up to 5 s
+wait_for() {
+  tries=50
+  until "$@"; do
+    tries=$((tries - 1))
+    [ $tries -gt 0 ] || return 1
+    sleep 0.1
+  done
+}
+
+export FAKE_NVML_DEVICES=2
+SOCK=$TMP/serve.sock
+
+"$NVML_TOOL" serve -S "$SOCK" 2> "$TMP/serve.err" &
+SERVE=$!
+PIDS="$SERVE"
+wait_for test -S "$SOCK" || fail "serve did not create its socket"
+
+wait_for "$NVML_TOOL" status -S "$SOCK" > "$TMP/status" 2> /dev/null ||
+  fail "status -S through serve failed"
+[ "$(grep -c '^[01]:' "$TMP/status")" -eq 2 ] || fail "status -S did not list both devices"
+
+# A second daemon must not take over the socket of a running one (timeout bounds one that does)
+if timeout 5 "$NVML_TOOL" serve -S "$SOCK" 2> "$TMP/second.err"; then
+  fail "a second serve started on a live socket"
+fi
+grep -q 'already listening' "$TMP/second.err" || fail "unexpected error: $(cat "$TMP/second.err")"
+"$NVML_TOOL" status -S "$SOCK" > /dev/null || fail "the refused serve broke the running one"
+
+# A client that connects and stays silent must not delay the next query (needs python3 to hold
+# a Unix socket open)
+if command -v python3 > /dev/null; then
+  python3 -c 'import socket, sys, time
+s = socket.socket(socket.AF_UNIX)
+s.connect(sys.argv[1])
+time.sleep(5)' "$SOCK" &
+  PIDS="$PIDS $!"
+  sleep 0.2
+  START=$(date +%s%N)
+  "$NVML_TOOL" status -S "$SOCK" | grep -q '^0:' || fail "status -S behind a silent client"
+  [ $(($(date +%s%N) - START)) -lt 1000000000 ] || fail "a silent query client stalled serve"
+fi
+
+kill $SERVE
+wait $SERVE || true
+[ ! -e "$SOCK" ] || fail "serve left its socket behind"
+
+echo "PASS: serve"
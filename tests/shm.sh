@@ -0,0 +1,50 @@
+#!/bin/sh
+# watch --shm -> shm: the ring carries the basic fields of info json unchanged, and the opt-in
+# --io/--throttle/--energy metrics watch samples stay out of it.
+set -eu
+NVML_TOOL=${NVML_TOOL:-build/nvml-tool}
+TMP=$(mktemp -d)
+NAME=/nvml-tool-test-$$
+PIDS=""
+trap 'kill $PIDS 2> /dev/null || true; rm -rf "$TMP" "/dev/shm$NAME"' EXIT
+
+fail() {
+  echo "FAIL: $*" >&2
+  exit 1
+}
+
+# Retry a command for up to 5 s
+wait_for() {
+  tries=50
+  until "$@"; do
+    tries=$((tries - 1))
+    [ $tries -gt 0 ] || return 1
+    sleep 0.1
+  done
+}
+
+# A curve period of years keeps every reading constant for the length of the test, so the ring
+# and a direct query see the same values
+export FAKE_NVML_DEVICES=2 FAKE_NVML_TEMP=50:10:1000000000
+
+"$NVML_TOOL" watch --shm "$NAME" --io --throttle --energy -i 50 > /dev/null 2>&1 &
+PIDS="$!"
+wait_for "$NVML_TOOL" shm --shm "$NAME" > /dev/null 2>&1 || fail "watch did not publish the ring"
+
+"$NVML_TOOL" shm json --shm "$NAME" > "$TMP/shm.json" || fail "shm json exited with $?"
+"$NVML_TOOL" info json > "$TMP/info.json" || fail "info json exited with $?"
+! grep -Eq 'utilization|clock|pstate|throttle|energy|pcie|nvlink' "$TMP/shm.json" ||
+  fail "opt-in metrics leaked into the ring: $(cat "$TMP/shm.json")"
+
+# info json adds the metrics the ring doesn't carry; without them, and the commas that separated
+# them, both must print the same
+grep -Ev 'utilization|clock|pstate|throttle' "$TMP/info.json" | sed 's/,$//' > "$TMP/expected"
+sed 's/,$//' "$TMP/shm.json" > "$TMP/actual"
+cmp -s "$TMP/expected" "$TMP/actual" ||
+  fail "shm json differs from info json: $(diff "$TMP/expected" "$TMP/actual")"
+
+"$NVML_TOOL" shm --shm "$NAME" > "$TMP/shm.txt"
+"$NVML_TOOL" status > "$TMP/status.txt"
+cmp -s "$TMP/shm.txt" "$TMP/status.txt" || fail "shm differs from status"
+
+echo "PASS: shm"